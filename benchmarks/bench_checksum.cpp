@@ -0,0 +1,115 @@
+/*
+ * Measures what block checksums cost.
+ *
+ * usage: bench_checksum [volume_MiB]
+ * Prints the raw CRC32C throughput and the time batched reads spend verifying,
+ * per GiB read, compared with the same reads on the bare device.
+ */
+
+#include "in_memory_block_device.hpp"
+#include "checksum_block_device.hpp"
+#include "crc32c.hpp"
+#include "fs_constants.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+const int DEFAULT_VOLUME_MIB = 256;
+const int ROUNDS = 4;
+const double GIB = 1024.0 * 1024.0 * 1024.0;
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* returns GiB/s of checksumming buffer one block at a time */
+template <typename Checksum>
+static double checksum_throughput(const std::vector<uint8_t> &buffer, Checksum checksum)
+{
+    uint32_t sink = 0;
+    for (size_t offset = 0; offset < buffer.size(); offset += BLOCK_SIZE) // warm up
+        sink ^= checksum(buffer.data() + offset, BLOCK_SIZE);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++)
+        for (size_t offset = 0; offset < buffer.size(); offset += BLOCK_SIZE)
+            sink ^= checksum(buffer.data() + offset, BLOCK_SIZE);
+    double elapsed = seconds_since(start);
+
+    if (sink == 0x12345678) // keeps the loop from being optimized out
+        std::printf(" ");
+    return ROUNDS * buffer.size() / GIB / elapsed;
+}
+
+/* returns the seconds it takes to read the whole device once, in full batches */
+static double read_volume_seconds(const BlockDevice &device)
+{
+    std::vector<int> indices(MAX_BATCH_BLOCKS);
+    std::vector<uint8_t> buffer(MAX_BATCH_BLOCKS * BLOCK_SIZE);
+    int total_blocks = device.get_total_blocks_number() / MAX_BATCH_BLOCKS * MAX_BATCH_BLOCKS;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int first = 0; first < total_blocks; first += MAX_BATCH_BLOCKS)
+        {
+            for (int i = 0; i < MAX_BATCH_BLOCKS; i++)
+                indices[i] = first + i;
+            if (device.read_blocks(indices, buffer.data()) != FileSystemStatus::OK)
+            {
+                std::fprintf(stderr, "read failed at block %d\n", first);
+                std::exit(1);
+            }
+        }
+    }
+    return seconds_since(start) / ROUNDS;
+}
+
+int main(int argc, char *argv[])
+{
+    int volume_mib = argc > 1 ? std::atoi(argv[1]) : DEFAULT_VOLUME_MIB;
+    if (volume_mib <= 0)
+        volume_mib = DEFAULT_VOLUME_MIB;
+
+    std::vector<uint8_t> buffer(static_cast<size_t>(volume_mib) * 1024 * 1024);
+    std::mt19937_64 generator(1);
+    for (size_t i = 0; i + 8 <= buffer.size(); i += 8)
+    {
+        uint64_t word = generator();
+        std::memcpy(buffer.data() + i, &word, 8);
+    }
+
+    std::printf("crc32c hardware accelerated: %s\n", crc32c_is_hardware_accelerated() ? "yes" : "no");
+    std::printf("crc32c:           %6.2f GiB/s\n", checksum_throughput(buffer, [](const uint8_t *data, size_t length)
+                                                                          { return crc32c(data, length); }));
+    std::printf("crc32c portable:  %6.2f GiB/s\n", checksum_throughput(buffer, [](const uint8_t *data, size_t length)
+                                                                          { return crc32c_portable(data, length); }));
+
+    // the same data on a bare device and behind the checksum decorator
+    int data_blocks = static_cast<int>(buffer.size() / BLOCK_SIZE);
+    InMemoryBlockDevice bare(buffer.size());
+    InMemoryBlockDevice backing(static_cast<uint64_t>(ChecksumBlockDevice::backing_blocks_for(data_blocks)) * BLOCK_SIZE);
+    ChecksumBlockDevice checked(backing);
+
+    std::vector<int> indices(MAX_BATCH_BLOCKS);
+    for (int first = 0; first + MAX_BATCH_BLOCKS <= data_blocks; first += MAX_BATCH_BLOCKS)
+    {
+        for (int i = 0; i < MAX_BATCH_BLOCKS; i++)
+            indices[i] = first + i;
+        bare.write_blocks(indices, buffer.data() + static_cast<size_t>(first) * BLOCK_SIZE);
+        checked.write_blocks(indices, buffer.data() + static_cast<size_t>(first) * BLOCK_SIZE);
+    }
+
+    double volume_gib = static_cast<double>(data_blocks / MAX_BATCH_BLOCKS * MAX_BATCH_BLOCKS) * BLOCK_SIZE / GIB;
+    double bare_seconds = read_volume_seconds(bare);
+    double checked_seconds = read_volume_seconds(checked);
+
+    std::printf("read bare:        %6.2f GiB/s\n", volume_gib / bare_seconds);
+    std::printf("read verified:    %6.2f GiB/s\n", volume_gib / checked_seconds);
+    std::printf("verify cost:      %6.1f ms per GiB read\n", (checked_seconds - bare_seconds) / volume_gib * 1000.0);
+    return 0;
+}
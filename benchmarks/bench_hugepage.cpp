@@ -0,0 +1,96 @@
+/*
+ * Measures what hugepage backing buys an in-memory volume.
+ *
+ * usage: bench_hugepage [volume_MiB]
+ * Prints the mean latency of random single block reads, copied and through
+ * views, on the Dense layout and on the HugePage slab.
+ */
+
+#include "in_memory_block_device.hpp"
+#include "fs_constants.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+const int DEFAULT_VOLUME_MIB = 1024;
+const int READS_NUMBER = 4 * 1024 * 1024;
+
+static const char *backing_name(const InMemoryBlockDevice &device)
+{
+    if (device.get_layout() != InMemoryLayout::HugePage)
+        return "regular pages";
+    switch (device.get_hugepage_backing())
+    {
+    case HugePageBacking::HugeTlb:
+        return "MAP_HUGETLB";
+    case HugePageBacking::Transparent:
+        return "transparent huge pages";
+    default:
+        return "regular pages (huge pages refused)";
+    }
+}
+
+/* returns the mean nanoseconds of one read_block at the given indices */
+static double copy_read_nanoseconds(const InMemoryBlockDevice &device, const std::vector<int> &indices)
+{
+    std::vector<uint8_t> buffer(BLOCK_SIZE);
+    uint64_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int block_index : indices)
+    {
+        device.read_block(block_index, buffer.data());
+        sink += buffer[block_index % BLOCK_SIZE];
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (sink == 0x12345678) // keeps the loop from being optimized out
+        std::printf(" ");
+    return std::chrono::duration<double, std::nano>(elapsed).count() / indices.size();
+}
+
+/* the same through a view, one cache line per block, so page walks dominate */
+static double view_read_nanoseconds(const InMemoryBlockDevice &device, const std::vector<int> &indices)
+{
+    uint64_t sink = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int block_index : indices)
+        sink += device.view_block(block_index).value()[block_index % BLOCK_SIZE];
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (sink == 0x12345678)
+        std::printf(" ");
+    return std::chrono::duration<double, std::nano>(elapsed).count() / indices.size();
+}
+
+int main(int argc, char *argv[])
+{
+    int volume_mib = argc > 1 ? std::atoi(argv[1]) : DEFAULT_VOLUME_MIB;
+    if (volume_mib <= 0)
+        volume_mib = DEFAULT_VOLUME_MIB;
+    uint64_t volume_size = static_cast<uint64_t>(volume_mib) * 1024 * 1024;
+
+    // both are fully populated before timing, Dense by zeroing, HugePage by prefaulting
+    InMemoryBlockDevice dense(volume_size);
+    InMemoryBlockDevice huge(volume_size, InMemoryLayout::HugePage);
+
+    std::vector<int> indices(READS_NUMBER);
+    std::mt19937 generator(1);
+    std::uniform_int_distribution<int> distribution(0, dense.get_total_blocks_number() - 1);
+    for (int &block_index : indices)
+        block_index = distribution(generator);
+
+    copy_read_nanoseconds(dense, indices); // warm up
+    copy_read_nanoseconds(huge, indices);
+
+    std::printf("volume:            %d MiB, %d random reads\n", volume_mib, READS_NUMBER);
+    std::printf("hugepage backing:  %s\n", backing_name(huge));
+    std::printf("read_block dense:  %6.1f ns\n", copy_read_nanoseconds(dense, indices));
+    std::printf("read_block huge:   %6.1f ns\n", copy_read_nanoseconds(huge, indices));
+    std::printf("view_block dense:  %6.1f ns\n", view_read_nanoseconds(dense, indices));
+    std::printf("view_block huge:   %6.1f ns\n", view_read_nanoseconds(huge, indices));
+    return 0;
+}
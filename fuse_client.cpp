@@ -133,6 +133,23 @@ static LookupResponse rpc_lookup(int parent_inode_id, std::string_view name)
     return resp;
 }
 
+static StatfsResponse rpc_statfs()
+{
+    StatfsRequest req{};
+    StatfsResponse resp{};
+    resp.status = RpcStatus::SyscallError;
+
+    req.header.operation = RpcOperation::STATFS;
+    req.header.payload_size = 0;
+
+    std::lock_guard<std::mutex> lock(g_sock_mutex);
+    if (!send_all(g_sock, &req, sizeof(req)))
+        return resp;
+    if (!recv_all(g_sock, &resp, sizeof(resp)))
+        return resp;
+    return resp;
+}
+
 /* Walk a path like "/home/docs/file.txt" component by component.
  * Returns the final inode_id, or -1 on failure. */
 static int path_to_inode(const char *path)
@@ -266,7 +283,7 @@ static DeleteResponse rpc_delete(int parent_inode_id, int inode_id)
 /* Read up to bytes_to_read bytes starting at offset.
  * Returns the data vector, or empty on error. */
 static std::vector<uint8_t> rpc_read(int inode_id,
-                                     uint32_t offset,
+                                     uint64_t offset,
                                      uint32_t bytes_to_read)
 {
     std::vector<uint8_t> result;
@@ -306,7 +323,7 @@ static std::vector<uint8_t> rpc_read(int inode_id,
 static int rpc_write(int inode_id,
                      const uint8_t *data,
                      uint32_t size,
-                     uint32_t offset)
+                     uint64_t offset)
 {
     WriteRequest req{};
     req.header.operation = RpcOperation::WRITE;
@@ -319,7 +336,7 @@ static int rpc_write(int inode_id,
     while (size > 0)
     {
         uint32_t chunk = std::min(size, static_cast<uint32_t>(BLOCK_SIZE));
-        req.write_offset = offset + static_cast<uint32_t>(total_written);
+        req.write_offset = offset + static_cast<uint64_t>(total_written);
         req.data_size = chunk;
         memcpy(req.data, data + total_written, chunk);
 
@@ -438,7 +455,7 @@ static int fs_read(const char *path, char *buf, size_t size, off_t offset,
         return -ENOENT;
 
     auto data = rpc_read(inode_id,
-                         static_cast<uint32_t>(offset),
+                         static_cast<uint64_t>(offset),
                          static_cast<uint32_t>(size));
     if (data.empty())
         return 0;
@@ -459,7 +476,7 @@ static int fs_write(const char *path, const char *buf, size_t size,
     return rpc_write(inode_id,
                      reinterpret_cast<const uint8_t *>(buf),
                      static_cast<uint32_t>(size),
-                     static_cast<uint32_t>(offset));
+                     static_cast<uint64_t>(offset));
 }
 
 /* ── create ── */
@@ -549,11 +566,19 @@ static int fs_truncate(const char *path, off_t size,
 /* ── statfs ── (df, etc.) */
 static int fs_statfs(const char * /*path*/, struct statvfs *stbuf)
 {
+    StatfsResponse resp = rpc_statfs();
+    if (resp.status != RpcStatus::OK)
+        return -EIO;
+
     memset(stbuf, 0, sizeof(*stbuf));
     stbuf->f_bsize = BLOCK_SIZE;
-    stbuf->f_blocks = TOTAL_BLOCKS_NUMBER;
-    stbuf->f_bfree = 0; /* we don't expose a free-blocks RPC */
-    stbuf->f_bavail = 0;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = resp.total_blocks;
+    stbuf->f_bfree = resp.free_blocks;
+    stbuf->f_bavail = resp.free_blocks;
+    stbuf->f_files = resp.total_inodes;
+    stbuf->f_ffree = resp.free_inodes;
+    stbuf->f_favail = resp.free_inodes;
     stbuf->f_namemax = ENTRY_NAME_LENGTH;
     return 0;
 }
@@ -0,0 +1,103 @@
+/*
+ * A resident allocation bitmap.
+ *
+ * The FileSystem keeps its inode and data bitmaps in memory as 64-bit words in
+ * the on-disk bit order, a set bit is in use. A summary holds one bit per word,
+ * set while the word is full, so a search skips 64 full words with one summary
+ * word and AVX2 compares 4 summary words at a time when the CPU has it.
+ * allocate() is next-fit: it starts at the word of the last allocation and
+ * wraps around once, so a nearly full volume is not rescanned from bit 0.
+ * allocate_run() looks for contiguous free bits next to a goal bit instead.
+ *
+ * Reserved bits are in use but not yet on the device: word() leaves them out
+ * until they are claimed, so a crash never finds them allocated.
+ *
+ * The bitmap holds no device: the FileSystem loads it on mount and writes the
+ * word of every bit it changes into the bitmap block of the running transaction.
+ * Every call takes the bitmap lock for its own length only, store_word() copies
+ * the word under it so the block never gets an older copy of a word.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+const int BITS_PER_WORD = 64;
+const int RUN_SEARCH_BITS = 64 * BITS_PER_WORD; // how far past the goal a run of the full length is looked for
+
+struct BitRun
+{
+    int first;
+    int length;
+};
+
+class AllocationBitmap
+{
+private:
+    mutable std::mutex bitmap_mutex;
+    std::vector<uint64_t> words;
+    std::vector<uint64_t> summary; // bit w is set when words[w] is full
+    std::unordered_map<int, uint64_t> reserved_words; // the set bits that are not claimed yet
+    int total_bits;
+    int free_bits;
+    int cursor; // the word the next search starts at
+
+    void build_summary();
+    void mark_word(int word_index);
+    std::optional<int> find_free_word(int first_word, int last_word) const;
+    std::optional<int> find_free_bit_locked() const;
+    std::optional<int> find_free_bit_from(int bit) const;
+    int free_run_length(int bit, int max_bits) const;
+    bool scan_runs(int first_bit, int last_bit, int wanted_bits, BitRun &longest) const;
+    std::optional<BitRun> find_run_locked(int goal, int max_bits) const;
+    void mark_run_locked(const BitRun &run, bool reserve);
+    uint64_t word_locked(int word_index) const;
+
+public:
+    AllocationBitmap();
+
+    AllocationBitmap(const AllocationBitmap &) = delete;
+    AllocationBitmap &operator=(const AllocationBitmap &) = delete;
+
+    /* an empty bitmap of _total_bits bits */
+    void reset(int _total_bits);
+
+    /* loads the bitmap from its blocks, the bits past _total_bits are used */
+    void load(std::span<const uint8_t> bytes, int _total_bits);
+
+    /* sets the next free bit, nullopt when the bitmap is full */
+    std::optional<int> allocate();
+
+    /*
+     * sets up to max_bits contiguous free bits: the first run of max_bits within
+     * RUN_SEARCH_BITS of goal, else a run of a word's length anywhere, else the
+     * longest run seen. goal -1 starts at the cursor
+     */
+    std::optional<BitRun> allocate_run(int goal, int max_bits);
+
+    /* allocate_run() for bits that are claimed or cancelled one by one later */
+    std::optional<BitRun> reserve_run(int goal, int max_bits);
+    void claim(int bit);
+    void cancel(int bit);
+
+    /* false when the bit is out of range or already in that state */
+    bool set(int bit);
+    bool clear(int bit);
+
+    bool test(int bit) const;
+    /* the word as it goes to the device, reserved bits are still free there */
+    uint64_t word(int word_index) const;
+    /* word() into destination, threads storing the same word leave the newest one */
+    void store_word(int word_index, uint64_t &destination) const;
+    std::vector<int> free_bits_list() const;
+    int free_count() const;
+    int size() const;
+
+    /* the vectorized summary scan is used when the CPU has AVX2 */
+    static bool is_vectorized();
+};
@@ -3,11 +3,15 @@
  * basic block I/O operations.
  *
  * It is intended to be implemented by classes such as
- * InMemoryBlockDevice and DiskMemoryBlockDevice.
+ * InMemoryBlockDevice and MmapBlockDevice.
  */
 
 #pragma once
 #include <cstdint>
+#include <cstddef>
+#include <span>
+#include <expected>
+#include "fs_constants.hpp"
 #include "fs_status.hpp"
 
 class BlockDevice
@@ -20,4 +24,110 @@ public:
     virtual FileSystemStatus read_block(int block_index, uint8_t *buffer) const = 0;
 
     virtual FileSystemStatus write_block(int block_index, const uint8_t *buffer) = 0;
+
+    /*
+     * Batched I/O - buffer holds block_indices.size() consecutive blocks
+     * Devices that can submit many blocks at once override these,
+     * the default issues one call per block
+     */
+    virtual FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+    {
+        for (size_t i = 0; i < block_indices.size(); i++)
+        {
+            FileSystemStatus status = read_block(block_indices[i], buffer + i * BLOCK_SIZE);
+            if (status != FileSystemStatus::OK)
+                return status;
+        }
+        return FileSystemStatus::OK;
+    }
+
+    virtual FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+    {
+        for (size_t i = 0; i < block_indices.size(); i++)
+        {
+            FileSystemStatus status = write_block(block_indices[i], buffer + i * BLOCK_SIZE);
+            if (status != FileSystemStatus::OK)
+                return status;
+        }
+        return FileSystemStatus::OK;
+    }
+
+    /*
+     * Zero-copy access - a view points straight at the device's copy of the block,
+     * writes through a mutable view land on the device. A view stays valid until
+     * the next call on the device. Devices that cannot lend their storage return
+     * NotSupported and callers fall back to read_block / write_block
+     */
+    virtual std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const
+    {
+        (void)block_index;
+        return std::unexpected(FileSystemStatus::NotSupported);
+    }
+
+    virtual std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index)
+    {
+        (void)block_index;
+        return std::unexpected(FileSystemStatus::NotSupported);
+    }
+
+    /*
+     * Discard - the blocks of [first_block, first_block + blocks_count) no longer hold
+     * data, the device may release their storage. Once it returns OK they read back
+     * as zeros. Devices that cannot release storage return NotSupported
+     */
+    virtual FileSystemStatus discard_blocks(int first_block, int blocks_count)
+    {
+        (void)first_block;
+        (void)blocks_count;
+        return FileSystemStatus::NotSupported;
+    }
+
+    /* discards a sorted list of blocks, every run of consecutive blocks as one range */
+    FileSystemStatus discard_sorted_blocks(std::span<const int> block_indices)
+    {
+        size_t run_start = 0;
+        for (size_t i = 1; i <= block_indices.size(); i++)
+        {
+            if (i < block_indices.size() && block_indices[i] == block_indices[i - 1] + 1)
+                continue;
+
+            FileSystemStatus status = discard_blocks(block_indices[run_start], static_cast<int>(i - run_start));
+            if (status != FileSystemStatus::OK)
+                return status;
+            run_start = i;
+        }
+        return FileSystemStatus::OK;
+    }
+
+    /*
+     * Prefetch - a hint that the blocks will be read soon. A device with a cache
+     * may start loading them and return before they arrive, a hinted block may
+     * never be loaded. Devices without a cache return NotSupported
+     */
+    virtual FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const
+    {
+        (void)block_indices;
+        return FileSystemStatus::NotSupported;
+    }
+
+    /*
+     * a hint that blocks prefetched earlier will not be read after all, the ones
+     * still waiting to be loaded may be dropped. Devices without a cache ignore it
+     */
+    virtual void cancel_prefetch(std::span<const int> block_indices) const { (void)block_indices; }
+
+    /* makes every completed write durable. volatile devices have nothing to do */
+    virtual FileSystemStatus flush() { return FileSystemStatus::OK; }
+
+    /*
+     * Threads - the FileSystem calls its device from every thread running one of
+     * its calls, so the device it runs on takes calls from several threads at
+     * once. Its inode locks keep two calls off the same block unless both only
+     * read it, or both edit their own bytes of it through mutable views.
+     * The Journal is that device, it serializes its calls to the device under it
+     * so the devices below need no locks of their own. A device that takes
+     * concurrent calls on different blocks by itself returns true, the Journal
+     * then lets reads through to it without waiting for the other calls
+     */
+    virtual bool is_thread_safe() const { return false; }
 };
\ No newline at end of file
@@ -0,0 +1,22 @@
+/*
+ * 64-bit fingerprints of whole blocks.
+ *
+ * The hash keeps 8 independent 64-bit accumulators that consume the block in
+ * 64 byte stripes, each word mixed with a per-stripe key through a 32x32->64
+ * multiply, so the loop maps directly onto SIMD lanes. block_hash() uses AVX2
+ * when the CPU has it, block_hash_portable() is the scalar reference and
+ * returns the same values. It is not a cryptographic hash, equal fingerprints
+ * still have to be confirmed by comparing the blocks.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include <cstdint>
+
+/* hashes BLOCK_SIZE bytes */
+uint64_t block_hash(const uint8_t *block);
+
+uint64_t block_hash_portable(const uint8_t *block);
+
+bool block_hash_is_vectorized();
@@ -0,0 +1,124 @@
+/*
+ * A write-back block cache that decorates another BlockDevice.
+ *
+ * Blocks read or written through the cache stay in memory up to a byte budget
+ * and are evicted least recently used first. Writes only mark the cached copy
+ * dirty, dirty blocks reach the backing device when they are evicted or on
+ * flush(), so the repeated read-modify-writes of one FileSystem call cost
+ * a single device write.
+ *
+ * prefetch_blocks() only queues the blocks, a prefetch thread started on the
+ * first hint reads the uncached ones in batches and adds them clean. It reads
+ * without the cache lock, so hits are served meanwhile, and the backing device
+ * still sees one caller at a time. A block written back or discarded during
+ * the read is not added, its copy may be stale. cancel_prefetch() drops the
+ * queued blocks of a reader that stopped reading sequentially.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <expected>
+#include <list>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+struct BufferCacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t write_backs;     // dirty blocks written to the backing device
+    uint64_t prefetched;      // blocks read by the prefetch thread
+    uint64_t prefetch_hits;   // prefetched blocks read before they left the cache
+    uint64_t prefetch_wasted; // prefetched blocks evicted, overwritten or discarded unread
+};
+
+class BufferCache : public BlockDevice
+{
+private:
+    struct CachedBlock
+    {
+        int block_index;
+        bool dirty;
+        bool prefetched; // not read since the prefetch thread loaded it
+        std::array<uint8_t, BLOCK_SIZE> data;
+    };
+
+    using LruList = std::list<CachedBlock>;
+
+    BlockDevice &backing;
+    size_t capacity_blocks;
+
+    // front is the most recently used block
+    mutable LruList lru;
+    mutable std::unordered_map<int, LruList::iterator> index;
+    mutable BufferCacheStats stats;
+    mutable std::mutex cache_mutex;
+    mutable std::mutex backing_mutex; // taken under cache_mutex, or alone by the prefetch thread while it reads
+
+    mutable std::deque<int> prefetch_queue;
+    mutable std::unordered_set<int> prefetch_reading; // being read by the prefetch thread, still valid
+    mutable std::condition_variable prefetch_ready;
+    mutable std::thread prefetch_thread;
+    bool stopping;
+    mutable int viewed_block; // the block of the last view, the prefetch thread does not evict it
+
+    CachedBlock *find_cached(int block_index) const;
+    void count_read(CachedBlock &cached) const;
+    void prefetch_loop() const;
+    std::expected<CachedBlock *, FileSystemStatus> load(int block_index) const;
+    FileSystemStatus insert(int block_index, const uint8_t *data, bool dirty) const;
+    FileSystemStatus make_room(size_t new_blocks, int kept_block = -1) const;
+    FileSystemStatus write_back_dirty();
+    void invalidate_prefetch_read(int block_index) const;
+
+public:
+    /* the budget is rounded down to whole blocks, at least one block is always cached */
+    BufferCache(BlockDevice &_backing, size_t memory_budget_bytes);
+
+    /* stops the prefetch thread and writes dirty blocks back, the backing device must outlive the cache */
+    ~BufferCache() override;
+
+    BufferCache(const BufferCache &) = delete;
+    BufferCache &operator=(const BufferCache &) = delete;
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* a view points into the cache and stays valid until the next call on the cache, prefetching does not end it */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+
+    /* queues the uncached blocks for the prefetch thread and returns at once */
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+
+    /* drops the blocks still queued, a batch being read is cached anyway */
+    void cancel_prefetch(std::span<const int> block_indices) const override;
+
+    /* discards on the backing device, then drops the cached copies of the range, dirty ones included */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* writes every dirty block back, then flushes the backing device */
+    FileSystemStatus flush() override;
+
+    BufferCacheStats get_stats() const;
+    int cached_blocks_number() const;
+    int dirty_blocks_number() const;
+
+    /* blocks still queued for the prefetch thread or being read by it */
+    int queued_prefetch_number() const;
+};
@@ -0,0 +1,67 @@
+/*
+ * A BlockDevice decorator that keeps a CRC32C for every block.
+ *
+ * The checksums live in a reserved area at the end of the backing device, the
+ * blocks before it are the data blocks seen by the caller. The whole area is
+ * kept resident so a read costs no extra I/O. Reads are verified and fail with
+ * ChecksumMismatch, a write sends the data and its checksum blocks in one batch.
+ *
+ * A stored checksum of 0 marks a block that was never written through the
+ * device, it is not verified.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <vector>
+
+const int CHECKSUMS_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+
+class ChecksumBlockDevice : public BlockDevice
+{
+private:
+    BlockDevice &backing;
+    int data_blocks;
+    int checksum_area_start;
+    bool loaded;
+    std::vector<uint32_t> checksums; // resident copy of the checksum area
+    mutable uint64_t mismatches; // counted by the const read path
+
+    bool verify(int block_index, const uint8_t *data) const;
+
+public:
+    /* reads the checksum area of the backing device, check is_loaded() */
+    explicit ChecksumBlockDevice(BlockDevice &_backing);
+
+    ChecksumBlockDevice(const ChecksumBlockDevice &) = delete;
+    ChecksumBlockDevice &operator=(const ChecksumBlockDevice &) = delete;
+
+    /* the backing size needed to expose data_blocks blocks */
+    static int backing_blocks_for(int data_blocks);
+
+    bool is_loaded() const { return loaded; }
+    uint64_t get_mismatches() const { return mismatches; }
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* const views are verified first, writes through a view would skip the checksum so they are NotSupported */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+
+    /* the range is marked unwritten before the backing device discards it */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* blocks map one to one, so the hint is forwarded as is */
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+    void cancel_prefetch(std::span<const int> block_indices) const override;
+
+    FileSystemStatus flush() override;
+};
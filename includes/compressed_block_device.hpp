@@ -0,0 +1,136 @@
+/*
+ * A BlockDevice decorator that stores every block compressed.
+ *
+ * Backing layout:
+ *  block 0                  - header (magic, number of logical blocks)
+ *  blocks 1..table_blocks   - indirection table, one uint32 per logical block
+ *  the rest                 - slot area, each backing block holds 8 slots of 512 bytes
+ *
+ * A block is compressed with the built-in LZ codec and stored in consecutive slots
+ * of one backing block, so several blocks share a backing block. A table entry is
+ * (first slot << 4 | slot count), 0 is a block that was never written or is all
+ * zeros and takes no space. A block that does not shrink below 8 slots is stored raw.
+ *
+ * The table is written back on flush(). Slots freed by overwrites are reused only
+ * after that, so the table on the device always points at intact payloads. A
+ * write that finds too few free slots flushes to reclaim them, and on a full
+ * device the overwritten blocks of the batch are unmapped first, so a crash
+ * leaves them zeros. That happens only once the whole batch is known to fit,
+ * a batch that does not fit fails with the old blocks intact.
+ * Decompressed blocks are kept in a small LRU cache in front of the device.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <list>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+const int COMPRESSION_SLOT_SIZE = 512;
+const int SLOTS_PER_BLOCK = BLOCK_SIZE / COMPRESSION_SLOT_SIZE;
+const int TABLE_ENTRIES_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+const size_t DEFAULT_DECOMPRESSED_CACHE_BYTES = 64 * BLOCK_SIZE;
+
+struct CompressionStats
+{
+    uint64_t blocks_written;
+    uint64_t zero_blocks;       // stored as holes
+    uint64_t raw_blocks;        // did not compress, stored as is
+    uint64_t logical_bytes;     // bytes written by the caller, holes excluded
+    uint64_t stored_bytes;      // slot bytes used for them
+    uint64_t compress_nanoseconds;
+    uint64_t decompress_nanoseconds;
+    uint64_t blocks_decompressed;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+class CompressedBlockDevice : public BlockDevice
+{
+private:
+    struct CachedBlock
+    {
+        int block_index;
+        std::array<uint8_t, BLOCK_SIZE> data;
+    };
+
+    BlockDevice &backing;
+    int logical_blocks;
+    int table_blocks;
+    int slot_area_start;
+    int slot_area_blocks;
+    bool loaded;
+    bool formatted; // the backing device holds the header, or does after the next flush
+    bool header_dirty;
+
+    std::vector<uint32_t> table;
+    std::set<int> dirty_table_blocks;
+    std::vector<uint8_t> slot_masks; // used slots of every slot area block
+    std::vector<uint32_t> pending_free; // table entries released once the table is flushed
+    int allocation_cursor;
+
+    size_t cache_capacity_blocks;
+    mutable std::list<CachedBlock> cache; // front is the most recently used
+    mutable std::unordered_map<int, std::list<CachedBlock>::iterator> cache_index;
+    mutable CompressionStats stats;
+
+    std::expected<uint32_t, FileSystemStatus> allocate_slots(int slots_count);
+    void release_slots(uint32_t entry);
+    bool allocate_batch(std::span<const int> slots_counts, std::span<uint32_t> entries);
+    bool batch_fits(std::span<const int> slots_counts, std::span<const uint32_t> released_entries);
+    FileSystemStatus reclaim_slots(std::span<const int> block_indices, std::span<const int> slots_counts);
+    void set_entry(int block_index, uint32_t entry);
+    const uint8_t *find_cached(int block_index) const;
+    void cache_block(int block_index, const uint8_t *data) const;
+    FileSystemStatus load_blocks(std::span<const int> block_indices, uint8_t *buffer) const;
+
+public:
+    /* an unformatted backing device starts empty and is not written before the first write, check is_loaded() */
+    CompressedBlockDevice(BlockDevice &_backing, int _logical_blocks,
+                          size_t cache_bytes = DEFAULT_DECOMPRESSED_CACHE_BYTES);
+
+    /* the table is flushed, the backing device must outlive the compressed device */
+    ~CompressedBlockDevice() override;
+
+    CompressedBlockDevice(const CompressedBlockDevice &) = delete;
+    CompressedBlockDevice &operator=(const CompressedBlockDevice &) = delete;
+
+    /* the backing size that holds logical_blocks even if nothing compresses */
+    static int backing_blocks_for(int logical_blocks);
+
+    bool is_loaded() const { return loaded; }
+    CompressionStats get_stats() const { return stats; }
+
+    /* logical bytes per stored byte over everything written so far */
+    double get_compression_ratio() const;
+
+    /* slot area bytes used by live blocks */
+    uint64_t get_used_bytes() const;
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* a const view points into the decompressed cache, mutable views are NotSupported */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+
+    /* the range becomes holes, its slots are released on the next flush */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /*
+     * writes the header and the dirty table blocks, then flushes the backing device
+     * slot area blocks emptied by the released slots are discarded on the backing device
+     */
+    FileSystemStatus flush() override;
+};
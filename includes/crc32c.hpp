@@ -0,0 +1,18 @@
+/*
+ * CRC32C (Castagnoli) checksums.
+ *
+ * crc32c() uses the SSE4.2 crc32 instruction when the CPU has it and falls
+ * back to a portable slice-by-8 table implementation otherwise.
+ * Both continue a previous checksum, crc32c(b, crc32c(a)) == crc32c(a + b).
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+uint32_t crc32c(const uint8_t *data, size_t length, uint32_t crc = 0);
+
+uint32_t crc32c_portable(const uint8_t *data, size_t length, uint32_t crc = 0);
+
+bool crc32c_is_hardware_accelerated();
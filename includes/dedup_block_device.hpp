@@ -0,0 +1,125 @@
+/*
+ * A BlockDevice decorator that stores every distinct block once.
+ *
+ * Backing layout:
+ *  block 0                  - header (magic, number of logical blocks)
+ *  blocks 1..table_blocks   - map, one uint32 per logical block
+ *  the rest                 - physical blocks
+ *
+ * Every written block is fingerprinted with block_hash(). A block whose
+ * fingerprint and bytes match a stored physical block only gains a reference
+ * to it, otherwise it is written to a free physical block. A map entry is the
+ * physical block + 1, 0 is the zero block, so all-zero blocks take no space.
+ * Physical blocks are never overwritten in place, since other logical blocks
+ * may share them.
+ *
+ * The fingerprint index and the reference counts live in memory and are
+ * rebuilt from the map on mount. The map is written back on flush(), physical
+ * blocks that lost their last reference are reused only after that, so the map
+ * on the device always points at intact blocks. A write that finds too few free
+ * physical blocks flushes to reclaim them, and on a full device overwritten
+ * blocks of the batch are unmapped first, so a crash leaves them zeros. That
+ * happens only once they make room for the whole batch, a batch that does not
+ * fit fails with the old blocks intact.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <expected>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+const int DEDUP_ENTRIES_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+
+struct DedupStats
+{
+    uint64_t blocks_written;
+    uint64_t zero_blocks;      // collapsed into the zero block
+    uint64_t duplicate_blocks; // matched a stored block, nothing written
+    uint64_t unique_blocks;    // written to a new physical block
+    uint64_t hash_collisions;  // equal fingerprints of different blocks
+    uint64_t hash_nanoseconds;
+};
+
+class DedupBlockDevice : public BlockDevice
+{
+private:
+    BlockDevice &backing;
+    int logical_blocks;
+    int table_blocks;
+    int physical_area_start;
+    int physical_blocks;
+    bool loaded;
+    bool formatted; // the backing device holds the header, or does after the next flush
+    bool header_dirty;
+
+    std::vector<uint32_t> table;
+    std::set<int> dirty_table_blocks;
+    int mapped_blocks; // non-zero map entries
+
+    std::unordered_multimap<uint64_t, int> index; // fingerprint -> physical block
+    std::vector<uint64_t> fingerprints;           // of every physical block in use
+    std::vector<uint32_t> reference_counts;
+    std::vector<bool> allocated;                  // referenced, or released but not yet flushed
+    std::vector<int> pending_free;                // released once the map is flushed
+    int allocated_blocks;
+    int allocation_cursor;
+    DedupStats stats;
+
+    std::expected<int, FileSystemStatus> allocate_physical();
+    FileSystemStatus reserve_physical(std::span<const int> block_indices, std::span<const uint32_t> kept_entries, int needed);
+    void remove_from_index(int physical);
+    void add_reference(uint32_t entry);
+    void drop_reference(uint32_t entry);
+    void set_entry(int block_index, uint32_t entry);
+
+public:
+    /* an unformatted backing device starts empty and is not written before the first write, check is_loaded() */
+    DedupBlockDevice(BlockDevice &_backing, int _logical_blocks);
+
+    /* the map is flushed, the backing device must outlive the dedup device */
+    ~DedupBlockDevice() override;
+
+    DedupBlockDevice(const DedupBlockDevice &) = delete;
+    DedupBlockDevice &operator=(const DedupBlockDevice &) = delete;
+
+    /* the backing size that holds logical_blocks even if nothing repeats */
+    static int backing_blocks_for(int logical_blocks);
+
+    bool is_loaded() const { return loaded; }
+    DedupStats get_stats() const { return stats; }
+
+    /* physical blocks holding live data, released ones awaiting a flush excluded */
+    int get_physical_blocks_used() const;
+
+    /* non-zero logical blocks per physical block in use */
+    double get_dedup_ratio() const;
+
+    /* estimated bytes of the fingerprint index and the per physical block metadata */
+    size_t get_index_memory_bytes() const;
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* a const view is the backing view of the shared block, mutable views are NotSupported */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+
+    /* the range is mapped to the zero block, physical blocks left unreferenced are released on the next flush */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /*
+     * writes the header and the dirty map blocks, then flushes the backing device
+     * the released physical blocks are discarded on the backing device
+     */
+    FileSystemStatus flush() override;
+};
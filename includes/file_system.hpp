@@ -3,14 +3,23 @@
 #include "fs_constants.hpp"
 #include "block_device.hpp"
 #include "fs_status.hpp"
+#include "journal.hpp"
+#include "allocation_bitmap.hpp"
+#include "inode_lock_table.hpp"
 #include <string>
 #include <vector>
 #include <expected>
+#include <list>
 #include <optional>
 #include <string_view>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <span>
+#include <unordered_map>
 
 enum class EntryType
 {
@@ -19,32 +28,160 @@ enum class EntryType
     Directory
 };
 
+/*
+ * Volume layout, in blocks:
+ *  superblock | journal | inode bitmap | data bitmap | inode table | data
+ * The sizes follow from total_blocks and total_inodes, see make_superblock()
+ */
 struct Superblock
 {
     int magic;
     int version;
     int total_blocks;
     int root_dir_block_index;
+    int total_inodes;
+    int inode_bitmap_start;
+    int inode_bitmap_blocks;
+    int data_bitmap_start;
+    int data_bitmap_blocks;
+    int inode_table_start;
+    int inode_table_blocks;
+    int data_start;
+    int data_blocks;
 };
 
+enum class InodeLayout : uint8_t
+{
+    Blocks, // direct and indirect block pointers
+    Extents,
+    HashTree // a directory indexed by name hash, see DirNode
+};
+
+/*
+ * length file blocks from logical_block, stored from physical_block on. In an
+ * extent index physical_block is the child node, whose extents start at logical_block
+ */
+struct Extent
+{
+    int logical_block;
+    int physical_block;
+    int length;
+};
+
+const int INLINE_EXTENTS = 4;
+
+/*
+ * Blocks layout - a file block past the direct blocks is found through
+ * indirect_blocks[0] (an indirect block of POINTERS_PER_BLOCK block numbers),
+ * [1] (a block of indirect blocks) or [2] (a block of those). Every missing
+ * block is -1. A directory keeps its entries in the first DIR_LINEAR_BLOCKS
+ * direct blocks.
+ *
+ * Extents layout - extents is the root of an extent tree, sorted by
+ * logical_block, an unused slot has physical_block -1. With extent_depth 0
+ * they are the file extents, otherwise they index ExtentNode blocks
+ *
+ * HashTree layout - a directory that outgrew its linear blocks, index_root is
+ * the root DirNode of a B+tree of index_blocks blocks
+ */
 struct Inode
 {
     EntryType type;
-    int size;
-    int direct_blocks[TOTAL_DIRECT_BLOCKS];
-    int link_count;
+    uint16_t link_count;
+    InodeLayout layout;
+    uint8_t extent_depth;
+    uint64_t size;
+    union
+    {
+        struct
+        {
+            int direct_blocks[TOTAL_DIRECT_BLOCKS];
+            int indirect_blocks[INDIRECT_LEVELS];
+        };
+        Extent extents[INLINE_EXTENTS];
+        struct
+        {
+            int index_root;
+            int index_blocks;
+        };
+    };
+};
+
+static_assert(sizeof(Inode) == 64, "Inode must be 64 bytes");
+
+/* a block of the extent tree, depth 0 holds file extents and the rest index the level below */
+struct ExtentNode
+{
+    int count;
+    int depth;
+    Extent extents[(BLOCK_SIZE - 2 * sizeof(int)) / sizeof(Extent)];
 };
 
-static_assert(sizeof(Inode) == (3 + 12) * sizeof(int), "Inode must be 60 bytes");
+static_assert(sizeof(ExtentNode) <= BLOCK_SIZE, "an extent node must fit a block");
+
+const int EXTENTS_PER_NODE = sizeof(ExtentNode::extents) / sizeof(Extent);
+
+/* file blocks and the device blocks they are stored in, device_block -1 for a hole */
+struct BlockRun
+{
+    int file_block;
+    int device_block;
+    int length;
+};
+
+/* contiguous data blocks, absolute block numbers */
+struct DataBlockRun
+{
+    int first_block;
+    int length;
+};
 
 struct InodeAttributes // requires for the RPC GETATTR operation
 {
     EntryType type;
-    uint32_t size;
-    uint32_t blocks_used;
+    uint64_t size;
+    uint64_t blocks_used; // the data and the indirect blocks
     uint32_t link_count;
 };
 
+struct SpaceStats // requires for statfs
+{
+    uint64_t total_blocks; // the data blocks
+    uint64_t free_blocks;
+    uint64_t total_inodes;
+    uint64_t free_inodes;
+};
+
+struct ReadaheadStats
+{
+    uint64_t sequential_reads;
+    uint64_t random_reads; // reads that cancelled a window
+    uint64_t blocks_read;
+    uint64_t prefetched_blocks; // hinted to the device
+    uint64_t hit_blocks;        // read after being prefetched
+    uint64_t wasted_blocks;     // prefetched, then given up by a random read or a delete
+
+    double hit_rate() const { return blocks_read == 0 ? 0 : static_cast<double>(hit_blocks) / blocks_read; }
+    uint64_t wasted_bytes() const { return wasted_blocks * BLOCK_SIZE; }
+};
+
+struct DentryCacheStats
+{
+    uint64_t hits;          // names found in the cache
+    uint64_t negative_hits; // of them, names the cache knows are missing
+    uint64_t misses;        // names looked up in the directory
+    uint64_t evictions;
+
+    double hit_rate() const { return hits + misses == 0 ? 0 : static_cast<double>(hits) / (hits + misses); }
+};
+
+struct InodeCacheStats
+{
+    uint64_t hits;
+    uint64_t misses; // inodes read from the inode table
+    uint64_t evictions;
+};
+
 struct Entry
 {
     int inode_id;
@@ -59,23 +196,101 @@ const int INODE_SIZE = sizeof(Inode);
 const int DIR_ENTRY_SIZE = sizeof(Entry);
 const int ENTRIES_PER_BLOCK = BLOCK_SIZE / sizeof(Entry);
 const int INODES_PER_BLOCK = BLOCK_SIZE / INODE_SIZE;
-const int INODE_TABLE_SIZE = (TOTAL_INODE_NUMBER + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+const int MAX_FILE_BLOCKS = TOTAL_DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK +
+                            POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+
+/* a child of a hash tree index node, it holds the names hashing to hash and up */
+struct DirIndexEntry
+{
+    uint32_t hash;
+    int child_block;
+};
+
+const int DIR_LINEAR_BLOCKS = 1; // a directory that needs more becomes a hash tree
+const int DIR_NODE_HEADER_SIZE = 4 * sizeof(int);
+const int DIR_LEAF_ENTRIES = (BLOCK_SIZE - DIR_NODE_HEADER_SIZE) / (sizeof(uint32_t) + sizeof(Entry));
+const int DIR_INDEX_ENTRIES = (BLOCK_SIZE - DIR_NODE_HEADER_SIZE) / sizeof(DirIndexEntry);
+
+/*
+ * A block of a hash tree directory. A leaf (depth 0) holds entries sorted by
+ * the crc32c of their names and is chained to the next leaf in hash order.
+ * Colliding names sit next to each other and may run on into the next leaf,
+ * next_hash is the first hash that leaf takes. An index node holds its
+ * children sorted by hash, children[0] takes everything below children[1].
+ * Nodes are never merged, a directory keeps its tree until it is deleted
+ */
+struct DirNode
+{
+    int depth;
+    int count;
+    int next_leaf; // -1 after the last leaf
+    uint32_t next_hash;
+    union
+    {
+        struct
+        {
+            uint32_t hashes[DIR_LEAF_ENTRIES];
+            Entry entries[DIR_LEAF_ENTRIES];
+        };
+        DirIndexEntry children[DIR_INDEX_ENTRIES];
+    };
+};
 
-const int ROOT_DIR_BLOCK_INDEX = INODE_TABLE_START_INDEX + INODE_TABLE_SIZE;
-const int DATA_START_BLOCK = ROOT_DIR_BLOCK_INDEX + 1;
-const int DATA_TABLE_SIZE = TOTAL_BLOCKS_NUMBER - DATA_START_BLOCK;
+static_assert(sizeof(DirNode) <= BLOCK_SIZE, "a directory node must fit a block");
+static_assert(DIR_LINEAR_BLOCKS * ENTRIES_PER_BLOCK / (DIR_LEAF_ENTRIES / 2) < DIR_INDEX_ENTRIES, "a converted directory must fit one index node");
 
+/*
+ * The public calls are thread safe and run concurrently. Each one holds the
+ * inode locks of the inodes it reads or changes (see InodeLockTable for the
+ * order), then a journal handle. The allocation bitmaps, the caches and the
+ * readahead windows have locks of their own, held for a few instructions.
+ * The constructor and format() run alone.
+ */
 class FileSystem
 {
 public:
+    /* replays the journal of a formatted device before reading the superblock */
     explicit FileSystem(BlockDevice &_device);
 
-    void format();
+    /*
+     * lays out the whole device, 0 inodes picks one per BLOCKS_PER_INODE blocks
+     * and at least MIN_INODE_NUMBER. A device too small for the layout is OutOfBounds
+     */
+    FileSystemStatus format(int total_inodes = 0);
+    bool is_device_formatted() const { return is_formatted; }
+
+    /* the layout of a volume of total_blocks blocks, see format() for total_inodes */
+    static std::expected<Superblock, FileSystemStatus> make_superblock(int total_blocks, int total_inodes);
+
+    /* the mounted layout, before format() the one a default format() would pick */
+    const Superblock &get_superblock() const { return superblock; }
+
+    /* commits the changes of the finished calls, one journal write and flush for all of them */
+    FileSystemStatus sync();
+    JournalStats get_journal_stats() const { return journal.get_stats(); }
+
+    /* the layout of the files created from now on, directories pick their own */
+    void set_file_layout(InodeLayout layout) { file_layout = layout; }
+
+    /* freed data blocks are discarded on the device by the sync() that commits their release */
+    void set_online_discard(bool enabled) { online_discard = enabled; }
+
+    /* discards every free data block (fstrim), returns the number of discarded blocks */
+    std::expected<int, FileSystemStatus> trim_free_blocks();
+
+    /* the free counts are kept with the resident bitmaps, no device access */
+    SpaceStats get_space_stats() const;
+    int get_group_count() const { return static_cast<int>(groups.size()); }
+
+    ReadaheadStats get_readahead_stats() const;
+    DentryCacheStats get_dentry_cache_stats() const;
+    InodeCacheStats get_inode_cache_stats() const;
 
     /********** Public API ************/
 
     std::expected<Entry, FileSystemStatus> lookup(int dir_inode_id, std::string_view entry_name);
-    FileSystemStatus delete_entry(int parent_inode_id, int inode_id);
+    /* a name finds the entry of a large directory through its index instead of a scan */
+    FileSystemStatus delete_entry(int parent_inode_id, int inode_id, std::string_view entry_name = {});
     std::expected<InodeAttributes, FileSystemStatus> get_attributes(int inode_id);
     std::expected<int, FileSystemStatus> get_inode_by_path(std::string_view path);
 
@@ -86,48 +301,238 @@ public:
 
     // Directory operations
     std::expected<int, FileSystemStatus> create_directory(int parent_inode_id, std::string_view dir_name);
-    std::expected<std::vector<Entry>, FileSystemStatus> list_directory_content(int inode_id, uint32_t entry_offset);
-
-    // Testing helpers
-    const std::array<int, INODE_TABLE_SIZE> &get_inode_blocks_table() const { return inode_table_blocks; }
+    /* the entries of one page of the directory, a page past the last one is OutOfBounds */
+    std::expected<std::vector<Entry>, FileSystemStatus> list_directory_content(int inode_id, uint32_t page);
 
     friend class DataManagerTest;
     friend class InodeManagerTest;
     friend class FileSystemInternalTest;
 
 private:
-    BlockDevice &device;
-    std::array<int, INODE_TABLE_SIZE> inode_table_blocks;
+    Journal journal;
+    BlockDevice &device; // the journal, every metadata block goes through it
     bool is_formatted;
     Superblock superblock;
 
+    /*
+     * Allocation groups - the data blocks are split in groups of BLOCKS_PER_GROUP
+     * and the inodes in as many groups, so a group owns a data bitmap block, a
+     * slice of the inode bitmap and of the inode table. Its bitmaps stay in
+     * memory, each with its own lock and free count, loaded on mount and reset by
+     * format(). Files go to the group of their directory, new directories to a
+     * group with many free inodes and blocks
+     */
+    struct AllocationGroup
+    {
+        int first_inode;
+        int first_block; // the first data block, relative to data_start
+        AllocationBitmap inodes;
+        AllocationBitmap blocks;
+    };
+
+    std::vector<std::unique_ptr<AllocationGroup>> groups;
+    int inodes_per_group;
+    std::atomic<int> data_group_cursor;           // the group of the last data allocation
+    std::atomic<unsigned> directory_group_cursor; // where the search for a directory group starts
+
+    /*
+     * The data blocks reserved for the holes one write_file call fills. They are
+     * out of the bitmap but not in its blocks until a file block takes them, the
+     * ones left are given back when the reservation goes away
+     */
+    struct BlockReservation
+    {
+        FileSystem &fs;
+        std::vector<DataBlockRun> runs; // taken from the front, in device order
+        size_t next_run;
+
+        explicit BlockReservation(FileSystem &_fs) : fs(_fs), next_run(0) {}
+        ~BlockReservation() { fs.release_reservation(*this); }
+
+        BlockReservation(const BlockReservation &) = delete;
+        BlockReservation &operator=(const BlockReservation &) = delete;
+    };
+
+    /*
+     * The locks of the inodes the running calls use. A new inode is not locked,
+     * no call can reach it before its entry is added to the locked parent
+     */
+    InodeLockTable inode_locks;
+
+    InodeLayout file_layout;
+    bool online_discard;
+    std::mutex discard_mutex;
+    std::set<int> pending_discards; // freed, not yet discarded, absolute block numbers
+
+    /*
+     * Readahead - a read that starts where the last read of the file ended (or
+     * in its last block) is sequential. It hints the next window of blocks to
+     * the device ahead of time, the window starts at READAHEAD_MIN_BLOCKS and
+     * doubles whenever the reader has consumed half of what was prefetched.
+     * Any other read cancels the window
+     */
+    struct ReadaheadState
+    {
+        int next_block = 0;     // the file block a sequential read starts at
+        int window = 0;         // 0 until a sequential read opens one
+        int prefetched_end = 0; // file blocks below it were prefetched
+    };
+
+    mutable std::mutex readahead_mutex;
+    bool readahead_enabled;
+    std::unordered_map<int, ReadaheadState> readahead_states; // per inode
+    ReadaheadStats readahead_stats;
+
+    /* a page of a hash tree directory is a leaf, listing page after page follows the leaf chain */
+    struct DirCursor
+    {
+        uint32_t page;  // the page a listing continues with
+        int leaf_block; // its leaf, -1 past the last one
+    };
+
+    std::mutex dir_cursor_mutex;
+    std::unordered_map<int, DirCursor> dir_cursors; // per directory inode
+
+    /*
+     * Dentry cache - the results of lookup() by (directory, name), up to
+     * DENTRY_CACHE_ENTRIES of them. A name the directory does not hold is cached
+     * too, as an entry with inode_id -1. Adding and removing an entry update its
+     * name in place, deleting a directory drops every name under it
+     */
+    struct DentryKey
+    {
+        int dir_inode_id;
+        std::string_view name; // points into the cached entry, or at the name looked up
+        bool operator==(const DentryKey &other) const = default;
+    };
+
+    struct DentryKeyHash
+    {
+        size_t operator()(const DentryKey &key) const
+        {
+            return std::hash<std::string_view>{}(key.name) ^ (static_cast<size_t>(key.dir_inode_id) * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+
+    struct CachedDentry
+    {
+        int dir_inode_id;
+        std::string name;
+        Entry entry;
+    };
+
+    using DentryList = std::list<CachedDentry>;
+
+    /*
+     * Inode cache - the inodes read or written, up to INODE_CACHE_ENTRIES of
+     * them, the least recently used go first. Writes go through to the inode
+     * table block of the running transaction, the journal writes every dirty
+     * block once per commit. blocks_used is kept until the inode is written again
+     * or its file gains blocks
+     */
+    struct CachedInode
+    {
+        int inode_id;
+        Inode inode;
+        std::optional<uint64_t> blocks_used;
+    };
+
+    using InodeList = std::list<CachedInode>;
+
+    mutable std::mutex inode_cache_mutex;
+    InodeList inode_lru; // front is the most recently used
+    std::unordered_map<int, InodeList::iterator> inode_index;
+    InodeCacheStats inode_cache_stats;
+
+    mutable std::mutex dentry_mutex;
+    DentryList dentry_lru; // front is the most recently used
+    std::unordered_map<DentryKey, DentryList::iterator, DentryKeyHash> dentry_index;
+    DentryCacheStats dentry_stats;
+
     /********** Templates ************/
 
     template <typename T, typename Predicate>
     std::optional<T> get_element(const int *block_indices, int num_indices, int table_base_offset, int &out_absolute_block, Predicate is_match)
     {
-        uint8_t buffer[BLOCK_SIZE];
+        std::vector<int> absolute_blocks;
         for (int i = 0; i < num_indices; i++)
+            if (block_indices[i] != -1)
+                absolute_blocks.push_back(block_indices[i] + table_base_offset);
+
+        // devices that lend their blocks are scanned in place
+        if (!absolute_blocks.empty() && device.view_block(absolute_blocks.front()).has_value())
         {
-            out_absolute_block = block_indices[i] + table_base_offset;
-            if (block_indices[i] == -1)
-                continue;
-
-            auto *start = get_block_ptr<T>(out_absolute_block, buffer);
-            auto *end = start + BLOCK_SIZE / sizeof(T);
-            auto it = std::find_if(start, end, is_match);
-            if (it != end)
-                return *it;
+            for (int absolute_block : absolute_blocks)
+            {
+                auto view_res = device.view_block(absolute_block);
+                if (!view_res.has_value())
+                    break;
+
+                auto *start = reinterpret_cast<const T *>(view_res.value().data());
+                auto *end = start + BLOCK_SIZE / sizeof(T);
+                auto it = std::find_if(start, end, is_match);
+                if (it != end)
+                {
+                    out_absolute_block = absolute_block;
+                    return *it;
+                }
+            }
+
+            out_absolute_block = -1;
+            return std::nullopt;
         }
+
+        // otherwise fetch all the used blocks in one batch, then scan them in order
+        std::vector<uint8_t> buffer(absolute_blocks.size() * BLOCK_SIZE);
+        if (device.read_blocks(absolute_blocks, buffer.data()) == FileSystemStatus::OK)
+        {
+            for (size_t i = 0; i < absolute_blocks.size(); i++)
+            {
+                auto *start = reinterpret_cast<const T *>(buffer.data() + i * BLOCK_SIZE);
+                auto *end = start + BLOCK_SIZE / sizeof(T);
+                auto it = std::find_if(start, end, is_match);
+                if (it != end)
+                {
+                    out_absolute_block = absolute_blocks[i];
+                    return *it;
+                }
+            }
+        }
+
         out_absolute_block = -1;
         return std::nullopt;
     }
 
+    /* points at the block in place when the device lends it, otherwise reads it into buffer */
     template <typename T>
-    T *get_block_ptr(int absolute_block_number, uint8_t *buffer)
+    const T *get_block_ptr(int absolute_block_number, uint8_t *buffer) const
     {
+        auto view_res = device.view_block(absolute_block_number);
+        if (view_res.has_value())
+            return reinterpret_cast<const T *>(view_res.value().data());
+
         device.read_block(absolute_block_number, buffer);
-        return reinterpret_cast<T *>(buffer);
+        return reinterpret_cast<const T *>(buffer);
+    }
+
+    /* edits the block in place when the device lends it, otherwise as a read-modify-write */
+    template <typename T, typename Update>
+    FileSystemStatus update_block(int absolute_block_number, Update update)
+    {
+        auto view_res = device.mutable_view_block(absolute_block_number);
+        if (view_res.has_value())
+        {
+            update(reinterpret_cast<T *>(view_res.value().data()));
+            return FileSystemStatus::OK;
+        }
+
+        uint8_t buffer[BLOCK_SIZE];
+        FileSystemStatus status = device.read_block(absolute_block_number, buffer);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        update(reinterpret_cast<T *>(buffer));
+        return device.write_block(absolute_block_number, buffer);
     }
 
     template <typename T>
@@ -141,41 +546,115 @@ private:
 
     /********** Initialization ************/
     void format_superblock();
+    FileSystemStatus format_metadata();
     FileSystemStatus init_root_directory();
     FileSystemStatus init_directory_entries(int inode_id, int parent_inode_id);
     FileSystemStatus init_inode_bitmap_on_format();
-    FileSystemStatus init_inode_table_on_format() const;
+    FileSystemStatus init_inode_table_on_format();
     FileSystemStatus init_data_bitmap_on_format();
-    void init_data_blocks_on_format();
+    FileSystemStatus init_data_blocks_on_format();
+    FileSystemStatus init_bitmap_on_format(int start_block, int bitmap_blocks, int total_bits);
+    FileSystemStatus load_bitmaps();
+    std::expected<std::vector<uint8_t>, FileSystemStatus> read_bitmap(int start_block, int bitmap_blocks);
+    FileSystemStatus zero_blocks_on_format(int first_block, int blocks_count);
 
     /********** Inode Management ************/
     Inode create_inode(EntryType type);
     std::expected<Inode, FileSystemStatus> get_inode(int inode_id);
-    std::expected<int, FileSystemStatus> allocate_inode();
+    std::expected<int, FileSystemStatus> allocate_inode(int parent_inode_id = ROOT_INODE_ID, EntryType type = EntryType::File);
     std::expected<int, FileSystemStatus> create_new_inode(EntryType type, int parent_inode_id, std::string_view name);
     FileSystemStatus write_inode(int inode_id, const Inode &inode);
     FileSystemStatus free_inode(int inode_id);
 
     /********** Data Block Management ************/
-    std::expected<int, FileSystemStatus> allocate_data_block();
+    /* a block in group_index or a group after it, -1 continues from the last allocation */
+    std::expected<int, FileSystemStatus> allocate_data_block(int group_index = -1);
+    /* count blocks in as few runs as possible near goal (an absolute block, -1 for none), FullDisk when they are not all free */
+    std::expected<std::vector<DataBlockRun>, FileSystemStatus> allocate_data_blocks(int count, int goal);
+    void reserve_data_blocks(BlockReservation &reservation, int count, int goal, int group);
+    void release_reservation(BlockReservation &reservation);
+    /* the next reserved block, or a block in the group of the inode */
+    std::expected<int, FileSystemStatus> allocate_file_block(int inode_id, BlockReservation *reservation);
     std::expected<int, FileSystemStatus> get_block_index(Inode &inode, int target_block);
-    std::expected<int, FileSystemStatus> get_or_allocate_block_index(int inode_id, Inode &inode, int target_block);
+    FileSystemStatus map_blocks(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                BlockReservation *reservation = nullptr);
+    FileSystemStatus map_pointer_blocks(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                        BlockReservation *reservation);
+    std::expected<uint64_t, FileSystemStatus> count_blocks(const Inode &inode);
+    std::expected<uint64_t, FileSystemStatus> count_pointer_blocks(int block_index, int depth);
+    FileSystemStatus free_file_blocks(const Inode &inode);
+    FileSystemStatus free_pointer_blocks(int block_index, int depth);
+    FileSystemStatus free_data_blocks(int first_block, int blocks_count);
     FileSystemStatus free_data_block(int data_block_number);
 
+    /********** Extents ************/
+    void load_extent_root(const Inode &inode, ExtentNode &root);
+    void store_extent_root(const ExtentNode &root, Inode &inode);
+    FileSystemStatus read_extent_node(int block_index, ExtentNode &node);
+    FileSystemStatus write_extent_node(int block_index, const ExtentNode &node);
+    std::expected<BlockRun, FileSystemStatus> find_extent(const Inode &inode, int file_block);
+    FileSystemStatus map_extents(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                 BlockReservation *reservation);
+    FileSystemStatus add_extent(int inode_id, Inode &inode, const Extent &extent);
+    FileSystemStatus insert_extent(ExtentNode &node, int capacity, const Extent &extent, std::optional<Extent> &split);
+    FileSystemStatus insert_into_node(ExtentNode &node, int capacity, int position, const Extent &entry, std::optional<Extent> &split);
+    std::expected<uint64_t, FileSystemStatus> count_extent_blocks(const ExtentNode &node);
+    FileSystemStatus free_extent_blocks(const ExtentNode &node);
+
+    /********** Inode Cache ************/
+    std::optional<Inode> find_cached_inode(int inode_id);
+    std::optional<CachedInode> find_cached_attributes(int inode_id);
+    void cache_inode(int inode_id, const Inode &inode);
+    void cache_blocks_used(int inode_id, std::optional<uint64_t> blocks_used);
+    void forget_cached_inode(int inode_id);
+
+    /********** Dentry Cache ************/
+    std::optional<Entry> find_dentry(int dir_inode_id, std::string_view name);
+    void cache_dentry(int dir_inode_id, std::string_view name, const Entry &entry);
+    void forget_dentries(int dir_inode_id);
+
+    /********** Readahead ************/
+    void readahead(int inode_id, Inode &inode, int first_block, int last_block);
+    void forget_readahead(int inode_id);
+
     /********** Directory & Entry Management ************/
     Entry create_entry(EntryType type, int inode_id, std::string_view name);
     void set_as_empty(Entry &entry);
     void set_as_empty(Inode &inode);
+    void set_as_extents(Inode &inode);
     FileSystemStatus add_entry(int parent_inode_id, Entry &entry);
     FileSystemStatus add_entry_to_parent(int parent_inode_id, Inode &parent_inode, Entry &new_entry);
-    FileSystemStatus remove_entry(int dir_inode_id, int target_inode_id);
+    FileSystemStatus remove_entry(int dir_inode_id, int target_inode_id, std::string_view name = {});
     FileSystemStatus expand_directory(int inode_id, Inode &inode, Entry &new_entry);
-    FileSystemStatus delete_file(int parent_inode_id, int inode_id);
-    FileSystemStatus delete_directory(int parent_inode_id, int target_inode_id);
+    FileSystemStatus delete_file(int parent_inode_id, int inode_id, std::string_view name);
+    FileSystemStatus delete_directory(int parent_inode_id, int target_inode_id, std::string_view name);
+
+    /********** Hash Tree Directories ************/
+    static uint32_t name_hash(std::string_view name);
+    FileSystemStatus read_dir_node(int block_index, DirNode &node);
+    FileSystemStatus write_dir_node(int block_index, const DirNode &node);
+    std::expected<int, FileSystemStatus> find_dir_leaf(const Inode &inode, uint32_t hash, DirNode &leaf);
+    std::expected<Entry, FileSystemStatus> lookup_tree_entry(const Inode &inode, std::string_view name);
+    FileSystemStatus add_tree_entry(int inode_id, Inode &inode, const Entry &new_entry);
+    FileSystemStatus split_dir_node(int inode_id, Inode &inode, int parent_block, DirNode &parent, int slot, DirNode &child, DirNode &sibling);
+    FileSystemStatus remove_tree_entry(Inode &inode, int target_inode_id, std::string_view name, Entry &removed);
+    FileSystemStatus convert_to_hash_tree(int inode_id, Inode &inode);
+    std::expected<std::vector<Entry>, FileSystemStatus> list_tree_page(int inode_id, const Inode &inode, uint32_t page);
+    FileSystemStatus free_dir_tree(int block_index);
     /********** Path Resolution ************/
 
     /********** Bitmap (Low-Level) ************/
-    std::optional<int> find_free_bit(int start_block, int total_bits);
-    FileSystemStatus turn_on_bit(int bit_number, int starting_block_number, int max_bits_in_table);
-    FileSystemStatus turn_off_bit(int bit_number, int starting_block_number, int max_bits_in_table);
+    FileSystemStatus turn_on_bit(AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number);
+    FileSystemStatus turn_off_bit(AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number);
+    FileSystemStatus write_bitmap_word(const AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number);
+
+    /********** Allocation Groups ************/
+    void build_groups();
+    int inode_group_index(int inode_id) const;
+    AllocationGroup &inode_group(int inode_id);
+    AllocationGroup &data_group(int data_block_number);
+    int pick_directory_group();
+    int free_data_blocks_count() const;
+    void take_data_runs(int count, int goal, int group_index, bool reserve, std::vector<DataBlockRun> &runs);
+    FileSystemStatus write_data_run_words(const DataBlockRun &run);
 };
\ No newline at end of file
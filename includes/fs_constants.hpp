@@ -5,18 +5,30 @@ const int BITS_IN_BYTE = 8;
 
 /* FS constants */
 const int BLOCK_SIZE = 4096;
-const int TOTAL_BLOCKS_NUMBER = 100;
+const int BITS_PER_BLOCK = BLOCK_SIZE * BITS_IN_BYTE;
 const int ENTRY_NAME_LENGTH = 63;
-const int TOTAL_INODE_NUMBER = 128;
-const int TOTAL_DIRECT_BLOCKS = 12;
+const int TOTAL_DIRECT_BLOCKS = 9;
+const int INDIRECT_LEVELS = 3;                          // single, double and triple indirect blocks
+const int POINTERS_PER_BLOCK = BLOCK_SIZE / sizeof(int); // block numbers in an indirect block
 const int ROOT_INODE_ID = 0;
+const int MAX_BATCH_BLOCKS = 64; // blocks per read_blocks / write_blocks call
+const int READAHEAD_MIN_BLOCKS = 4;  // the first window of a sequential reader
+const int READAHEAD_MAX_BLOCKS = 32; // the window doubles up to 128 KiB
+const int DENTRY_CACHE_ENTRIES = 4096; // names remembered by lookup, the least recently used go first
+const int INODE_CACHE_ENTRIES = 8192;  // inodes kept in memory, about 1 MiB
 
 /* Superblock constants */
 const int FS_MAGIC = 0x12345678;
-const int FS_VERSION = 1;
+const int FS_VERSION = 7;
+
+/* Geometry - the real sizes are chosen by format() and kept in the superblock */
+const int DEFAULT_TOTAL_BLOCKS = 256; // a new volume when no size is given, 1 MiB
+const int MIN_INODE_NUMBER = 128;
+const int BLOCKS_PER_INODE = 4; // format() gives an inode per 16 KiB unless told otherwise
+const int BLOCKS_PER_GROUP = BITS_PER_BLOCK; // the data blocks of an allocation group, one data bitmap block
 
 /* Reserved blocks */
 const int SUPERBLOCK_INDEX = 0;
-const int INODE_BITMAP_INDEX = 1;
-const int DATA_BITMAP_INDEX = 2;
-const int INODE_TABLE_START_INDEX = 3;
+const int JOURNAL_START_INDEX = 1;
+const int JOURNAL_BLOCKS = 64; // the journal superblock and the log, several handles fit a transaction
+const int INODE_BITMAP_INDEX = JOURNAL_START_INDEX + JOURNAL_BLOCKS; // the rest of the metadata follows it
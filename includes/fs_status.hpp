@@ -16,5 +16,8 @@ enum class FileSystemStatus
     EntryNotFound,
     NotEmpty,
     InodeNotFound,
-    InodeNotEmpty
+    InodeNotEmpty,
+    DeviceError,
+    NotSupported,
+    ChecksumMismatch
 };
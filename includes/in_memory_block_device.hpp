@@ -5,18 +5,98 @@
 #include <vector>
 #include <array>
 #include <cstdint>
+#include <memory>
 #include "fs_status.hpp"
 
+/*
+ * Dense keeps every block in one contiguous allocation.
+ * Sparse backs blocks with a two-level page table and allocates a block on its
+ * first non-zero write, never-written blocks read as a shared zero block.
+ * Memory then follows the live data instead of the device size.
+ * HugePage keeps every block in one 2 MiB aligned slab of huge pages, so large
+ * volumes need a TLB entry per 512 blocks instead of one per block.
+ */
+enum class InMemoryLayout
+{
+    Dense,
+    Sparse,
+    HugePage
+};
+
+/* what actually backs a HugePage slab, the kernel may refuse huge pages */
+enum class HugePageBacking
+{
+    None,        // regular pages, or not a HugePage device
+    HugeTlb,     // reserved huge pages (MAP_HUGETLB)
+    Transparent  // transparent huge pages requested with madvise
+};
+
+struct HugePageOptions
+{
+    bool prefault = true; // touch every page at construction, so no fault is taken on the I/O path
+    int numa_node = -1;   // preferred NUMA node of the slab, -1 leaves the placement to the kernel
+};
+
+const int SPARSE_LEAF_BLOCKS = 512; // blocks covered by one second level table
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
 class InMemoryBlockDevice : public BlockDevice
 {
 private:
-    std::vector<std::array<uint8_t, BLOCK_SIZE>> memory;
+    using Block = std::array<uint8_t, BLOCK_SIZE>;
+    using SparseLeaf = std::array<std::unique_ptr<Block>, SPARSE_LEAF_BLOCKS>;
+
+    int total_blocks;
+    InMemoryLayout layout;
+    std::vector<Block> memory;                           // Dense
+    std::vector<std::unique_ptr<SparseLeaf>> page_table; // Sparse
+    uint8_t *slab;                                       // HugePage
+    size_t slab_size;
+    HugePageBacking hugepage_backing;
+    bool numa_bound;
+    int allocated_blocks;
+
+    bool map_slab(const HugePageOptions &options);
+
+    bool is_valid_index(int block_index) const;
+    const uint8_t *block_data(int block_index) const;
+    uint8_t *writable_block_data(int block_index);
+    void store_block(int block_index, const uint8_t *buffer);
 
 public:
-    /* constructs a memory block */
-    explicit InMemoryBlockDevice(int size_byte);
+    /*
+     * constructs a memory block
+     * a HugePage slab that cannot be mapped at all falls back to the Dense layout
+     */
+    explicit InMemoryBlockDevice(uint64_t size_byte, InMemoryLayout _layout = InMemoryLayout::Dense,
+                                 HugePageOptions hugepage_options = {});
+    ~InMemoryBlockDevice() override;
+
+    InMemoryBlockDevice(const InMemoryBlockDevice &) = delete;
+    InMemoryBlockDevice &operator=(const InMemoryBlockDevice &) = delete;
+
+    InMemoryLayout get_layout() const { return layout; }
+    HugePageBacking get_hugepage_backing() const { return hugepage_backing; }
+
+    /* true if the slab was placed on the requested NUMA node */
+    bool is_numa_bound() const { return numa_bound; }
+
+    /* blocks that hold memory, every block in Dense and HugePage layouts */
+    int allocated_blocks_number() const;
 
     int get_total_blocks_number() const override;
     FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
     FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* in Sparse layout a mutable view allocates the block, a const view of a hole shows the zero block */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+
+    /* Sparse releases the blocks and their emptied second level tables, the other layouts zero them */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* Dense and HugePage blocks never move, Sparse allocates its tables on write */
+    bool is_thread_safe() const override { return layout != InMemoryLayout::Sparse; }
 };
\ No newline at end of file
@@ -0,0 +1,75 @@
+/*
+ * Per-inode reader/writer locks.
+ *
+ * A FileSystem call holds the lock of every inode it reads (shared) or changes
+ * (exclusive) for its whole length. A lock exists only while somebody holds or
+ * waits for it, so the table follows the inodes in use instead of the volume.
+ *
+ * Lock order:
+ *  1. at most a parent and one child per call, the lower inode id first. The
+ *     pair is taken before the call checks that the child is in the parent,
+ *     so the order may not rely on the tree
+ *  2. inode locks before the journal handle, a call never waits for an inode
+ *     while a commit waits for its handle
+ *  3. the bitmap, cache and readahead locks last and one at a time, they are
+ *     held for a few instructions and never while waiting for anything else
+ */
+
+#pragma once
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+enum class InodeLockMode
+{
+    Shared,
+    Exclusive
+};
+
+class InodeLockTable
+{
+private:
+    struct InodeLock
+    {
+        std::shared_mutex mutex;
+        int users = 0; // holders and waiters, the lock goes away at 0
+    };
+
+    std::mutex table_mutex;
+    std::unordered_map<int, InodeLock> locks; // nodes stay put, a waiter keeps its reference
+
+    InodeLock &acquire(int inode_id);
+    void release(int inode_id);
+
+public:
+    /* holds the lock of an inode, and of a child after it when child_id is given */
+    class Guard
+    {
+    private:
+        InodeLockTable &table;
+        int inode_ids[2];
+        InodeLock *held[2];
+        InodeLockMode modes[2];
+        int count;
+
+        void lock(int inode_id, InodeLockMode mode);
+
+    public:
+        Guard(InodeLockTable &_table, int inode_id, InodeLockMode mode);
+        /* the lower id first, the same inode twice is locked once in the stronger mode */
+        Guard(InodeLockTable &_table, int parent_id, InodeLockMode parent_mode, int child_id, InodeLockMode child_mode);
+        ~Guard();
+
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+    };
+
+    InodeLockTable() = default;
+
+    InodeLockTable(const InodeLockTable &) = delete;
+    InodeLockTable &operator=(const InodeLockTable &) = delete;
+
+    /* the inodes some call holds or waits for */
+    size_t size();
+};
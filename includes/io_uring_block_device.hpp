@@ -0,0 +1,74 @@
+/*
+ * A BlockDevice backed by an image file that is read and written through io_uring.
+ *
+ * The image is opened with O_DIRECT so the page cache is bypassed. Buffers that
+ * are not block aligned go through an aligned bounce buffer.
+ * Besides the synchronous BlockDevice calls, requests can be queued, submitted
+ * together and completed later, so a whole batch of blocks is in flight at once.
+ * When the kernel refuses io_uring the device falls back to pread/pwrite.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <span>
+#include <string>
+
+const int IO_URING_QUEUE_DEPTH = 64;
+
+struct IoCompletion
+{
+    uint64_t request_id;
+    FileSystemStatus status;
+};
+
+struct IoRing; // the kernel rings and the in-flight bookkeeping
+
+class IoUringBlockDevice : public BlockDevice
+{
+private:
+    int fd;
+    int total_blocks;
+    bool direct_io;
+    std::unique_ptr<IoRing> ring;
+
+    FileSystemStatus run_batch(std::span<const int> block_indices, uint8_t *buffer, bool is_read) const;
+
+public:
+    /* opens (or creates) the image. an existing larger image keeps its size */
+    IoUringBlockDevice(const std::string &image_path, uint64_t size_byte, int queue_depth = IO_URING_QUEUE_DEPTH);
+    ~IoUringBlockDevice() override;
+
+    IoUringBlockDevice(const IoUringBlockDevice &) = delete;
+    IoUringBlockDevice &operator=(const IoUringBlockDevice &) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    bool is_direct() const { return direct_io; }
+    bool uses_io_uring() const;
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+    FileSystemStatus flush() override;
+
+    /* punches a hole in the image, requests in flight on the range must complete first */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /********** Asynchronous interface ************/
+
+    /* queued requests start once submit() is called, the buffer must live until completion */
+    std::expected<uint64_t, FileSystemStatus> queue_read(int block_index, uint8_t *buffer);
+    std::expected<uint64_t, FileSystemStatus> queue_write(int block_index, const uint8_t *buffer);
+    FileSystemStatus submit();
+
+    /* blocks until one submitted request completes */
+    std::expected<IoCompletion, FileSystemStatus> wait_completion();
+    int in_flight() const;
+};
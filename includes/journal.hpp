@@ -0,0 +1,219 @@
+/*
+ * A write-ahead journal for the FileSystem metadata.
+ *
+ * Journal area, JOURNAL_BLOCKS blocks from JOURNAL_START_INDEX:
+ *  first block  - journal superblock (magic, sequence of the first transaction in the log)
+ *  the rest     - the log, filled from its start
+ *
+ * A transaction is logged as a descriptor block (the home block numbers and
+ * the revoked blocks), the block images, and a commit block holding a CRC32C of
+ * the descriptor and the images. All of it is written in one sequential batch
+ * followed by one flush. A transaction whose commit block is missing or does
+ * not match is ignored on replay.
+ *
+ * The Journal is a BlockDevice the FileSystem runs on. Every block write goes
+ * into the running transaction and reads see the newest image. Each public
+ * FileSystem call that changes the volume holds a Handle, a read-only one
+ * holds a ReadPin that takes no credits and only keeps a checkpoint from
+ * writing home under its reads. commit() waits until the running handles are
+ * done, swaps in a new running transaction and logs the old one. A handle
+ * starts with MAX_HANDLE_BLOCKS credits and every block it adds to the
+ * transaction uses one, the FileSystem extends it before it runs out. A commit
+ * requested while another one is in flight waits for it and then logs
+ * everything that joined meanwhile in one batch (group commit). A transaction
+ * whose log write fails is kept apart and written again before the next one.
+ *
+ * File data does not go through the log: write_data_blocks() writes it to its
+ * home location (ordered mode) and revokes the logged images of those blocks,
+ * so replay cannot overwrite the data with an older metadata image. The data
+ * is flushed before the commit block of its transaction is written.
+ *
+ * Logged blocks are written to their home locations only when the log is full
+ * or on checkpoint(), then the log starts over. Until then their images stay
+ * in memory. A device without a journal superblock is passed through as is.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <span>
+
+const int JOURNAL_LOG_BLOCKS = JOURNAL_BLOCKS - 1;
+const int MAX_TRANSACTION_BLOCKS = JOURNAL_LOG_BLOCKS - 2; // a descriptor and a commit block around the images
+const int MAX_HANDLE_BLOCKS = 8;                           // blocks a single FileSystem call may dirty
+
+struct JournalStats
+{
+    uint64_t commits;
+    uint64_t handles_committed; // FileSystem calls in the committed transactions
+    uint64_t blocks_logged;
+    uint64_t revokes_logged;
+    uint64_t checkpoints;
+    uint64_t replayed_transactions;
+    uint64_t replayed_blocks;
+};
+
+class Journal : public BlockDevice
+{
+private:
+    using Block = std::array<uint8_t, BLOCK_SIZE>;
+
+    struct Transaction
+    {
+        uint64_t sequence = 0;
+        std::map<int, std::unique_ptr<Block>> blocks; // home block -> newest image
+        std::set<int> revoked;
+        int updates = 0;  // handles still running
+        int reserved = 0; // credits the running handles have not used yet
+        int handles = 0;
+        bool locked = false;       // a commit waits for the running handles, no new one may start
+        bool ordered_data = false; // file data went home meanwhile, it is flushed before the commit block
+    };
+
+    BlockDevice &backing;
+    bool active;
+
+    mutable std::mutex journal_mutex;
+    std::condition_variable state_changed;
+    mutable std::mutex io_mutex; // serializes the calls to the backing device
+    bool concurrent_reads;       // the backing device is thread safe, reads skip io_mutex
+
+    std::unique_ptr<Transaction> running;
+    std::unique_ptr<Transaction> committing;
+    std::unique_ptr<Transaction> failed; // its log write failed, it is written again before the running one
+    std::map<int, std::unique_ptr<Block>> checkpoint_blocks; // logged, not yet written home
+    int readers;             // pinned read-only calls, a checkpoint waits for them
+    bool checkpoint_waiting; // no new reader is pinned until the checkpoint is done
+    int log_head;
+    uint64_t committed_sequence;
+    uint64_t failed_sequence;
+    JournalStats stats;
+
+    bool is_valid_index(int block_index) const;
+    const Block *find_logged(int block_index) const;
+    Block &running_block(int block_index, FileSystemStatus &status);
+    void forget_logged(int block_index);
+
+    /* io_mutex for a read of the backing device, not taken when it is thread safe */
+    std::unique_lock<std::mutex> read_lock() const;
+
+    /* the running transaction fits this many more credits */
+    bool has_room(int credits) const;
+
+    /* a block new to the running transaction uses a credit of the handle of this thread */
+    void charge_block();
+
+    bool start_handle();
+    void stop_handle();
+
+    FileSystemStatus commit_locked(std::unique_lock<std::mutex> &lock);
+    FileSystemStatus make_log_room(std::unique_lock<std::mutex> &lock, const Transaction &transaction);
+    FileSystemStatus log_committing(std::unique_lock<std::mutex> &lock);
+    FileSystemStatus write_transaction(const Transaction &transaction, int log_offset);
+    FileSystemStatus checkpoint_locked(std::unique_lock<std::mutex> &lock);
+    FileSystemStatus write_home(const std::map<int, const Block *> &blocks);
+    FileSystemStatus write_journal_superblock(uint64_t sequence);
+
+public:
+    /* every FileSystem call holds one, a handle opened inside another one joins it */
+    class Handle
+    {
+    private:
+        Journal &journal;
+        bool outermost;
+        bool started; // false when the journal was not active
+
+    public:
+        explicit Handle(Journal &_journal);
+        ~Handle();
+
+        Handle(const Handle &) = delete;
+        Handle &operator=(const Handle &) = delete;
+    };
+
+    /* every read-only FileSystem call holds one, inside a Handle or another pin it does nothing */
+    class ReadPin
+    {
+    private:
+        Journal &journal;
+        bool pinned;
+
+    public:
+        explicit ReadPin(Journal &_journal);
+        ~ReadPin();
+
+        ReadPin(const ReadPin &) = delete;
+        ReadPin &operator=(const ReadPin &) = delete;
+    };
+
+    explicit Journal(BlockDevice &_backing);
+
+    /* commits and checkpoints, the backing device must outlive the journal */
+    ~Journal() override;
+
+    Journal(const Journal &) = delete;
+    Journal &operator=(const Journal &) = delete;
+
+    /* replays the committed transactions of an existing journal and starts journaling */
+    FileSystemStatus recover();
+
+    /* writes an empty journal and starts journaling, whatever the area held */
+    FileSystemStatus format();
+
+    bool is_active() const { return active; }
+    JournalStats get_stats() const;
+
+    /*
+     * makes the handle of this thread hold credits for at least this many more
+     * blocks, committing what it wrote so far when the transaction is too full.
+     * Only called where a commit leaves the metadata consistent, at worst with
+     * allocated blocks nothing points to yet, a long call is split there
+     */
+    void extend_handle(int blocks = MAX_HANDLE_BLOCKS);
+
+    /* makes everything written so far durable, joining a commit in flight */
+    FileSystemStatus commit();
+
+    /* commits, writes every logged block home and empties the log */
+    FileSystemStatus checkpoint();
+
+    /* writes file data to its home location, bypassing the log */
+    FileSystemStatus write_data_blocks(std::span<const int> block_indices, const uint8_t *buffer);
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /*
+     * a mutable view is the image in the running transaction. A logged image is
+     * lent only to a handle, a commit may replace it under a pinned reader. A
+     * block that is not logged is viewed only on a thread safe backing device
+     */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+
+    /* like file data, the range bypasses the log and its logged images are revoked */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* forwarded to the backing device, blocks with a logged image are read from memory anyway */
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+    void cancel_prefetch(std::span<const int> block_indices) const override;
+
+    /* the same as commit() */
+    FileSystemStatus flush() override;
+
+    /* the calls to the backing device are serialized, reads only when it is not thread safe itself */
+    bool is_thread_safe() const override { return true; }
+};
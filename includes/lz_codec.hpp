@@ -0,0 +1,18 @@
+/*
+ * A small LZ77 codec in the LZ4 block format, tuned for single 4 KiB blocks.
+ *
+ * A compressed stream is a list of sequences: a token byte holding the literal
+ * and match lengths, the literals, then a 2 byte little endian offset back into
+ * the output and the match length extension. The last sequence has literals only.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* returns the compressed size, or 0 if the output does not fit in dst_capacity */
+size_t lz_compress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_capacity);
+
+/* returns false unless src decodes to exactly dst_size bytes. corrupt input never writes out of dst */
+bool lz_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
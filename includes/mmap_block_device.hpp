@@ -0,0 +1,64 @@
+/*
+ * A BlockDevice backed by an image file that is mapped into memory.
+ *
+ * The image is created sparse, so a multi-GB volume costs nothing until
+ * blocks are written, and the OS page cache does the caching for us.
+ * Data written through the mapping survives a process restart; flush()
+ * and flush_blocks() make it survive a machine crash too.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <cstdint>
+#include <string>
+
+enum class BlockAccessHint
+{
+    Normal,
+    Sequential,
+    Random,
+    WillNeed,
+    DontNeed
+};
+
+class MmapBlockDevice : public BlockDevice
+{
+private:
+    int fd;
+    uint8_t *mapping;
+    int total_blocks;
+
+public:
+    /* opens (or creates) the image. an existing larger image keeps its size */
+    MmapBlockDevice(const std::string &image_path, uint64_t size_byte);
+    ~MmapBlockDevice() override;
+
+    MmapBlockDevice(const MmapBlockDevice &) = delete;
+    MmapBlockDevice &operator=(const MmapBlockDevice &) = delete;
+
+    bool is_open() const { return mapping != nullptr; }
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+    FileSystemStatus flush() override;
+
+    /* punches a hole in the image, the mapped pages of the range read as zeros afterwards */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* asks the kernel to read the pages in the background (MADV_WILLNEED), one call per run of blocks */
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+
+    /* every call is a copy from or to the mapping, or a system call */
+    bool is_thread_safe() const override { return true; }
+
+    FileSystemStatus flush_blocks(int first_block, int blocks_count);
+    FileSystemStatus advise_blocks(int first_block, int blocks_count, BlockAccessHint hint);
+};
@@ -0,0 +1,167 @@
+/*
+ * A BlockDevice decorator that measures the I/O passing through it.
+ *
+ * For every kind of device call it counts the calls, blocks and bytes and keeps
+ * a log-linear latency histogram. It also keeps a heat map of reads and writes
+ * per block region, and with CallScope the number of device calls made by each
+ * FileSystem call. Everything can be queried or dumped as JSON.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <map>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class DeviceOperation
+{
+    Read,
+    Write,
+    ReadBatch,
+    WriteBatch,
+    View,
+    MutableView,
+    Flush,
+    Discard,
+    Prefetch
+};
+
+const int DEVICE_OPERATIONS_NUMBER = 9;
+
+/*
+ * HDR style histogram: 16 linear sub-buckets per power of two,
+ * so a recorded value is off by at most 1/16
+ */
+class LatencyHistogram
+{
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS_NUMBER = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    std::array<uint64_t, BUCKETS_NUMBER> buckets;
+    uint64_t total_count;
+    uint64_t total_sum;
+    uint64_t min_value;
+    uint64_t max_value;
+
+    static int bucket_of(uint64_t value);
+    static uint64_t bucket_upper_value(int bucket);
+
+public:
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void merge(const LatencyHistogram &other);
+
+    uint64_t count() const { return total_count; }
+    uint64_t min() const { return total_count == 0 ? 0 : min_value; }
+    uint64_t max() const { return max_value; }
+    double mean() const;
+
+    /* the smallest recorded value that percent percent of the values do not exceed */
+    uint64_t percentile(double percent) const;
+};
+
+struct OperationStats
+{
+    uint64_t calls = 0;
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    LatencyHistogram latency_ns;
+};
+
+/* device calls made while a FileSystem call of one name was running */
+struct FileSystemCallStats
+{
+    uint64_t calls = 0;
+    uint64_t device_ops = 0;
+    uint64_t blocks = 0;
+    uint64_t max_device_ops = 0;
+
+    double device_ops_per_call() const { return calls == 0 ? 0 : static_cast<double>(device_ops) / calls; }
+};
+
+class StatsBlockDevice : public BlockDevice
+{
+private:
+    BlockDevice &backing;
+    int heat_region_blocks;
+
+    mutable std::mutex stats_mutex;
+    mutable std::array<OperationStats, DEVICE_OPERATIONS_NUMBER> operations;
+    mutable std::vector<uint64_t> region_reads;
+    mutable std::vector<uint64_t> region_writes;
+    mutable uint64_t total_device_ops;
+    mutable uint64_t total_blocks;
+    std::map<std::string, FileSystemCallStats> call_stats;
+
+    void record(DeviceOperation operation, std::span<const int> block_indices,
+                std::chrono::steady_clock::time_point start, FileSystemStatus status) const;
+
+public:
+    /*
+     * Counts the device calls its thread made between its construction and
+     * destruction under call_name. A null device makes it a no-op, so callers
+     * can always open a scope. Scopes may nest
+     */
+    class CallScope
+    {
+    private:
+        StatsBlockDevice *device;
+        std::string call_name;
+        uint64_t device_ops_at_start;
+        uint64_t blocks_at_start;
+
+    public:
+        CallScope(StatsBlockDevice *_device, std::string _call_name);
+        ~CallScope();
+
+        CallScope(const CallScope &) = delete;
+        CallScope &operator=(const CallScope &) = delete;
+    };
+
+    /* the heat map counts accesses per region of heat_region_blocks blocks */
+    explicit StatsBlockDevice(BlockDevice &_backing, int _heat_region_blocks = 1);
+
+    OperationStats get_operation_stats(DeviceOperation operation) const;
+    std::map<std::string, FileSystemCallStats> get_call_stats() const;
+    uint64_t get_total_device_ops() const;
+
+    int get_heat_region_blocks() const { return heat_region_blocks; }
+    uint64_t get_region_reads(int region) const;
+    uint64_t get_region_writes(int region) const;
+
+    /*
+     * counters, histograms, per call figures and the touched heat map regions
+     * extra_members ("\"name\": value, ...") are appended to the top-level object as is
+     */
+    std::string to_json(std::string_view extra_members = {}) const;
+    void reset();
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+    void cancel_prefetch(std::span<const int> block_indices) const override;
+    FileSystemStatus flush() override;
+
+    /* the figures have their own lock, the calls are as safe as the backing device */
+    bool is_thread_safe() const override { return backing.is_thread_safe(); }
+};
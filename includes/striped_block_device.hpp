@@ -0,0 +1,77 @@
+/*
+ * A BlockDevice that stripes blocks over several child devices (RAID-0).
+ *
+ * Logical blocks are laid out in stripe units of consecutive blocks, the units
+ * go round-robin over the children. A batch is split into one sub-request per
+ * child and the sub-requests run in parallel, each child has its own worker
+ * thread. The caller runs one of the sub-requests itself.
+ *
+ * Calls on the striped device must be serialized like on any other device,
+ * the children are only ever used by one thread at a time.
+ */
+
+#pragma once
+
+#include "fs_constants.hpp"
+#include "block_device.hpp"
+#include "fs_status.hpp"
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+const int DEFAULT_STRIPE_BLOCKS = 16; // 64 KiB stripe unit
+
+struct StripeWorker; // a thread and its task queue
+
+class StripedBlockDevice : public BlockDevice
+{
+private:
+    std::vector<BlockDevice *> children;
+    int stripe_blocks;
+    int total_blocks;
+    std::vector<std::unique_ptr<StripeWorker>> workers;
+
+    struct ChildRequest
+    {
+        std::vector<int> child_blocks;
+        std::vector<size_t> positions; // position of each block in the caller's buffer
+    };
+
+    void locate(int block_index, int &child, int &child_block) const;
+    std::vector<ChildRequest> split(std::span<const int> block_indices) const;
+    FileSystemStatus run_parallel(std::vector<std::function<FileSystemStatus()>> &tasks) const;
+
+public:
+    /* the children must outlive the striped device, the capacity is limited by the smallest child */
+    StripedBlockDevice(std::vector<BlockDevice *> _children, int _stripe_blocks = DEFAULT_STRIPE_BLOCKS);
+    ~StripedBlockDevice() override;
+
+    StripedBlockDevice(const StripedBlockDevice &) = delete;
+    StripedBlockDevice &operator=(const StripedBlockDevice &) = delete;
+
+    int get_children_number() const { return static_cast<int>(children.size()); }
+    int get_stripe_blocks() const { return stripe_blocks; }
+
+    int get_total_blocks_number() const override;
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override;
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override;
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override;
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override;
+
+    /* views are forwarded to the child that holds the block */
+    std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> view_block(int block_index) const override;
+    std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> mutable_view_block(int block_index) override;
+
+    /* every child discards its part of the range, in parallel */
+    FileSystemStatus discard_blocks(int first_block, int blocks_count) override;
+
+    /* every child gets the hint for its blocks, from the calling thread since a hint does not wait */
+    FileSystemStatus prefetch_blocks(std::span<const int> block_indices) const override;
+    void cancel_prefetch(std::span<const int> block_indices) const override;
+
+    /* flushes all the children in parallel */
+    FileSystemStatus flush() override;
+};
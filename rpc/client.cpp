@@ -13,8 +13,8 @@
 
 CreateFileResponse create_file(int client_fd, int parent_inode_id, std::string_view file_name);
 MkdirResponse create_dir(int client_fd, int parent_inode_id, std::string_view dir_name);
-std::expected<std::vector<uint8_t>, RpcStatus> read_file(int client_fd, int inode_id, uint32_t read_offset, uint32_t bytes_to_read);
-WriteResponse write_file(int client_fd, int inode_id, const std::vector<uint8_t> &data, uint32_t write_offset);
+std::expected<std::vector<uint8_t>, RpcStatus> read_file(int client_fd, int inode_id, uint64_t read_offset, uint32_t bytes_to_read);
+WriteResponse write_file(int client_fd, int inode_id, const std::vector<uint8_t> &data, uint64_t write_offset);
 DeleteResponse delete_entry(int client_fd, int parent_inode_id, int inode_id);
 std::expected<std::vector<RpcEntry>, RpcStatus> read_dir(int client_fd, int inode_id);
 GetattrResponse getattr(int client_fd, int inode_id);
@@ -128,7 +128,7 @@ MkdirResponse create_dir(int client_fd, int parent_inode_id, std::string_view di
     return response;
 }
 
-std::expected<std::vector<uint8_t>, RpcStatus> read_file(int client_fd, int inode_id, uint32_t read_offset, uint32_t bytes_to_read)
+std::expected<std::vector<uint8_t>, RpcStatus> read_file(int client_fd, int inode_id, uint64_t read_offset, uint32_t bytes_to_read)
 {
     ReadRequest request;
     ReadResponse response;
@@ -172,7 +172,7 @@ std::expected<std::vector<uint8_t>, RpcStatus> read_file(int client_fd, int inod
     return v_data;
 }
 
-WriteResponse write_file(int client_fd, int inode_id, const std::vector<uint8_t> &data, uint32_t write_offset)
+WriteResponse write_file(int client_fd, int inode_id, const std::vector<uint8_t> &data, uint64_t write_offset)
 {
     WriteRequest request;
     WriteResponse response;
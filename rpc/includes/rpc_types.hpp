@@ -20,8 +20,8 @@ enum class RpcEntryType : uint32_t
 struct RpcInode
 {
     RpcEntryType type;
-    uint32_t size;
-    uint32_t blocks_used;
+    uint64_t size;
+    uint64_t blocks_used;
     uint32_t link_count;
 };
 
@@ -36,7 +36,8 @@ enum class RpcOperation : uint32_t
     WRITE,
     DELETE,
     MKDIR,
-    READDIR
+    READDIR,
+    STATFS
 };
 
 enum class RpcStatus : uint32_t
@@ -75,7 +76,7 @@ struct ReadRequest
 {
     RpcHeader header;
     int inode_id;
-    uint32_t read_offset;
+    uint64_t read_offset;
     uint32_t bytes_to_read;
 };
 
@@ -91,7 +92,7 @@ struct WriteRequest
 {
     RpcHeader header;
     int inode_id;
-    uint32_t write_offset;
+    uint64_t write_offset;
     uint32_t data_size;
     uint8_t data[BLOCK_SIZE];
 };
@@ -170,4 +171,19 @@ struct LookupResponse
     RpcHeader header;
     RpcStatus status;
     int inode_id;
+};
+
+struct StatfsRequest
+{
+    RpcHeader header;
+};
+
+struct StatfsResponse
+{
+    RpcHeader header;
+    RpcStatus status;
+    uint64_t total_blocks; // the data blocks
+    uint64_t free_blocks;
+    uint64_t total_inodes;
+    uint64_t free_inodes;
 };
\ No newline at end of file
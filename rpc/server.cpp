@@ -1,34 +1,113 @@
 // server.cpp
 #include <iostream>
 #include <cstring>
+#include <algorithm>
+#include <cstdlib>
 #include <thread>
-#include <mutex>
+#include <memory>
+#include <vector>
+#include <chrono>
 #include <unistd.h>
 
 #include <sys/socket.h> // socket, bind, listen, accept
 #include <netinet/in.h> // sockaddr_in
+#include <sys/stat.h>   // stat
 #include <unistd.h>     // close
 
 #include "includes/rpc_constants.hpp"
 #include "includes/rpc_types.hpp"
 #include "../includes/file_system.hpp"
-#include "../includes/in_memory_block_device.hpp"
-
-RpcStatus handle_client(int client_fd, FileSystem &fs, std::mutex &fs_mutex);
-CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
+#include "../includes/mmap_block_device.hpp"
+#include "../includes/io_uring_block_device.hpp"
+#include "../includes/buffer_cache.hpp"
+#include "../includes/striped_block_device.hpp"
+#include "../includes/checksum_block_device.hpp"
+#include "../includes/compressed_block_device.hpp"
+#include "../includes/dedup_block_device.hpp"
+#include "../includes/stats_block_device.hpp"
+#include <fstream>
+#include <sstream>
+
+RpcStatus handle_client(int client_fd, FileSystem &fs);
+CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, uint32_t payload_size);
+MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, uint32_t payload_size);
 RpcStatus fs_status_to_rpc_status(FileSystemStatus status);
 RpcEntryType fs_entry_type_to_rpc_status(EntryType type);
-ReadResponse handle_read(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-WriteResponse handle_write(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-DeleteResponse handle_delete(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-GetattrResponse handle_getattr(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-LookupResponse handle_lookup(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size);
-
-int main()
+ReadResponse handle_read(int client_fd, FileSystem &fs, uint32_t payload_size);
+WriteResponse handle_write(int client_fd, FileSystem &fs, uint32_t payload_size);
+DeleteResponse handle_delete(int client_fd, FileSystem &fs, uint32_t payload_size);
+ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, uint32_t payload_size);
+GetattrResponse handle_getattr(int client_fd, FileSystem &fs, uint32_t payload_size);
+LookupResponse handle_lookup(int client_fd, FileSystem &fs, uint32_t payload_size);
+StatfsResponse handle_statfs(FileSystem &fs);
+std::unique_ptr<BlockDevice> open_image(const char *image_path, bool direct_io, uint64_t image_size, int metadata_blocks);
+bool is_blank_volume(const BlockDevice &volume);
+void write_back_loop(FileSystem &fs);
+RpcStatus commit_changes(FileSystem &fs);
+void stats_dump_loop(const StatsBlockDevice &stats, const FileSystem &fs, const char *stats_path);
+std::string readahead_json(const ReadaheadStats &stats);
+
+const char *DEFAULT_IMAGE_PATH = "fs.img";
+const size_t DIRECT_CACHE_BYTES = 16 * 1024 * 1024;
+const int WRITE_BACK_INTERVAL_SECONDS = 5;
+const int STATS_DUMP_INTERVAL_SECONDS = 5;
+
+// set with --stats, every handler counts the device calls it makes
+StatsBlockDevice *device_stats = nullptr;
+
+/*
+usage: server [image_path ...] [--blocks n] [--inodes n] [--format] [--direct] [--checksum] [--compress] [--dedup] [--discard] [--extents] [--stats stats_path]
+several images are striped into one volume, --blocks and --inodes size a new volume
+only a blank volume is formatted unless --format is given
+*/
+int main(int argc, char *argv[])
 {
-    std::mutex fs_mutex;
+    std::vector<const char *> image_paths;
+    bool direct_io = false;
+    bool checksums = false;
+    bool compression = false;
+    bool dedup = false;
+    bool discard = false;
+    bool extents = false;
+    bool format_volume = false;
+    const char *stats_path = nullptr;
+    int total_blocks = DEFAULT_TOTAL_BLOCKS;
+    int total_inodes = 0; // format() picks one per BLOCKS_PER_INODE blocks
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--blocks") == 0 && i + 1 < argc)
+            total_blocks = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--inodes") == 0 && i + 1 < argc)
+            total_inodes = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--direct") == 0)
+            direct_io = true;
+        else if (std::strcmp(argv[i], "--checksum") == 0)
+            checksums = true;
+        else if (std::strcmp(argv[i], "--compress") == 0)
+            compression = true;
+        else if (std::strcmp(argv[i], "--dedup") == 0)
+            dedup = true;
+        else if (std::strcmp(argv[i], "--discard") == 0)
+            discard = true;
+        else if (std::strcmp(argv[i], "--extents") == 0)
+            extents = true;
+        else if (std::strcmp(argv[i], "--format") == 0)
+            format_volume = true;
+        else if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            stats_path = argv[++i];
+        else
+            image_paths.push_back(argv[i]);
+    }
+    if (image_paths.empty())
+        image_paths.push_back(DEFAULT_IMAGE_PATH);
+
+    auto layout_res = FileSystem::make_superblock(total_blocks, total_inodes);
+    if (!layout_res.has_value() || total_inodes < 0)
+    {
+        std::cerr << "a volume of " << total_blocks << " blocks cannot hold its metadata" << std::endl;
+        return 1;
+    }
+
     // step 1 — create the socket
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd < 0)
@@ -62,10 +141,144 @@ int main()
 
     std::cout << "Server listening on port " << PORT << std::endl;
 
-    // recieving data
-    InMemoryBlockDevice device(TOTAL_BLOCKS_NUMBER * BLOCK_SIZE);
-    FileSystem fs(device);
-    fs.format();
+    // mount the images, only a blank volume or one given --format is formatted
+    int images_number = static_cast<int>(image_paths.size());
+    // sized for the worst case, unused physical blocks and compression slots stay holes in the sparse images
+    int volume_blocks = dedup ? DedupBlockDevice::backing_blocks_for(total_blocks) : total_blocks;
+    int compressed_blocks = volume_blocks;
+    if (compression)
+        volume_blocks = CompressedBlockDevice::backing_blocks_for(volume_blocks);
+    if (checksums)
+        volume_blocks = ChecksumBlockDevice::backing_blocks_for(volume_blocks);
+    uint64_t stripes_per_image = (volume_blocks + images_number * DEFAULT_STRIPE_BLOCKS - 1) / (images_number * DEFAULT_STRIPE_BLOCKS);
+    uint64_t image_size = images_number == 1 ? static_cast<uint64_t>(volume_blocks) * BLOCK_SIZE
+                                             : stripes_per_image * DEFAULT_STRIPE_BLOCKS * BLOCK_SIZE;
+
+    std::vector<std::unique_ptr<BlockDevice>> images;
+    std::vector<BlockDevice *> image_devices;
+    for (const char *image_path : image_paths)
+    {
+        // an existing image keeps its size, growing it would move the areas its layers keep at the end
+        struct stat image_stat;
+        bool existing_image = stat(image_path, &image_stat) == 0 && image_stat.st_size > 0;
+        images.push_back(open_image(image_path, direct_io, existing_image ? 0 : image_size, layout_res.value().data_start));
+        if (!images.back())
+        {
+            std::cerr << "cannot open the image " << image_path << std::endl;
+            return 1;
+        }
+        image_devices.push_back(images.back().get());
+    }
+
+    std::unique_ptr<StripedBlockDevice> striped;
+    BlockDevice *fs_device = image_devices[0];
+    if (images_number > 1)
+    {
+        striped = std::make_unique<StripedBlockDevice>(image_devices, DEFAULT_STRIPE_BLOCKS);
+        fs_device = striped.get();
+    }
+
+    // every layer and the superblock start at block 0, anything there is a volume that must not be lost
+    bool blank_volume = is_blank_volume(*fs_device);
+
+    // the checksums sit below the cache so every block is verified when it comes off the image
+    std::unique_ptr<ChecksumBlockDevice> checksum_device;
+    if (checksums)
+    {
+        checksum_device = std::make_unique<ChecksumBlockDevice>(*fs_device);
+        if (!checksum_device->is_loaded())
+        {
+            std::cerr << "cannot read the checksum area" << std::endl;
+            return 1;
+        }
+        fs_device = checksum_device.get();
+    }
+
+    std::unique_ptr<CompressedBlockDevice> compressed_device;
+    if (compression)
+    {
+        compressed_device = std::make_unique<CompressedBlockDevice>(*fs_device, compressed_blocks);
+        if (!compressed_device->is_loaded())
+        {
+            std::cerr << "cannot read the compression table" << std::endl;
+            return 1;
+        }
+        fs_device = compressed_device.get();
+    }
+
+    // above the compression, so only distinct blocks are compressed
+    std::unique_ptr<DedupBlockDevice> dedup_device;
+    if (dedup)
+    {
+        dedup_device = std::make_unique<DedupBlockDevice>(*fs_device, total_blocks);
+        if (!dedup_device->is_loaded())
+        {
+            std::cerr << "cannot read the dedup map" << std::endl;
+            return 1;
+        }
+        fs_device = dedup_device.get();
+    }
+
+    // O_DIRECT skips the page cache, so the server keeps its own in front of the image
+    std::unique_ptr<BufferCache> cache;
+    if (direct_io)
+    {
+        cache = std::make_unique<BufferCache>(*fs_device, DIRECT_CACHE_BYTES);
+        fs_device = cache.get();
+    }
+
+    // on top of the stack, so it sees exactly the calls FileSystem makes
+    std::unique_ptr<StatsBlockDevice> stats_device;
+    if (stats_path != nullptr)
+    {
+        stats_device = std::make_unique<StatsBlockDevice>(*fs_device);
+        device_stats = stats_device.get();
+        fs_device = stats_device.get();
+    }
+
+    FileSystem fs(*fs_device);
+    if (fs.is_device_formatted() && !format_volume)
+    {
+        std::cout << "Mounted existing volume of " << images_number << " image(s), " << fs.get_superblock().total_blocks
+                  << " blocks and " << fs.get_superblock().total_inodes << " inodes" << std::endl;
+
+        // blocks freed before the volume ran with --discard still take space in the image
+        if (discard)
+        {
+            auto trim_res = fs.trim_free_blocks();
+            if (trim_res.has_value())
+                std::cout << "Trimmed " << trim_res.value() << " free blocks" << std::endl;
+        }
+    }
+    else if (!blank_volume && !format_volume)
+    {
+        // another FS_VERSION, other --checksum/--compress/--dedup or another geometry
+        std::cerr << "the images hold a volume this server cannot mount with these options, run with --format to erase it" << std::endl;
+        return 1; // the layers above the image write nothing until the volume is written
+    }
+    else
+    {
+        // ends with a journal commit, which flushes the whole stack
+        if (fs.format(total_inodes) != FileSystemStatus::OK)
+        {
+            std::cerr << "cannot format the volume" << std::endl;
+            return 1;
+        }
+        std::cout << "Formatted new volume of " << images_number << " image(s), " << fs.get_superblock().total_blocks
+                  << " blocks and " << fs.get_superblock().total_inodes << " inodes" << std::endl;
+    }
+
+    // started once the volume is mounted, so the early returns above never leave it behind
+    if (stats_device)
+        std::thread(stats_dump_loop, std::cref(*stats_device), std::cref(fs), stats_path).detach();
+
+    fs.set_online_discard(discard);
+    if (extents)
+        fs.set_file_layout(InodeLayout::Extents);
+
+    // the cache, the compression table and the dedup map only reach the image on flush
+    if (direct_io || compression || dedup)
+        std::thread(write_back_loop, std::ref(fs)).detach();
 
     // step 4 — accept a client
     while (true)
@@ -80,7 +293,7 @@ int main()
         }
 
         std::cout << "Client connected!" << std::endl;
-        std::thread t(handle_client, client_fd, std::ref(fs), std::ref(fs_mutex));
+        std::thread t(handle_client, client_fd, std::ref(fs));
         t.detach();
     }
 
@@ -91,6 +304,101 @@ int main()
     return 0;
 }
 
+/*
+this function opens the image through the page cache (mmap)
+or, with direct_io, through io_uring with O_DIRECT
+*/
+std::unique_ptr<BlockDevice> open_image(const char *image_path, bool direct_io, uint64_t image_size, int metadata_blocks)
+{
+    if (direct_io)
+    {
+        auto uring_device = std::make_unique<IoUringBlockDevice>(image_path, image_size);
+        if (!uring_device->is_open())
+            return nullptr;
+        return uring_device;
+    }
+
+    auto mmap_device = std::make_unique<MmapBlockDevice>(image_path, image_size);
+    if (!mmap_device->is_open())
+        return nullptr;
+
+    mmap_device->advise_blocks(0, std::min(metadata_blocks, mmap_device->get_total_blocks_number()), BlockAccessHint::WillNeed); // metadata is hot
+    return mmap_device;
+}
+
+/*
+this function tells whether the volume is blank, a new image
+or one whose first block was never written
+*/
+bool is_blank_volume(const BlockDevice &volume)
+{
+    alignas(BLOCK_SIZE) uint8_t buffer[BLOCK_SIZE]; // aligned for O_DIRECT
+    if (volume.read_block(SUPERBLOCK_INDEX, buffer) != FileSystemStatus::OK)
+        return false;
+    return std::all_of(buffer, buffer + BLOCK_SIZE, [](uint8_t byte)
+                       { return byte == 0; });
+}
+
+/*
+this function periodically flushes the device, writing the cached blocks
+and the compression table back to the image. It goes through the journal,
+which serializes it with the commits of the handlers
+*/
+void write_back_loop(FileSystem &fs)
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(WRITE_BACK_INTERVAL_SECONDS));
+
+        StatsBlockDevice::CallScope call_scope(device_stats, "periodic_flush");
+        if (fs.sync() != FileSystemStatus::OK)
+            std::cerr << "periodic flush of the image failed" << std::endl;
+    }
+}
+
+/*
+this function commits the changes of the finished calls. The call has released its inode locks,
+so the handlers finishing meanwhile share one journal write and flush (group commit)
+*/
+RpcStatus commit_changes(FileSystem &fs)
+{
+    StatsBlockDevice::CallScope call_scope(device_stats, "commit");
+    return fs_status_to_rpc_status(fs.sync());
+}
+
+/*
+this function periodically rewrites the stats file with the device figures
+and the readahead figures of the filesystem as JSON
+*/
+void stats_dump_loop(const StatsBlockDevice &stats, const FileSystem &fs, const char *stats_path)
+{
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(STATS_DUMP_INTERVAL_SECONDS));
+
+        std::ofstream stats_file(stats_path, std::ios::trunc);
+        if (!stats_file)
+        {
+            std::cerr << "cannot write the stats file " << stats_path << std::endl;
+            continue;
+        }
+        stats_file << stats.to_json(readahead_json(fs.get_readahead_stats())) << std::endl;
+    }
+}
+
+/*
+this function formats the readahead figures as a member of the stats JSON
+*/
+std::string readahead_json(const ReadaheadStats &stats)
+{
+    std::ostringstream json;
+    json << "\"readahead\": {\"sequential_reads\": " << stats.sequential_reads
+         << ", \"random_reads\": " << stats.random_reads << ", \"blocks_read\": " << stats.blocks_read
+         << ", \"prefetched_blocks\": " << stats.prefetched_blocks << ", \"hit_blocks\": " << stats.hit_blocks
+         << ", \"hit_rate\": " << stats.hit_rate() << ", \"wasted_bytes\": " << stats.wasted_bytes() << "}";
+    return json.str();
+}
+
 RpcEntryType fs_entry_type_to_rpc_status(EntryType type)
 {
     if (type == EntryType::File)
@@ -121,7 +429,7 @@ RpcStatus fs_status_to_rpc_status(FileSystemStatus status)
     }
 }
 
-RpcStatus handle_client(int client_fd, FileSystem &fs, std::mutex &fs_mutex)
+RpcStatus handle_client(int client_fd, FileSystem &fs)
 {
     while (true)
     {
@@ -147,56 +455,63 @@ RpcStatus handle_client(int client_fd, FileSystem &fs, std::mutex &fs_mutex)
         {
         case RpcOperation::CREATE_FILE:
         {
-            CreateFileResponse response = handle_create_file(client_fd, fs, fs_mutex, request_header.payload_size);
+            CreateFileResponse response = handle_create_file(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::MKDIR:
         {
-            MkdirResponse response = handle_mkdir(client_fd, fs, fs_mutex, request_header.payload_size);
+            MkdirResponse response = handle_mkdir(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::READ:
         {
-            ReadResponse response = handle_read(client_fd, fs, fs_mutex, request_header.payload_size);
+            ReadResponse response = handle_read(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::WRITE:
         {
-            WriteResponse response = handle_write(client_fd, fs, fs_mutex, request_header.payload_size);
+            WriteResponse response = handle_write(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::DELETE:
         {
-            DeleteResponse response = handle_delete(client_fd, fs, fs_mutex, request_header.payload_size);
+            DeleteResponse response = handle_delete(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::READDIR:
         {
-            ReaddirResponse response = handle_read_dir(client_fd, fs, fs_mutex, request_header.payload_size);
+            ReaddirResponse response = handle_read_dir(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::GETATTR:
         {
-            GetattrResponse response = handle_getattr(client_fd, fs, fs_mutex, request_header.payload_size);
+            GetattrResponse response = handle_getattr(client_fd, fs, request_header.payload_size);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
 
         case RpcOperation::LOOKUP:
         {
-            LookupResponse response = handle_lookup(client_fd, fs, fs_mutex, request_header.payload_size);
+            LookupResponse response = handle_lookup(client_fd, fs, request_header.payload_size);
+            send(client_fd, &response, sizeof(response), 0);
+            break;
+        }
+
+        case RpcOperation::STATFS:
+        {
+            StatfsResponse response = handle_statfs(fs);
             send(client_fd, &response, sizeof(response), 0);
             break;
         }
@@ -210,7 +525,7 @@ RpcStatus handle_client(int client_fd, FileSystem &fs, std::mutex &fs_mutex)
     return RpcStatus::OK;
 }
 
-CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     CreateFileRequest request;
     CreateFileResponse response;
@@ -224,7 +539,7 @@ CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, std::mutex
     }
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "create_file");
         auto create_file_res = fs.create_file(request.parent_inode_id, request.file_name);
         if (!create_file_res.has_value())
         {
@@ -245,12 +560,12 @@ CreateFileResponse handle_create_file(int client_fd, FileSystem &fs, std::mutex
         //           << " the entry type is: " << int(attributes.type)
         //           << std::endl;
     }
-    response.status = RpcStatus::OK;
+    response.status = commit_changes(fs);
 
     return response;
 }
 
-MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     MkdirRequest request;
     MkdirResponse response;
@@ -264,7 +579,7 @@ MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, std::mutex &fs_mutex,
     }
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "mkdir");
         auto new_dir_res = fs.create_directory(request.parent_inode_id, request.directory_name);
         if (!new_dir_res.has_value())
         {
@@ -275,12 +590,12 @@ MkdirResponse handle_mkdir(int client_fd, FileSystem &fs, std::mutex &fs_mutex,
 
         response.new_inode_id = new_dir_res.value();
     }
-    response.status = RpcStatus::OK;
+    response.status = commit_changes(fs);
 
     return response;
 }
 
-ReadResponse handle_read(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+ReadResponse handle_read(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     ReadResponse response;
     ReadRequest request;
@@ -297,7 +612,7 @@ ReadResponse handle_read(int client_fd, FileSystem &fs, std::mutex &fs_mutex, ui
     std::span data_span(buffer, BLOCK_SIZE); // wrap buffer as a span
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "read");
         auto read_res = fs.read_file(request.inode_id, data_span, request.read_offset);
         // fs.read_file() failed
         if (!read_res.has_value())
@@ -315,7 +630,7 @@ ReadResponse handle_read(int client_fd, FileSystem &fs, std::mutex &fs_mutex, ui
     return response;
 }
 
-WriteResponse handle_write(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+WriteResponse handle_write(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     WriteRequest request;
     WriteResponse response;
@@ -331,7 +646,7 @@ WriteResponse handle_write(int client_fd, FileSystem &fs, std::mutex &fs_mutex,
     std::span<const uint8_t> data_span(request.data, request.data_size);
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "write");
         auto write_res = fs.write_file(request.inode_id, data_span, request.write_offset);
         if (!write_res.has_value())
         {
@@ -342,12 +657,12 @@ WriteResponse handle_write(int client_fd, FileSystem &fs, std::mutex &fs_mutex,
 
         response.bytes_written = write_res.value();
     }
-    response.status = RpcStatus::OK;
+    response.status = commit_changes(fs);
 
     return response;
 }
 
-DeleteResponse handle_delete(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+DeleteResponse handle_delete(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     DeleteRequest request;
     DeleteResponse response;
@@ -360,15 +675,17 @@ DeleteResponse handle_delete(int client_fd, FileSystem &fs, std::mutex &fs_mutex
     }
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "delete");
         auto status = fs.delete_entry(request.parent_inode_id, request.inode_id);
         response.status = fs_status_to_rpc_status(status);
     }
+    if (response.status == RpcStatus::OK)
+        response.status = commit_changes(fs);
 
     return response;
 }
 
-ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     ReaddirResponse response;
     ReaddirRequest request;
@@ -381,15 +698,8 @@ ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, std::mutex &fs_mu
         return response;
     }
 
-    if (request.page >= TOTAL_DIRECT_BLOCKS)
     {
-        response.entry_count = -1;
-        response.status = RpcStatus::OK;
-        return response;
-    }
-
-    {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "readdir");
         auto entries_res = fs.list_directory_content(request.inode_id, request.page);
 
         if (!entries_res.has_value())
@@ -422,7 +732,7 @@ ReaddirResponse handle_read_dir(int client_fd, FileSystem &fs, std::mutex &fs_mu
     return response;
 }
 
-GetattrResponse handle_getattr(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+GetattrResponse handle_getattr(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     GetattrRequest request;
     GetattrResponse response;
@@ -438,7 +748,7 @@ GetattrResponse handle_getattr(int client_fd, FileSystem &fs, std::mutex &fs_mut
 
     InodeAttributes inode_attr;
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "getattr");
 
         auto inode_res = fs.get_attributes(request.inode_id);
         if (!inode_res.has_value())
@@ -461,7 +771,7 @@ GetattrResponse handle_getattr(int client_fd, FileSystem &fs, std::mutex &fs_mut
     return response;
 }
 
-LookupResponse handle_lookup(int client_fd, FileSystem &fs, std::mutex &fs_mutex, uint32_t payload_size)
+LookupResponse handle_lookup(int client_fd, FileSystem &fs, uint32_t payload_size)
 {
     LookupRequest request;
     LookupResponse response;
@@ -477,7 +787,7 @@ LookupResponse handle_lookup(int client_fd, FileSystem &fs, std::mutex &fs_mutex
     // std::cout << "Test: the inode_id is: " << request.entry_name << std::endl;
 
     {
-        std::lock_guard<std::mutex> lock(fs_mutex);
+        StatsBlockDevice::CallScope call_scope(device_stats, "lookup");
 
         auto entry_res = fs.lookup(request.parent_inode_id, request.entry_name);
         if (!entry_res.has_value())
@@ -495,3 +805,19 @@ LookupResponse handle_lookup(int client_fd, FileSystem &fs, std::mutex &fs_mutex
 
     return response;
 }
+
+/* the request has no payload, the counts come from the resident bitmaps */
+StatfsResponse handle_statfs(FileSystem &fs)
+{
+    StatfsResponse response;
+
+    SpaceStats stats = fs.get_space_stats();
+
+    response.total_blocks = stats.total_blocks;
+    response.free_blocks = stats.free_blocks;
+    response.total_inodes = stats.total_inodes;
+    response.free_inodes = stats.free_inodes;
+    response.status = RpcStatus::OK;
+
+    return response;
+}
@@ -0,0 +1,396 @@
+#include "allocation_bitmap.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define ALLOCATION_BITMAP_HAS_AVX2_PATH 1
+#endif
+
+static const uint64_t FULL_WORD = ~uint64_t{0};
+
+/* the first summary word in [first, last) with a free word under it, last when there is none */
+static size_t portable_find_not_full(const uint64_t *summary, size_t first, size_t last)
+{
+    while (first < last && summary[first] == FULL_WORD)
+        first++;
+    return first;
+}
+
+#ifdef ALLOCATION_BITMAP_HAS_AVX2_PATH
+
+/* 4 summary words per compare, the tail goes through the scalar loop */
+__attribute__((target("avx2"))) static size_t avx2_find_not_full(const uint64_t *summary, size_t first, size_t last)
+{
+    const __m256i full = _mm256_set1_epi64x(-1);
+    for (; first + 4 <= last; first += 4)
+    {
+        __m256i lanes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(summary + first));
+        if (!_mm256_testc_si256(lanes, full))
+            break;
+    }
+    return portable_find_not_full(summary, first, last);
+}
+
+bool AllocationBitmap::is_vectorized()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+static size_t find_not_full(const uint64_t *summary, size_t first, size_t last)
+{
+    if (AllocationBitmap::is_vectorized())
+        return avx2_find_not_full(summary, first, last);
+    return portable_find_not_full(summary, first, last);
+}
+
+#else
+
+bool AllocationBitmap::is_vectorized()
+{
+    return false;
+}
+
+static size_t find_not_full(const uint64_t *summary, size_t first, size_t last)
+{
+    return portable_find_not_full(summary, first, last);
+}
+
+#endif
+
+AllocationBitmap::AllocationBitmap() : total_bits(0), free_bits(0), cursor(0)
+{
+}
+
+void AllocationBitmap::reset(int _total_bits)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    total_bits = std::max(_total_bits, 0);
+    words.assign((total_bits + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+    reserved_words.clear();
+    build_summary();
+}
+
+void AllocationBitmap::load(std::span<const uint8_t> bytes, int _total_bits)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    total_bits = std::max(_total_bits, 0);
+    words.assign((total_bits + BITS_PER_WORD - 1) / BITS_PER_WORD, FULL_WORD);
+    std::memcpy(words.data(), bytes.data(), std::min(bytes.size(), words.size() * sizeof(uint64_t)));
+    reserved_words.clear();
+    build_summary();
+}
+
+/* marks the bits past total_bits as used, then counts the free bits and fills the summary */
+void AllocationBitmap::build_summary()
+{
+    int tail_bits = total_bits % BITS_PER_WORD;
+    if (tail_bits != 0)
+        words.back() |= FULL_WORD << tail_bits;
+
+    // the summary bits of words that do not exist count as full
+    summary.assign((words.size() + BITS_PER_WORD - 1) / BITS_PER_WORD, FULL_WORD);
+    free_bits = 0;
+    for (size_t word_index = 0; word_index < words.size(); word_index++)
+    {
+        mark_word(static_cast<int>(word_index));
+        free_bits += std::popcount(~words[word_index]);
+    }
+    cursor = 0;
+}
+
+void AllocationBitmap::mark_word(int word_index)
+{
+    uint64_t mask = uint64_t{1} << (word_index % BITS_PER_WORD);
+    if (words[word_index] == FULL_WORD)
+        summary[word_index / BITS_PER_WORD] |= mask;
+    else
+        summary[word_index / BITS_PER_WORD] &= ~mask;
+}
+
+/* the first word in [first_word, last_word) with a free bit */
+std::optional<int> AllocationBitmap::find_free_word(int first_word, int last_word) const
+{
+    if (first_word >= last_word)
+        return std::nullopt;
+
+    // the words before first_word in its summary word count as full
+    size_t summary_index = first_word / BITS_PER_WORD;
+    uint64_t used = summary[summary_index] | ((uint64_t{1} << (first_word % BITS_PER_WORD)) - 1);
+    if (used == FULL_WORD)
+    {
+        summary_index = find_not_full(summary.data(), summary_index + 1, summary.size());
+        if (summary_index == summary.size())
+            return std::nullopt;
+        used = summary[summary_index];
+    }
+
+    int word_index = static_cast<int>(summary_index) * BITS_PER_WORD + std::countr_one(used);
+    if (word_index >= last_word)
+        return std::nullopt;
+    return word_index;
+}
+
+std::optional<int> AllocationBitmap::find_free_bit_locked() const
+{
+    if (free_bits == 0)
+        return std::nullopt;
+
+    auto word_res = find_free_word(cursor, static_cast<int>(words.size()));
+    if (!word_res.has_value())
+        word_res = find_free_word(0, cursor);
+    if (!word_res.has_value())
+        return std::nullopt;
+
+    int word_index = word_res.value();
+    return word_index * BITS_PER_WORD + std::countr_one(words[word_index]);
+}
+
+/* the first free bit at or after bit, without wrapping around */
+std::optional<int> AllocationBitmap::find_free_bit_from(int bit) const
+{
+    int word_index = bit / BITS_PER_WORD;
+    uint64_t used = words[word_index] | ((uint64_t{1} << (bit % BITS_PER_WORD)) - 1);
+    if (used != FULL_WORD)
+        return word_index * BITS_PER_WORD + std::countr_one(used);
+
+    auto word_res = find_free_word(word_index + 1, static_cast<int>(words.size()));
+    if (!word_res.has_value())
+        return std::nullopt;
+    return word_res.value() * BITS_PER_WORD + std::countr_one(words[word_res.value()]);
+}
+
+/* the free bits from bit on, up to max_bits */
+int AllocationBitmap::free_run_length(int bit, int max_bits) const
+{
+    int length = 0;
+    while (length < max_bits && bit < total_bits)
+    {
+        int offset = bit % BITS_PER_WORD;
+        uint64_t used = words[bit / BITS_PER_WORD] >> offset;
+        int free = used == 0 ? BITS_PER_WORD - offset : std::countr_zero(used);
+        length += free;
+        bit += free;
+        if (free < BITS_PER_WORD - offset)
+            break;
+    }
+    return std::min(length, max_bits);
+}
+
+/* true when a run of wanted_bits starts in [first_bit, last_bit), longest keeps the longest run seen */
+bool AllocationBitmap::scan_runs(int first_bit, int last_bit, int wanted_bits, BitRun &longest) const
+{
+    for (int bit = first_bit; bit < last_bit;)
+    {
+        auto free_res = find_free_bit_from(bit);
+        if (!free_res.has_value() || free_res.value() >= last_bit)
+            return false;
+
+        BitRun run{free_res.value(), free_run_length(free_res.value(), wanted_bits)};
+        if (run.length > longest.length)
+            longest = run;
+        if (run.length >= wanted_bits)
+            return true;
+        bit = run.first + run.length + 1; // the bit after the run is in use
+    }
+    return false;
+}
+
+std::optional<BitRun> AllocationBitmap::find_run_locked(int goal, int max_bits) const
+{
+    if (free_bits == 0 || max_bits <= 0)
+        return std::nullopt;
+
+    int start = goal >= 0 && goal < total_bits ? goal : cursor * BITS_PER_WORD;
+    int window_end = std::min(total_bits, start + std::max(RUN_SEARCH_BITS, max_bits));
+
+    // the full length close to the goal, then a word long run anywhere, then the longest one seen
+    BitRun longest{-1, 0};
+    if (scan_runs(start, window_end, max_bits, longest))
+        return longest;
+
+    int wanted_bits = std::min(max_bits, BITS_PER_WORD);
+    if (longest.length >= wanted_bits)
+        return longest;
+
+    BitRun far{-1, 0};
+    if (scan_runs(window_end, total_bits, wanted_bits, far) || scan_runs(0, start, wanted_bits, far))
+        return BitRun{far.first, std::min(max_bits, free_run_length(far.first, max_bits))};
+
+    if (far.length > longest.length)
+        longest = far;
+    if (longest.length == 0)
+        return std::nullopt;
+    return longest;
+}
+
+void AllocationBitmap::mark_run_locked(const BitRun &run, bool reserve)
+{
+    for (int bit = run.first; bit < run.first + run.length;)
+    {
+        int word_index = bit / BITS_PER_WORD;
+        int bits = std::min(BITS_PER_WORD - bit % BITS_PER_WORD, run.first + run.length - bit);
+        uint64_t mask = (bits == BITS_PER_WORD ? FULL_WORD : (uint64_t{1} << bits) - 1) << (bit % BITS_PER_WORD);
+
+        words[word_index] |= mask;
+        if (reserve)
+            reserved_words[word_index] |= mask;
+        mark_word(word_index);
+        bit += bits;
+    }
+
+    free_bits -= run.length;
+    cursor = (run.first + run.length - 1) / BITS_PER_WORD;
+}
+
+std::optional<BitRun> AllocationBitmap::allocate_run(int goal, int max_bits)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    auto run_res = find_run_locked(goal, max_bits);
+    if (run_res.has_value())
+        mark_run_locked(run_res.value(), false);
+    return run_res;
+}
+
+std::optional<BitRun> AllocationBitmap::reserve_run(int goal, int max_bits)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    auto run_res = find_run_locked(goal, max_bits);
+    if (run_res.has_value())
+        mark_run_locked(run_res.value(), true);
+    return run_res;
+}
+
+void AllocationBitmap::claim(int bit)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    auto it = reserved_words.find(bit / BITS_PER_WORD);
+    if (it == reserved_words.end())
+        return;
+
+    it->second &= ~(uint64_t{1} << (bit % BITS_PER_WORD));
+    if (it->second == 0)
+        reserved_words.erase(it);
+}
+
+void AllocationBitmap::cancel(int bit)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    int word_index = bit / BITS_PER_WORD;
+    uint64_t mask = uint64_t{1} << (bit % BITS_PER_WORD);
+    auto it = reserved_words.find(word_index);
+    if (it == reserved_words.end() || (it->second & mask) == 0)
+        return;
+
+    it->second &= ~mask;
+    if (it->second == 0)
+        reserved_words.erase(it);
+    words[word_index] &= ~mask;
+    mark_word(word_index);
+    free_bits++;
+}
+
+std::optional<int> AllocationBitmap::allocate()
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    auto bit_res = find_free_bit_locked();
+    if (!bit_res.has_value())
+        return std::nullopt;
+
+    int bit = bit_res.value();
+    int word_index = bit / BITS_PER_WORD;
+    words[word_index] |= uint64_t{1} << (bit % BITS_PER_WORD);
+    mark_word(word_index);
+    free_bits--;
+    cursor = word_index;
+    return bit;
+}
+
+bool AllocationBitmap::set(int bit)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    if (bit < 0 || bit >= total_bits)
+        return false;
+
+    int word_index = bit / BITS_PER_WORD;
+    uint64_t mask = uint64_t{1} << (bit % BITS_PER_WORD);
+    if ((words[word_index] & mask) != 0)
+        return false;
+
+    words[word_index] |= mask;
+    mark_word(word_index);
+    free_bits--;
+    return true;
+}
+
+bool AllocationBitmap::clear(int bit)
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    if (bit < 0 || bit >= total_bits)
+        return false;
+
+    int word_index = bit / BITS_PER_WORD;
+    uint64_t mask = uint64_t{1} << (bit % BITS_PER_WORD);
+    if ((words[word_index] & mask) == 0)
+        return false;
+
+    words[word_index] &= ~mask;
+    mark_word(word_index);
+    free_bits++;
+    return true;
+}
+
+bool AllocationBitmap::test(int bit) const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    if (bit < 0 || bit >= total_bits)
+        return false;
+    return (words[bit / BITS_PER_WORD] & (uint64_t{1} << (bit % BITS_PER_WORD))) != 0;
+}
+
+uint64_t AllocationBitmap::word_locked(int word_index) const
+{
+    auto it = reserved_words.find(word_index);
+    if (it == reserved_words.end())
+        return words[word_index];
+    return words[word_index] & ~it->second;
+}
+
+uint64_t AllocationBitmap::word(int word_index) const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    return word_locked(word_index);
+}
+
+void AllocationBitmap::store_word(int word_index, uint64_t &destination) const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    destination = word_locked(word_index);
+}
+
+std::vector<int> AllocationBitmap::free_bits_list() const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    std::vector<int> bits;
+    bits.reserve(free_bits);
+    for (size_t word_index = 0; word_index < words.size(); word_index++)
+    {
+        for (uint64_t free = ~words[word_index]; free != 0; free &= free - 1)
+            bits.push_back(static_cast<int>(word_index) * BITS_PER_WORD + std::countr_zero(free));
+    }
+    return bits;
+}
+
+int AllocationBitmap::free_count() const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    return free_bits;
+}
+
+int AllocationBitmap::size() const
+{
+    std::lock_guard<std::mutex> lock(bitmap_mutex);
+    return total_bits;
+}
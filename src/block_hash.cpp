@@ -0,0 +1,129 @@
+#include "block_hash.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BLOCK_HASH_HAS_AVX2_PATH 1
+#endif
+
+static const int ACCUMULATORS = 8;
+static const int STRIPE_BYTES = ACCUMULATORS * sizeof(uint64_t);
+static const int STRIPES_PER_BLOCK = BLOCK_SIZE / STRIPE_BYTES;
+static const int KEYS_NUMBER = STRIPES_PER_BLOCK + ACCUMULATORS; // stripe s uses keys s..s+7, the merge the last 8
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t AVALANCHE_PRIME = 0x165667919E3779F9ULL;
+
+/* fixed pseudo-random keys from splitmix64, so fingerprints are stable across runs */
+static const std::array<uint64_t, KEYS_NUMBER> KEYS = []
+{
+    std::array<uint64_t, KEYS_NUMBER> keys{};
+    uint64_t state = 0x6A09E667F3BCC908ULL;
+    for (uint64_t &key : keys)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        key = z ^ (z >> 31);
+    }
+    return keys;
+}();
+
+static uint64_t multiply_fold(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+/* folds the accumulators into the fingerprint */
+static uint64_t merge_accumulators(const uint64_t *accumulators)
+{
+    uint64_t hash = BLOCK_SIZE * PRIME64_1;
+    for (int i = 0; i < ACCUMULATORS; i += 2)
+        hash += multiply_fold(accumulators[i] ^ KEYS[STRIPES_PER_BLOCK + i], accumulators[i + 1] ^ KEYS[STRIPES_PER_BLOCK + i + 1]);
+
+    hash ^= hash >> 37;
+    hash *= AVALANCHE_PRIME;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*
+ * per stripe and lane: keyed = word ^ key, accumulator[lane] += low32(keyed) * high32(keyed)
+ * and the word itself is added to the neighbouring lane, so no input bit is lost
+ */
+uint64_t block_hash_portable(const uint8_t *block)
+{
+    uint64_t accumulators[ACCUMULATORS] = {};
+    for (int stripe = 0; stripe < STRIPES_PER_BLOCK; stripe++)
+    {
+        for (int lane = 0; lane < ACCUMULATORS; lane++)
+        {
+            uint64_t word;
+            std::memcpy(&word, block + stripe * STRIPE_BYTES + lane * sizeof(uint64_t), sizeof(word));
+            uint64_t keyed = word ^ KEYS[stripe + lane];
+            accumulators[lane ^ 1] += word;
+            accumulators[lane] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+        }
+    }
+    return merge_accumulators(accumulators);
+}
+
+#ifdef BLOCK_HASH_HAS_AVX2_PATH
+
+/* one stripe half on 4 lanes, the swap moves every word to its neighbouring lane */
+__attribute__((target("avx2"))) static __m256i avx2_accumulate(__m256i lanes, const uint8_t *data, const uint64_t *keys)
+{
+    __m256i words = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    __m256i keyed = _mm256_xor_si256(words, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys)));
+    __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+    __m256i swapped = _mm256_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm256_add_epi64(lanes, _mm256_add_epi64(product, swapped));
+}
+
+/* the same stripe loop on two 4 lane vectors */
+__attribute__((target("avx2"))) static uint64_t avx2_hash(const uint8_t *block)
+{
+    __m256i low_lanes = _mm256_setzero_si256();
+    __m256i high_lanes = _mm256_setzero_si256();
+
+    for (int stripe = 0; stripe < STRIPES_PER_BLOCK; stripe++)
+    {
+        const uint8_t *stripe_data = block + stripe * STRIPE_BYTES;
+        low_lanes = avx2_accumulate(low_lanes, stripe_data, KEYS.data() + stripe);
+        high_lanes = avx2_accumulate(high_lanes, stripe_data + 32, KEYS.data() + stripe + 4);
+    }
+
+    uint64_t accumulators[ACCUMULATORS];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(accumulators), low_lanes);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(accumulators + 4), high_lanes);
+    return merge_accumulators(accumulators);
+}
+
+bool block_hash_is_vectorized()
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+
+uint64_t block_hash(const uint8_t *block)
+{
+    if (block_hash_is_vectorized())
+        return avx2_hash(block);
+    return block_hash_portable(block);
+}
+
+#else
+
+bool block_hash_is_vectorized()
+{
+    return false;
+}
+
+uint64_t block_hash(const uint8_t *block)
+{
+    return block_hash_portable(block);
+}
+
+#endif
@@ -0,0 +1,528 @@
+#include "buffer_cache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "fs_status.hpp"
+
+BufferCache::BufferCache(BlockDevice &_backing, size_t memory_budget_bytes)
+    : backing(_backing), capacity_blocks(std::max<size_t>(1, memory_budget_bytes / BLOCK_SIZE)), stats{}, stopping(false), viewed_block(-1)
+{
+}
+
+BufferCache::~BufferCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        stopping = true;
+    }
+    prefetch_ready.notify_all();
+    if (prefetch_thread.joinable())
+        prefetch_thread.join();
+
+    flush();
+}
+
+/* returns the cached block and marks it as the most recently used, nullptr on a miss */
+BufferCache::CachedBlock *BufferCache::find_cached(int block_index) const
+{
+    auto it = index.find(block_index);
+    if (it == index.end())
+        return nullptr;
+
+    lru.splice(lru.begin(), lru, it->second);
+    return &*it->second;
+}
+
+/* the first read of a prefetched block is a prefetch hit */
+void BufferCache::count_read(CachedBlock &cached) const
+{
+    if (!cached.prefetched)
+        return;
+    cached.prefetched = false;
+    stats.prefetch_hits++;
+}
+
+/*
+ * This function evicts least recently used blocks until new_blocks more fit in the budget
+ * The dirty victims are written back in a single batch, if that fails nothing is evicted
+ * kept_block is never evicted, so fewer blocks may fit when the cache is tiny
+ */
+FileSystemStatus BufferCache::make_room(size_t new_blocks, int kept_block) const
+{
+    if (lru.size() + new_blocks <= capacity_blocks)
+        return FileSystemStatus::OK;
+
+    size_t victims_number = std::min(lru.size() + new_blocks - capacity_blocks, lru.size());
+
+    std::vector<LruList::iterator> victims;
+    std::vector<int> dirty_indices;
+    std::vector<uint8_t> dirty_data;
+    for (auto victim = lru.end(); victim != lru.begin() && victims.size() < victims_number;)
+    {
+        --victim;
+        if (victim->block_index == kept_block)
+            continue;
+        victims.push_back(victim);
+        if (victim->dirty)
+        {
+            dirty_indices.push_back(victim->block_index);
+            dirty_data.insert(dirty_data.end(), victim->data.begin(), victim->data.end());
+        }
+    }
+
+    if (!dirty_indices.empty())
+    {
+        FileSystemStatus status;
+        {
+            std::lock_guard<std::mutex> backing_lock(backing_mutex);
+            status = backing.write_blocks(dirty_indices, dirty_data.data());
+        }
+        if (status != FileSystemStatus::OK)
+            return status;
+        for (int block_index : dirty_indices)
+            invalidate_prefetch_read(block_index);
+        stats.write_backs += dirty_indices.size();
+    }
+
+    for (LruList::iterator victim : victims)
+    {
+        if (victim->prefetched)
+            stats.prefetch_wasted++;
+        index.erase(victim->block_index);
+        lru.erase(victim);
+    }
+    stats.evictions += victims.size();
+
+    return FileSystemStatus::OK;
+}
+
+/* the backing copy of the block changes, a prefetch read of it in flight is not cached */
+void BufferCache::invalidate_prefetch_read(int block_index) const
+{
+    if (!prefetch_reading.empty())
+        prefetch_reading.erase(block_index);
+}
+
+/*
+ * This function stores a whole block in the cache, replacing the cached copy if there is one
+ * A block that is already dirty stays dirty
+ */
+FileSystemStatus BufferCache::insert(int block_index, const uint8_t *data, bool dirty) const
+{
+    CachedBlock *cached = find_cached(block_index);
+    if (cached == nullptr)
+    {
+        FileSystemStatus status = make_room(1);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        lru.emplace_front();
+        lru.front().block_index = block_index;
+        lru.front().dirty = false;
+        lru.front().prefetched = false;
+        index[block_index] = lru.begin();
+        cached = &lru.front();
+    }
+    else if (cached->prefetched && dirty)
+    {
+        cached->prefetched = false;
+        stats.prefetch_wasted++;
+    }
+
+    std::memcpy(cached->data.data(), data, BLOCK_SIZE);
+    cached->dirty = cached->dirty || dirty;
+    return FileSystemStatus::OK;
+}
+
+/* returns the cached block, reading it from the backing device on a miss */
+std::expected<BufferCache::CachedBlock *, FileSystemStatus> BufferCache::load(int block_index) const
+{
+    if (block_index < 0 || block_index >= backing.get_total_blocks_number())
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    CachedBlock *cached = find_cached(block_index);
+    if (cached != nullptr)
+    {
+        stats.hits++;
+        count_read(*cached);
+        return cached;
+    }
+
+    stats.misses++;
+    FileSystemStatus status = make_room(1);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
+
+    lru.emplace_front();
+    {
+        std::lock_guard<std::mutex> backing_lock(backing_mutex);
+        status = backing.read_block(block_index, lru.front().data.data());
+    }
+    if (status != FileSystemStatus::OK)
+    {
+        lru.pop_front();
+        return std::unexpected(status);
+    }
+
+    lru.front().block_index = block_index;
+    lru.front().dirty = false;
+    lru.front().prefetched = false;
+    index[block_index] = lru.begin();
+    return &lru.front();
+}
+
+int BufferCache::get_total_blocks_number() const
+{
+    return backing.get_total_blocks_number();
+}
+
+FileSystemStatus BufferCache::read_block(int block_index, uint8_t *buffer) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto cached = load(block_index);
+    if (!cached)
+        return cached.error();
+
+    std::memcpy(buffer, (*cached)->data.data(), BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus BufferCache::write_block(int block_index, const uint8_t *buffer)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    if (block_index < 0 || block_index >= backing.get_total_blocks_number())
+        return FileSystemStatus::OutOfBounds;
+
+    return insert(block_index, buffer, true);
+}
+
+/*
+ * This function serves the cached blocks from memory and reads all the missing
+ * blocks from the backing device in a single batch
+ */
+FileSystemStatus BufferCache::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    int total_blocks = backing.get_total_blocks_number();
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<int> missing_indices;
+    std::vector<size_t> missing_positions;
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        CachedBlock *cached = find_cached(block_indices[i]);
+        if (cached == nullptr)
+        {
+            missing_indices.push_back(block_indices[i]);
+            missing_positions.push_back(i);
+            continue;
+        }
+        count_read(*cached);
+        std::memcpy(buffer + i * BLOCK_SIZE, cached->data.data(), BLOCK_SIZE);
+    }
+
+    stats.hits += block_indices.size() - missing_indices.size();
+    stats.misses += missing_indices.size();
+    if (missing_indices.empty())
+        return FileSystemStatus::OK;
+
+    std::vector<uint8_t> missing_data(missing_indices.size() * BLOCK_SIZE);
+    FileSystemStatus status;
+    {
+        std::lock_guard<std::mutex> backing_lock(backing_mutex);
+        status = backing.read_blocks(missing_indices, missing_data.data());
+    }
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (size_t i = 0; i < missing_indices.size(); i++)
+        std::memcpy(buffer + missing_positions[i] * BLOCK_SIZE, missing_data.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+
+    // a batch larger than the cache only keeps its tail
+    size_t first_kept = missing_indices.size() > capacity_blocks ? missing_indices.size() - capacity_blocks : 0;
+    status = make_room(missing_indices.size() - first_kept);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (size_t i = first_kept; i < missing_indices.size(); i++)
+    {
+        status = insert(missing_indices[i], missing_data.data() + i * BLOCK_SIZE, false);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+    return FileSystemStatus::OK;
+}
+
+/* the blocks are only marked dirty, they reach the backing device on eviction or flush */
+FileSystemStatus BufferCache::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    int total_blocks = backing.get_total_blocks_number();
+    size_t uncached_number = 0;
+    for (int block_index : block_indices)
+    {
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+        if (!index.contains(block_index))
+            uncached_number++;
+    }
+
+    // evict for the whole batch at once so the dirty victims are written back together
+    FileSystemStatus status = make_room(std::min(uncached_number, capacity_blocks));
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        status = insert(block_indices[i], buffer + i * BLOCK_SIZE, true);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> BufferCache::view_block(int block_index) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto cached = load(block_index);
+    if (!cached)
+        return std::unexpected(cached.error());
+
+    viewed_block = block_index;
+    return std::span<const uint8_t, BLOCK_SIZE>((*cached)->data);
+}
+
+/* the block is marked dirty up front since the caller writes through the view */
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> BufferCache::mutable_view_block(int block_index)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    auto cached = load(block_index);
+    if (!cached)
+        return std::unexpected(cached.error());
+
+    (*cached)->dirty = true;
+    viewed_block = block_index;
+    return std::span<uint8_t, BLOCK_SIZE>((*cached)->data);
+}
+
+/*
+ * This function writes all dirty blocks back in ascending block order, in batches
+ * The blocks stay cached and become clean
+ */
+FileSystemStatus BufferCache::write_back_dirty()
+{
+    std::vector<CachedBlock *> dirty_blocks;
+    for (CachedBlock &cached : lru)
+        if (cached.dirty)
+            dirty_blocks.push_back(&cached);
+
+    std::sort(dirty_blocks.begin(), dirty_blocks.end(),
+              [](const CachedBlock *a, const CachedBlock *b)
+              { return a->block_index < b->block_index; });
+
+    std::vector<int> batch_indices;
+    std::vector<uint8_t> batch_data;
+    for (size_t first = 0; first < dirty_blocks.size(); first += MAX_BATCH_BLOCKS)
+    {
+        size_t last = std::min(first + MAX_BATCH_BLOCKS, dirty_blocks.size());
+
+        batch_indices.clear();
+        batch_data.clear();
+        for (size_t i = first; i < last; i++)
+        {
+            batch_indices.push_back(dirty_blocks[i]->block_index);
+            batch_data.insert(batch_data.end(), dirty_blocks[i]->data.begin(), dirty_blocks[i]->data.end());
+        }
+
+        FileSystemStatus status;
+        {
+            std::lock_guard<std::mutex> backing_lock(backing_mutex);
+            status = backing.write_blocks(batch_indices, batch_data.data());
+        }
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        for (size_t i = first; i < last; i++)
+        {
+            dirty_blocks[i]->dirty = false;
+            invalidate_prefetch_read(dirty_blocks[i]->block_index);
+        }
+        stats.write_backs += last - first;
+    }
+    return FileSystemStatus::OK;
+}
+
+/* a full queue drops the rest of the hint, the reader fetches those blocks itself */
+FileSystemStatus BufferCache::prefetch_blocks(std::span<const int> block_indices) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    int total_blocks = backing.get_total_blocks_number();
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    for (int block_index : block_indices)
+        if (!index.contains(block_index) && prefetch_queue.size() < capacity_blocks)
+            prefetch_queue.push_back(block_index);
+
+    if (prefetch_queue.empty())
+        return FileSystemStatus::OK;
+
+    if (!prefetch_thread.joinable())
+        prefetch_thread = std::thread(&BufferCache::prefetch_loop, this);
+    prefetch_ready.notify_one();
+    return FileSystemStatus::OK;
+}
+
+void BufferCache::cancel_prefetch(std::span<const int> block_indices) const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (prefetch_queue.empty())
+        return;
+
+    std::unordered_set<int> cancelled(block_indices.begin(), block_indices.end());
+    std::erase_if(prefetch_queue, [&cancelled](int block_index)
+                  { return cancelled.contains(block_index); });
+}
+
+/*
+ * This function runs on the prefetch thread, it reads the queued blocks that are
+ * still not cached in batches of up to MAX_BATCH_BLOCKS and caches them clean
+ * The batch is read without cache_mutex, only the blocks nobody cached, wrote back
+ * or discarded meanwhile are added. The block of the last view is never evicted here,
+ * the caller may still be using the view. A failed read is dropped, the reader sees the
+ * error when it reads the block itself
+ */
+void BufferCache::prefetch_loop() const
+{
+    std::unique_lock<std::mutex> lock(cache_mutex);
+    std::vector<int> batch_indices;
+    std::vector<uint8_t> batch_data;
+    size_t batch_limit = std::min<size_t>(MAX_BATCH_BLOCKS, capacity_blocks);
+
+    while (true)
+    {
+        prefetch_ready.wait(lock, [this]
+                            { return stopping || !prefetch_queue.empty(); });
+        if (stopping)
+            return;
+
+        batch_indices.clear();
+        while (!prefetch_queue.empty() && batch_indices.size() < batch_limit)
+        {
+            int block_index = prefetch_queue.front();
+            prefetch_queue.pop_front();
+            if (!index.contains(block_index) && prefetch_reading.insert(block_index).second)
+                batch_indices.push_back(block_index);
+        }
+        if (batch_indices.empty())
+            continue;
+
+        batch_data.resize(batch_indices.size() * BLOCK_SIZE);
+        lock.unlock();
+        FileSystemStatus status;
+        {
+            std::lock_guard<std::mutex> backing_lock(backing_mutex);
+            status = backing.read_blocks(batch_indices, batch_data.data());
+        }
+        lock.lock();
+
+        size_t valid_number = 0;
+        for (size_t i = 0; i < batch_indices.size(); i++)
+        {
+            bool valid = prefetch_reading.erase(batch_indices[i]) != 0 && !index.contains(batch_indices[i]);
+            if (!valid)
+                batch_indices[i] = -1;
+            valid_number += valid;
+        }
+        if (status != FileSystemStatus::OK || valid_number == 0 ||
+            make_room(valid_number, viewed_block) != FileSystemStatus::OK)
+            continue;
+
+        // the viewed block stays, so only the blocks that fit the budget are added
+        for (size_t i = 0; i < batch_indices.size() && lru.size() < capacity_blocks; i++)
+        {
+            if (batch_indices[i] == -1)
+                continue;
+            lru.emplace_front();
+            lru.front().block_index = batch_indices[i];
+            lru.front().dirty = false;
+            lru.front().prefetched = true;
+            std::memcpy(lru.front().data.data(), batch_data.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+            index[batch_indices[i]] = lru.begin();
+            stats.prefetched++;
+        }
+    }
+}
+
+FileSystemStatus BufferCache::discard_blocks(int first_block, int blocks_count)
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    FileSystemStatus status;
+    {
+        std::lock_guard<std::mutex> backing_lock(backing_mutex);
+        status = backing.discard_blocks(first_block, blocks_count);
+    }
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+    {
+        invalidate_prefetch_read(block_index);
+        auto it = index.find(block_index);
+        if (it == index.end())
+            continue;
+        if (it->second->prefetched)
+            stats.prefetch_wasted++;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus BufferCache::flush()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+
+    FileSystemStatus status = write_back_dirty();
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::lock_guard<std::mutex> backing_lock(backing_mutex);
+    return backing.flush();
+}
+
+BufferCacheStats BufferCache::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return stats;
+}
+
+int BufferCache::cached_blocks_number() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return static_cast<int>(lru.size());
+}
+
+int BufferCache::queued_prefetch_number() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return static_cast<int>(prefetch_queue.size() + prefetch_reading.size());
+}
+
+int BufferCache::dirty_blocks_number() const
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return static_cast<int>(std::count_if(lru.begin(), lru.end(), [](const CachedBlock &cached)
+                                          { return cached.dirty; }));
+}
@@ -0,0 +1,193 @@
+#include "checksum_block_device.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
+#include <cstring>
+#include "fs_status.hpp"
+
+static const uint32_t UNWRITTEN_CHECKSUM = 0;
+
+/* the checksum stored for a block, a real CRC of 0 is stored as 1 to keep 0 for unwritten blocks */
+static uint32_t block_checksum(const uint8_t *data)
+{
+    uint32_t crc = crc32c(data, BLOCK_SIZE);
+    return crc == UNWRITTEN_CHECKSUM ? 1 : crc;
+}
+
+/*
+ * This constructor splits the backing device into data blocks and the checksum
+ * area behind them, then loads the whole area in batches
+ */
+ChecksumBlockDevice::ChecksumBlockDevice(BlockDevice &_backing)
+    : backing(_backing), data_blocks(0), checksum_area_start(0), loaded(false), mismatches(0)
+{
+    int backing_blocks = backing.get_total_blocks_number();
+    int checksum_blocks = (backing_blocks + CHECKSUMS_PER_BLOCK) / (CHECKSUMS_PER_BLOCK + 1); // ceiling value
+    data_blocks = backing_blocks - checksum_blocks;
+    checksum_area_start = data_blocks;
+    if (data_blocks <= 0)
+    {
+        data_blocks = 0;
+        return;
+    }
+
+    checksums.resize(static_cast<size_t>(checksum_blocks) * CHECKSUMS_PER_BLOCK);
+    std::vector<int> batch_indices;
+    for (int first = 0; first < checksum_blocks; first += MAX_BATCH_BLOCKS)
+    {
+        int batch_size = std::min(MAX_BATCH_BLOCKS, checksum_blocks - first);
+        batch_indices.clear();
+        for (int i = 0; i < batch_size; i++)
+            batch_indices.push_back(checksum_area_start + first + i);
+
+        uint8_t *destination = reinterpret_cast<uint8_t *>(checksums.data() + static_cast<size_t>(first) * CHECKSUMS_PER_BLOCK);
+        if (backing.read_blocks(batch_indices, destination) != FileSystemStatus::OK)
+            return;
+    }
+
+    loaded = true;
+}
+
+int ChecksumBlockDevice::backing_blocks_for(int data_blocks)
+{
+    return data_blocks + (data_blocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+}
+
+bool ChecksumBlockDevice::verify(int block_index, const uint8_t *data) const
+{
+    uint32_t stored = checksums[block_index];
+    if (stored == UNWRITTEN_CHECKSUM || stored == block_checksum(data))
+        return true;
+
+    mismatches++;
+    return false;
+}
+
+int ChecksumBlockDevice::get_total_blocks_number() const
+{
+    return loaded ? data_blocks : 0;
+}
+
+FileSystemStatus ChecksumBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    return read_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus ChecksumBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    return write_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus ChecksumBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    FileSystemStatus status = backing.read_blocks(block_indices, buffer);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+        if (!verify(block_indices[i], buffer + i * BLOCK_SIZE))
+            return FileSystemStatus::ChecksumMismatch;
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function writes the data blocks followed by the checksum blocks they touch,
+ * all in one batch. If the write fails the resident checksums are rolled back
+ */
+FileSystemStatus ChecksumBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<uint32_t> previous_checksums;
+    std::vector<int> checksum_blocks;
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        previous_checksums.push_back(checksums[block_indices[i]]);
+        checksums[block_indices[i]] = block_checksum(buffer + i * BLOCK_SIZE);
+        checksum_blocks.push_back(block_indices[i] / CHECKSUMS_PER_BLOCK);
+    }
+    std::sort(checksum_blocks.begin(), checksum_blocks.end());
+    checksum_blocks.erase(std::unique(checksum_blocks.begin(), checksum_blocks.end()), checksum_blocks.end());
+
+    std::vector<int> batch_indices(block_indices.begin(), block_indices.end());
+    std::vector<uint8_t> batch_data(buffer, buffer + block_indices.size() * BLOCK_SIZE);
+    for (int checksum_block : checksum_blocks)
+    {
+        batch_indices.push_back(checksum_area_start + checksum_block);
+        const uint8_t *source = reinterpret_cast<const uint8_t *>(checksums.data() + static_cast<size_t>(checksum_block) * CHECKSUMS_PER_BLOCK);
+        batch_data.insert(batch_data.end(), source, source + BLOCK_SIZE);
+    }
+
+    FileSystemStatus status = backing.write_blocks(batch_indices, batch_data.data());
+    if (status != FileSystemStatus::OK)
+    {
+        for (size_t i = block_indices.size(); i-- > 0;) // reverse order undoes repeated indices too
+            checksums[block_indices[i]] = previous_checksums[i];
+    }
+    return status;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> ChecksumBlockDevice::view_block(int block_index) const
+{
+    if (block_index < 0 || block_index >= get_total_blocks_number())
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    auto view_res = backing.view_block(block_index);
+    if (!view_res)
+        return std::unexpected(view_res.error());
+
+    if (!verify(block_index, view_res.value().data()))
+        return std::unexpected(FileSystemStatus::ChecksumMismatch);
+    return view_res.value();
+}
+
+/*
+ * This function stores the unwritten checksum for the range first, so a crash
+ * before the discard completes cannot leave a stale checksum over a zeroed block
+ */
+FileSystemStatus ChecksumBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > get_total_blocks_number() - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+    if (blocks_count == 0)
+        return FileSystemStatus::OK;
+
+    std::fill_n(checksums.begin() + first_block, blocks_count, UNWRITTEN_CHECKSUM);
+
+    std::vector<int> batch_indices;
+    std::vector<uint8_t> batch_data;
+    int first_checksum_block = first_block / CHECKSUMS_PER_BLOCK;
+    int last_checksum_block = (first_block + blocks_count - 1) / CHECKSUMS_PER_BLOCK;
+    for (int checksum_block = first_checksum_block; checksum_block <= last_checksum_block; checksum_block++)
+    {
+        batch_indices.push_back(checksum_area_start + checksum_block);
+        const uint8_t *source = reinterpret_cast<const uint8_t *>(checksums.data() + static_cast<size_t>(checksum_block) * CHECKSUMS_PER_BLOCK);
+        batch_data.insert(batch_data.end(), source, source + BLOCK_SIZE);
+    }
+
+    FileSystemStatus status = backing.write_blocks(batch_indices, batch_data.data());
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    return backing.discard_blocks(first_block, blocks_count);
+}
+
+FileSystemStatus ChecksumBlockDevice::prefetch_blocks(std::span<const int> block_indices) const
+{
+    return backing.prefetch_blocks(block_indices);
+}
+
+void ChecksumBlockDevice::cancel_prefetch(std::span<const int> block_indices) const
+{
+    backing.cancel_prefetch(block_indices);
+}
+
+FileSystemStatus ChecksumBlockDevice::flush()
+{
+    return backing.flush();
+}
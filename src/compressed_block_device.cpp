@@ -0,0 +1,637 @@
+#include "compressed_block_device.hpp"
+#include "lz_codec.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include "fs_status.hpp"
+
+static const uint32_t COMPRESSED_MAGIC = 0x4C5A4653; // "LZFS"
+static const uint32_t COMPRESSED_VERSION = 1;
+static const int HEADER_BLOCK_INDEX = 0;
+static const int PAYLOAD_LENGTH_BYTES = 2; // a compressed payload starts with its uint16 length
+static const int MAX_SLOT_AREA_BLOCKS = (1 << 28) / SLOTS_PER_BLOCK; // a table entry has 28 bits of slot
+
+struct CompressedHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int logical_blocks;
+};
+
+static uint32_t make_entry(uint32_t first_slot, int slots_count)
+{
+    return (first_slot << 4) | static_cast<uint32_t>(slots_count);
+}
+
+static uint32_t entry_first_slot(uint32_t entry)
+{
+    return entry >> 4;
+}
+
+static int entry_slots_count(uint32_t entry)
+{
+    return static_cast<int>(entry & 0x0F);
+}
+
+static uint64_t nanoseconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * This constructor mounts a compressed device, or starts an empty one on a backing
+ * device without the header. The slot usage is rebuilt from the table
+ */
+CompressedBlockDevice::CompressedBlockDevice(BlockDevice &_backing, int _logical_blocks, size_t cache_bytes)
+    : backing(_backing), logical_blocks(_logical_blocks), table_blocks(0), slot_area_start(0), slot_area_blocks(0),
+      loaded(false), formatted(false), header_dirty(false), allocation_cursor(0),
+      cache_capacity_blocks(std::max<size_t>(1, cache_bytes / BLOCK_SIZE)), stats{}
+{
+    uint8_t buffer[BLOCK_SIZE];
+    if (backing.get_total_blocks_number() < 1 || backing.read_block(HEADER_BLOCK_INDEX, buffer) != FileSystemStatus::OK)
+        return;
+
+    CompressedHeader header;
+    std::memcpy(&header, buffer, sizeof(header));
+    formatted = header.magic == COMPRESSED_MAGIC && header.version == COMPRESSED_VERSION && header.logical_blocks > 0;
+    if (formatted)
+        logical_blocks = header.logical_blocks; // an existing device keeps its size
+    if (logical_blocks <= 0)
+        return;
+
+    table_blocks = (logical_blocks + TABLE_ENTRIES_PER_BLOCK - 1) / TABLE_ENTRIES_PER_BLOCK;
+    slot_area_start = HEADER_BLOCK_INDEX + 1 + table_blocks;
+    slot_area_blocks = std::min(backing.get_total_blocks_number() - slot_area_start, MAX_SLOT_AREA_BLOCKS);
+    if (slot_area_blocks <= 0)
+        return;
+
+    table.assign(static_cast<size_t>(table_blocks) * TABLE_ENTRIES_PER_BLOCK, 0);
+    slot_masks.assign(slot_area_blocks, 0);
+
+    if (!formatted)
+    {
+        // nothing is written until the first write claims the backing device
+        loaded = true;
+        return;
+    }
+
+    std::vector<int> batch_indices;
+    for (int first = 0; first < table_blocks; first += MAX_BATCH_BLOCKS)
+    {
+        int batch_size = std::min(MAX_BATCH_BLOCKS, table_blocks - first);
+        batch_indices.clear();
+        for (int i = 0; i < batch_size; i++)
+            batch_indices.push_back(HEADER_BLOCK_INDEX + 1 + first + i);
+
+        uint8_t *destination = reinterpret_cast<uint8_t *>(table.data() + static_cast<size_t>(first) * TABLE_ENTRIES_PER_BLOCK);
+        if (backing.read_blocks(batch_indices, destination) != FileSystemStatus::OK)
+            return;
+    }
+
+    for (int i = 0; i < logical_blocks; i++)
+    {
+        uint32_t entry = table[i];
+        if (entry == 0)
+            continue;
+
+        uint32_t first_slot = entry_first_slot(entry);
+        int slots_count = entry_slots_count(entry);
+        int slot_block = static_cast<int>(first_slot / SLOTS_PER_BLOCK);
+        int slot_in_block = static_cast<int>(first_slot % SLOTS_PER_BLOCK);
+        if (slot_block >= slot_area_blocks || slots_count > SLOTS_PER_BLOCK || slot_in_block + slots_count > SLOTS_PER_BLOCK)
+            return; // the table does not fit this backing device
+        slot_masks[slot_block] |= static_cast<uint8_t>(((1u << slots_count) - 1) << slot_in_block);
+    }
+
+    loaded = true;
+}
+
+CompressedBlockDevice::~CompressedBlockDevice()
+{
+    if (loaded)
+        flush();
+}
+
+int CompressedBlockDevice::backing_blocks_for(int logical_blocks)
+{
+    return HEADER_BLOCK_INDEX + 1 + (logical_blocks + TABLE_ENTRIES_PER_BLOCK - 1) / TABLE_ENTRIES_PER_BLOCK + logical_blocks;
+}
+
+double CompressedBlockDevice::get_compression_ratio() const
+{
+    if (stats.stored_bytes == 0)
+        return 1.0;
+    return static_cast<double>(stats.logical_bytes) / static_cast<double>(stats.stored_bytes);
+}
+
+uint64_t CompressedBlockDevice::get_used_bytes() const
+{
+    uint64_t used_slots = 0;
+    for (int i = 0; i < logical_blocks; i++)
+        used_slots += entry_slots_count(table[i]);
+    return used_slots * COMPRESSION_SLOT_SIZE;
+}
+
+/*
+ * This function finds slots_count free consecutive slots inside one backing block,
+ * scanning from where the last allocation ended
+ */
+std::expected<uint32_t, FileSystemStatus> CompressedBlockDevice::allocate_slots(int slots_count)
+{
+    uint8_t run_mask = static_cast<uint8_t>((1u << slots_count) - 1);
+
+    for (int scanned = 0; scanned < slot_area_blocks; scanned++)
+    {
+        int slot_block = (allocation_cursor + scanned) % slot_area_blocks;
+        uint8_t used = slot_masks[slot_block];
+        if (used == 0xFF)
+            continue;
+
+        for (int slot = 0; slot + slots_count <= SLOTS_PER_BLOCK; slot++)
+        {
+            uint8_t wanted = static_cast<uint8_t>(run_mask << slot);
+            if ((used & wanted) != 0)
+                continue;
+
+            slot_masks[slot_block] |= wanted;
+            allocation_cursor = slot_block;
+            return make_entry(static_cast<uint32_t>(slot_block) * SLOTS_PER_BLOCK + slot, slots_count);
+        }
+    }
+
+    return std::unexpected(FileSystemStatus::FullDisk);
+}
+
+void CompressedBlockDevice::release_slots(uint32_t entry)
+{
+    if (entry == 0)
+        return;
+
+    uint32_t first_slot = entry_first_slot(entry);
+    uint8_t run_mask = static_cast<uint8_t>((1u << entry_slots_count(entry)) - 1);
+    slot_masks[first_slot / SLOTS_PER_BLOCK] &= static_cast<uint8_t>(~(run_mask << (first_slot % SLOTS_PER_BLOCK)));
+}
+
+/*
+ * This function takes slots for every payload of a batch, a zero count takes none
+ * Either all of them are taken or none is
+ */
+bool CompressedBlockDevice::allocate_batch(std::span<const int> slots_counts, std::span<uint32_t> entries)
+{
+    for (size_t i = 0; i < slots_counts.size(); i++)
+    {
+        if (slots_counts[i] == 0)
+            continue;
+
+        auto slots_res = allocate_slots(slots_counts[i]);
+        if (!slots_res)
+        {
+            for (size_t j = 0; j < i; j++)
+                release_slots(entries[j]);
+            std::fill(entries.begin(), entries.end(), 0);
+            return false;
+        }
+        entries[i] = slots_res.value();
+    }
+    return true;
+}
+
+/* tries the allocation on the slot usage with the given entries released, nothing changes */
+bool CompressedBlockDevice::batch_fits(std::span<const int> slots_counts, std::span<const uint32_t> released_entries)
+{
+    std::vector<uint8_t> saved_masks = slot_masks;
+    int saved_cursor = allocation_cursor;
+    for (uint32_t entry : released_entries)
+        release_slots(entry);
+
+    std::vector<uint32_t> entries(slots_counts.size(), 0);
+    bool fits = allocate_batch(slots_counts, entries);
+
+    slot_masks.swap(saved_masks);
+    allocation_cursor = saved_cursor;
+    return fits;
+}
+
+/*
+ * This function frees slots for a batch that found too few. The slots waiting for
+ * a flush are released by one. When there are none, the old payloads of the batch
+ * blocks are unmapped on the device before their slots are reused, but only once
+ * the whole batch is known to fit in what that frees. FullDisk means the batch
+ * does not fit and no mapping changed
+ */
+FileSystemStatus CompressedBlockDevice::reclaim_slots(std::span<const int> block_indices, std::span<const int> slots_counts)
+{
+    if (std::any_of(pending_free.begin(), pending_free.end(), [](uint32_t entry)
+                    { return entry != 0; }))
+        return flush();
+
+    std::vector<uint32_t> old_entries;
+    for (int block_index : block_indices)
+        if (table[block_index] != 0)
+            old_entries.push_back(table[block_index]);
+    if (old_entries.empty() || !batch_fits(slots_counts, old_entries))
+        return FileSystemStatus::FullDisk;
+
+    for (int block_index : block_indices)
+    {
+        if (table[block_index] == 0)
+            continue;
+        pending_free.push_back(table[block_index]);
+        set_entry(block_index, 0);
+        auto cached = cache_index.find(block_index);
+        if (cached != cache_index.end())
+        {
+            cache.erase(cached->second);
+            cache_index.erase(cached);
+        }
+    }
+    return flush();
+}
+
+void CompressedBlockDevice::set_entry(int block_index, uint32_t entry)
+{
+    table[block_index] = entry;
+    dirty_table_blocks.insert(block_index / TABLE_ENTRIES_PER_BLOCK);
+}
+
+const uint8_t *CompressedBlockDevice::find_cached(int block_index) const
+{
+    auto it = cache_index.find(block_index);
+    if (it == cache_index.end())
+        return nullptr;
+
+    cache.splice(cache.begin(), cache, it->second);
+    return it->second->data.data();
+}
+
+void CompressedBlockDevice::cache_block(int block_index, const uint8_t *data) const
+{
+    auto it = cache_index.find(block_index);
+    if (it != cache_index.end())
+    {
+        cache.splice(cache.begin(), cache, it->second);
+        std::memcpy(it->second->data.data(), data, BLOCK_SIZE);
+        return;
+    }
+
+    if (cache.size() >= cache_capacity_blocks)
+    {
+        cache_index.erase(cache.back().block_index);
+        cache.pop_back();
+    }
+
+    cache.emplace_front();
+    cache.front().block_index = block_index;
+    std::memcpy(cache.front().data.data(), data, BLOCK_SIZE);
+    cache_index[block_index] = cache.begin();
+}
+
+/*
+ * This function serves blocks from the cache, fetches the backing blocks of
+ * the misses in one batch and decompresses them into buffer and the cache
+ */
+FileSystemStatus CompressedBlockDevice::load_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    std::vector<size_t> missing_positions;
+    std::map<int, size_t> backing_positions; // backing block -> position in the read batch
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        const uint8_t *cached = find_cached(block_indices[i]);
+        if (cached != nullptr)
+        {
+            stats.cache_hits++;
+            std::memcpy(buffer + i * BLOCK_SIZE, cached, BLOCK_SIZE);
+            continue;
+        }
+
+        stats.cache_misses++;
+        uint32_t entry = table[block_indices[i]];
+        if (entry == 0)
+        {
+            std::memset(buffer + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            continue;
+        }
+
+        missing_positions.push_back(i);
+        backing_positions.emplace(slot_area_start + static_cast<int>(entry_first_slot(entry) / SLOTS_PER_BLOCK), 0);
+    }
+
+    if (missing_positions.empty())
+        return FileSystemStatus::OK;
+
+    std::vector<int> backing_indices;
+    for (auto &[backing_index, position] : backing_positions)
+    {
+        position = backing_indices.size();
+        backing_indices.push_back(backing_index);
+    }
+
+    std::vector<uint8_t> backing_data(backing_indices.size() * BLOCK_SIZE);
+    FileSystemStatus status = backing.read_blocks(backing_indices, backing_data.data());
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i : missing_positions)
+    {
+        uint32_t entry = table[block_indices[i]];
+        uint32_t first_slot = entry_first_slot(entry);
+        int slots_count = entry_slots_count(entry);
+        size_t position = backing_positions[slot_area_start + static_cast<int>(first_slot / SLOTS_PER_BLOCK)];
+        const uint8_t *payload = backing_data.data() + position * BLOCK_SIZE + (first_slot % SLOTS_PER_BLOCK) * COMPRESSION_SLOT_SIZE;
+        uint8_t *destination = buffer + i * BLOCK_SIZE;
+
+        if (slots_count == SLOTS_PER_BLOCK)
+        {
+            std::memcpy(destination, payload, BLOCK_SIZE);
+        }
+        else
+        {
+            uint16_t compressed_size;
+            std::memcpy(&compressed_size, payload, PAYLOAD_LENGTH_BYTES);
+            if (compressed_size > slots_count * COMPRESSION_SLOT_SIZE - PAYLOAD_LENGTH_BYTES ||
+                !lz_decompress(payload + PAYLOAD_LENGTH_BYTES, compressed_size, destination, BLOCK_SIZE))
+                return FileSystemStatus::DeviceError;
+        }
+
+        cache_block(block_indices[i], destination);
+    }
+    stats.decompress_nanoseconds += nanoseconds_since(start);
+    stats.blocks_decompressed += missing_positions.size();
+
+    return FileSystemStatus::OK;
+}
+
+int CompressedBlockDevice::get_total_blocks_number() const
+{
+    return loaded ? logical_blocks : 0;
+}
+
+FileSystemStatus CompressedBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    return read_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus CompressedBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    return write_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus CompressedBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    return load_blocks(block_indices, buffer);
+}
+
+/*
+ * This function compresses the batch, takes free slots for all of its payloads and
+ * writes every backing block it touched in one batch. Backing blocks that
+ * already hold other payloads are read first so those payloads are kept
+ */
+FileSystemStatus CompressedBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    // the first write claims an unformatted backing device, whatever its table area holds is garbage
+    if (!formatted)
+    {
+        formatted = true;
+        header_dirty = true;
+        for (int i = 0; i < table_blocks; i++)
+            dirty_table_blocks.insert(i);
+    }
+
+    std::vector<uint32_t> new_entries(block_indices.size(), 0);
+    std::vector<int> slots_counts(block_indices.size(), 0);
+    std::vector<uint8_t> payloads(block_indices.size() * BLOCK_SIZE);
+    std::set<int> touched_blocks; // slot area blocks that receive a payload
+    uint64_t logical_bytes = 0, stored_bytes = 0, zero_blocks = 0, raw_blocks = 0;
+
+    auto rollback = [&]()
+    {
+        for (uint32_t entry : new_entries)
+            release_slots(entry);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        const uint8_t *source = buffer + i * BLOCK_SIZE;
+        uint8_t *payload = payloads.data() + i * BLOCK_SIZE;
+
+        if (std::all_of(source, source + BLOCK_SIZE, [](uint8_t byte)
+                        { return byte == 0; }))
+        {
+            zero_blocks++;
+            continue;
+        }
+
+        // a payload that needs all 8 slots is no better than the raw block
+        int slots_count = SLOTS_PER_BLOCK;
+        size_t compressed_size = lz_compress(source, BLOCK_SIZE, payload + PAYLOAD_LENGTH_BYTES,
+                                             (SLOTS_PER_BLOCK - 1) * COMPRESSION_SLOT_SIZE - PAYLOAD_LENGTH_BYTES);
+        if (compressed_size != 0)
+        {
+            uint16_t stored_size = static_cast<uint16_t>(compressed_size);
+            std::memcpy(payload, &stored_size, PAYLOAD_LENGTH_BYTES);
+            slots_count = static_cast<int>((compressed_size + PAYLOAD_LENGTH_BYTES + COMPRESSION_SLOT_SIZE - 1) / COMPRESSION_SLOT_SIZE);
+        }
+        else
+        {
+            std::memcpy(payload, source, BLOCK_SIZE);
+            raw_blocks++;
+        }
+
+        slots_counts[i] = slots_count;
+        logical_bytes += BLOCK_SIZE;
+        stored_bytes += static_cast<uint64_t>(slots_count) * COMPRESSION_SLOT_SIZE;
+    }
+    stats.compress_nanoseconds += nanoseconds_since(start);
+
+    while (!allocate_batch(slots_counts, new_entries))
+    {
+        FileSystemStatus status = reclaim_slots(block_indices, slots_counts);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+    for (uint32_t entry : new_entries)
+        if (entry != 0)
+            touched_blocks.insert(static_cast<int>(entry_first_slot(entry) / SLOTS_PER_BLOCK));
+
+    std::vector<int> backing_indices;
+    std::map<int, size_t> backing_positions; // slot area block -> position in the write batch
+    for (int slot_block : touched_blocks)
+    {
+        backing_positions[slot_block] = backing_indices.size();
+        backing_indices.push_back(slot_area_start + slot_block);
+    }
+
+    // a touched block holds other payloads if any of its used slots is not new
+    std::vector<uint8_t> new_slots(backing_indices.size(), 0);
+    for (uint32_t entry : new_entries)
+    {
+        if (entry == 0)
+            continue;
+        uint32_t first_slot = entry_first_slot(entry);
+        uint8_t run_mask = static_cast<uint8_t>((1u << entry_slots_count(entry)) - 1);
+        new_slots[backing_positions[first_slot / SLOTS_PER_BLOCK]] |= static_cast<uint8_t>(run_mask << (first_slot % SLOTS_PER_BLOCK));
+    }
+
+    std::vector<int> shared_indices;
+    for (int slot_block : touched_blocks)
+        if ((slot_masks[slot_block] & ~new_slots[backing_positions[slot_block]]) != 0)
+            shared_indices.push_back(slot_area_start + slot_block);
+
+    std::vector<uint8_t> backing_data(backing_indices.size() * BLOCK_SIZE, 0);
+    if (!shared_indices.empty())
+    {
+        std::vector<uint8_t> shared_data(shared_indices.size() * BLOCK_SIZE);
+        FileSystemStatus status = backing.read_blocks(shared_indices, shared_data.data());
+        if (status != FileSystemStatus::OK)
+        {
+            rollback();
+            return status;
+        }
+        for (size_t i = 0; i < shared_indices.size(); i++)
+            std::memcpy(backing_data.data() + backing_positions[shared_indices[i] - slot_area_start] * BLOCK_SIZE,
+                        shared_data.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        uint32_t entry = new_entries[i];
+        if (entry == 0)
+            continue;
+        uint32_t first_slot = entry_first_slot(entry);
+        uint8_t *destination = backing_data.data() + backing_positions[first_slot / SLOTS_PER_BLOCK] * BLOCK_SIZE +
+                               (first_slot % SLOTS_PER_BLOCK) * COMPRESSION_SLOT_SIZE;
+        std::memcpy(destination, payloads.data() + i * BLOCK_SIZE, entry_slots_count(entry) * COMPRESSION_SLOT_SIZE);
+    }
+
+    if (!backing_indices.empty())
+    {
+        FileSystemStatus status = backing.write_blocks(backing_indices, backing_data.data());
+        if (status != FileSystemStatus::OK)
+        {
+            rollback();
+            return status;
+        }
+    }
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        pending_free.push_back(table[block_indices[i]]);
+        set_entry(block_indices[i], new_entries[i]);
+        cache_block(block_indices[i], buffer + i * BLOCK_SIZE);
+    }
+
+    stats.blocks_written += block_indices.size();
+    stats.zero_blocks += zero_blocks;
+    stats.raw_blocks += raw_blocks;
+    stats.logical_bytes += logical_bytes;
+    stats.stored_bytes += stored_bytes;
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> CompressedBlockDevice::view_block(int block_index) const
+{
+    if (block_index < 0 || block_index >= get_total_blocks_number())
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    uint8_t buffer[BLOCK_SIZE];
+    FileSystemStatus status = load_blocks(std::span<const int>(&block_index, 1), buffer);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
+
+    if (find_cached(block_index) == nullptr) // holes are not cached
+        cache_block(block_index, buffer);
+    return std::span<const uint8_t, BLOCK_SIZE>(cache_index[block_index]->data);
+}
+
+/*
+ * This function makes the table durable, only then the slots of overwritten
+ * blocks can be handed out again
+ */
+FileSystemStatus CompressedBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > get_total_blocks_number() - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+    {
+        auto cached = cache_index.find(block_index);
+        if (cached != cache_index.end())
+        {
+            cache.erase(cached->second);
+            cache_index.erase(cached);
+        }
+
+        if (table[block_index] == 0)
+            continue;
+        pending_free.push_back(table[block_index]);
+        set_entry(block_index, 0);
+    }
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus CompressedBlockDevice::flush()
+{
+    if (!loaded)
+        return FileSystemStatus::DeviceError;
+
+    std::vector<int> batch_indices;
+    std::vector<uint8_t> batch_data;
+    if (header_dirty)
+    {
+        CompressedHeader header{COMPRESSED_MAGIC, COMPRESSED_VERSION, logical_blocks};
+        batch_indices.push_back(HEADER_BLOCK_INDEX);
+        batch_data.resize(BLOCK_SIZE, 0);
+        std::memcpy(batch_data.data(), &header, sizeof(header));
+    }
+    for (int table_block : dirty_table_blocks)
+    {
+        batch_indices.push_back(HEADER_BLOCK_INDEX + 1 + table_block);
+        const uint8_t *source = reinterpret_cast<const uint8_t *>(table.data() + static_cast<size_t>(table_block) * TABLE_ENTRIES_PER_BLOCK);
+        batch_data.insert(batch_data.end(), source, source + BLOCK_SIZE);
+    }
+
+    for (size_t first = 0; first < batch_indices.size(); first += MAX_BATCH_BLOCKS)
+    {
+        size_t batch_size = std::min<size_t>(MAX_BATCH_BLOCKS, batch_indices.size() - first);
+        FileSystemStatus status = backing.write_blocks(std::span<const int>(batch_indices.data() + first, batch_size),
+                                                       batch_data.data() + first * BLOCK_SIZE);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    FileSystemStatus status = backing.flush();
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    header_dirty = false;
+    dirty_table_blocks.clear();
+
+    std::vector<int> emptied_blocks;
+    for (uint32_t entry : pending_free)
+    {
+        if (entry == 0)
+            continue;
+        release_slots(entry);
+        int slot_block = static_cast<int>(entry_first_slot(entry) / SLOTS_PER_BLOCK);
+        if (slot_masks[slot_block] == 0)
+            emptied_blocks.push_back(slot_area_start + slot_block);
+    }
+    pending_free.clear();
+
+    // the next payload written to an empty block rewrites all of it, so its old bytes are dead
+    std::sort(emptied_blocks.begin(), emptied_blocks.end());
+    emptied_blocks.erase(std::unique(emptied_blocks.begin(), emptied_blocks.end()), emptied_blocks.end());
+    backing.discard_sorted_blocks(emptied_blocks); // a backing device without discard keeps them
+    return FileSystemStatus::OK;
+}
@@ -0,0 +1,165 @@
+#include "crc32c.hpp"
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAS_SSE42_PATH 1
+#endif
+
+static const uint32_t CRC32C_POLY = 0x82F63B78; // reflected Castagnoli polynomial
+
+/* slice-by-8 tables, table[k][i] is the CRC of byte i followed by k zero bytes */
+static const std::array<std::array<uint32_t, 256>, 8> SLICE_TABLES = []
+{
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        tables[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+    return tables;
+}();
+
+/* the raw register update, without the initial and final inversion */
+static uint32_t portable_update(uint32_t state, const uint8_t *data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        word ^= state;
+        state = SLICE_TABLES[7][word & 0xFF] ^ SLICE_TABLES[6][(word >> 8) & 0xFF] ^
+                SLICE_TABLES[5][(word >> 16) & 0xFF] ^ SLICE_TABLES[4][(word >> 24) & 0xFF] ^
+                SLICE_TABLES[3][(word >> 32) & 0xFF] ^ SLICE_TABLES[2][(word >> 40) & 0xFF] ^
+                SLICE_TABLES[1][(word >> 48) & 0xFF] ^ SLICE_TABLES[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+
+    while (length-- > 0)
+        state = (state >> 8) ^ SLICE_TABLES[0][(state ^ *data++) & 0xFF];
+    return state;
+}
+
+uint32_t crc32c_portable(const uint8_t *data, size_t length, uint32_t crc)
+{
+    return ~portable_update(~crc, data, length);
+}
+
+#ifdef CRC32C_HAS_SSE42_PATH
+
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one per cycle,
+ * so long inputs are cut into three lanes that are computed side by side and combined
+ */
+static const size_t LANE_BYTES = 1360; // 3 lanes cover a 4 KiB block but its last 16 bytes
+
+/* returns a * b modulo the polynomial, both reflected */
+static uint32_t multiply_modulo(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+    for (uint32_t mask = 1u << 31; mask != 0; mask >>= 1)
+    {
+        if (a & mask)
+            product ^= b;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/* shift_tables[k][i] moves byte k of a register past LANE_BYTES zero bytes */
+static const std::array<std::array<uint32_t, 256>, 4> LANE_SHIFT_TABLES = []
+{
+    // x^(8 * LANE_BYTES) by repeated squaring, starting from x^1 (reflected 1 << 30)
+    uint32_t lane_power = 1u << 31; // x^0
+    uint32_t square = 1u << 30;     // x^1
+    for (size_t bits = 8 * LANE_BYTES; bits != 0; bits >>= 1)
+    {
+        if (bits & 1)
+            lane_power = multiply_modulo(lane_power, square);
+        square = multiply_modulo(square, square);
+    }
+
+    std::array<std::array<uint32_t, 256>, 4> tables{};
+    for (int k = 0; k < 4; k++)
+        for (uint32_t i = 0; i < 256; i++)
+            tables[k][i] = multiply_modulo(lane_power, i << (8 * k));
+    return tables;
+}();
+
+static uint32_t shift_past_lane(uint32_t state)
+{
+    return LANE_SHIFT_TABLES[0][state & 0xFF] ^ LANE_SHIFT_TABLES[1][(state >> 8) & 0xFF] ^
+           LANE_SHIFT_TABLES[2][(state >> 16) & 0xFF] ^ LANE_SHIFT_TABLES[3][state >> 24];
+}
+
+__attribute__((target("sse4.2"))) static uint32_t sse42_update(uint32_t state, const uint8_t *data, size_t length)
+{
+    while (length >= 3 * LANE_BYTES)
+    {
+        uint64_t lane_a = state, lane_b = 0, lane_c = 0;
+        for (size_t offset = 0; offset < LANE_BYTES; offset += 8)
+        {
+            uint64_t word_a, word_b, word_c;
+            std::memcpy(&word_a, data + offset, 8);
+            std::memcpy(&word_b, data + LANE_BYTES + offset, 8);
+            std::memcpy(&word_c, data + 2 * LANE_BYTES + offset, 8);
+            lane_a = _mm_crc32_u64(lane_a, word_a);
+            lane_b = _mm_crc32_u64(lane_b, word_b);
+            lane_c = _mm_crc32_u64(lane_c, word_c);
+        }
+
+        state = shift_past_lane(static_cast<uint32_t>(lane_a)) ^ static_cast<uint32_t>(lane_b);
+        state = shift_past_lane(state) ^ static_cast<uint32_t>(lane_c);
+        data += 3 * LANE_BYTES;
+        length -= 3 * LANE_BYTES;
+    }
+
+    uint64_t wide_state = state;
+    while (length >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        wide_state = _mm_crc32_u64(wide_state, word);
+        data += 8;
+        length -= 8;
+    }
+
+    state = static_cast<uint32_t>(wide_state);
+    while (length-- > 0)
+        state = _mm_crc32_u8(state, *data++);
+    return state;
+}
+
+bool crc32c_is_hardware_accelerated()
+{
+    static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    return has_sse42;
+}
+
+uint32_t crc32c(const uint8_t *data, size_t length, uint32_t crc)
+{
+    if (crc32c_is_hardware_accelerated())
+        return ~sse42_update(~crc, data, length);
+    return ~portable_update(~crc, data, length);
+}
+
+#else
+
+bool crc32c_is_hardware_accelerated()
+{
+    return false;
+}
+
+uint32_t crc32c(const uint8_t *data, size_t length, uint32_t crc)
+{
+    return ~portable_update(~crc, data, length);
+}
+
+#endif
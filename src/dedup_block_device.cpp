@@ -0,0 +1,573 @@
+#include "dedup_block_device.hpp"
+#include "block_hash.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include "fs_status.hpp"
+
+static const uint32_t DEDUP_MAGIC = 0x44444653; // "DDFS"
+static const uint32_t DEDUP_VERSION = 1;
+static const int HEADER_BLOCK_INDEX = 0;
+
+static const std::array<uint8_t, BLOCK_SIZE> ZERO_BLOCK{};
+
+struct DedupHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    int logical_blocks;
+};
+
+static bool is_zero_block(const uint8_t *data)
+{
+    return std::memcmp(data, ZERO_BLOCK.data(), BLOCK_SIZE) == 0;
+}
+
+/*
+ * This constructor mounts a dedup device, or starts an empty one on a backing
+ * device without the header. The reference counts and the fingerprint index
+ * are rebuilt from the map, hashing every physical block in use
+ */
+DedupBlockDevice::DedupBlockDevice(BlockDevice &_backing, int _logical_blocks)
+    : backing(_backing), logical_blocks(_logical_blocks), table_blocks(0), physical_area_start(0), physical_blocks(0),
+      loaded(false), formatted(false), header_dirty(false), mapped_blocks(0), allocated_blocks(0), allocation_cursor(0), stats{}
+{
+    uint8_t buffer[BLOCK_SIZE];
+    if (backing.get_total_blocks_number() < 1 || backing.read_block(HEADER_BLOCK_INDEX, buffer) != FileSystemStatus::OK)
+        return;
+
+    DedupHeader header;
+    std::memcpy(&header, buffer, sizeof(header));
+    formatted = header.magic == DEDUP_MAGIC && header.version == DEDUP_VERSION && header.logical_blocks > 0;
+    if (formatted)
+        logical_blocks = header.logical_blocks; // an existing device keeps its size
+    if (logical_blocks <= 0)
+        return;
+
+    table_blocks = (logical_blocks + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK;
+    physical_area_start = HEADER_BLOCK_INDEX + 1 + table_blocks;
+    physical_blocks = backing.get_total_blocks_number() - physical_area_start;
+    if (physical_blocks <= 0)
+        return;
+
+    table.assign(static_cast<size_t>(table_blocks) * DEDUP_ENTRIES_PER_BLOCK, 0);
+    fingerprints.assign(physical_blocks, 0);
+    reference_counts.assign(physical_blocks, 0);
+    allocated.assign(physical_blocks, false);
+
+    if (!formatted)
+    {
+        // nothing is written until the first write claims the backing device
+        loaded = true;
+        return;
+    }
+
+    std::vector<int> batch_indices;
+    for (int first = 0; first < table_blocks; first += MAX_BATCH_BLOCKS)
+    {
+        int batch_size = std::min(MAX_BATCH_BLOCKS, table_blocks - first);
+        batch_indices.clear();
+        for (int i = 0; i < batch_size; i++)
+            batch_indices.push_back(HEADER_BLOCK_INDEX + 1 + first + i);
+
+        uint8_t *destination = reinterpret_cast<uint8_t *>(table.data() + static_cast<size_t>(first) * DEDUP_ENTRIES_PER_BLOCK);
+        if (backing.read_blocks(batch_indices, destination) != FileSystemStatus::OK)
+            return;
+    }
+
+    std::vector<int> used_physical;
+    for (int i = 0; i < logical_blocks; i++)
+    {
+        uint32_t entry = table[i];
+        if (entry == 0)
+            continue;
+        if (entry > static_cast<uint32_t>(physical_blocks))
+            return; // the map does not fit this backing device
+
+        int physical = static_cast<int>(entry - 1);
+        if (reference_counts[physical]++ == 0)
+        {
+            allocated[physical] = true;
+            allocated_blocks++;
+            used_physical.push_back(physical);
+        }
+        mapped_blocks++;
+    }
+
+    std::vector<uint8_t> batch_data(MAX_BATCH_BLOCKS * BLOCK_SIZE);
+    for (size_t first = 0; first < used_physical.size(); first += MAX_BATCH_BLOCKS)
+    {
+        size_t batch_size = std::min<size_t>(MAX_BATCH_BLOCKS, used_physical.size() - first);
+        batch_indices.clear();
+        for (size_t i = 0; i < batch_size; i++)
+            batch_indices.push_back(physical_area_start + used_physical[first + i]);
+
+        if (backing.read_blocks(batch_indices, batch_data.data()) != FileSystemStatus::OK)
+            return;
+
+        for (size_t i = 0; i < batch_size; i++)
+        {
+            int physical = used_physical[first + i];
+            fingerprints[physical] = block_hash(batch_data.data() + i * BLOCK_SIZE);
+            index.emplace(fingerprints[physical], physical);
+        }
+    }
+
+    loaded = true;
+}
+
+DedupBlockDevice::~DedupBlockDevice()
+{
+    if (loaded)
+        flush();
+}
+
+int DedupBlockDevice::backing_blocks_for(int logical_blocks)
+{
+    return HEADER_BLOCK_INDEX + 1 + (logical_blocks + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK + logical_blocks;
+}
+
+int DedupBlockDevice::get_physical_blocks_used() const
+{
+    return allocated_blocks - static_cast<int>(pending_free.size());
+}
+
+double DedupBlockDevice::get_dedup_ratio() const
+{
+    int physical_used = get_physical_blocks_used();
+    if (physical_used == 0)
+        return 1.0;
+    return static_cast<double>(mapped_blocks) / physical_used;
+}
+
+/* a multimap node holds the pair and the next pointer, the bucket array one pointer per bucket */
+size_t DedupBlockDevice::get_index_memory_bytes() const
+{
+    size_t node_bytes = sizeof(std::pair<const uint64_t, int>) + sizeof(void *);
+    return index.size() * node_bytes + index.bucket_count() * sizeof(void *) +
+           fingerprints.capacity() * sizeof(uint64_t) + reference_counts.capacity() * sizeof(uint32_t) +
+           allocated.capacity() / 8;
+}
+
+/* scans for a free physical block from where the last allocation ended */
+std::expected<int, FileSystemStatus> DedupBlockDevice::allocate_physical()
+{
+    for (int scanned = 0; scanned < physical_blocks; scanned++)
+    {
+        int physical = (allocation_cursor + scanned) % physical_blocks;
+        if (allocated[physical])
+            continue;
+
+        allocated[physical] = true;
+        allocated_blocks++;
+        allocation_cursor = physical;
+        return physical;
+    }
+
+    return std::unexpected(FileSystemStatus::FullDisk);
+}
+
+/*
+ * This function makes room for needed new physical blocks before a batch maps
+ * anything. The blocks waiting for a flush are released by one. When that is not
+ * enough, blocks the batch overwrites are unmapped on the device first, but only
+ * physical blocks nothing else shares and the batch does not reference again
+ * (kept_entries), and only if they make room for the whole batch. FullDisk
+ * means the batch does not fit and no mapping changed
+ */
+FileSystemStatus DedupBlockDevice::reserve_physical(std::span<const int> block_indices, std::span<const uint32_t> kept_entries, int needed)
+{
+    if (physical_blocks - allocated_blocks >= needed)
+        return FileSystemStatus::OK;
+
+    if (!pending_free.empty())
+    {
+        FileSystemStatus status = flush();
+        if (status != FileSystemStatus::OK || physical_blocks - allocated_blocks >= needed)
+            return status;
+    }
+
+    std::set<int> batch_blocks(block_indices.begin(), block_indices.end());
+    std::set<uint32_t> kept(kept_entries.begin(), kept_entries.end());
+    std::map<int, uint32_t> batch_references; // physical block -> logical blocks of the batch mapped to it
+    for (int block_index : batch_blocks)
+        if (table[block_index] != 0)
+            batch_references[static_cast<int>(table[block_index] - 1)]++;
+
+    int missing = needed - (physical_blocks - allocated_blocks);
+    std::set<int> released;
+    for (auto [physical, references] : batch_references)
+        if (static_cast<int>(released.size()) < missing && references == reference_counts[physical] &&
+            !kept.contains(static_cast<uint32_t>(physical) + 1))
+            released.insert(physical);
+    if (static_cast<int>(released.size()) < missing)
+        return FileSystemStatus::FullDisk;
+
+    for (int block_index : batch_blocks)
+    {
+        uint32_t old_entry = table[block_index];
+        if (old_entry == 0 || !released.contains(static_cast<int>(old_entry - 1)))
+            continue;
+        set_entry(block_index, 0);
+        drop_reference(old_entry);
+    }
+    return flush();
+}
+
+void DedupBlockDevice::remove_from_index(int physical)
+{
+    auto [first, last] = index.equal_range(fingerprints[physical]);
+    for (auto it = first; it != last; ++it)
+    {
+        if (it->second == physical)
+        {
+            index.erase(it);
+            return;
+        }
+    }
+}
+
+void DedupBlockDevice::add_reference(uint32_t entry)
+{
+    if (entry != 0)
+        reference_counts[entry - 1]++;
+}
+
+/* the last reference takes the block out of the index, its space is freed on flush */
+void DedupBlockDevice::drop_reference(uint32_t entry)
+{
+    if (entry == 0)
+        return;
+
+    int physical = static_cast<int>(entry - 1);
+    if (--reference_counts[physical] > 0)
+        return;
+
+    remove_from_index(physical);
+    pending_free.push_back(physical);
+}
+
+void DedupBlockDevice::set_entry(int block_index, uint32_t entry)
+{
+    if (table[block_index] == 0 && entry != 0)
+        mapped_blocks++;
+    else if (table[block_index] != 0 && entry == 0)
+        mapped_blocks--;
+
+    table[block_index] = entry;
+    dirty_table_blocks.insert(block_index / DEDUP_ENTRIES_PER_BLOCK);
+}
+
+int DedupBlockDevice::get_total_blocks_number() const
+{
+    return loaded ? logical_blocks : 0;
+}
+
+FileSystemStatus DedupBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    return read_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus DedupBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    return write_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+/* the physical blocks are fetched in one batch, zero blocks are filled in here */
+FileSystemStatus DedupBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<int> physical_indices;
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        uint32_t entry = table[block_indices[i]];
+        if (entry == 0)
+        {
+            std::memset(buffer + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            continue;
+        }
+        physical_indices.push_back(physical_area_start + static_cast<int>(entry - 1));
+        positions.push_back(i);
+    }
+
+    if (physical_indices.empty())
+        return FileSystemStatus::OK;
+    if (physical_indices.size() == block_indices.size()) // no zero block, read in place
+        return backing.read_blocks(physical_indices, buffer);
+
+    std::vector<uint8_t> physical_data(physical_indices.size() * BLOCK_SIZE);
+    FileSystemStatus status = backing.read_blocks(physical_indices, physical_data.data());
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (size_t i = 0; i < positions.size(); i++)
+        std::memcpy(buffer + positions[i] * BLOCK_SIZE, physical_data.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function fingerprints the batch, reads the stored blocks whose
+ * fingerprints match in one batch to compare them byte by byte, and writes
+ * the blocks that matched nothing to new physical blocks in one batch.
+ * Duplicates inside the batch share one physical block too. Room for all the
+ * new physical blocks is made before any is taken, the map and the reference
+ * counts change only once the write succeeded
+ */
+FileSystemStatus DedupBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= get_total_blocks_number())
+            return FileSystemStatus::OutOfBounds;
+
+    // the first write claims an unformatted backing device, whatever its map area holds is garbage
+    if (!formatted)
+    {
+        formatted = true;
+        header_dirty = true;
+        for (int i = 0; i < table_blocks; i++)
+            dirty_table_blocks.insert(i);
+    }
+
+    std::vector<uint64_t> hashes(block_indices.size(), 0);
+    std::vector<bool> zero(block_indices.size(), false);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        const uint8_t *source = buffer + i * BLOCK_SIZE;
+        zero[i] = is_zero_block(source);
+        if (!zero[i])
+            hashes[i] = block_hash(source);
+    }
+    stats.hash_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    // the stored blocks that may be duplicates, physical block -> position in the read batch
+    std::map<int, size_t> candidate_positions;
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        if (zero[i])
+            continue;
+        auto [first, last] = index.equal_range(hashes[i]);
+        for (auto it = first; it != last; ++it)
+            candidate_positions.emplace(it->second, 0);
+    }
+
+    std::vector<int> candidate_indices;
+    for (auto &[physical, position] : candidate_positions)
+    {
+        position = candidate_indices.size();
+        candidate_indices.push_back(physical_area_start + physical);
+    }
+
+    std::vector<uint8_t> candidate_data(candidate_indices.size() * BLOCK_SIZE);
+    if (!candidate_indices.empty())
+    {
+        FileSystemStatus status = backing.read_blocks(candidate_indices, candidate_data.data());
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    std::vector<uint32_t> new_entries(block_indices.size(), 0);
+    std::vector<int> unique_of(block_indices.size(), -1); // the new content a block holds, -1 for none
+    std::vector<size_t> unique_positions;                  // batch position of the first block of every new content
+    std::unordered_multimap<uint64_t, int> batch_index;    // fingerprint -> new content
+    uint64_t zero_blocks = 0, duplicate_blocks = 0, hash_collisions = 0;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        const uint8_t *source = buffer + i * BLOCK_SIZE;
+        if (zero[i])
+        {
+            zero_blocks++;
+            continue;
+        }
+
+        int match = -1;
+        auto [first, last] = index.equal_range(hashes[i]);
+        for (auto it = first; it != last && match < 0; ++it)
+        {
+            if (std::memcmp(candidate_data.data() + candidate_positions[it->second] * BLOCK_SIZE, source, BLOCK_SIZE) == 0)
+                match = it->second;
+            else
+                hash_collisions++;
+        }
+        if (match >= 0)
+        {
+            new_entries[i] = static_cast<uint32_t>(match) + 1;
+            duplicate_blocks++;
+            continue;
+        }
+
+        auto [batch_first, batch_last] = batch_index.equal_range(hashes[i]);
+        for (auto it = batch_first; it != batch_last && unique_of[i] < 0; ++it)
+        {
+            if (std::memcmp(buffer + unique_positions[it->second] * BLOCK_SIZE, source, BLOCK_SIZE) == 0)
+                unique_of[i] = it->second;
+            else
+                hash_collisions++;
+        }
+        if (unique_of[i] >= 0)
+        {
+            duplicate_blocks++;
+            continue;
+        }
+
+        unique_of[i] = static_cast<int>(unique_positions.size());
+        batch_index.emplace(hashes[i], unique_of[i]);
+        unique_positions.push_back(i);
+    }
+
+    FileSystemStatus status = reserve_physical(block_indices, new_entries, static_cast<int>(unique_positions.size()));
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::vector<int> new_physical;
+    auto rollback = [&]()
+    {
+        for (int physical : new_physical)
+        {
+            remove_from_index(physical);
+            allocated[physical] = false;
+            allocated_blocks--;
+        }
+    };
+
+    for (size_t position : unique_positions)
+    {
+        auto physical_res = allocate_physical();
+        if (!physical_res)
+        {
+            rollback();
+            return physical_res.error();
+        }
+        int physical = physical_res.value();
+        new_physical.push_back(physical);
+        fingerprints[physical] = hashes[position];
+        index.emplace(hashes[position], physical);
+    }
+    for (size_t i = 0; i < block_indices.size(); i++)
+        if (unique_of[i] >= 0)
+            new_entries[i] = static_cast<uint32_t>(new_physical[unique_of[i]]) + 1;
+
+    if (!new_physical.empty())
+    {
+        std::vector<int> write_indices;
+        std::vector<uint8_t> write_data(new_physical.size() * BLOCK_SIZE);
+        for (size_t i = 0; i < new_physical.size(); i++)
+        {
+            write_indices.push_back(physical_area_start + new_physical[i]);
+            std::memcpy(write_data.data() + i * BLOCK_SIZE, buffer + unique_positions[i] * BLOCK_SIZE, BLOCK_SIZE);
+        }
+
+        status = backing.write_blocks(write_indices, write_data.data());
+        if (status != FileSystemStatus::OK)
+        {
+            rollback();
+            return status;
+        }
+    }
+
+    // every new reference is taken before any old one is dropped, so a block
+    // that moves between logical blocks of the batch is never released
+    for (uint32_t entry : new_entries)
+        add_reference(entry);
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        uint32_t old_entry = table[block_indices[i]];
+        set_entry(block_indices[i], new_entries[i]);
+        drop_reference(old_entry);
+    }
+
+    stats.blocks_written += block_indices.size();
+    stats.zero_blocks += zero_blocks;
+    stats.duplicate_blocks += duplicate_blocks;
+    stats.unique_blocks += new_physical.size();
+    stats.hash_collisions += hash_collisions;
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> DedupBlockDevice::view_block(int block_index) const
+{
+    if (block_index < 0 || block_index >= get_total_blocks_number())
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    uint32_t entry = table[block_index];
+    if (entry == 0)
+        return std::span<const uint8_t, BLOCK_SIZE>(ZERO_BLOCK);
+    return backing.view_block(physical_area_start + static_cast<int>(entry - 1));
+}
+
+/*
+ * This function makes the map durable, only then the physical blocks that
+ * lost their last reference can be handed out again
+ */
+FileSystemStatus DedupBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > get_total_blocks_number() - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+    {
+        if (table[block_index] == 0)
+            continue;
+        uint32_t old_entry = table[block_index];
+        set_entry(block_index, 0);
+        drop_reference(old_entry);
+    }
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus DedupBlockDevice::flush()
+{
+    if (!loaded)
+        return FileSystemStatus::DeviceError;
+
+    std::vector<int> batch_indices;
+    std::vector<uint8_t> batch_data;
+    if (header_dirty)
+    {
+        DedupHeader header{DEDUP_MAGIC, DEDUP_VERSION, logical_blocks};
+        batch_indices.push_back(HEADER_BLOCK_INDEX);
+        batch_data.resize(BLOCK_SIZE, 0);
+        std::memcpy(batch_data.data(), &header, sizeof(header));
+    }
+    for (int table_block : dirty_table_blocks)
+    {
+        batch_indices.push_back(HEADER_BLOCK_INDEX + 1 + table_block);
+        const uint8_t *source = reinterpret_cast<const uint8_t *>(table.data() + static_cast<size_t>(table_block) * DEDUP_ENTRIES_PER_BLOCK);
+        batch_data.insert(batch_data.end(), source, source + BLOCK_SIZE);
+    }
+
+    for (size_t first = 0; first < batch_indices.size(); first += MAX_BATCH_BLOCKS)
+    {
+        size_t batch_size = std::min<size_t>(MAX_BATCH_BLOCKS, batch_indices.size() - first);
+        FileSystemStatus status = backing.write_blocks(std::span<const int>(batch_indices.data() + first, batch_size),
+                                                       batch_data.data() + first * BLOCK_SIZE);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    FileSystemStatus status = backing.flush();
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    header_dirty = false;
+    dirty_table_blocks.clear();
+    std::vector<int> released_blocks;
+    for (int physical : pending_free)
+    {
+        allocated[physical] = false;
+        released_blocks.push_back(physical_area_start + physical);
+    }
+    allocated_blocks -= static_cast<int>(pending_free.size());
+    pending_free.clear();
+
+    std::sort(released_blocks.begin(), released_blocks.end());
+    backing.discard_sorted_blocks(released_blocks); // a backing device without discard keeps them
+    return FileSystemStatus::OK;
+}
@@ -1,10 +1,12 @@
 #include "fs_constants.hpp"
 #include "file_system.hpp"
 #include "fs_status.hpp"
+#include "crc32c.hpp"
 #include <cassert>
 #include <vector>
 #include <cstring>
 #include <algorithm>
+#include <numeric>
 #include <string_view>
 #include <optional>
 #include <iostream>
@@ -15,14 +17,22 @@
 /********************************** PUBLIC APIs **********************************/
 
 /* ctor */
-FileSystem::FileSystem(BlockDevice &_device) : device(_device), is_formatted(false)
+FileSystem::FileSystem(BlockDevice &_device)
+    : journal(_device), device(journal), is_formatted(false), inodes_per_group(0), data_group_cursor(0), directory_group_cursor(0), file_layout(InodeLayout::Blocks),
+      online_discard(false), readahead_enabled(true), readahead_stats{}, inode_cache_stats{}, dentry_stats{}
 {
+    int total_blocks = device.get_total_blocks_number();
+    superblock = make_superblock(total_blocks, 0).value_or(Superblock{}); // until a format or a mount
+    build_groups();
+
+    if (journal.recover() != FileSystemStatus::OK)
+        return;
+
     Superblock candidate;
     uint8_t buffer[BLOCK_SIZE];
 
     device.read_block(SUPERBLOCK_INDEX, buffer);
     std::memcpy(&candidate, buffer, sizeof(Superblock));
-    int total_blocks = device.get_total_blocks_number();
 
     if (candidate.magic != FS_MAGIC || candidate.version != FS_VERSION)
     {
@@ -36,7 +46,9 @@ FileSystem::FileSystem(BlockDevice &_device) : device(_device), is_formatted(fal
         return;
     }
 
-    if (candidate.root_dir_block_index != DATA_START_BLOCK)
+    // the stored layout must be the one its sizes lead to
+    auto expected_res = make_superblock(candidate.total_blocks, candidate.total_inodes);
+    if (!expected_res.has_value() || std::memcmp(&expected_res.value(), &candidate, sizeof(Superblock)) != 0)
     {
         is_formatted = false;
         return;
@@ -44,7 +56,43 @@ FileSystem::FileSystem(BlockDevice &_device) : device(_device), is_formatted(fal
 
     // A superblock exists on the device hence the devicie was formatted by another fs
     superblock = candidate;
-    is_formatted = true;
+    build_groups();
+    is_formatted = load_bitmaps() == FileSystemStatus::OK;
+}
+
+/*
+This function computes the layout of a volume
+The bitmaps take as many blocks as their bits need, the data bitmap covers
+every block that is left after the inode table
+*/
+std::expected<Superblock, FileSystemStatus> FileSystem::make_superblock(int total_blocks, int total_inodes)
+{
+    if (total_inodes <= 0)
+        total_inodes = std::max(MIN_INODE_NUMBER, total_blocks / BLOCKS_PER_INODE);
+
+    Superblock layout{};
+    layout.magic = FS_MAGIC;
+    layout.version = FS_VERSION;
+    layout.total_blocks = total_blocks;
+    layout.total_inodes = total_inodes;
+
+    layout.inode_bitmap_start = INODE_BITMAP_INDEX;
+    layout.inode_bitmap_blocks = (total_inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    layout.inode_table_blocks = (total_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+
+    // the data bitmap and the data blocks share what is left, a bitmap block covers BITS_PER_BLOCK blocks
+    int64_t left_blocks = static_cast<int64_t>(total_blocks) - INODE_BITMAP_INDEX - layout.inode_bitmap_blocks - layout.inode_table_blocks;
+    if (left_blocks < 2) // a bitmap block and the root directory block
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+    layout.data_bitmap_blocks = static_cast<int>((left_blocks + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1));
+
+    layout.data_bitmap_start = layout.inode_bitmap_start + layout.inode_bitmap_blocks;
+    layout.inode_table_start = layout.data_bitmap_start + layout.data_bitmap_blocks;
+    layout.data_start = layout.inode_table_start + layout.inode_table_blocks;
+    layout.data_blocks = total_blocks - layout.data_start;
+    layout.root_dir_block_index = layout.data_start;
+
+    return layout;
 }
 
 /*
@@ -55,72 +103,201 @@ the size of the storage
 reserved blocks
 and so on
 */
-void FileSystem::format()
+FileSystemStatus FileSystem::format(int total_inodes)
+{
+    auto layout_res = make_superblock(device.get_total_blocks_number(), total_inodes);
+    if (!layout_res.has_value())
+        return layout_res.error();
+
+    FileSystemStatus status;
+    {
+        Journal::Handle handle(journal);
+        status = journal.format();
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        superblock = layout_res.value();
+        build_groups();
+        status = format_metadata();
+    }
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    {
+        std::lock_guard<std::mutex> lock(readahead_mutex);
+        readahead_states.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(inode_cache_mutex);
+        inode_lru.clear();
+        inode_index.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(dentry_mutex);
+        dentry_lru.clear();
+        dentry_index.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(dir_cursor_mutex);
+        dir_cursors.clear();
+    }
+    return sync();
+}
+
+/*
+The bitmaps, the inode table and the data area are written straight to the device,
+they are far larger than the log. Only the superblock and the root directory go
+into the transaction, so the volume is formatted once it commits
+*/
+FileSystemStatus FileSystem::format_metadata()
 {
     is_formatted = true; // locate it in the end so device is locked until the initialization is over
 
+    FileSystemStatus status = init_inode_bitmap_on_format();
+    if (status == FileSystemStatus::OK)
+        status = init_inode_table_on_format();
+    if (status == FileSystemStatus::OK)
+        status = init_data_bitmap_on_format();
+    if (status == FileSystemStatus::OK)
+        status = init_data_blocks_on_format();
+    if (status != FileSystemStatus::OK)
+        return status;
+
     uint8_t buffer[BLOCK_SIZE];
     std::fill_n(buffer, BLOCK_SIZE, 0);
 
-    // init_superblock()
-    superblock.magic = FS_MAGIC;
-    superblock.version = FS_VERSION;
-    superblock.total_blocks = device.get_total_blocks_number();
-    superblock.root_dir_block_index = DATA_START_BLOCK;
-
     static_assert(sizeof(Superblock) <= BLOCK_SIZE);
     Superblock *sb_block = reinterpret_cast<Superblock *>(buffer);
     sb_block[0] = superblock;
 
-    device.write_block(SUPERBLOCK_INDEX, buffer);
+    status = device.write_block(SUPERBLOCK_INDEX, buffer);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    return init_root_directory();
+}
+
+/*
+this function commits the finished calls, then discards the blocks they freed
+a block is discarded only once its release is committed, so a crash cannot
+leave a zeroed block that the bitmap still gives to a file
+*/
+FileSystemStatus FileSystem::sync()
+{
+    std::vector<int> freed_blocks;
+    {
+        std::lock_guard<std::mutex> lock(discard_mutex);
+        freed_blocks.assign(pending_discards.begin(), pending_discards.end());
+    }
+
+    FileSystemStatus status = journal.commit();
+    if (status != FileSystemStatus::OK || freed_blocks.empty())
+        return status;
+
+    // blocks allocated again since were taken out of the pending set
+    std::lock_guard<std::mutex> lock(discard_mutex);
+    std::vector<int> discarded_blocks;
+    for (int block_index : freed_blocks)
+        if (pending_discards.erase(block_index) != 0)
+            discarded_blocks.push_back(block_index);
+
+    journal.discard_sorted_blocks(discarded_blocks); // a device without discard keeps them
+    return FileSystemStatus::OK;
+}
+
+/*
+this function discards all the free data blocks, merged into ranges
+the frees of earlier calls are committed first
+*/
+std::expected<int, FileSystemStatus> FileSystem::trim_free_blocks()
+{
+    if (!is_formatted)
+        return std::unexpected(FileSystemStatus::NotFormatted);
+
+    FileSystemStatus status = sync();
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
 
-    for (int i = 0; i < INODE_TABLE_SIZE; i++)
-        inode_table_blocks[i] = i;
+    // a block allocated meanwhile waits for the lock before it drops its pending discard and gets written
+    Journal::Handle handle(journal);
+    std::lock_guard<std::mutex> lock(discard_mutex);
+    std::vector<int> free_blocks;
+    for (const auto &group : groups)
+    {
+        for (int bit : group->blocks.free_bits_list())
+            free_blocks.push_back(superblock.data_start + group->first_block + bit);
+    }
 
-    init_inode_bitmap_on_format();
-    init_inode_table_on_format();
+    status = journal.discard_sorted_blocks(free_blocks);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
 
-    init_data_bitmap_on_format();
-    init_data_blocks_on_format();
+    pending_discards.clear();
+    return static_cast<int>(free_blocks.size());
+}
 
-    init_root_directory();
+SpaceStats FileSystem::get_space_stats() const
+{
+    SpaceStats stats{};
+    stats.total_blocks = superblock.data_blocks;
+    stats.free_blocks = free_data_blocks_count();
+    stats.total_inodes = superblock.total_inodes;
+    for (const auto &group : groups)
+        stats.free_inodes += group->inodes.free_count();
+    return stats;
 }
 
 /********** Public API ************/
 
 std::expected<Entry, FileSystemStatus> FileSystem::lookup(int directory_inode_id, const std::string_view entry_name)
 {
-    if (directory_inode_id < 0 || directory_inode_id >= TOTAL_INODE_NUMBER)
+    if (directory_inode_id < 0 || directory_inode_id >= superblock.total_inodes)
         return std::unexpected(FileSystemStatus::OutOfBounds);
 
-    auto att_res = get_attributes(directory_inode_id);
-    if (!att_res.has_value())
-        return std::unexpected(att_res.error());
+    // a cached name takes no pin and no device access
+    auto cached = find_dentry(directory_inode_id, entry_name);
+    if (cached.has_value())
+    {
+        if (cached.value().inode_id == -1)
+            return std::unexpected(FileSystemStatus::EntryNotFound);
+        return cached.value();
+    }
 
-    // get the root inode
+    // the name is cached before the lock goes, a change of the directory waits for it
+    InodeLockTable::Guard inode_lock(inode_locks, directory_inode_id, InodeLockMode::Shared);
+    Journal::ReadPin pin(journal);
     auto directory_inode_res = get_inode(directory_inode_id);
     if (!directory_inode_res.has_value())
         return std::unexpected(directory_inode_res.error());
 
     const Inode directory_inode = directory_inode_res.value();
+    std::expected<Entry, FileSystemStatus> entry_res = std::unexpected(FileSystemStatus::EntryNotFound);
+    if (directory_inode.layout == InodeLayout::HashTree)
+        entry_res = lookup_tree_entry(directory_inode, entry_name);
+    else
+    {
+        int absolute_block_number;
+        auto element_res = get_element<Entry>(
+            directory_inode.direct_blocks,
+            TOTAL_DIRECT_BLOCKS,
+            0,
+            absolute_block_number,
+            [entry_name](const Entry &entry)
+            { return entry.inode_id != -1 && entry.name == entry_name; });
+        if (element_res.has_value())
+            entry_res = element_res.value();
+    }
 
-    int absolute_block_number;
-    auto element_res = get_element<Entry>(
-        directory_inode.direct_blocks,
-        TOTAL_DIRECT_BLOCKS,
-        0,
-        absolute_block_number,
-        [entry_name](const Entry &entry)
-        { 
-            std::cout << "Test: " << entry.name << std::endl;
-            return entry.inode_id != -1 && entry.name == entry_name; });
-
-    std::cout << "Test: " << absolute_block_number << std::endl;
-
-    if (!element_res.has_value())
-        return std::unexpected(FileSystemStatus::EntryNotFound);
+    if (entry_res.has_value())
+        cache_dentry(directory_inode_id, entry_name, entry_res.value());
+    else if (entry_res.error() == FileSystemStatus::EntryNotFound)
+    {
+        Entry missing;
+        set_as_empty(missing);
+        cache_dentry(directory_inode_id, entry_name, missing);
+    }
 
-    return element_res.value();
+    return entry_res;
 }
 
 //************* File operations
@@ -133,36 +310,98 @@ data will store the continious memory start in offset till offset + data.size()
 */
 std::expected<size_t, FileSystemStatus> FileSystem::read_file(int inode_id, std::span<uint8_t> data, size_t offset)
 {
+    InodeLockTable::Guard inode_lock(inode_locks, inode_id, InodeLockMode::Shared);
+    Journal::ReadPin pin(journal);
     // get the inode
     auto inode_res = get_inode(inode_id);
     if (!inode_res.has_value())
         return std::unexpected(inode_res.error());
     Inode inode = inode_res.value();
 
+    if (offset > inode.size)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
     // calc how many bytes to read
-    int data_size = std::min(data.size(), inode.size - offset);
-    int copied_data = 0;
-    uint8_t buffer[BLOCK_SIZE];
+    size_t data_size = std::min<uint64_t>(data.size(), inode.size - offset);
+    if (data_size == 0)
+        return 0;
+
+    // the whole range is mapped up front into runs of contiguous blocks, every indirect block or extent is looked up once
+    int range_first_block = offset / BLOCK_SIZE;
+    int range_last_block = (offset + data_size - 1) / BLOCK_SIZE;
+    std::vector<BlockRun> runs;
+    FileSystemStatus status = map_blocks(inode_id, inode, range_first_block, range_last_block - range_first_block + 1, false, runs);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
 
-    while (copied_data < data_size)
+    std::vector<int> block_indices;
+    uint8_t edge_buffer[BLOCK_SIZE];
+    for (const BlockRun &run : runs)
     {
-        int current_offset = offset + copied_data;
-        int target_block = current_offset / BLOCK_SIZE;
-        auto source_block_res = get_block_index(inode, target_block);
-        if (!source_block_res.has_value())
-            return std::unexpected(source_block_res.error());
+        // the bytes of the read that the run holds
+        uint64_t run_start = std::max<uint64_t>(offset, static_cast<uint64_t>(run.file_block) * BLOCK_SIZE);
+        uint64_t run_end = std::min<uint64_t>(offset + data_size, static_cast<uint64_t>(run.file_block + run.length) * BLOCK_SIZE);
+        auto device_block_of = [&run](uint64_t position)
+        { return run.device_block + static_cast<int>(position / BLOCK_SIZE - run.file_block); };
+
+        if (run.device_block == -1) // a block never written reads as zeros
+        {
+            std::fill(data.data() + (run_start - offset), data.data() + (run_end - offset), 0);
+            continue;
+        }
+
+        // devices that lend their blocks are copied from in place
+        if (device.view_block(run.device_block).has_value())
+        {
+            for (uint64_t position = run_start; position < run_end;)
+            {
+                int block_start = position % BLOCK_SIZE;
+                int chunk_size = std::min<uint64_t>(run_end - position, BLOCK_SIZE - block_start);
+                auto view_res = device.view_block(device_block_of(position));
+                if (!view_res.has_value())
+                    return std::unexpected(view_res.error());
+
+                std::memcpy(data.data() + (position - offset), view_res.value().data() + block_start, chunk_size);
+                position += chunk_size;
+            }
+            continue;
+        }
+
+        // otherwise the whole blocks of the run are read straight into data in one request, a partly read edge block through edge_buffer
+        uint64_t whole_start = (run_start + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        uint64_t whole_end = std::max(whole_start, run_end / BLOCK_SIZE * BLOCK_SIZE);
+        uint64_t head_end = std::min(whole_start, run_end);
+        uint64_t tail_start = std::max(whole_end, head_end);
 
-        int source_block_index = source_block_res.value();
-        int starting_byte = current_offset % BLOCK_SIZE;
-        int bytes_to_copy = std::min(data_size - copied_data, BLOCK_SIZE - starting_byte);
+        if (run_start < head_end)
+        {
+            status = device.read_block(device_block_of(run_start), edge_buffer);
+            if (status != FileSystemStatus::OK)
+                return std::unexpected(status);
+            std::memcpy(data.data() + (run_start - offset), edge_buffer + run_start % BLOCK_SIZE, head_end - run_start);
+        }
 
-        get_block_ptr<uint8_t>(source_block_index, buffer);
-        std::memcpy(data.data() + copied_data, buffer + starting_byte, bytes_to_copy);
+        if (whole_start < whole_end)
+        {
+            block_indices.resize((whole_end - whole_start) / BLOCK_SIZE);
+            std::iota(block_indices.begin(), block_indices.end(), device_block_of(whole_start));
+            status = device.read_blocks(block_indices, data.data() + (whole_start - offset));
+            if (status != FileSystemStatus::OK)
+                return std::unexpected(status);
+        }
 
-        copied_data += bytes_to_copy;
+        if (tail_start < run_end)
+        {
+            status = device.read_block(device_block_of(tail_start), edge_buffer);
+            if (status != FileSystemStatus::OK)
+                return std::unexpected(status);
+            std::memcpy(data.data() + (tail_start - offset), edge_buffer, run_end - tail_start);
+        }
     }
 
-    return copied_data;
+    readahead(inode_id, inode, range_first_block, range_last_block);
+
+    return data_size;
 }
 
 /*
@@ -170,61 +409,127 @@ This function writes to an entry data from a span container
 param inode_id - the inode index we are writing to
 param data - the data we are adding to the file
 param offset - the position of the curser where data is written
-The writing starts from offset byte till offset + the container size OR tha max size of a file (48KB)
+The writing starts from offset byte till offset + the container size, a file holds up to MAX_FILE_BLOCKS blocks
 */
 std::expected<size_t, FileSystemStatus> FileSystem::write_file(int inode_id, std::span<const uint8_t> data, size_t offset)
 {
+    InodeLockTable::Guard inode_lock(inode_locks, inode_id, InodeLockMode::Exclusive);
+    Journal::Handle handle(journal);
     // get the inode
     auto inode_res = get_inode(inode_id);
     if (!inode_res.has_value())
         return std::unexpected(inode_res.error());
 
     Inode inode = inode_res.value();
-    int data_size = data.size();
-    int written_data_size = 0;
+    size_t data_size = data.size();
+    size_t written_data_size = 0;
+    if (data_size > 0 && (offset + data_size - 1) / BLOCK_SIZE >= static_cast<uint64_t>(MAX_FILE_BLOCKS))
+        return std::unexpected(FileSystemStatus::OutOfBounds);
 
-    uint8_t buffer[BLOCK_SIZE];
+    std::vector<BlockRun> runs;
+    std::vector<int> block_indices;
+    uint8_t edge_buffer[BLOCK_SIZE];
+
+    // the blocks past the end of the file are holes, they are reserved at once right after its last block, or in its group
+    BlockReservation reservation(*this);
+    if (data_size > 0)
+    {
+        int64_t file_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int64_t first_new_block = std::max<int64_t>(offset / BLOCK_SIZE, file_blocks);
+        int64_t last_new_block = (offset + data_size - 1) / BLOCK_SIZE;
+        if (first_new_block <= last_new_block)
+        {
+            int goal = -1;
+            if (file_blocks > 0 && map_blocks(inode_id, inode, file_blocks - 1, 1, false, runs) == FileSystemStatus::OK &&
+                !runs.empty() && runs[0].device_block != -1)
+                goal = runs[0].device_block + 1;
+            reserve_data_blocks(reservation, static_cast<int>(last_new_block - first_new_block + 1), goal, inode_group_index(inode_id));
+        }
+    }
+
+    // the range is mapped in batches of up to MAX_BATCH_BLOCKS
     while (written_data_size < data_size) // while we still have data to write
     {
-        int target_block = (offset + written_data_size) / BLOCK_SIZE;
-        auto target_block_res = get_or_allocate_block_index(inode_id, inode, target_block); // getting the block to write to
-        if (!target_block_res.has_value())
-            return std::unexpected(target_block_res.error());
+        // every block allocated extends the handle again, a batch may take them from many groups
+        journal.extend_handle();
+
+        uint64_t batch_offset = offset + written_data_size;
+        int first_block = batch_offset / BLOCK_SIZE;
+        int last_block = (offset + data_size - 1) / BLOCK_SIZE;
+        int blocks_count = std::min(last_block - first_block + 1, MAX_BATCH_BLOCKS);
+        uint64_t batch_end = std::min<uint64_t>(offset + data_size, static_cast<uint64_t>(first_block + blocks_count) * BLOCK_SIZE);
 
-        int block_index = target_block_res.value();
-        int starting_byte = (offset + written_data_size) % BLOCK_SIZE;
-        int required_bytes = std::min(data_size - written_data_size, BLOCK_SIZE - starting_byte);
+        // getting the blocks to write to, the missing ones are allocated
+        FileSystemStatus status = map_blocks(inode_id, inode, first_block, blocks_count, true, runs, &reservation);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
 
-        get_block_ptr<uint8_t>(block_index, buffer);
-        std::memcpy(buffer + starting_byte, data.data() + written_data_size, required_bytes);
-        device.write_block(block_index, buffer);
-        written_data_size += required_bytes;
+        for (const BlockRun &run : runs)
+        {
+            // the bytes of the batch that go to the run
+            uint64_t run_start = std::max<uint64_t>(batch_offset, static_cast<uint64_t>(run.file_block) * BLOCK_SIZE);
+            uint64_t run_end = std::min<uint64_t>(batch_end, static_cast<uint64_t>(run.file_block + run.length) * BLOCK_SIZE);
+            auto device_block_of = [&run](uint64_t position)
+            { return run.device_block + static_cast<int>(position / BLOCK_SIZE - run.file_block); };
+
+            // whole blocks are written straight from data in one request, a partly written edge block keeps its old bytes
+            uint64_t whole_start = (run_start + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            uint64_t whole_end = std::max(whole_start, run_end / BLOCK_SIZE * BLOCK_SIZE);
+            uint64_t head_end = std::min(whole_start, run_end);
+            uint64_t tail_start = std::max(whole_end, head_end);
+
+            for (auto [edge_start, edge_end] : {std::pair{run_start, head_end}, std::pair{tail_start, run_end}})
+            {
+                if (edge_start >= edge_end)
+                    continue;
+
+                int edge_block = device_block_of(edge_start);
+                status = device.read_block(edge_block, edge_buffer);
+                if (status != FileSystemStatus::OK)
+                    return std::unexpected(status);
+
+                std::memcpy(edge_buffer + edge_start % BLOCK_SIZE, data.data() + (edge_start - offset), edge_end - edge_start);
+                status = journal.write_data_blocks(std::span<const int>(&edge_block, 1), edge_buffer); // ordered, not logged
+                if (status != FileSystemStatus::OK)
+                    return std::unexpected(status);
+            }
+
+            if (whole_start < whole_end)
+            {
+                block_indices.resize((whole_end - whole_start) / BLOCK_SIZE);
+                std::iota(block_indices.begin(), block_indices.end(), device_block_of(whole_start));
+                status = journal.write_data_blocks(block_indices, data.data() + (whole_start - offset));
+                if (status != FileSystemStatus::OK)
+                    return std::unexpected(status);
+            }
+        }
+
+        written_data_size = batch_end - offset;
     }
 
-    inode.size = std::max(inode.size, static_cast<int>(offset) + data_size);
+    inode.size = std::max<uint64_t>(inode.size, offset + data_size);
     write_inode(inode_id, inode);
     return written_data_size;
 }
 
-FileSystemStatus FileSystem::delete_file(int dir_inode_id, int file_inode_id)
+/* the inode goes first, a crash while its blocks are freed leaks them instead of leaving it pointing at free blocks */
+FileSystemStatus FileSystem::delete_file(int dir_inode_id, int file_inode_id, std::string_view name)
 {
     auto file_inode_res = get_inode(file_inode_id);
     if (!file_inode_res.has_value())
         return FileSystemStatus::InodeNotFound;
     Inode file_inode = file_inode_res.value();
 
-    FileSystemStatus status = remove_entry(dir_inode_id, file_inode_id);
+    FileSystemStatus status = remove_entry(dir_inode_id, file_inode_id, name);
     if (status != FileSystemStatus::OK)
         return status;
 
     if (file_inode.link_count == 1)
     {
-        for (int data_block_index : file_inode.direct_blocks)
-            if (data_block_index != -1)
-                free_data_block(data_block_index);
-        set_as_empty(file_inode);
         free_inode(file_inode_id);
-        return FileSystemStatus::OK;
+        forget_readahead(file_inode_id);
+
+        return free_file_blocks(file_inode);
     }
 
     file_inode.link_count--;
@@ -240,6 +545,8 @@ this function creates a new file in path
 */
 std::expected<int, FileSystemStatus> FileSystem::create_file(int parent_inode_id, std::string_view file_name)
 {
+    InodeLockTable::Guard inode_lock(inode_locks, parent_inode_id, InodeLockMode::Exclusive);
+    Journal::Handle handle(journal);
     if (file_name.length() > ENTRY_NAME_LENGTH)
     {
         std::cout << "Error. The file name is too long." << std::endl;
@@ -258,8 +565,11 @@ std::expected<int, FileSystemStatus> FileSystem::create_file(int parent_inode_id
 
 //************* Directory operations
 
+/* a page of a linear directory is one of its blocks, of a hash tree one of its leaves */
 std::expected<std::vector<Entry>, FileSystemStatus> FileSystem::list_directory_content(int inode_id, uint32_t block)
 {
+    InodeLockTable::Guard inode_lock(inode_locks, inode_id, InodeLockMode::Shared);
+    Journal::ReadPin pin(journal);
     std::vector<Entry> v_entries;
 
     auto inode_res = get_inode(inode_id);
@@ -267,8 +577,11 @@ std::expected<std::vector<Entry>, FileSystemStatus> FileSystem::list_directory_c
         return std::unexpected(inode_res.error());
     Inode inode = inode_res.value();
 
+    if (inode.layout == InodeLayout::HashTree)
+        return list_tree_page(inode_id, inode, block);
+
     if (block >= TOTAL_DIRECT_BLOCKS)
-        return v_entries;
+        return std::unexpected(FileSystemStatus::OutOfBounds);
 
     if (inode.direct_blocks[block] == -1)
         return v_entries;
@@ -281,7 +594,7 @@ std::expected<std::vector<Entry>, FileSystemStatus> FileSystem::list_directory_c
     return v_entries;
 }
 
-FileSystemStatus FileSystem::delete_directory(int parent_inode_id, int target_inode_id)
+FileSystemStatus FileSystem::delete_directory(int parent_inode_id, int target_inode_id, std::string_view name)
 {
     // get the target inode
     auto directory_inode_res = get_inode(target_inode_id);
@@ -293,14 +606,27 @@ FileSystemStatus FileSystem::delete_directory(int parent_inode_id, int target_in
     if (target_dir_inode.size > 2 * sizeof(Entry))
         return FileSystemStatus::InodeNotEmpty;
 
-    FileSystemStatus status = remove_entry(parent_inode_id, target_inode_id);
+    FileSystemStatus status = remove_entry(parent_inode_id, target_inode_id, name);
     if (status != FileSystemStatus::OK)
         return status;
+    forget_dentries(target_inode_id);
+
+    // the tree goes after the inode, like the blocks of a file
+    if (target_dir_inode.layout == InodeLayout::HashTree)
+    {
+        free_inode(target_inode_id);
+        {
+            std::lock_guard<std::mutex> lock(dir_cursor_mutex);
+            dir_cursors.erase(target_inode_id);
+        }
+
+        return free_dir_tree(target_dir_inode.index_root);
+    }
 
     // free the data blocks
     for (int block_number : target_dir_inode.direct_blocks)
         if (block_number != -1)
-            free_data_block(block_number);
+            free_data_block(block_number - superblock.data_start);
 
     // commit
     free_inode(target_inode_id);
@@ -310,23 +636,20 @@ FileSystemStatus FileSystem::delete_directory(int parent_inode_id, int target_in
 
 std::expected<int, FileSystemStatus> FileSystem::create_directory(int parent_inode_id, std::string_view directroy_name)
 {
+    InodeLockTable::Guard inode_lock(inode_locks, parent_inode_id, InodeLockMode::Exclusive);
+    Journal::Handle handle(journal);
     // get the cwd directory
     // auto inode_id_res = get_inode(parent_inode_id);
     // if (!inode_id_res.has_value())
     //     return std::unexpected(inode_id_res.error());
     // int cwd_inode_id = inode_id_res.value().;
 
-    // create a new inode for the new directory
+    // create a new inode for the new directory, it holds . and .. before its entry is added
     auto new_inode_res = create_new_inode(EntryType::Directory, parent_inode_id, directroy_name);
     if (!new_inode_res.has_value())
         return std::unexpected(new_inode_res.error());
-    int new_inode_id = new_inode_res.value();
-
-    FileSystemStatus status = init_directory_entries(new_inode_id, parent_inode_id);
-    if (status != FileSystemStatus::OK)
-        return std::unexpected(status);
 
-    return new_inode_id;
+    return new_inode_res.value();
 }
 
 /********************************** PRIVATE APIs **********************************/
@@ -336,7 +659,8 @@ std::expected<int, FileSystemStatus> FileSystem::create_directory(int parent_ino
 FileSystemStatus FileSystem::init_root_directory()
 {
     // turn on the bit 0
-    FileSystemStatus status = turn_on_bit(0, INODE_BITMAP_INDEX, TOTAL_INODE_NUMBER);
+    AllocationGroup &group = inode_group(ROOT_INODE_ID);
+    FileSystemStatus status = turn_on_bit(group.inodes, group.first_inode, superblock.inode_bitmap_start, ROOT_INODE_ID);
     if (status != FileSystemStatus::OK)
         return status;
 
@@ -371,71 +695,118 @@ FileSystemStatus FileSystem::init_directory_entries(int inode_id, int parent_ino
 
 FileSystemStatus FileSystem::init_inode_bitmap_on_format()
 {
-    uint8_t buffer[BLOCK_SIZE];
-    std::fill(buffer, buffer + BLOCK_SIZE, 0xFF);
-
-    int bytes_in_bitmap = TOTAL_INODE_NUMBER / BITS_IN_BYTE;
-    if (bytes_in_bitmap > 0)
-        std::fill(buffer, buffer + bytes_in_bitmap, 0x00);
+    for (auto &group : groups)
+        group->inodes.reset(std::clamp(superblock.total_inodes - group->first_inode, 0, inodes_per_group));
+    return init_bitmap_on_format(superblock.inode_bitmap_start, superblock.inode_bitmap_blocks, superblock.total_inodes);
+}
 
-    int remaining_bits = TOTAL_INODE_NUMBER % BITS_IN_BYTE;
-    if (remaining_bits > 0)
-    {
-        uint8_t mask = static_cast<uint8_t>(0xFF << remaining_bits);
-        buffer[bytes_in_bitmap] = mask;
-    }
+/* a zeroed inode is free (EntryType::Uninitialized) */
+FileSystemStatus FileSystem::init_inode_table_on_format()
+{
+    return zero_blocks_on_format(superblock.inode_table_start, superblock.inode_table_blocks);
+}
 
-    device.write_block(INODE_BITMAP_INDEX, buffer);
+FileSystemStatus FileSystem::init_data_bitmap_on_format()
+{
+    for (auto &group : groups)
+        group->blocks.reset(std::clamp(superblock.data_blocks - group->first_block, 0, BLOCKS_PER_GROUP));
+    return init_bitmap_on_format(superblock.data_bitmap_start, superblock.data_bitmap_blocks, superblock.data_blocks);
+}
 
-    return FileSystemStatus::OK;
+FileSystemStatus FileSystem::init_data_blocks_on_format()
+{
+    return zero_blocks_on_format(superblock.data_start, superblock.data_blocks);
 }
 
-FileSystemStatus FileSystem::init_inode_table_on_format() const
+/*
+This function writes an empty bitmap of total_bits bits over bitmap_blocks blocks
+The bits past total_bits are marked as used so they are never allocated
+*/
+FileSystemStatus FileSystem::init_bitmap_on_format(int start_block, int bitmap_blocks, int total_bits)
 {
-    uint8_t buffer[BLOCK_SIZE];
-    int ablsolute_block_number;
+    std::vector<uint8_t> buffer;
+    std::vector<int> block_indices;
 
-    for (int relative_block_number : get_inode_blocks_table())
+    for (int first = 0; first < bitmap_blocks; first += MAX_BATCH_BLOCKS)
     {
-        std::fill(buffer, buffer + BLOCK_SIZE, 0x00);
+        int batch_blocks = std::min(MAX_BATCH_BLOCKS, bitmap_blocks - first);
+        buffer.assign(static_cast<size_t>(batch_blocks) * BLOCK_SIZE, 0xFF);
+        block_indices.clear();
 
-        Inode *inodes = reinterpret_cast<Inode *>(buffer);
-        for (int i = 0; i < INODES_PER_BLOCK; i++)
-            for (int &block_id : inodes[i].direct_blocks)
-                block_id = -1;
+        for (int i = 0; i < batch_blocks; i++)
+        {
+            block_indices.push_back(start_block + first + i);
 
-        ablsolute_block_number = relative_block_number + INODE_TABLE_START_INDEX;
-        device.write_block(ablsolute_block_number, buffer);
-    }
+            int first_bit = (first + i) * BITS_PER_BLOCK;
+            int free_bits = std::clamp(total_bits - first_bit, 0, BITS_PER_BLOCK);
+            uint8_t *bytes = buffer.data() + static_cast<size_t>(i) * BLOCK_SIZE;
 
+            std::fill_n(bytes, free_bits / BITS_IN_BYTE, 0x00); // mark as free
+            if (free_bits % BITS_IN_BYTE > 0)
+                bytes[free_bits / BITS_IN_BYTE] = static_cast<uint8_t>(0xFF << (free_bits % BITS_IN_BYTE));
+        }
+
+        FileSystemStatus status = journal.write_data_blocks(block_indices, buffer.data());
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
     return FileSystemStatus::OK;
 }
 
-FileSystemStatus FileSystem::init_data_bitmap_on_format()
+/* every group loads its slice of the two bitmaps, a group starts on a word of both */
+FileSystemStatus FileSystem::load_bitmaps()
 {
-    uint8_t buffer[BLOCK_SIZE];
-    // mark anything as used to prevet access blocks that not actually exists
-    std::fill_n(buffer, BLOCK_SIZE, 0xFF);
-    int required_bytes = DATA_TABLE_SIZE / BITS_IN_BYTE; // full bytes to be used in the bitmap
-    int remaining_bits = DATA_TABLE_SIZE % BITS_IN_BYTE; // the tail of the bitmap
-
-    std::fill(buffer, buffer + required_bytes, 0); // mark as free
-
-    if (remaining_bits > 0)
-        buffer[required_bytes] = static_cast<uint8_t>(0xFF << remaining_bits);
-
-    // commit changes
-    device.write_block(DATA_BITMAP_INDEX, buffer);
+    auto inode_bytes_res = read_bitmap(superblock.inode_bitmap_start, superblock.inode_bitmap_blocks);
+    if (!inode_bytes_res.has_value())
+        return inode_bytes_res.error();
+    auto data_bytes_res = read_bitmap(superblock.data_bitmap_start, superblock.data_bitmap_blocks);
+    if (!data_bytes_res.has_value())
+        return data_bytes_res.error();
+
+    std::span<const uint8_t> inode_bytes = inode_bytes_res.value();
+    std::span<const uint8_t> data_bytes = data_bytes_res.value();
+    for (auto &group : groups)
+    {
+        int inodes = std::clamp(superblock.total_inodes - group->first_inode, 0, inodes_per_group);
+        int blocks = std::clamp(superblock.data_blocks - group->first_block, 0, BLOCKS_PER_GROUP);
+        group->inodes.load(inode_bytes.subspan(group->first_inode / BITS_IN_BYTE), inodes);
+        group->blocks.load(data_bytes.subspan(group->first_block / BITS_IN_BYTE), blocks);
+    }
     return FileSystemStatus::OK;
 }
 
-void FileSystem::init_data_blocks_on_format()
+std::expected<std::vector<uint8_t>, FileSystemStatus> FileSystem::read_bitmap(int start_block, int bitmap_blocks)
 {
-    uint8_t buffer[BLOCK_SIZE];
-    std::memset(buffer, 0, BLOCK_SIZE);
+    std::vector<uint8_t> bytes(static_cast<size_t>(bitmap_blocks) * BLOCK_SIZE);
+    for (int i = 0; i < bitmap_blocks; i++)
+    {
+        FileSystemStatus status = device.read_block(start_block + i, bytes.data() + static_cast<size_t>(i) * BLOCK_SIZE);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+    }
+    return bytes;
+}
+
+/* discards the range when the device can, otherwise writes zeros over it in batches */
+FileSystemStatus FileSystem::zero_blocks_on_format(int first_block, int blocks_count)
+{
+    if (journal.discard_blocks(first_block, blocks_count) == FileSystemStatus::OK)
+        return FileSystemStatus::OK;
+
+    std::vector<uint8_t> buffer(MAX_BATCH_BLOCKS * BLOCK_SIZE, 0);
+    std::vector<int> block_indices;
+
+    for (int i = first_block; i < first_block + blocks_count; i += MAX_BATCH_BLOCKS)
+    {
+        block_indices.clear();
+        for (int j = i; j < std::min(i + MAX_BATCH_BLOCKS, first_block + blocks_count); j++)
+            block_indices.push_back(j);
 
-    for (int i = DATA_START_BLOCK; i < TOTAL_BLOCKS_NUMBER; i++)
-        device.write_block(i, buffer);
+        FileSystemStatus status = journal.write_data_blocks(block_indices, buffer.data());
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+    return FileSystemStatus::OK;
 }
 
 /********** Inode Management ************/
@@ -447,35 +818,53 @@ Inode FileSystem::create_inode(EntryType type)
     inode.type = type;
     inode.link_count = type == EntryType::File ? 1 : 2;
     inode.size = 0;
+    if (type == EntryType::File && file_layout == InodeLayout::Extents)
+        set_as_extents(inode);
 
     return inode;
 }
 
 std::expected<Inode, FileSystemStatus> FileSystem::get_inode(int inode_id)
 {
-    if (inode_id < 0 || inode_id >= TOTAL_INODE_NUMBER)
+    if (inode_id < 0 || inode_id >= superblock.total_inodes)
         return std::unexpected(FileSystemStatus::OutOfBounds);
 
+    auto cached = find_cached_inode(inode_id);
+    if (cached.has_value())
+        return cached.value();
+
     uint8_t buffer[BLOCK_SIZE];
     int block_number = inode_id / INODES_PER_BLOCK;
-    block_number += INODE_TABLE_START_INDEX;
+    block_number += superblock.inode_table_start;
     int inode_index = inode_id % INODES_PER_BLOCK;
 
-    // auto *inodes = get_block_ptr();
     auto *inodes = get_block_ptr<Inode>(block_number, buffer);
 
     if (inodes[inode_index].type == EntryType::Uninitialized)
         return std::unexpected(FileSystemStatus::InodeNotFound);
 
+    cache_inode(inode_id, inodes[inode_index]);
     return inodes[inode_index];
 }
 
 std::expected<InodeAttributes, FileSystemStatus> FileSystem::get_attributes(int inode_id)
 {
-    auto inode_res = get_inode(inode_id);
-    if (!inode_res.has_value())
-        return std::unexpected(inode_res.error());
-    Inode inode = inode_res.value();
+    // a cached inode with a known block count takes no pin and no device access
+    InodeLockTable::Guard inode_lock(inode_locks, inode_id, InodeLockMode::Shared);
+    std::optional<Journal::ReadPin> pin;
+    std::optional<CachedInode> cached = find_cached_attributes(inode_id);
+    if (!cached.has_value() || !cached->blocks_used.has_value())
+        pin.emplace(journal);
+
+    if (!cached.has_value())
+    {
+        auto inode_res = get_inode(inode_id);
+        if (!inode_res.has_value())
+            return std::unexpected(inode_res.error());
+        cached = CachedInode{inode_id, inode_res.value(), std::nullopt};
+    }
+    const Inode &inode = cached->inode;
+    std::optional<uint64_t> blocks_used = cached->blocks_used;
 
     InodeAttributes inode_attributes;
 
@@ -488,31 +877,56 @@ std::expected<InodeAttributes, FileSystemStatus> FileSystem::get_attributes(int
 
     inode_attributes.link_count = inode.link_count;
 
-    inode_attributes.blocks_used = 0;
-    for (int i = 0; i < TOTAL_DIRECT_BLOCKS; i++)
-        if (inode.direct_blocks[i] != -1)
-            inode_attributes.blocks_used++;
+    if (!blocks_used.has_value())
+    {
+        auto count_res = count_blocks(inode);
+        if (!count_res.has_value())
+            return std::unexpected(count_res.error());
+        blocks_used = count_res.value();
+        cache_blocks_used(inode_id, blocks_used);
+    }
+    inode_attributes.blocks_used = blocks_used.value();
 
     return inode_attributes;
 }
 
-// This function returns the index of the next free Inode
-std::expected<int, FileSystemStatus> FileSystem::allocate_inode()
+/*
+This function returns the index of the next free Inode
+A file takes an inode in the group of its parent, a directory in the group pick_directory_group() finds,
+the groups after it are tried in turn
+*/
+std::expected<int, FileSystemStatus> FileSystem::allocate_inode(int parent_inode_id, EntryType type)
 {
-    // search for free inode'
-    auto free_inode_res = find_free_bit(INODE_BITMAP_INDEX, TOTAL_INODE_NUMBER);
-    if (!free_inode_res.has_value())
-        return std::unexpected(FileSystemStatus::FullInode);
+    int groups_count = static_cast<int>(groups.size());
+    int first_group = type == EntryType::Directory ? pick_directory_group() : inode_group_index(parent_inode_id);
+
+    for (int i = 0; i < groups_count; i++)
+    {
+        AllocationGroup &group = *groups[(first_group + i) % groups_count];
+
+        // search for free inode
+        auto free_inode_res = group.inodes.allocate();
+        if (!free_inode_res.has_value())
+            continue;
 
-    int free_bit = free_inode_res.value();
-    turn_on_bit(free_bit, INODE_BITMAP_INDEX, TOTAL_INODE_NUMBER);
+        int free_bit = free_inode_res.value();
+        int inode_id = group.first_inode + free_bit;
+        FileSystemStatus status = write_bitmap_word(group.inodes, group.first_inode, superblock.inode_bitmap_start, inode_id);
+        if (status != FileSystemStatus::OK)
+        {
+            group.inodes.clear(free_bit);
+            return std::unexpected(status);
+        }
+
+        return inode_id;
+    }
 
-    return free_bit;
+    return std::unexpected(FileSystemStatus::FullInode);
 }
 
 std::expected<int, FileSystemStatus> FileSystem::create_new_inode(EntryType type, int parent_inode_id, const std::string_view name)
 {
-    auto inode_res = allocate_inode();
+    auto inode_res = allocate_inode(parent_inode_id, type);
     if (!inode_res.has_value())
         return std::unexpected(inode_res.error());
     int new_inode_id = inode_res.value();
@@ -522,6 +936,14 @@ std::expected<int, FileSystemStatus> FileSystem::create_new_inode(EntryType type
     if (status != FileSystemStatus::OK)
         return std::unexpected(status);
 
+    // the new inode is complete before the parent links it, no other call can reach it until then
+    if (type == EntryType::Directory)
+    {
+        status = init_directory_entries(new_inode_id, parent_inode_id);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+    }
+
     Entry new_entry = create_entry(type, new_inode_id, name);
     status = add_entry(parent_inode_id, new_entry);
     if (status != FileSystemStatus::OK)
@@ -535,132 +957,1169 @@ FileSystemStatus FileSystem::write_inode(int inode_id, const Inode &inode)
     if (!is_formatted)
         return FileSystemStatus::NotFormatted;
 
-    if (inode_id < 0 || inode_id >= TOTAL_INODE_NUMBER)
+    if (inode_id < 0 || inode_id >= superblock.total_inodes)
         return FileSystemStatus::OutOfBounds;
 
     int inode_size = sizeof(Inode);
-    uint8_t buffer[BLOCK_SIZE];
 
-    int block_index = (inode_id / INODES_PER_BLOCK) + INODE_TABLE_START_INDEX;
+    int block_index = (inode_id / INODES_PER_BLOCK) + superblock.inode_table_start;
     int block_offset = (inode_id % INODES_PER_BLOCK) * inode_size;
 
-    device.read_block(block_index, buffer);
-    std::memcpy(buffer + block_offset, &inode, inode_size);
+    FileSystemStatus status = update_block<uint8_t>(block_index, [&](uint8_t *bytes)
+                                                    { std::memcpy(bytes + block_offset, &inode, inode_size); });
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    if (inode.type == EntryType::Uninitialized)
+        forget_cached_inode(inode_id);
+    else
+        cache_inode(inode_id, inode);
 
-    device.write_block(block_index, buffer);
     return FileSystemStatus::OK;
 }
 
 FileSystemStatus FileSystem::free_inode(int inode_id)
 {
-    if (inode_id < 0 || inode_id >= TOTAL_INODE_NUMBER)
+    if (inode_id < 0 || inode_id >= superblock.total_inodes)
         return FileSystemStatus::OutOfBounds;
 
-    FileSystemStatus status = turn_off_bit(inode_id, INODE_BITMAP_INDEX, TOTAL_INODE_NUMBER);
-    if (status != FileSystemStatus::OK)
-        return FileSystemStatus::UnknownError;
-
-    int block_index = inode_id / INODES_PER_BLOCK + INODE_TABLE_START_INDEX;
+    // the id is cleared before its bit, another call may take it as soon as the bit is off
+    forget_cached_inode(inode_id);
+    int block_index = inode_id / INODES_PER_BLOCK + superblock.inode_table_start;
     int inode_index = inode_id % INODES_PER_BLOCK;
 
-    uint8_t buffer[BLOCK_SIZE];
-    auto *inodes = get_block_ptr<Inode>(block_index, buffer);
-    auto &target_inode = inodes[inode_index];
-
-    uint8_t *begin = reinterpret_cast<uint8_t *>(&target_inode); // std::fill treats a single-byte block
-    uint8_t *end = begin + sizeof(Inode);
-    std::fill(begin, end, 0x00);
-    device.write_block(block_index, buffer);
+    FileSystemStatus status = update_block<Inode>(block_index, [inode_index](Inode *inodes)
+                                                  {
+                                                      auto &target_inode = inodes[inode_index];
+                                                      uint8_t *begin = reinterpret_cast<uint8_t *>(&target_inode); // std::fill treats a single-byte block
+                                                      uint8_t *end = begin + sizeof(Inode);
+                                                      std::fill(begin, end, 0x00); });
+    if (status != FileSystemStatus::OK)
+        return status;
 
+    AllocationGroup &group = inode_group(inode_id);
+    status = turn_off_bit(group.inodes, group.first_inode, superblock.inode_bitmap_start, inode_id);
+    if (status != FileSystemStatus::OK)
+        return FileSystemStatus::UnknownError;
     return FileSystemStatus::OK;
 }
 
 /********** Data Block Management ************/
 
 /*
-This method allocate the first free data block in the data table and mark the block as used
+This method allocates the next free data block after the last allocation and marks the block as used
 */
-std::expected<int, FileSystemStatus> FileSystem::allocate_data_block()
+std::expected<int, FileSystemStatus> FileSystem::allocate_data_block(int group_index)
 {
-    // search a free bit in the bitmap
-    auto free_bit_res = find_free_bit(DATA_BITMAP_INDEX, DATA_TABLE_SIZE);
-    if (!free_bit_res.has_value())
+    // search a free bit in the bitmaps, from group_index or the group of the last allocation on
+    std::vector<DataBlockRun> runs;
+    take_data_runs(1, -1, group_index, false, runs);
+    if (runs.empty())
         return std::unexpected(FileSystemStatus::FullDisk);
 
     // set the block as used
-    int free_bit = free_bit_res.value();
-    turn_on_bit(free_bit, DATA_BITMAP_INDEX, DATA_TABLE_SIZE);
+    int block_index = runs[0].first_block;
+    FileSystemStatus status = write_data_run_words(runs[0]);
+    if (status != FileSystemStatus::OK)
+    {
+        AllocationGroup &group = data_group(block_index - superblock.data_start);
+        group.blocks.clear(block_index - superblock.data_start - group.first_block);
+        return std::unexpected(status);
+    }
+
+    // a freed block that is used again must not be discarded
+    std::lock_guard<std::mutex> lock(discard_mutex);
+    pending_discards.erase(block_index);
 
-    return free_bit + DATA_START_BLOCK;
+    return block_index;
 }
 
-std::expected<int, FileSystemStatus> FileSystem::get_block_index(Inode &inode, int target_block)
+/*
+This method allocates count data blocks in runs of contiguous blocks, the first one as close to goal as it can
+Every next run is looked for right after the one before it
+*/
+std::expected<std::vector<DataBlockRun>, FileSystemStatus> FileSystem::allocate_data_blocks(int count, int goal)
 {
-    if (target_block < 0 || target_block >= 12) // inode has at most 12 blocks
+    if (count < 0)
         return std::unexpected(FileSystemStatus::OutOfBounds);
+    if (free_data_blocks_count() < count)
+        return std::unexpected(FileSystemStatus::FullDisk);
 
-    if (inode.direct_blocks[target_block] == -1) // the last block is not full
-        return std::unexpected(FileSystemStatus::OutOfBounds);
+    std::vector<DataBlockRun> runs;
+    take_data_runs(count, goal, -1, false, runs);
+
+    int allocated = 0;
+    for (const DataBlockRun &run : runs)
+        allocated += run.length;
+    FileSystemStatus status = allocated == count ? FileSystemStatus::OK : FileSystemStatus::FullDisk;
+
+    for (size_t i = 0; i < runs.size() && status == FileSystemStatus::OK; i++)
+        status = write_data_run_words(runs[i]);
+
+    if (status != FileSystemStatus::OK)
+    {
+        for (const DataBlockRun &run : runs)
+        {
+            AllocationGroup &group = data_group(run.first_block - superblock.data_start);
+            for (int block_index = run.first_block; block_index < run.first_block + run.length; block_index++)
+                group.blocks.clear(block_index - superblock.data_start - group.first_block);
+            write_data_run_words(run);
+        }
+        return std::unexpected(status);
+    }
 
-    return inode.direct_blocks[target_block];
+    // blocks freed and used again must not be discarded
+    std::lock_guard<std::mutex> lock(discard_mutex);
+    for (const DataBlockRun &run : runs)
+        pending_discards.erase(pending_discards.lower_bound(run.first_block), pending_discards.lower_bound(run.first_block + run.length));
+
+    return runs;
 }
 
 /*
-This function returns the last partly full block or allocates a new block
-param inode_id - the index of the inode
-param inode - the inode of the entry
-param target_block - the block index of the file blocks (0 - 11)
+sets aside up to count blocks near goal, or in group_index when there is no goal
+a write that finds fewer allocates the rest one by one
 */
-std::expected<int, FileSystemStatus> FileSystem::get_or_allocate_block_index(int inode_id, Inode &inode, int target_block)
+void FileSystem::reserve_data_blocks(BlockReservation &reservation, int count, int goal, int group_index)
 {
-    if (inode.direct_blocks[target_block] == -1)
-    {
-        auto block_res = allocate_data_block();
-        if (!block_res.has_value())
-            return std::unexpected(block_res.error());
+    take_data_runs(std::min(count, free_data_blocks_count()), goal, group_index, true, reservation.runs);
 
-        int new_block_index = block_res.value();
-        inode.direct_blocks[target_block] = new_block_index;
-        write_inode(inode_id, inode);
+    std::lock_guard<std::mutex> lock(discard_mutex);
+    for (const DataBlockRun &run : reservation.runs)
+        pending_discards.erase(pending_discards.lower_bound(run.first_block), pending_discards.lower_bound(run.first_block + run.length));
+}
 
-        return new_block_index;
+/* the reserved blocks no file block took are free again, they never reached the bitmap blocks */
+void FileSystem::release_reservation(BlockReservation &reservation)
+{
+    for (; reservation.next_run < reservation.runs.size(); reservation.next_run++)
+    {
+        const DataBlockRun &run = reservation.runs[reservation.next_run];
+        AllocationGroup &group = data_group(run.first_block - superblock.data_start);
+        for (int block_index = run.first_block; block_index < run.first_block + run.length; block_index++)
+            group.blocks.cancel(block_index - superblock.data_start - group.first_block);
     }
-
-    return inode.direct_blocks[target_block];
 }
 
 /*
-param data_block_number - the block number in the data table itselt
+the next reserved block when there is one, otherwise the next free block
+every block may dirty the bitmap block of another group, so the handle is extended first,
+a commit there leaves the blocks allocated so far in the file unreachable at worst
 */
-FileSystemStatus FileSystem::free_data_block(int data_block_number)
+std::expected<int, FileSystemStatus> FileSystem::allocate_file_block(int inode_id, BlockReservation *reservation)
 {
-    if (data_block_number < 0 || data_block_number >= DATA_TABLE_SIZE)
-        return FileSystemStatus::OutOfBounds;
-
-    FileSystemStatus status = turn_off_bit(data_block_number, DATA_BITMAP_INDEX, DATA_TABLE_SIZE);
-
+    journal.extend_handle();
+    if (reservation == nullptr || reservation->next_run == reservation->runs.size())
+        return allocate_data_block(inode_group_index(inode_id));
+
+    DataBlockRun &run = reservation->runs[reservation->next_run];
+    int block_index = run.first_block++;
+    if (--run.length == 0)
+        reservation->next_run++;
+
+    int data_block_number = block_index - superblock.data_start;
+    AllocationGroup &group = data_group(data_block_number);
+    group.blocks.claim(data_block_number - group.first_block);
+    FileSystemStatus status = write_bitmap_word(group.blocks, group.first_block, superblock.data_bitmap_start, data_block_number);
     if (status != FileSystemStatus::OK)
-        return status;
+    {
+        group.blocks.clear(data_block_number - group.first_block);
+        return std::unexpected(status);
+    }
 
-    return FileSystemStatus::OK;
+    return block_index;
 }
 
-/********** Directory & Entry Management ************/
-
-void FileSystem::set_as_empty(Entry &entry)
+std::expected<int, FileSystemStatus> FileSystem::get_block_index(Inode &inode, int target_block)
 {
-    entry.inode_id = -1;
-    entry.type = static_cast<EntryType>(-1);
-    int name_length = sizeof(entry.name) / sizeof(entry.name[0]);
-    std::fill(std::begin(entry.name), std::end(entry.name), 0);
+    std::vector<BlockRun> runs;
+    FileSystemStatus status = map_blocks(-1, inode, target_block, 1, false, runs);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
+
+    if (runs.front().device_block == -1) // the block was never written
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    return runs.front().device_block;
 }
 
-void FileSystem::set_as_empty(Inode &inode)
+/* appends length file blocks stored from device_block, or a hole, merging them into the last run when they continue it */
+static void append_run(std::vector<BlockRun> &runs, int file_block, int device_block, int length)
 {
-    inode.type = EntryType::Uninitialized;
+    if (!runs.empty())
+    {
+        BlockRun &last = runs.back();
+        bool continues_device = last.device_block == -1 ? device_block == -1 : device_block == last.device_block + last.length;
+        if (last.file_block + last.length == file_block && continues_device)
+        {
+            last.length += length;
+            return;
+        }
+    }
+
+    runs.push_back(BlockRun{file_block, device_block, length});
+}
+
+/*
+This function maps the file blocks first_block .. first_block + blocks_count - 1 to runs of contiguous device blocks
+param allocate - the holes get new data blocks, and the indirect blocks or extent nodes they need
+param reservation - when given, the holes take its blocks first
+An inode whose pointers or extents change is written back
+*/
+FileSystemStatus FileSystem::map_blocks(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                        BlockReservation *reservation)
+{
+    runs.clear();
+    if (first_block < 0 || blocks_count < 0 || static_cast<int64_t>(first_block) + blocks_count > MAX_FILE_BLOCKS)
+        return FileSystemStatus::OutOfBounds;
+
+    // the file may gain blocks without its inode being written
+    if (allocate)
+        cache_blocks_used(inode_id, std::nullopt);
+
+    if (inode.layout == InodeLayout::Extents)
+        return map_extents(inode_id, inode, first_block, blocks_count, allocate, runs, reservation);
+    return map_pointer_blocks(inode_id, inode, first_block, blocks_count, allocate, runs, reservation);
+}
+
+/*
+This function finds the slots that lead from the inode to a file block
+depth 0 is the direct block slots[0], otherwise slots[1..depth] are the slots in the
+pointer blocks from indirect_blocks[depth - 1] down
+*/
+static bool get_block_path(int file_block, int &depth, int (&slots)[INDIRECT_LEVELS + 1])
+{
+    if (file_block < 0)
+        return false;
+
+    if (file_block < TOTAL_DIRECT_BLOCKS)
+    {
+        depth = 0;
+        slots[0] = file_block;
+        return true;
+    }
+
+    int64_t block = file_block - TOTAL_DIRECT_BLOCKS;
+    int64_t blocks_at_depth = POINTERS_PER_BLOCK;
+    for (depth = 1; depth <= INDIRECT_LEVELS; depth++)
+    {
+        if (block < blocks_at_depth)
+        {
+            for (int level = depth; level >= 1; level--)
+            {
+                slots[level] = block % POINTERS_PER_BLOCK;
+                block /= POINTERS_PER_BLOCK;
+            }
+            return true;
+        }
+
+        block -= blocks_at_depth;
+        blocks_at_depth *= POINTERS_PER_BLOCK;
+    }
+
+    return false;
+}
+
+/*
+map_blocks() for the blocks layout
+The pointer block of every level is kept while it serves the range, so a sequential range
+reads each indirect block once
+*/
+FileSystemStatus FileSystem::map_pointer_blocks(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                                BlockReservation *reservation)
+{
+    std::vector<int> pointers[INDIRECT_LEVELS]; // the pointer block loaded at every level
+    int loaded_blocks[INDIRECT_LEVELS] = {-1, -1, -1};
+    bool inode_changed = false;
+    FileSystemStatus status = FileSystemStatus::OK;
+
+    int end_block = first_block + blocks_count;
+    for (int file_block = first_block; file_block < end_block && status == FileSystemStatus::OK;)
+    {
+        int depth;
+        int slots[INDIRECT_LEVELS + 1];
+        if (!get_block_path(file_block, depth, slots))
+        {
+            status = FileSystemStatus::OutOfBounds;
+            break;
+        }
+
+        if (depth == 0)
+        {
+            int &direct_block = inode.direct_blocks[slots[0]];
+            if (direct_block == -1 && allocate)
+            {
+                auto block_res = allocate_file_block(inode_id, reservation);
+                if (!block_res.has_value())
+                {
+                    status = block_res.error();
+                    break;
+                }
+                direct_block = block_res.value();
+                inode_changed = true;
+            }
+
+            append_run(runs, file_block, direct_block, 1);
+            file_block++;
+            continue;
+        }
+
+        // walk down to the last level pointer block, the top one hangs off the inode
+        int *slot = &inode.indirect_blocks[depth - 1];
+        int parent_block = -1;
+        int level = 0;
+        for (; level < depth; level++)
+        {
+            int block_index = *slot;
+            if (block_index == -1)
+            {
+                if (!allocate)
+                    break;
+
+                journal.extend_handle();
+                auto block_res = allocate_data_block(inode_group_index(inode_id));
+                if (!block_res.has_value())
+                {
+                    status = block_res.error();
+                    break;
+                }
+
+                block_index = *slot = block_res.value();
+                pointers[level].assign(POINTERS_PER_BLOCK, -1);
+                loaded_blocks[level] = block_index;
+                status = device.write_block(block_index, reinterpret_cast<const uint8_t *>(pointers[level].data()));
+                if (status == FileSystemStatus::OK && parent_block != -1)
+                    status = device.write_block(parent_block, reinterpret_cast<const uint8_t *>(pointers[level - 1].data()));
+                inode_changed |= parent_block == -1;
+                if (status != FileSystemStatus::OK)
+                    break;
+            }
+            else if (loaded_blocks[level] != block_index)
+            {
+                pointers[level].resize(POINTERS_PER_BLOCK);
+                status = device.read_block(block_index, reinterpret_cast<uint8_t *>(pointers[level].data()));
+                if (status != FileSystemStatus::OK)
+                    break;
+                loaded_blocks[level] = block_index;
+            }
+
+            parent_block = block_index;
+            slot = &pointers[level][slots[level + 1]];
+        }
+        if (status != FileSystemStatus::OK)
+            break;
+
+        // the rest of the range in this last level block
+        int run = std::min(end_block - file_block, POINTERS_PER_BLOCK - slots[depth]);
+        if (level < depth)
+        {
+            append_run(runs, file_block, -1, run);
+            file_block += run;
+            continue;
+        }
+
+        bool pointers_changed = false;
+        for (int i = 0; i < run; i++, slot++)
+        {
+            if (*slot == -1 && allocate)
+            {
+                auto block_res = allocate_file_block(inode_id, reservation);
+                if (!block_res.has_value())
+                {
+                    status = block_res.error();
+                    break;
+                }
+                *slot = block_res.value();
+                pointers_changed = true;
+            }
+            append_run(runs, file_block + i, *slot, 1);
+        }
+
+        if (pointers_changed)
+        {
+            FileSystemStatus write_status = device.write_block(parent_block, reinterpret_cast<const uint8_t *>(pointers[depth - 1].data()));
+            if (status == FileSystemStatus::OK)
+                status = write_status;
+        }
+        file_block += run;
+    }
+
+    if (inode_changed)
+    {
+        FileSystemStatus write_status = write_inode(inode_id, inode);
+        if (status == FileSystemStatus::OK)
+            status = write_status;
+    }
+
+    return status;
+}
+
+/* the data blocks of a file and the indirect blocks or extent nodes that map them */
+std::expected<uint64_t, FileSystemStatus> FileSystem::count_blocks(const Inode &inode)
+{
+    if (inode.layout == InodeLayout::Extents)
+    {
+        ExtentNode root;
+        load_extent_root(inode, root);
+        return count_extent_blocks(root);
+    }
+
+    if (inode.layout == InodeLayout::HashTree)
+        return static_cast<uint64_t>(inode.index_blocks);
+
+    uint64_t blocks_used = 0;
+    for (int i = 0; i < TOTAL_DIRECT_BLOCKS; i++)
+        if (inode.direct_blocks[i] != -1)
+            blocks_used++;
+
+    for (int level = 0; level < INDIRECT_LEVELS; level++)
+    {
+        if (inode.indirect_blocks[level] == -1)
+            continue;
+
+        auto count_res = count_pointer_blocks(inode.indirect_blocks[level], level + 1);
+        if (!count_res.has_value())
+            return count_res;
+        blocks_used += count_res.value();
+    }
+
+    return blocks_used;
+}
+
+/* the blocks used under a block at depth, 0 is a data block and the rest are pointer blocks */
+std::expected<uint64_t, FileSystemStatus> FileSystem::count_pointer_blocks(int block_index, int depth)
+{
+    if (depth == 0)
+        return 1;
+
+    std::vector<int> pointers(POINTERS_PER_BLOCK);
+    FileSystemStatus status = device.read_block(block_index, reinterpret_cast<uint8_t *>(pointers.data()));
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
+
+    uint64_t blocks_used = 1;
+    for (int pointer : pointers)
+    {
+        if (pointer == -1)
+            continue;
+
+        if (depth == 1)
+        {
+            blocks_used++;
+            continue;
+        }
+
+        auto count_res = count_pointer_blocks(pointer, depth - 1);
+        if (!count_res.has_value())
+            return count_res;
+        blocks_used += count_res.value();
+    }
+
+    return blocks_used;
+}
+
+/* frees every block of a file, the inode must be unreachable already */
+FileSystemStatus FileSystem::free_file_blocks(const Inode &inode)
+{
+    if (inode.layout == InodeLayout::Extents)
+    {
+        ExtentNode root;
+        load_extent_root(inode, root);
+        return free_extent_blocks(root);
+    }
+
+    for (int data_block_index : inode.direct_blocks)
+    {
+        if (data_block_index == -1)
+            continue;
+
+        FileSystemStatus status = free_data_blocks(data_block_index, 1);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    for (int level = 0; level < INDIRECT_LEVELS; level++)
+    {
+        if (inode.indirect_blocks[level] == -1)
+            continue;
+
+        FileSystemStatus status = free_pointer_blocks(inode.indirect_blocks[level], level + 1);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/* frees a block at depth and everything under it, 0 is a data block and the rest are pointer blocks */
+FileSystemStatus FileSystem::free_pointer_blocks(int block_index, int depth)
+{
+    if (depth > 0)
+    {
+        std::vector<int> pointers(POINTERS_PER_BLOCK);
+        FileSystemStatus status = device.read_block(block_index, reinterpret_cast<uint8_t *>(pointers.data()));
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        for (int pointer : pointers)
+        {
+            if (pointer == -1)
+                continue;
+
+            status = free_pointer_blocks(pointer, depth - 1);
+            if (status != FileSystemStatus::OK)
+                return status;
+        }
+    }
+
+    return free_data_blocks(block_index, 1);
+}
+
+/*
+This function frees the device blocks first_block .. first_block + blocks_count - 1
+Every block freed may commit the journal, so the callers have already made the blocks unreachable
+*/
+FileSystemStatus FileSystem::free_data_blocks(int first_block, int blocks_count)
+{
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+    {
+        // a large file dirties more bitmap blocks than one transaction holds
+        journal.extend_handle();
+        FileSystemStatus status = free_data_block(block_index - superblock.data_start);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/********** Extents ************/
+
+void FileSystem::load_extent_root(const Inode &inode, ExtentNode &root)
+{
+    root.depth = inode.extent_depth;
+    root.count = 0;
+    for (const Extent &extent : inode.extents)
+        if (extent.physical_block != -1)
+            root.extents[root.count++] = extent;
+}
+
+void FileSystem::store_extent_root(const ExtentNode &root, Inode &inode)
+{
+    inode.extent_depth = root.depth;
+    for (int i = 0; i < INLINE_EXTENTS; i++)
+        inode.extents[i] = i < root.count ? root.extents[i] : Extent{0, -1, 0};
+}
+
+FileSystemStatus FileSystem::read_extent_node(int block_index, ExtentNode &node)
+{
+    uint8_t buffer[BLOCK_SIZE];
+    FileSystemStatus status = device.read_block(block_index, buffer);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::memcpy(&node, buffer, sizeof(ExtentNode));
+    if (node.count < 0 || node.count > EXTENTS_PER_NODE || node.depth < 0)
+        return FileSystemStatus::UnknownError;
+
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus FileSystem::write_extent_node(int block_index, const ExtentNode &node)
+{
+    uint8_t buffer[BLOCK_SIZE] = {};
+    std::memcpy(buffer, &node, sizeof(ExtentNode));
+    return device.write_block(block_index, buffer);
+}
+
+/* the first entry of the node that starts past file_block */
+static Extent *upper_extent(ExtentNode &node, int file_block)
+{
+    return std::upper_bound(node.extents, node.extents + node.count, file_block, [](int block, const Extent &extent)
+                            { return block < extent.logical_block; });
+}
+
+/*
+This function returns the run of the extent that holds file_block, from file_block to the end of the extent
+A block no extent holds starts a hole that lasts until the next extent
+*/
+std::expected<BlockRun, FileSystemStatus> FileSystem::find_extent(const Inode &inode, int file_block)
+{
+    ExtentNode node;
+    load_extent_root(inode, node);
+
+    int hole_end = MAX_FILE_BLOCKS; // the first extent found past file_block
+    while (true)
+    {
+        Extent *next = upper_extent(node, file_block);
+        if (next != node.extents + node.count)
+            hole_end = std::min(hole_end, next->logical_block);
+
+        if (node.depth == 0)
+        {
+            if (next != node.extents)
+            {
+                const Extent &extent = *(next - 1);
+                int extent_end = extent.logical_block + extent.length;
+                if (file_block < extent_end)
+                    return BlockRun{file_block, extent.physical_block + (file_block - extent.logical_block), extent_end - file_block};
+            }
+
+            return BlockRun{file_block, -1, hole_end - file_block};
+        }
+
+        if (node.count == 0)
+            return std::unexpected(FileSystemStatus::UnknownError);
+
+        // the child covering file_block, or the first one for a block before all of them
+        int child_block = next == node.extents ? node.extents[0].physical_block : (next - 1)->physical_block;
+        FileSystemStatus status = read_extent_node(child_block, node);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+    }
+}
+
+/*
+map_blocks() for the extents layout, one tree lookup per extent or hole
+Every stretch of a hole that gets contiguous device blocks becomes one extent
+*/
+FileSystemStatus FileSystem::map_extents(int inode_id, Inode &inode, int first_block, int blocks_count, bool allocate, std::vector<BlockRun> &runs,
+                                         BlockReservation *reservation)
+{
+    int end_block = first_block + blocks_count;
+    for (int file_block = first_block; file_block < end_block;)
+    {
+        auto run_res = find_extent(inode, file_block);
+        if (!run_res.has_value())
+            return run_res.error();
+
+        BlockRun run = run_res.value();
+        run.length = std::min(run.length, end_block - file_block);
+        if (run.device_block != -1 || !allocate)
+        {
+            append_run(runs, run.file_block, run.device_block, run.length);
+            file_block += run.length;
+            continue;
+        }
+
+        FileSystemStatus status = FileSystemStatus::OK;
+        Extent extent{file_block, -1, 0};
+        for (int i = 0; i < run.length; i++)
+        {
+            auto block_res = allocate_file_block(inode_id, reservation);
+            if (!block_res.has_value())
+            {
+                status = block_res.error();
+                break;
+            }
+
+            int block_index = block_res.value();
+            if (extent.length > 0 && block_index != extent.physical_block + extent.length)
+            {
+                journal.extend_handle(); // the nodes split on the way down
+                status = add_extent(inode_id, inode, extent);
+                append_run(runs, extent.logical_block, extent.physical_block, extent.length);
+                extent = Extent{extent.logical_block + extent.length, -1, 0};
+                if (status != FileSystemStatus::OK)
+                {
+                    free_data_block(block_index - superblock.data_start);
+                    break;
+                }
+            }
+
+            if (extent.length == 0)
+                extent.physical_block = block_index;
+            extent.length++;
+        }
+
+        if (extent.length > 0)
+        {
+            journal.extend_handle();
+            FileSystemStatus add_status = add_extent(inode_id, inode, extent);
+            append_run(runs, extent.logical_block, extent.physical_block, extent.length);
+            if (status == FileSystemStatus::OK)
+                status = add_status;
+        }
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        file_block += run.length;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/* adds an extent of new blocks to the tree of the inode and writes the inode back */
+FileSystemStatus FileSystem::add_extent(int inode_id, Inode &inode, const Extent &extent)
+{
+    ExtentNode root;
+    load_extent_root(inode, root);
+
+    std::optional<Extent> split;
+    FileSystemStatus status = insert_extent(root, INLINE_EXTENTS, extent, split);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    // the root lives in the inode and cannot split, its lower half moves down into a new node instead
+    if (split.has_value())
+    {
+        auto block_res = allocate_data_block(inode_group_index(inode_id));
+        if (!block_res.has_value())
+            return block_res.error();
+
+        status = write_extent_node(block_res.value(), root);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        Extent lower{root.extents[0].logical_block, block_res.value(), 0};
+        root.depth++;
+        root.count = 2;
+        root.extents[0] = lower;
+        root.extents[1] = split.value();
+    }
+
+    store_extent_root(root, inode);
+    return write_inode(inode_id, inode);
+}
+
+/*
+This function inserts extent under node, the caller stores node afterwards
+An extent that continues the one before it, both in the file and on the device, grows it instead
+param split - set when node was full, the new node that took its upper entries
+*/
+FileSystemStatus FileSystem::insert_extent(ExtentNode &node, int capacity, const Extent &extent, std::optional<Extent> &split)
+{
+    split.reset();
+    int position = upper_extent(node, extent.logical_block) - node.extents;
+
+    if (node.depth == 0)
+    {
+        if (position > 0)
+        {
+            Extent &previous = node.extents[position - 1];
+            if (previous.logical_block + previous.length == extent.logical_block &&
+                previous.physical_block + previous.length == extent.physical_block)
+            {
+                previous.length += extent.length;
+                return FileSystemStatus::OK;
+            }
+        }
+
+        return insert_into_node(node, capacity, position, extent, split);
+    }
+
+    int child_position = std::max(position - 1, 0);
+    Extent &child_entry = node.extents[child_position];
+    ExtentNode child;
+    FileSystemStatus status = read_extent_node(child_entry.physical_block, child);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::optional<Extent> child_split;
+    status = insert_extent(child, EXTENTS_PER_NODE, extent, child_split);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    status = write_extent_node(child_entry.physical_block, child);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    child_entry.logical_block = std::min(child_entry.logical_block, extent.logical_block);
+    if (!child_split.has_value())
+        return FileSystemStatus::OK;
+
+    return insert_into_node(node, capacity, child_position + 1, child_split.value(), split);
+}
+
+/*
+This function puts entry at position, a full node keeps its lower half and the rest moves to a new node
+An append to a full node moves only the new entry, so a file written in order leaves its nodes full
+*/
+FileSystemStatus FileSystem::insert_into_node(ExtentNode &node, int capacity, int position, const Extent &entry, std::optional<Extent> &split)
+{
+    split.reset();
+    if (node.count < capacity)
+    {
+        std::copy_backward(node.extents + position, node.extents + node.count, node.extents + node.count + 1);
+        node.extents[position] = entry;
+        node.count++;
+        return FileSystemStatus::OK;
+    }
+
+    auto block_res = allocate_data_block();
+    if (!block_res.has_value())
+        return block_res.error();
+
+    std::vector<Extent> entries(node.extents, node.extents + node.count);
+    entries.insert(entries.begin() + position, entry);
+    int kept = position == node.count ? node.count : static_cast<int>(entries.size()) / 2;
+
+    ExtentNode upper{};
+    upper.depth = node.depth;
+    upper.count = static_cast<int>(entries.size()) - kept;
+    std::copy(entries.begin() + kept, entries.end(), upper.extents);
+    node.count = kept;
+    std::copy(entries.begin(), entries.begin() + kept, node.extents);
+
+    FileSystemStatus status = write_extent_node(block_res.value(), upper);
+    if (status != FileSystemStatus::OK)
+    {
+        free_data_block(block_res.value() - superblock.data_start);
+        return status;
+    }
+
+    split = Extent{upper.extents[0].logical_block, block_res.value(), 0};
+    return FileSystemStatus::OK;
+}
+
+/* the blocks of the extents under node and the nodes below it */
+std::expected<uint64_t, FileSystemStatus> FileSystem::count_extent_blocks(const ExtentNode &node)
+{
+    uint64_t blocks_used = 0;
+    for (int i = 0; i < node.count; i++)
+    {
+        if (node.depth == 0)
+        {
+            blocks_used += node.extents[i].length;
+            continue;
+        }
+
+        ExtentNode child;
+        FileSystemStatus status = read_extent_node(node.extents[i].physical_block, child);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+
+        auto count_res = count_extent_blocks(child);
+        if (!count_res.has_value())
+            return count_res;
+        blocks_used += 1 + count_res.value();
+    }
+
+    return blocks_used;
+}
+
+FileSystemStatus FileSystem::free_extent_blocks(const ExtentNode &node)
+{
+    for (int i = 0; i < node.count; i++)
+    {
+        const Extent &extent = node.extents[i];
+        if (node.depth == 0)
+        {
+            FileSystemStatus status = free_data_blocks(extent.physical_block, extent.length);
+            if (status != FileSystemStatus::OK)
+                return status;
+            continue;
+        }
+
+        ExtentNode child;
+        FileSystemStatus status = read_extent_node(extent.physical_block, child);
+        if (status == FileSystemStatus::OK)
+            status = free_extent_blocks(child);
+        if (status == FileSystemStatus::OK)
+            status = free_data_blocks(extent.physical_block, 1);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/********** Inode Cache ************/
+
+std::optional<Inode> FileSystem::find_cached_inode(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    auto it = inode_index.find(inode_id);
+    if (it == inode_index.end())
+    {
+        inode_cache_stats.misses++;
+        return std::nullopt;
+    }
+
+    inode_lru.splice(inode_lru.begin(), inode_lru, it->second);
+    inode_cache_stats.hits++;
+    return it->second->inode;
+}
+
+/*
+the cached inode with its block count, read under one lock so an eviction cannot come between them
+a miss is counted by the get_inode() that follows it
+*/
+std::optional<FileSystem::CachedInode> FileSystem::find_cached_attributes(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    auto it = inode_index.find(inode_id);
+    if (it == inode_index.end())
+        return std::nullopt;
+
+    inode_lru.splice(inode_lru.begin(), inode_lru, it->second);
+    inode_cache_stats.hits++;
+    return *it->second;
+}
+
+void FileSystem::cache_inode(int inode_id, const Inode &inode)
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    auto it = inode_index.find(inode_id);
+    if (it != inode_index.end())
+    {
+        it->second->inode = inode;
+        it->second->blocks_used.reset();
+        inode_lru.splice(inode_lru.begin(), inode_lru, it->second);
+        return;
+    }
+
+    if (inode_lru.size() >= static_cast<size_t>(INODE_CACHE_ENTRIES))
+    {
+        inode_index.erase(inode_lru.back().inode_id);
+        inode_lru.pop_back();
+        inode_cache_stats.evictions++;
+    }
+
+    inode_lru.push_front(CachedInode{inode_id, inode, std::nullopt});
+    inode_index.emplace(inode_id, inode_lru.begin());
+}
+
+/* only for a cached inode, nullopt drops the count */
+void FileSystem::cache_blocks_used(int inode_id, std::optional<uint64_t> blocks_used)
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    auto it = inode_index.find(inode_id);
+    if (it != inode_index.end())
+        it->second->blocks_used = blocks_used;
+}
+
+void FileSystem::forget_cached_inode(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    auto it = inode_index.find(inode_id);
+    if (it == inode_index.end())
+        return;
+
+    inode_lru.erase(it->second);
+    inode_index.erase(it);
+}
+
+InodeCacheStats FileSystem::get_inode_cache_stats() const
+{
+    std::lock_guard<std::mutex> lock(inode_cache_mutex);
+    return inode_cache_stats;
+}
+
+/********** Dentry Cache ************/
+
+/* the cached entry of name in the directory, inode_id -1 when the name is known to be missing */
+std::optional<Entry> FileSystem::find_dentry(int dir_inode_id, std::string_view name)
+{
+    std::lock_guard<std::mutex> lock(dentry_mutex);
+    auto it = dentry_index.find(DentryKey{dir_inode_id, name});
+    if (it == dentry_index.end())
+    {
+        dentry_stats.misses++;
+        return std::nullopt;
+    }
+
+    dentry_lru.splice(dentry_lru.begin(), dentry_lru, it->second);
+    dentry_stats.hits++;
+    if (it->second->entry.inode_id == -1)
+        dentry_stats.negative_hits++;
+
+    return it->second->entry;
+}
+
+void FileSystem::cache_dentry(int dir_inode_id, std::string_view name, const Entry &entry)
+{
+    std::lock_guard<std::mutex> lock(dentry_mutex);
+    auto it = dentry_index.find(DentryKey{dir_inode_id, name});
+    if (it != dentry_index.end())
+    {
+        it->second->entry = entry;
+        dentry_lru.splice(dentry_lru.begin(), dentry_lru, it->second);
+        return;
+    }
+
+    if (dentry_lru.size() >= static_cast<size_t>(DENTRY_CACHE_ENTRIES))
+    {
+        const CachedDentry &oldest = dentry_lru.back();
+        dentry_index.erase(DentryKey{oldest.dir_inode_id, oldest.name});
+        dentry_lru.pop_back();
+        dentry_stats.evictions++;
+    }
+
+    // the key points at the name kept in the list node
+    dentry_lru.push_front(CachedDentry{dir_inode_id, std::string(name), entry});
+    dentry_index.emplace(DentryKey{dir_inode_id, dentry_lru.front().name}, dentry_lru.begin());
+}
+
+/* a deleted directory takes its names along, its inode may come back as another directory */
+void FileSystem::forget_dentries(int dir_inode_id)
+{
+    std::lock_guard<std::mutex> lock(dentry_mutex);
+    for (auto it = dentry_lru.begin(); it != dentry_lru.end();)
+    {
+        if (it->dir_inode_id != dir_inode_id)
+        {
+            ++it;
+            continue;
+        }
+
+        dentry_index.erase(DentryKey{it->dir_inode_id, it->name});
+        it = dentry_lru.erase(it);
+    }
+}
+
+DentryCacheStats FileSystem::get_dentry_cache_stats() const
+{
+    std::lock_guard<std::mutex> lock(dentry_mutex);
+    return dentry_stats;
+}
+
+/********** Readahead ************/
+
+/*
+This function moves the readahead window of the file after a read of file blocks first_block..last_block
+A sequential reader that has consumed half of the prefetched blocks gets the next window hinted to the device
+A reader that turns random cancels the blocks of its window it has not read
+A device that does not take hints turns readahead off for good
+*/
+void FileSystem::readahead(int inode_id, Inode &inode, int first_block, int last_block)
+{
+    int file_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int prefetch_start, prefetch_end;
+    bool cancel = false;
+    {
+        std::lock_guard<std::mutex> lock(readahead_mutex);
+        if (!readahead_enabled)
+            return;
+
+        ReadaheadState &state = readahead_states[inode_id];
+        int blocks_count = last_block - first_block + 1;
+        readahead_stats.blocks_read += blocks_count;
+
+        // a small reader may start in the block the last read ended in
+        if (first_block != state.next_block && first_block != state.next_block - 1)
+        {
+            readahead_stats.random_reads++;
+            readahead_stats.wasted_blocks += std::max(0, state.prefetched_end - state.next_block);
+            prefetch_start = state.next_block;
+            prefetch_end = std::min(state.prefetched_end, file_blocks);
+            state = ReadaheadState{};
+            state.next_block = last_block + 1;
+            if (prefetch_start >= prefetch_end)
+                return;
+            cancel = true;
+        }
+        else
+        {
+            readahead_stats.sequential_reads++;
+            readahead_stats.hit_blocks += std::clamp(state.prefetched_end - first_block, 0, blocks_count);
+            state.next_block = last_block + 1;
+
+            if (state.window != 0 && state.prefetched_end - state.next_block >= state.window / 2)
+                return;
+
+            state.window = state.window == 0 ? READAHEAD_MIN_BLOCKS : std::min(state.window * 2, READAHEAD_MAX_BLOCKS);
+            prefetch_start = std::max(state.prefetched_end, state.next_block);
+            prefetch_end = std::min(state.next_block + state.window, file_blocks);
+            if (prefetch_start >= prefetch_end)
+                return;
+
+            state.prefetched_end = prefetch_end;
+            readahead_stats.prefetched_blocks += prefetch_end - prefetch_start;
+        }
+    }
+
+    // the holes of a sparse file have nothing to prefetch or cancel
+    std::vector<BlockRun> runs;
+    std::vector<int> block_indices;
+    if (map_blocks(inode_id, inode, prefetch_start, prefetch_end - prefetch_start, false, runs) == FileSystemStatus::OK)
+        for (const BlockRun &run : runs)
+            for (int i = 0; i < run.length && run.device_block != -1; i++)
+                block_indices.push_back(run.device_block + i);
+
+    if (cancel)
+    {
+        if (!block_indices.empty())
+            device.cancel_prefetch(block_indices);
+        return;
+    }
+
+    if (block_indices.empty() || device.prefetch_blocks(block_indices) != FileSystemStatus::NotSupported)
+        return;
+
+    std::lock_guard<std::mutex> lock(readahead_mutex);
+    readahead_enabled = false;
+    readahead_stats.prefetched_blocks -= prefetch_end - prefetch_start;
+    readahead_states.clear();
+}
+
+/* a deleted file gives up its window, what was prefetched and not read is wasted */
+void FileSystem::forget_readahead(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(readahead_mutex);
+    auto it = readahead_states.find(inode_id);
+    if (it == readahead_states.end())
+        return;
+
+    readahead_stats.wasted_blocks += std::max(0, it->second.prefetched_end - it->second.next_block);
+    readahead_states.erase(it);
+}
+
+ReadaheadStats FileSystem::get_readahead_stats() const
+{
+    std::lock_guard<std::mutex> lock(readahead_mutex);
+    return readahead_stats;
+}
+
+/*
+param data_block_number - the block number in the data table itselt
+*/
+FileSystemStatus FileSystem::free_data_block(int data_block_number)
+{
+    if (data_block_number < 0 || data_block_number >= superblock.data_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    AllocationGroup &group = data_group(data_block_number);
+    FileSystemStatus status = turn_off_bit(group.blocks, group.first_block, superblock.data_bitmap_start, data_block_number);
+
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    if (online_discard)
+    {
+        std::lock_guard<std::mutex> lock(discard_mutex);
+        pending_discards.insert(data_block_number + superblock.data_start);
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/********** Directory & Entry Management ************/
+
+void FileSystem::set_as_empty(Entry &entry)
+{
+    entry.inode_id = -1;
+    entry.type = static_cast<EntryType>(-1);
+    int name_length = sizeof(entry.name) / sizeof(entry.name[0]);
+    std::fill(std::begin(entry.name), std::end(entry.name), 0);
+}
+
+void FileSystem::set_as_empty(Inode &inode)
+{
+    inode.type = EntryType::Uninitialized;
     inode.size = 0;
     inode.link_count = 0;
+    inode.layout = InodeLayout::Blocks;
+    inode.extent_depth = 0;
     std::fill(inode.direct_blocks, inode.direct_blocks + TOTAL_DIRECT_BLOCKS, -1);
+    std::fill(inode.indirect_blocks, inode.indirect_blocks + INDIRECT_LEVELS, -1);
+}
+
+void FileSystem::set_as_extents(Inode &inode)
+{
+    inode.layout = InodeLayout::Extents;
+    inode.extent_depth = 0;
+    std::fill(inode.extents, inode.extents + INLINE_EXTENTS, Extent{0, -1, 0});
 }
 
 Entry FileSystem::create_entry(EntryType type, int inode_id, std::string_view entry_name)
@@ -690,7 +2149,16 @@ FileSystemStatus FileSystem::add_entry_to_parent(int parent_inode_id, Inode &par
 {
     FileSystemStatus status;
     int ablsolute_block_number;
-    uint8_t buffer[BLOCK_SIZE];
+
+    if (parent_inode.layout == InodeLayout::HashTree)
+    {
+        status = add_tree_entry(parent_inode_id, parent_inode, new_entry);
+        if (status == FileSystemStatus::OK)
+            status = write_inode(parent_inode_id, parent_inode);
+        if (status == FileSystemStatus::OK)
+            cache_dentry(parent_inode_id, new_entry.name, new_entry);
+        return status;
+    }
 
     // find an empty Entry slot in the parent inode
     auto Entry_res = get_element<Entry>(
@@ -702,27 +2170,42 @@ FileSystemStatus FileSystem::add_entry_to_parent(int parent_inode_id, Inode &par
         { return entry.inode_id == -1; });
 
     if (!Entry_res.has_value())
-        return expand_directory(parent_inode_id, parent_inode, new_entry);
+    {
+        int used_blocks = std::count_if(parent_inode.direct_blocks, parent_inode.direct_blocks + TOTAL_DIRECT_BLOCKS, [](int block_index)
+                                        { return block_index != -1; });
+        if (used_blocks < DIR_LINEAR_BLOCKS)
+        {
+            status = expand_directory(parent_inode_id, parent_inode, new_entry);
+            if (status == FileSystemStatus::OK)
+                cache_dentry(parent_inode_id, new_entry.name, new_entry);
+            return status;
+        }
+
+        status = convert_to_hash_tree(parent_inode_id, parent_inode);
+        if (status != FileSystemStatus::OK)
+            return status;
 
-    auto *entries = get_block_ptr<Entry>(ablsolute_block_number, buffer);
-    auto *it = std::find_if(entries, entries + ENTRIES_PER_BLOCK, [](const Entry &entry)
-                            { return entry.inode_id == -1; });
+        return add_entry_to_parent(parent_inode_id, parent_inode, new_entry);
+    }
 
     // update the entries block
-    int entry_index = it - entries;
-    entries[entry_index] = new_entry;
+    status = update_block<Entry>(ablsolute_block_number, [&new_entry](Entry *entries)
+                                 {
+                                     auto *it = std::find_if(entries, entries + ENTRIES_PER_BLOCK, [](const Entry &entry)
+                                                             { return entry.inode_id == -1; });
+                                     *it = new_entry; });
+    if (status != FileSystemStatus::OK)
+        return status;
     parent_inode.size += sizeof(Entry);
 
-    // commit changes
-    device.write_block(ablsolute_block_number, buffer);
-
     // commit changes
     write_inode(parent_inode_id, parent_inode);
+    cache_dentry(parent_inode_id, new_entry.name, new_entry);
 
     return FileSystemStatus::OK;
 }
 
-FileSystemStatus FileSystem::remove_entry(int dir_inode_id, int target_inode_id)
+FileSystemStatus FileSystem::remove_entry(int dir_inode_id, int target_inode_id, std::string_view name)
 {
     int target_block;
 
@@ -731,6 +2214,21 @@ FileSystemStatus FileSystem::remove_entry(int dir_inode_id, int target_inode_id)
         return parent_inode_res.error();
     Inode parent_inode = parent_inode_res.value();
 
+    // the name stays cached as missing
+    Entry removed;
+    set_as_empty(removed);
+
+    if (parent_inode.layout == InodeLayout::HashTree)
+    {
+        Entry entry;
+        FileSystemStatus status = remove_tree_entry(parent_inode, target_inode_id, name, entry);
+        if (status == FileSystemStatus::OK)
+            status = write_inode(dir_inode_id, parent_inode);
+        if (status == FileSystemStatus::OK)
+            cache_dentry(dir_inode_id, entry.name, removed);
+        return status;
+    }
+
     get_element<Entry>(
         parent_inode.direct_blocks,
         TOTAL_DIRECT_BLOCKS,
@@ -742,22 +2240,25 @@ FileSystemStatus FileSystem::remove_entry(int dir_inode_id, int target_inode_id)
     if (target_block == -1)
         return FileSystemStatus::EntryNotFound;
 
-    uint8_t buffer[BLOCK_SIZE];
-    auto entries = get_block_ptr<Entry>(target_block, buffer);
-
     // remove the entry from the parent directory
-    for (int i = 0; i < ENTRIES_PER_BLOCK; i++)
-        if (entries[i].inode_id == target_inode_id)
-        {
-            set_as_empty(entries[i]);
-            break;
-        }
+    std::string removed_name;
+    FileSystemStatus status = update_block<Entry>(target_block, [this, target_inode_id, &removed_name](Entry *entries)
+                                                  {
+                                                      for (int i = 0; i < ENTRIES_PER_BLOCK; i++)
+                                                          if (entries[i].inode_id == target_inode_id)
+                                                          {
+                                                              removed_name = entries[i].name;
+                                                              set_as_empty(entries[i]);
+                                                              break;
+                                                          } });
+    if (status != FileSystemStatus::OK)
+        return status;
 
     parent_inode.size -= sizeof(Entry);
 
     // commit changes
-    device.write_block(target_block, buffer);
     write_inode(dir_inode_id, parent_inode);
+    cache_dentry(dir_inode_id, removed_name, removed);
 
     return FileSystemStatus::OK;
 }
@@ -765,7 +2266,7 @@ FileSystemStatus FileSystem::remove_entry(int dir_inode_id, int target_inode_id)
 FileSystemStatus FileSystem::expand_directory(int inode_id, Inode &inode, Entry &new_entry)
 {
     // allocate block
-    auto block_index_res = allocate_data_block();
+    auto block_index_res = allocate_data_block(inode_group_index(inode_id));
     if (!block_index_res.has_value())
         return block_index_res.error();
 
@@ -802,16 +2303,419 @@ FileSystemStatus FileSystem::expand_directory(int inode_id, Inode &inode, Entry
     return FileSystemStatus::OK;
 }
 
-FileSystemStatus FileSystem::delete_entry(int parent_inode_id, int inode_id)
+FileSystemStatus FileSystem::delete_entry(int parent_inode_id, int inode_id, std::string_view entry_name)
 {
+    // . and .. go only with their directory
+    if (entry_name == "." || entry_name == ".." || inode_id == parent_inode_id)
+        return FileSystemStatus::EntryTypeError;
+
+    InodeLockTable::Guard inode_lock(inode_locks, parent_inode_id, InodeLockMode::Exclusive, inode_id, InodeLockMode::Exclusive);
+    Journal::Handle handle(journal);
     auto inode_res = get_inode(inode_id);
     if (!inode_res.has_value())
         return FileSystemStatus::InodeNotFound;
 
     if (inode_res.value().type == EntryType::File)
-        return delete_file(parent_inode_id, inode_id);
+        return delete_file(parent_inode_id, inode_id, entry_name);
+    else
+        return delete_directory(parent_inode_id, inode_id, entry_name);
+}
+
+/********** Hash Tree Directories ************/
+
+uint32_t FileSystem::name_hash(std::string_view name)
+{
+    return crc32c(reinterpret_cast<const uint8_t *>(name.data()), name.size());
+}
+
+static int dir_node_capacity(const DirNode &node)
+{
+    return node.depth == 0 ? DIR_LEAF_ENTRIES : DIR_INDEX_ENTRIES;
+}
+
+/* the child of an index node that takes hash, a hash equal to a child's may also continue the child before it */
+static int dir_child_slot(const DirNode &node, uint32_t hash)
+{
+    auto it = std::lower_bound(node.children + 1, node.children + node.count, hash, [](const DirIndexEntry &child, uint32_t value)
+                               { return child.hash < value; });
+    return static_cast<int>(it - node.children) - 1;
+}
+
+FileSystemStatus FileSystem::read_dir_node(int block_index, DirNode &node)
+{
+    uint8_t buffer[BLOCK_SIZE];
+    FileSystemStatus status = device.read_block(block_index, buffer);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::memcpy(&node, buffer, sizeof(DirNode));
+    if (node.depth < 0 || node.count < 0 || node.count > dir_node_capacity(node) || (node.depth > 0 && node.count == 0))
+        return FileSystemStatus::UnknownError;
+
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus FileSystem::write_dir_node(int block_index, const DirNode &node)
+{
+    uint8_t buffer[BLOCK_SIZE] = {};
+    std::memcpy(buffer, &node, sizeof(DirNode));
+    return device.write_block(block_index, buffer);
+}
+
+/* reads the first leaf that may hold names hashing to hash into leaf */
+std::expected<int, FileSystemStatus> FileSystem::find_dir_leaf(const Inode &inode, uint32_t hash, DirNode &leaf)
+{
+    int block_index = inode.index_root;
+    while (true)
+    {
+        FileSystemStatus status = read_dir_node(block_index, leaf);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+
+        if (leaf.depth == 0)
+            return block_index;
+
+        block_index = leaf.children[dir_child_slot(leaf, hash)].child_block;
+    }
+}
+
+std::expected<Entry, FileSystemStatus> FileSystem::lookup_tree_entry(const Inode &inode, std::string_view name)
+{
+    uint32_t hash = name_hash(name);
+    DirNode leaf;
+    auto leaf_res = find_dir_leaf(inode, hash, leaf);
+    if (!leaf_res.has_value())
+        return std::unexpected(leaf_res.error());
+
+    while (true)
+    {
+        int i = std::lower_bound(leaf.hashes, leaf.hashes + leaf.count, hash) - leaf.hashes;
+        for (; i < leaf.count && leaf.hashes[i] == hash; i++)
+            if (leaf.entries[i].name == name)
+                return leaf.entries[i];
+
+        // colliding names may run on into the next leaf
+        if (leaf.next_leaf == -1 || leaf.next_hash > hash)
+            return std::unexpected(FileSystemStatus::EntryNotFound);
+
+        FileSystemStatus status = read_dir_node(leaf.next_leaf, leaf);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+    }
+}
+
+/*
+This function inserts an entry into the leaf its name hash leads to
+A full node met on the way down is split before the descent goes on, so a split never climbs back up
+Every split leaves a complete tree, the handle may commit between two of them
+*/
+FileSystemStatus FileSystem::add_tree_entry(int inode_id, Inode &inode, const Entry &new_entry)
+{
+    uint32_t hash = name_hash(new_entry.name);
+    int block_index = inode.index_root;
+    DirNode node;
+    FileSystemStatus status = read_dir_node(block_index, node);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    // a full root gets a new root above it, then splits like any other node
+    if (node.count == dir_node_capacity(node))
+    {
+        journal.extend_handle();
+        auto block_res = allocate_data_block(inode_group_index(inode_id));
+        if (!block_res.has_value())
+            return block_res.error();
+
+        DirNode root{};
+        root.depth = node.depth + 1;
+        root.count = 1;
+        root.next_leaf = -1;
+        root.children[0] = DirIndexEntry{0, block_index};
+        status = write_dir_node(block_res.value(), root);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        block_index = block_res.value();
+        inode.index_root = block_index;
+        inode.index_blocks++;
+        status = write_inode(inode_id, inode);
+        if (status != FileSystemStatus::OK)
+            return status;
+        node = root;
+    }
+
+    while (node.depth > 0)
+    {
+        int slot = dir_child_slot(node, hash);
+        DirNode child;
+        status = read_dir_node(node.children[slot].child_block, child);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        if (child.count == dir_node_capacity(child))
+        {
+            journal.extend_handle();
+            DirNode sibling;
+            status = split_dir_node(inode_id, inode, block_index, node, slot, child, sibling);
+            if (status != FileSystemStatus::OK)
+                return status;
+
+            if (dir_child_slot(node, hash) != slot)
+            {
+                slot++;
+                child = sibling;
+            }
+        }
+
+        block_index = node.children[slot].child_block;
+        node = child;
+    }
+
+    int position = std::upper_bound(node.hashes, node.hashes + node.count, hash) - node.hashes;
+    std::copy_backward(node.hashes + position, node.hashes + node.count, node.hashes + node.count + 1);
+    std::copy_backward(node.entries + position, node.entries + node.count, node.entries + node.count + 1);
+    node.hashes[position] = hash;
+    node.entries[position] = new_entry;
+    node.count++;
+    inode.size += sizeof(Entry);
+
+    return write_dir_node(block_index, node);
+}
+
+/* moves the upper half of child, the full node at slot of parent, into sibling, a new node right after it */
+FileSystemStatus FileSystem::split_dir_node(int inode_id, Inode &inode, int parent_block, DirNode &parent, int slot, DirNode &child, DirNode &sibling)
+{
+    auto block_res = allocate_data_block(inode_group_index(inode_id));
+    if (!block_res.has_value())
+        return block_res.error();
+    int child_block = parent.children[slot].child_block;
+    int sibling_block = block_res.value();
+
+    int half = child.count / 2;
+    sibling = DirNode{};
+    sibling.depth = child.depth;
+    sibling.count = child.count - half;
+    sibling.next_leaf = -1;
+
+    uint32_t split_hash;
+    if (child.depth == 0)
+    {
+        std::copy(child.hashes + half, child.hashes + child.count, sibling.hashes);
+        std::copy(child.entries + half, child.entries + child.count, sibling.entries);
+        split_hash = sibling.hashes[0];
+        sibling.next_leaf = child.next_leaf;
+        sibling.next_hash = child.next_hash;
+        child.next_leaf = sibling_block;
+        child.next_hash = split_hash;
+    }
+    else
+    {
+        std::copy(child.children + half, child.children + child.count, sibling.children);
+        split_hash = sibling.children[0].hash;
+    }
+    child.count = half;
+
+    std::copy_backward(parent.children + slot + 1, parent.children + parent.count, parent.children + parent.count + 1);
+    parent.children[slot + 1] = DirIndexEntry{split_hash, sibling_block};
+    parent.count++;
+
+    FileSystemStatus status = write_dir_node(sibling_block, sibling);
+    if (status == FileSystemStatus::OK)
+        status = write_dir_node(child_block, child);
+    if (status == FileSystemStatus::OK)
+        status = write_dir_node(parent_block, parent);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    inode.index_blocks++;
+    return write_inode(inode_id, inode);
+}
+
+/* without a name the leaves are searched one after the other for target_inode_id */
+FileSystemStatus FileSystem::remove_tree_entry(Inode &inode, int target_inode_id, std::string_view name, Entry &removed)
+{
+    uint32_t hash = name.empty() ? 0 : name_hash(name);
+    DirNode leaf;
+    auto leaf_res = find_dir_leaf(inode, hash, leaf);
+    if (!leaf_res.has_value())
+        return leaf_res.error();
+    int leaf_block = leaf_res.value();
+
+    while (true)
+    {
+        int i = name.empty() ? 0 : std::lower_bound(leaf.hashes, leaf.hashes + leaf.count, hash) - leaf.hashes;
+        for (; i < leaf.count && (name.empty() || leaf.hashes[i] == hash); i++)
+        {
+            if (leaf.entries[i].inode_id != target_inode_id || (!name.empty() && leaf.entries[i].name != name))
+                continue;
+
+            removed = leaf.entries[i];
+            std::copy(leaf.hashes + i + 1, leaf.hashes + leaf.count, leaf.hashes + i);
+            std::copy(leaf.entries + i + 1, leaf.entries + leaf.count, leaf.entries + i);
+            leaf.count--;
+            inode.size -= sizeof(Entry);
+
+            return write_dir_node(leaf_block, leaf);
+        }
+
+        if (leaf.next_leaf == -1 || (!name.empty() && leaf.next_hash > hash))
+            return FileSystemStatus::EntryNotFound;
+
+        leaf_block = leaf.next_leaf;
+        FileSystemStatus status = read_dir_node(leaf_block, leaf);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+}
+
+/*
+This function turns a full linear directory into half full leaves under one index node
+The tree is written before the inode points at it and the linear blocks are freed after, a crash in between leaks blocks
+*/
+FileSystemStatus FileSystem::convert_to_hash_tree(int inode_id, Inode &inode)
+{
+    std::vector<int> linear_blocks;
+    std::vector<std::pair<uint32_t, Entry>> entries;
+    uint8_t buffer[BLOCK_SIZE];
+    for (int block_index : inode.direct_blocks)
+    {
+        if (block_index == -1)
+            continue;
+        linear_blocks.push_back(block_index);
+
+        auto *block_entries = get_block_ptr<Entry>(block_index, buffer);
+        for (int i = 0; i < ENTRIES_PER_BLOCK; i++)
+            if (block_entries[i].inode_id != -1)
+                entries.emplace_back(name_hash(block_entries[i].name), block_entries[i]);
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const auto &a, const auto &b)
+                     { return a.first < b.first; });
+
+    // the leaves and then the root
+    int entries_count = static_cast<int>(entries.size());
+    int leaves_count = entries_count / (DIR_LEAF_ENTRIES / 2) + 1;
+    std::vector<int> tree_blocks;
+    for (int i = 0; i <= leaves_count; i++)
+    {
+        auto block_res = allocate_data_block(inode_group_index(inode_id));
+        if (!block_res.has_value())
+        {
+            for (int block_index : tree_blocks)
+                free_data_blocks(block_index, 1);
+            return block_res.error();
+        }
+        tree_blocks.push_back(block_res.value());
+    }
+
+    DirNode root{};
+    root.depth = 1;
+    root.count = leaves_count;
+    root.next_leaf = -1;
+    for (int leaf_number = 0; leaf_number < leaves_count; leaf_number++)
+    {
+        int first = leaf_number * entries_count / leaves_count;
+        int last = (leaf_number + 1) * entries_count / leaves_count;
+
+        DirNode leaf{};
+        leaf.count = last - first;
+        leaf.next_leaf = leaf_number + 1 < leaves_count ? tree_blocks[leaf_number + 1] : -1;
+        leaf.next_hash = last < entries_count ? entries[last].first : 0;
+        for (int i = first; i < last; i++)
+        {
+            leaf.hashes[i - first] = entries[i].first;
+            leaf.entries[i - first] = entries[i].second;
+        }
+        root.children[leaf_number] = DirIndexEntry{leaf_number == 0 ? 0 : entries[first].first, tree_blocks[leaf_number]};
+
+        journal.extend_handle();
+        FileSystemStatus status = write_dir_node(tree_blocks[leaf_number], leaf);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    FileSystemStatus status = write_dir_node(tree_blocks.back(), root);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    std::fill(inode.direct_blocks, inode.direct_blocks + TOTAL_DIRECT_BLOCKS, -1);
+    inode.layout = InodeLayout::HashTree;
+    inode.index_root = tree_blocks.back();
+    inode.index_blocks = leaves_count + 1;
+    status = write_inode(inode_id, inode);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (int block_index : linear_blocks)
+    {
+        status = free_data_blocks(block_index, 1);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+/* page after page follows the leaf chain from the cursor, any other page walks it from the first leaf */
+std::expected<std::vector<Entry>, FileSystemStatus> FileSystem::list_tree_page(int inode_id, const Inode &inode, uint32_t page)
+{
+    std::optional<int> cursor_block;
+    {
+        std::lock_guard<std::mutex> lock(dir_cursor_mutex);
+        auto it = dir_cursors.find(inode_id);
+        if (it != dir_cursors.end() && it->second.page == page)
+            cursor_block = it->second.leaf_block;
+    }
+
+    DirNode leaf;
+    if (cursor_block.has_value())
+    {
+        if (cursor_block.value() == -1)
+            return std::unexpected(FileSystemStatus::OutOfBounds);
+
+        FileSystemStatus status = read_dir_node(cursor_block.value(), leaf);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+    }
     else
-        return delete_directory(parent_inode_id, inode_id);
+    {
+        auto leaf_res = find_dir_leaf(inode, 0, leaf);
+        if (!leaf_res.has_value())
+            return std::unexpected(leaf_res.error());
+
+        for (uint32_t i = 0; i < page; i++)
+        {
+            if (leaf.next_leaf == -1)
+                return std::unexpected(FileSystemStatus::OutOfBounds);
+
+            FileSystemStatus status = read_dir_node(leaf.next_leaf, leaf);
+            if (status != FileSystemStatus::OK)
+                return std::unexpected(status);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(dir_cursor_mutex);
+        dir_cursors[inode_id] = DirCursor{page + 1, leaf.next_leaf};
+    }
+
+    return std::vector<Entry>(leaf.entries, leaf.entries + leaf.count);
+}
+
+FileSystemStatus FileSystem::free_dir_tree(int block_index)
+{
+    DirNode node;
+    FileSystemStatus status = read_dir_node(block_index, node);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    for (int i = 0; node.depth > 0 && i < node.count; i++)
+    {
+        status = free_dir_tree(node.children[i].child_block);
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return free_data_blocks(block_index, 1);
 }
 
 /********** Path Resolution ************/
@@ -821,6 +2725,7 @@ this function returns the inode_id of the last entry in path
 */
 std::expected<int, FileSystemStatus> FileSystem::get_inode_by_path(const std::string_view path)
 {
+    // no handle of its own, a lookup answered by the dentry cache needs none
     std::stringstream s_stream(static_cast<std::string>(path));
     std::string entry_name;
 
@@ -845,79 +2750,173 @@ std::expected<int, FileSystemStatus> FileSystem::get_inode_by_path(const std::st
 
 /********** Bitmap (Low-Level) ************/
 
-std::optional<int> FileSystem::find_free_bit(int start_block, int total_bits)
+FileSystemStatus FileSystem::turn_on_bit(AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number)
 {
-    uint8_t buffer[BLOCK_SIZE];
-
-    int free_bit;
-    const int bits_per_block = BLOCK_SIZE * BITS_IN_BYTE;
-
-    int bitmap_size = (total_bits + bits_per_block - 1) / bits_per_block;
-    for (int j = 0; j < bitmap_size; j++)
-    {
-        auto *bytes = get_block_ptr<uint8_t>(start_block + j, buffer);
-        for (int i = 0; i < BLOCK_SIZE; i++)
-        {
-            if (bytes[i] == 0xFF)
-                continue;
+    if (bit_number < first_bit || bit_number >= first_bit + bitmap.size())
+        return FileSystemStatus::OutOfBounds;
 
-            free_bit = std::countr_one(bytes[i]); // return the index of the first 0
+    bitmap.set(bit_number - first_bit);
+    return write_bitmap_word(bitmap, first_bit, start_block, bit_number);
+}
 
-            int absolute_free_bit = (j * BLOCK_SIZE * BITS_IN_BYTE) + i * BITS_IN_BYTE + free_bit;
-            if (absolute_free_bit < total_bits)
-                return absolute_free_bit;
-        }
-    }
+/*
+this function mark an element as free
+bitmap - the resident bitmap of the group the bit belongs to
+first_bit - the first bit of the group
+start_block - the first block index of the bitmap table
+bit_number - The global index of the bit to be turn off to 0
+*/
+FileSystemStatus FileSystem::turn_off_bit(AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number)
+{
+    if (bit_number < first_bit || bit_number >= first_bit + bitmap.size())
+        return FileSystemStatus::OutOfBounds;
 
-    return std::nullopt;
+    bitmap.clear(bit_number - first_bit);
+    return write_bitmap_word(bitmap, first_bit, start_block, bit_number);
 }
 
-FileSystemStatus FileSystem::turn_on_bit(int bit_number, int starting_block_number, int max_bits_in_table)
+/*
+copies the word that holds bit_number from the resident bitmap of its group into its bitmap block
+the copy is taken under the bitmap lock, so calls changing bits of one word leave the newest word there
+*/
+FileSystemStatus FileSystem::write_bitmap_word(const AllocationBitmap &bitmap, int first_bit, int start_block, int bit_number)
 {
-    if (bit_number < 0 || bit_number >= max_bits_in_table)
-        return FileSystemStatus::OutOfBounds;
+    const int words_per_block = BLOCK_SIZE / sizeof(uint64_t);
+    int word_index = bit_number / BITS_PER_WORD;
+    int group_word_index = (bit_number - first_bit) / BITS_PER_WORD;
 
-    int absolute_block_index;
+    return update_block<uint64_t>(start_block + word_index / words_per_block, [&](uint64_t *words)
+                                  { bitmap.store_word(group_word_index, words[word_index % words_per_block]); });
+}
 
-    int table_block_index = bit_number / (BLOCK_SIZE * BITS_IN_BYTE);
-    int byte_index = bit_number / BITS_IN_BYTE;
-    byte_index %= BLOCK_SIZE;
-    int bit_index = bit_number % BITS_IN_BYTE;
+/********** Allocation Groups ************/
 
-    uint8_t mask = static_cast<uint8_t>(1 << bit_index);
-    absolute_block_index = table_block_index + starting_block_number;
+/*
+This function splits the volume of the superblock in groups of BLOCKS_PER_GROUP data blocks
+The inodes are split in as many groups, rounded to whole bitmap words and inode table blocks
+*/
+void FileSystem::build_groups()
+{
+    int groups_count = std::max(1, (superblock.data_blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP);
+    int alignment = std::max(BITS_PER_WORD, static_cast<int>(INODES_PER_BLOCK));
+    inodes_per_group = (superblock.total_inodes + groups_count - 1) / groups_count;
+    inodes_per_group = std::max(alignment, (inodes_per_group + alignment - 1) / alignment * alignment);
 
-    uint8_t buffer[BLOCK_SIZE];
+    groups.clear();
+    for (int i = 0; i < groups_count; i++)
+    {
+        auto group = std::make_unique<AllocationGroup>();
+        group->first_inode = i * inodes_per_group;
+        group->first_block = i * BLOCKS_PER_GROUP;
+        groups.push_back(std::move(group));
+    }
+    data_group_cursor = 0;
+    directory_group_cursor = 0;
+}
 
-    device.read_block(absolute_block_index, buffer);
-    buffer[byte_index] |= mask;
-    device.write_block(absolute_block_index, buffer);
+int FileSystem::inode_group_index(int inode_id) const
+{
+    int index = inode_id < 0 ? 0 : inode_id / inodes_per_group;
+    return std::min(index, static_cast<int>(groups.size()) - 1);
+}
 
-    return FileSystemStatus::OK;
+FileSystem::AllocationGroup &FileSystem::inode_group(int inode_id)
+{
+    return *groups[inode_group_index(inode_id)];
+}
+
+/* param data_block_number - the block number in the data table */
+FileSystem::AllocationGroup &FileSystem::data_group(int data_block_number)
+{
+    int index = std::clamp(data_block_number / BLOCKS_PER_GROUP, 0, static_cast<int>(groups.size()) - 1);
+    return *groups[index];
 }
 
 /*
-this function mark an element as free
-bit_number - The global index of the bit to be turn off to 0
-starting_block_number - the first block index of the bitmap table
-max_bits_in_table - the total bits in the bitmap
+This function finds the group of a new directory: the first group with about the average of free inodes
+and of free blocks (a quarter of a group less, as in ext4), else the one with the most free inodes. The search starts one group further every time,
+so directories take turns over the groups and their files follow them
 */
-FileSystemStatus FileSystem::turn_off_bit(int bit_number, int starting_block_number, int max_bits_in_table)
+int FileSystem::pick_directory_group()
 {
-    if (bit_number < 0 || bit_number >= max_bits_in_table)
-        return FileSystemStatus::OutOfBounds;
+    int groups_count = static_cast<int>(groups.size());
+    int64_t free_inodes = 0;
+    for (const auto &group : groups)
+        free_inodes += group->inodes.free_count();
+    int64_t min_free_inodes = free_inodes / groups_count - inodes_per_group / 4;
+    int64_t min_free_blocks = free_data_blocks_count() / groups_count - BLOCKS_PER_GROUP / 4;
+
+    int first_group = static_cast<int>(directory_group_cursor++ % groups_count);
+    int best_group = first_group;
+    int best_free_inodes = -1;
+    for (int i = 0; i < groups_count; i++)
+    {
+        int index = (first_group + i) % groups_count;
+        const AllocationGroup &group = *groups[index];
+        int group_free_inodes = group.inodes.free_count();
+        if (group_free_inodes > 0 && group_free_inodes >= min_free_inodes && group.blocks.free_count() >= min_free_blocks)
+            return index;
+
+        if (group_free_inodes > best_free_inodes)
+        {
+            best_group = index;
+            best_free_inodes = group_free_inodes;
+        }
+    }
+    return best_group;
+}
 
-    int block_index = bit_number / (BLOCK_SIZE * BITS_IN_BYTE); // the block in the table
-    int byte_number = bit_number / BITS_IN_BYTE;                // the byte index in the whole table
-    int byte_index = byte_number % BLOCK_SIZE;                  // the byte index in the block
-    int bit_index = bit_number % BITS_IN_BYTE;                  // the bit in the byte
+int FileSystem::free_data_blocks_count() const
+{
+    int free_blocks = 0;
+    for (const auto &group : groups)
+        free_blocks += group->blocks.free_count();
+    return free_blocks;
+}
 
-    uint8_t buffer[BLOCK_SIZE];
-    device.read_block(starting_block_number + block_index, buffer);
+/*
+This function takes runs of up to count data blocks in total, reserved or allocated, without writing the bitmap blocks
+The group of goal (an absolute block) is searched first, from goal on. Without a goal group_index is, from its cursor,
+and without either the group of the last allocation. The next groups follow in turn
+*/
+void FileSystem::take_data_runs(int count, int goal, int group_index, bool reserve, std::vector<DataBlockRun> &runs)
+{
+    int groups_count = static_cast<int>(groups.size());
+    int goal_bit = -1;
+    if (goal >= superblock.data_start && goal < superblock.data_start + superblock.data_blocks)
+    {
+        group_index = data_group(goal - superblock.data_start).first_block / BLOCKS_PER_GROUP;
+        goal_bit = goal - superblock.data_start - group_index * BLOCKS_PER_GROUP;
+    }
+    else if (group_index < 0 || group_index >= groups_count)
+        group_index = data_group_cursor;
 
-    uint8_t mask = 1 << bit_index;
-    buffer[byte_index] &= ~mask;
-    device.write_block(starting_block_number + block_index, buffer);
+    for (int i = 0; i < groups_count && count > 0; i++, goal_bit = -1)
+    {
+        int index = (group_index + i) % groups_count;
+        AllocationGroup &group = *groups[index];
+        while (count > 0)
+        {
+            auto run_res = reserve ? group.blocks.reserve_run(goal_bit, count) : group.blocks.allocate_run(goal_bit, count);
+            if (!run_res.has_value())
+                break;
+
+            BitRun run = run_res.value();
+            runs.push_back(DataBlockRun{superblock.data_start + group.first_block + run.first, run.length});
+            count -= run.length;
+            goal_bit = run.first + run.length;
+            data_group_cursor = index;
+        }
+    }
+}
 
-    return FileSystemStatus::OK;
+/* every bitmap word the run covers is written once, a run stays in its group */
+FileSystemStatus FileSystem::write_data_run_words(const DataBlockRun &run)
+{
+    int first_bit = run.first_block - superblock.data_start;
+    AllocationGroup &group = data_group(first_bit);
+    FileSystemStatus status = FileSystemStatus::OK;
+    for (int bit = first_bit; bit < first_bit + run.length && status == FileSystemStatus::OK; bit = (bit / BITS_PER_WORD + 1) * BITS_PER_WORD)
+        status = write_bitmap_word(group.blocks, group.first_block, superblock.data_bitmap_start, bit);
+    return status;
 }
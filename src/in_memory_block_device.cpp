@@ -1,38 +1,277 @@
 #include "in_memory_block_device.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "fs_status.hpp"
 
+static const std::array<uint8_t, BLOCK_SIZE> ZERO_BLOCK{};
+
+static const int MPOL_PREFERRED_POLICY = 1; // MPOL_PREFERRED of <numaif.h>, without linking libnuma
+static const int MAX_NUMA_NODE = 63;        // the node mask is a single word
+static const int HUGE_PAGE_2MB_FLAG = 21 << MAP_HUGE_SHIFT; // MAP_HUGE_2MB of <linux/mman.h>
+
+/* maps size bytes of anonymous memory at a HUGE_PAGE_SIZE aligned address */
+static uint8_t *map_aligned(size_t size)
+{
+    void *address = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (address == MAP_FAILED)
+        return nullptr;
+
+    uintptr_t begin = reinterpret_cast<uintptr_t>(address);
+    uintptr_t aligned = (begin + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    size_t head = aligned - begin;
+    size_t tail = HUGE_PAGE_SIZE - head;
+    if (head > 0)
+        munmap(address, head);
+    if (tail > 0)
+        munmap(reinterpret_cast<void *>(aligned + size), tail);
+    return reinterpret_cast<uint8_t *>(aligned);
+}
+
 /*
  * This constructor allocate an in-memory blocks for the FS
+ * In Sparse layout only the first level of the page table is allocated
  */
-InMemoryBlockDevice::InMemoryBlockDevice(int size_byte)
+InMemoryBlockDevice::InMemoryBlockDevice(uint64_t size_byte, InMemoryLayout _layout, HugePageOptions hugepage_options)
+    : total_blocks(0), layout(_layout), slab(nullptr), slab_size(0), hugepage_backing(HugePageBacking::None),
+      numa_bound(false), allocated_blocks(0)
 {
-    int required_blocks = (size_byte + BLOCK_SIZE - 1) / BLOCK_SIZE; // ceiling value
-    if (required_blocks <= 0)
+    uint64_t required_blocks = (size_byte + BLOCK_SIZE - 1) / BLOCK_SIZE; // ceiling value
+    if (required_blocks == 0)
         required_blocks = 1;
-    memory.resize(required_blocks);
+    total_blocks = static_cast<int>(required_blocks);
+
+    if (layout == InMemoryLayout::HugePage && !map_slab(hugepage_options))
+        layout = InMemoryLayout::Dense;
+
+    if (layout == InMemoryLayout::HugePage)
+    {
+        allocated_blocks = total_blocks;
+    }
+    else if (layout == InMemoryLayout::Dense)
+    {
+        memory.resize(total_blocks);
+        allocated_blocks = total_blocks;
+    }
+    else
+    {
+        page_table.resize((total_blocks + SPARSE_LEAF_BLOCKS - 1) / SPARSE_LEAF_BLOCKS);
+    }
+}
+
+InMemoryBlockDevice::~InMemoryBlockDevice()
+{
+    if (slab != nullptr)
+        munmap(slab, slab_size);
+}
+
+/*
+ * This function maps the HugePage slab, rounded up to whole huge pages
+ * Reserved huge pages are tried first, then a regular mapping that asks for
+ * transparent huge pages. The slab is bound to its NUMA node before it is
+ * prefaulted, so the pages are allocated there. Anonymous memory starts zeroed
+ */
+bool InMemoryBlockDevice::map_slab(const HugePageOptions &options)
+{
+    size_t blocks_size = static_cast<size_t>(total_blocks) * BLOCK_SIZE;
+    slab_size = (blocks_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+    void *address = mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | HUGE_PAGE_2MB_FLAG, -1, 0);
+    if (address != MAP_FAILED)
+    {
+        slab = static_cast<uint8_t *>(address);
+        hugepage_backing = HugePageBacking::HugeTlb;
+    }
+    else
+    {
+        slab = map_aligned(slab_size);
+        if (slab == nullptr)
+        {
+            slab_size = 0;
+            return false;
+        }
+        if (madvise(slab, slab_size, MADV_HUGEPAGE) == 0)
+            hugepage_backing = HugePageBacking::Transparent;
+    }
+
+    if (options.numa_node >= 0 && options.numa_node <= MAX_NUMA_NODE)
+    {
+        unsigned long node_mask = 1UL << options.numa_node;
+        numa_bound = syscall(SYS_mbind, slab, slab_size, MPOL_PREFERRED_POLICY, &node_mask,
+                             sizeof(node_mask) * 8 + 1, 0) == 0;
+    }
+
+    if (options.prefault)
+    {
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        for (size_t offset = 0; offset < slab_size; offset += page_size)
+            reinterpret_cast<volatile uint8_t *>(slab)[offset] = 0;
+    }
+
+    return true;
+}
+
+bool InMemoryBlockDevice::is_valid_index(int block_index) const
+{
+    return block_index >= 0 && block_index < total_blocks;
+}
+
+/* returns the block content, a hole of a Sparse device is the shared zero block */
+const uint8_t *InMemoryBlockDevice::block_data(int block_index) const
+{
+    if (layout == InMemoryLayout::HugePage)
+        return slab + static_cast<size_t>(block_index) * BLOCK_SIZE;
+    if (layout == InMemoryLayout::Dense)
+        return memory[block_index].data();
+
+    const std::unique_ptr<SparseLeaf> &leaf = page_table[block_index / SPARSE_LEAF_BLOCKS];
+    if (!leaf)
+        return ZERO_BLOCK.data();
+
+    const std::unique_ptr<Block> &block = (*leaf)[block_index % SPARSE_LEAF_BLOCKS];
+    if (!block)
+        return ZERO_BLOCK.data();
+
+    return block->data();
+}
+
+/* returns the block content for writing, allocating a zeroed block for a hole */
+uint8_t *InMemoryBlockDevice::writable_block_data(int block_index)
+{
+    if (layout == InMemoryLayout::HugePage)
+        return slab + static_cast<size_t>(block_index) * BLOCK_SIZE;
+    if (layout == InMemoryLayout::Dense)
+        return memory[block_index].data();
+
+    std::unique_ptr<SparseLeaf> &leaf = page_table[block_index / SPARSE_LEAF_BLOCKS];
+    if (!leaf)
+        leaf = std::make_unique<SparseLeaf>();
+
+    std::unique_ptr<Block> &block = (*leaf)[block_index % SPARSE_LEAF_BLOCKS];
+    if (!block)
+    {
+        block = std::make_unique<Block>(); // value initialized, so zeroed
+        allocated_blocks++;
+    }
+
+    return block->data();
+}
+
+/* a zero write to a hole leaves it a hole */
+void InMemoryBlockDevice::store_block(int block_index, const uint8_t *buffer)
+{
+    if (layout == InMemoryLayout::Sparse && block_data(block_index) == ZERO_BLOCK.data() &&
+        std::memcmp(buffer, ZERO_BLOCK.data(), BLOCK_SIZE) == 0)
+        return;
+
+    std::memcpy(writable_block_data(block_index), buffer, BLOCK_SIZE);
+}
+
+int InMemoryBlockDevice::allocated_blocks_number() const
+{
+    return allocated_blocks;
 }
 
 int InMemoryBlockDevice::get_total_blocks_number() const
 {
-    return memory.size();
+    return total_blocks;
 }
 
 FileSystemStatus InMemoryBlockDevice::read_block(int block_index, uint8_t *buffer) const
 {
-    if (block_index < 0 || block_index >= get_total_blocks_number())
+    if (!is_valid_index(block_index))
         return FileSystemStatus::OutOfBounds;
 
-    std::memcpy(buffer, &memory[block_index], BLOCK_SIZE);
+    std::memcpy(buffer, block_data(block_index), BLOCK_SIZE);
     return FileSystemStatus::OK;
 }
 
 FileSystemStatus InMemoryBlockDevice::write_block(int block_index, const uint8_t *buffer)
 {
-    if (block_index < 0 || block_index >= get_total_blocks_number())
+    if (!is_valid_index(block_index))
         return FileSystemStatus::OutOfBounds;
 
-    std::memcpy(&memory[block_index], buffer, BLOCK_SIZE);
+    store_block(block_index, buffer);
+    return FileSystemStatus::OK;
+}
+
+
+/* the whole batch is validated first so a bad index leaves the device untouched */
+FileSystemStatus InMemoryBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (!is_valid_index(block_index))
+            return FileSystemStatus::OutOfBounds;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+        std::memcpy(buffer + i * BLOCK_SIZE, block_data(block_indices[i]), BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus InMemoryBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (!is_valid_index(block_index))
+            return FileSystemStatus::OutOfBounds;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+        store_block(block_indices[i], buffer + i * BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> InMemoryBlockDevice::view_block(int block_index) const
+{
+    if (!is_valid_index(block_index))
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    return std::span<const uint8_t, BLOCK_SIZE>(block_data(block_index), BLOCK_SIZE);
+}
+
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> InMemoryBlockDevice::mutable_view_block(int block_index)
+{
+    if (!is_valid_index(block_index))
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    return std::span<uint8_t, BLOCK_SIZE>(writable_block_data(block_index), BLOCK_SIZE);
+}
+
+FileSystemStatus InMemoryBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > total_blocks - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+    if (blocks_count == 0)
+        return FileSystemStatus::OK;
+
+    if (layout != InMemoryLayout::Sparse)
+    {
+        std::memset(writable_block_data(first_block), 0, static_cast<size_t>(blocks_count) * BLOCK_SIZE);
+        return FileSystemStatus::OK;
+    }
+
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+    {
+        std::unique_ptr<SparseLeaf> &leaf = page_table[block_index / SPARSE_LEAF_BLOCKS];
+        if (!leaf)
+        {
+            block_index = (block_index / SPARSE_LEAF_BLOCKS + 1) * SPARSE_LEAF_BLOCKS - 1; // a whole hole
+            continue;
+        }
+
+        std::unique_ptr<Block> &block = (*leaf)[block_index % SPARSE_LEAF_BLOCKS];
+        if (block)
+        {
+            block.reset();
+            allocated_blocks--;
+        }
+
+        bool leaf_done = block_index % SPARSE_LEAF_BLOCKS == SPARSE_LEAF_BLOCKS - 1 || block_index == first_block + blocks_count - 1;
+        if (leaf_done && std::none_of(leaf->begin(), leaf->end(), [](const std::unique_ptr<Block> &leaf_block)
+                                      { return leaf_block != nullptr; }))
+            leaf.reset();
+    }
     return FileSystemStatus::OK;
 }
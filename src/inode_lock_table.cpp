@@ -0,0 +1,81 @@
+#include "inode_lock_table.hpp"
+
+InodeLockTable::InodeLock &InodeLockTable::acquire(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(table_mutex);
+    InodeLock &inode_lock = locks[inode_id];
+    inode_lock.users++;
+    return inode_lock;
+}
+
+void InodeLockTable::release(int inode_id)
+{
+    std::lock_guard<std::mutex> lock(table_mutex);
+    auto it = locks.find(inode_id);
+    if (--it->second.users == 0)
+        locks.erase(it);
+}
+
+size_t InodeLockTable::size()
+{
+    std::lock_guard<std::mutex> lock(table_mutex);
+    return locks.size();
+}
+
+/********** Guard ************/
+
+InodeLockTable::Guard::Guard(InodeLockTable &_table, int inode_id, InodeLockMode mode) : table(_table), inode_ids{}, held{}, modes{}, count(0)
+{
+    lock(inode_id, mode);
+}
+
+InodeLockTable::Guard::Guard(InodeLockTable &_table, int parent_id, InodeLockMode parent_mode, int child_id, InodeLockMode child_mode)
+    : table(_table), inode_ids{}, held{}, modes{}, count(0)
+{
+    if (parent_id == child_id)
+    {
+        lock(parent_id, parent_mode == InodeLockMode::Exclusive ? parent_mode : child_mode);
+        return;
+    }
+
+    /* the pair comes from the client and is not checked yet, so the lower id goes first whichever is the parent */
+    if (parent_id < child_id)
+    {
+        lock(parent_id, parent_mode);
+        lock(child_id, child_mode);
+    }
+    else
+    {
+        lock(child_id, child_mode);
+        lock(parent_id, parent_mode);
+    }
+}
+
+/* the table lock is not held while the inode lock is waited for */
+void InodeLockTable::Guard::lock(int inode_id, InodeLockMode mode)
+{
+    InodeLock &inode_lock = table.acquire(inode_id);
+    if (mode == InodeLockMode::Shared)
+        inode_lock.mutex.lock_shared();
+    else
+        inode_lock.mutex.lock();
+
+    inode_ids[count] = inode_id;
+    held[count] = &inode_lock;
+    modes[count] = mode;
+    count++;
+}
+
+/* the child goes first */
+InodeLockTable::Guard::~Guard()
+{
+    while (count > 0)
+    {
+        count--;
+        if (modes[count] == InodeLockMode::Shared)
+            held[count]->mutex.unlock_shared();
+        else
+            held[count]->mutex.unlock();
+        table.release(inode_ids[count]);
+    }
+}
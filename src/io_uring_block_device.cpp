@@ -0,0 +1,536 @@
+#include "io_uring_block_device.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // <linux/fs.h> defines a 1024 byte BLOCK_SIZE macro, use fs_constants.hpp
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "fs_status.hpp"
+
+struct PendingIo
+{
+    uint8_t *user_buffer;
+    int bounce_slot; // -1 when the caller's buffer is aligned and used directly
+    bool is_read;
+};
+
+/*
+ * The submission / completion rings shared with the kernel
+ * Only one thread touches the rings at a time, guarded by mutex
+ */
+struct IoRing
+{
+    int image_fd = -1;
+    int ring_fd = -1;
+    unsigned entries = 0;
+
+    void *sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void *cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    void *sqes_map = MAP_FAILED;
+    size_t sqes_size = 0;
+
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned unsubmitted = 0;
+
+    uint8_t *bounce_buffers = nullptr;
+    std::vector<int> free_bounce_slots;
+    std::unordered_map<uint64_t, PendingIo> pending;
+    std::deque<IoCompletion> completed; // reaped but not yet handed to the caller
+    uint64_t next_request_id = 1;
+    std::mutex mutex;
+
+    bool available() const { return ring_fd >= 0; }
+
+    void setup(int fd, unsigned queue_depth);
+    ~IoRing();
+
+    std::expected<uint64_t, FileSystemStatus> queue(int block_index, uint8_t *buffer, bool is_read);
+    FileSystemStatus submit();
+    FileSystemStatus wait_one(IoCompletion &completion);
+    FileSystemStatus complete_range(uint64_t first_request_id, uint64_t last_request_id);
+
+private:
+    bool reap_one(IoCompletion &completion);
+    void release_ring();
+};
+
+/*
+ * This function creates the rings, a failure leaves the ring unavailable
+ * and every request is served with pread / pwrite instead
+ */
+void IoRing::setup(int fd, unsigned queue_depth)
+{
+    image_fd = fd;
+
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, queue_depth, &params));
+
+    if (ring_fd >= 0)
+    {
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring != MAP_FAILED)
+            cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        if (cq_ring != MAP_FAILED)
+            sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+        if (sqes_map == MAP_FAILED)
+        {
+            release_ring();
+        }
+        else
+        {
+            auto *sq = static_cast<uint8_t *>(sq_ring);
+            auto *cq = static_cast<uint8_t *>(cq_ring);
+            sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            sqes = static_cast<io_uring_sqe *>(sqes_map);
+            entries = params.sq_entries;
+        }
+    }
+
+    // O_DIRECT needs aligned memory on the pread / pwrite path too
+    int bounce_count = entries > 0 ? static_cast<int>(entries) : 1;
+    bounce_buffers = static_cast<uint8_t *>(std::aligned_alloc(BLOCK_SIZE, bounce_count * BLOCK_SIZE));
+    for (int slot = bounce_count - 1; slot >= 0; slot--)
+        free_bounce_slots.push_back(slot);
+}
+
+void IoRing::release_ring()
+{
+    if (sqes_map != MAP_FAILED)
+        munmap(sqes_map, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+
+    sqes_map = cq_ring = sq_ring = MAP_FAILED;
+    ring_fd = -1;
+    entries = 0;
+}
+
+IoRing::~IoRing()
+{
+    IoCompletion completion;
+    while (available() && !pending.empty() && wait_one(completion) == FileSystemStatus::OK)
+        ;
+
+    release_ring();
+    std::free(bounce_buffers);
+}
+
+std::expected<uint64_t, FileSystemStatus> IoRing::queue(int block_index, uint8_t *buffer, bool is_read)
+{
+    off_t offset = static_cast<off_t>(block_index) * BLOCK_SIZE;
+    bool aligned = reinterpret_cast<uintptr_t>(buffer) % BLOCK_SIZE == 0;
+
+    if (!available())
+    {
+        uint64_t request_id = next_request_id++;
+        uint8_t *io_buffer = aligned ? buffer : bounce_buffers;
+        ssize_t done;
+        if (is_read)
+        {
+            done = pread(image_fd, io_buffer, BLOCK_SIZE, offset);
+            if (!aligned)
+                std::memcpy(buffer, io_buffer, BLOCK_SIZE);
+        }
+        else
+        {
+            if (!aligned)
+                std::memcpy(io_buffer, buffer, BLOCK_SIZE);
+            done = pwrite(image_fd, io_buffer, BLOCK_SIZE, offset);
+        }
+
+        completed.push_back({request_id, done == BLOCK_SIZE ? FileSystemStatus::OK : FileSystemStatus::DeviceError});
+        return request_id;
+    }
+
+    // the ring holds at most `entries` requests, retire one to make room
+    while (pending.size() >= entries)
+    {
+        IoCompletion completion;
+        FileSystemStatus status = wait_one(completion);
+        if (status != FileSystemStatus::OK)
+            return std::unexpected(status);
+        completed.push_back(completion);
+    }
+
+    // the id is taken only once the request is surely queued, so a failed queue() leaves no id without a request
+    uint64_t request_id = next_request_id++;
+    int bounce_slot = -1;
+    uint8_t *io_buffer = buffer;
+    if (!aligned)
+    {
+        bounce_slot = free_bounce_slots.back();
+        free_bounce_slots.pop_back();
+        io_buffer = bounce_buffers + bounce_slot * BLOCK_SIZE;
+        if (!is_read)
+            std::memcpy(io_buffer, buffer, BLOCK_SIZE);
+    }
+
+    unsigned tail = *sq_tail; // we are the only producer
+    unsigned index = tail & *sq_mask;
+
+    io_uring_sqe &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = is_read ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe.fd = image_fd;
+    sqe.addr = reinterpret_cast<uint64_t>(io_buffer);
+    sqe.len = BLOCK_SIZE;
+    sqe.off = static_cast<uint64_t>(offset);
+    sqe.user_data = request_id;
+
+    sq_array[index] = index;
+    std::atomic_ref<unsigned>(*sq_tail).store(tail + 1, std::memory_order_release);
+
+    unsubmitted++;
+    pending[request_id] = {buffer, bounce_slot, is_read};
+    return request_id;
+}
+
+/* hands every queued request to the kernel in one system call */
+FileSystemStatus IoRing::submit()
+{
+    while (unsubmitted > 0)
+    {
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0, 0, nullptr, 0));
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return FileSystemStatus::DeviceError;
+        }
+        unsubmitted -= submitted;
+    }
+    return FileSystemStatus::OK;
+}
+
+bool IoRing::reap_one(IoCompletion &completion)
+{
+    unsigned head = *cq_head; // we are the only consumer
+    if (head == std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire))
+        return false;
+
+    const io_uring_cqe &cqe = cqes[head & *cq_mask];
+    auto it = pending.find(cqe.user_data);
+    PendingIo io = it->second;
+    pending.erase(it);
+
+    completion.request_id = cqe.user_data;
+    completion.status = cqe.res == BLOCK_SIZE ? FileSystemStatus::OK : FileSystemStatus::DeviceError;
+
+    std::atomic_ref<unsigned>(*cq_head).store(head + 1, std::memory_order_release);
+
+    if (io.bounce_slot != -1)
+    {
+        if (io.is_read && completion.status == FileSystemStatus::OK)
+            std::memcpy(io.user_buffer, bounce_buffers + io.bounce_slot * BLOCK_SIZE, BLOCK_SIZE);
+        free_bounce_slots.push_back(io.bounce_slot);
+    }
+
+    return true;
+}
+
+/* submits whatever is queued and waits for the next completion */
+FileSystemStatus IoRing::wait_one(IoCompletion &completion)
+{
+    while (!reap_one(completion))
+    {
+        if (pending.empty())
+            return FileSystemStatus::NotFound;
+
+        int submitted = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (submitted < 0)
+        {
+            // a full completion ring or a short allocation pass once completions are reaped
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return FileSystemStatus::DeviceError;
+        }
+        unsubmitted -= submitted;
+    }
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function waits for a range of request ids queued together
+ * Completions of other requests are kept for wait_completion()
+ */
+FileSystemStatus IoRing::complete_range(uint64_t first_request_id, uint64_t last_request_id)
+{
+    FileSystemStatus result = FileSystemStatus::OK;
+    uint64_t remaining = last_request_id - first_request_id + 1;
+    auto in_range = [&](uint64_t request_id)
+    { return request_id >= first_request_id && request_id <= last_request_id; };
+
+    for (auto it = completed.begin(); it != completed.end();)
+    {
+        if (!in_range(it->request_id))
+        {
+            ++it;
+            continue;
+        }
+        if (it->status != FileSystemStatus::OK)
+            result = it->status;
+        remaining--;
+        it = completed.erase(it);
+    }
+
+    while (remaining > 0)
+    {
+        IoCompletion completion;
+        FileSystemStatus status = wait_one(completion);
+        if (status != FileSystemStatus::OK)
+            return status;
+
+        if (!in_range(completion.request_id))
+        {
+            completed.push_back(completion);
+            continue;
+        }
+        if (completion.status != FileSystemStatus::OK)
+            result = completion.status;
+        remaining--;
+    }
+
+    return result;
+}
+
+/*
+ * This constructor opens the image with O_DIRECT and creates the rings
+ * Filesystems that refuse O_DIRECT (e.g. tmpfs) get a buffered image
+ */
+IoUringBlockDevice::IoUringBlockDevice(const std::string &image_path, uint64_t size_byte, int queue_depth)
+    : fd(-1), total_blocks(0), direct_io(true), ring(std::make_unique<IoRing>())
+{
+    fd = open(image_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL)
+    {
+        direct_io = false;
+        fd = open(image_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd < 0)
+        return;
+
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) < 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    uint64_t required_blocks = (size_byte + BLOCK_SIZE - 1) / BLOCK_SIZE; // ceiling value
+    uint64_t existing_blocks = static_cast<uint64_t>(image_stat.st_size) / BLOCK_SIZE;
+    if (existing_blocks > required_blocks) // never truncate a volume
+        required_blocks = existing_blocks;
+    if (required_blocks == 0)
+        required_blocks = 1;
+
+    uint64_t image_size = required_blocks * BLOCK_SIZE;
+    if (static_cast<uint64_t>(image_stat.st_size) < image_size && ftruncate(fd, image_size) < 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    total_blocks = static_cast<int>(required_blocks);
+    ring->setup(fd, queue_depth > 0 ? queue_depth : IO_URING_QUEUE_DEPTH);
+}
+
+IoUringBlockDevice::~IoUringBlockDevice()
+{
+    ring.reset(); // drains in-flight requests before the image is closed
+    if (fd >= 0)
+        close(fd);
+}
+
+bool IoUringBlockDevice::uses_io_uring() const
+{
+    return ring->available();
+}
+
+int IoUringBlockDevice::get_total_blocks_number() const
+{
+    return total_blocks;
+}
+
+/*
+ * This function queues the whole batch, submits it with one system call
+ * and waits for all of it, in chunks of the ring size. The requests of a
+ * chunk point into buffer and the bounce slots, so whatever was queued is
+ * waited for even when queueing fails partway
+ */
+FileSystemStatus IoUringBlockDevice::run_batch(std::span<const int> block_indices, uint8_t *buffer, bool is_read) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    std::lock_guard<std::mutex> lock(ring->mutex);
+
+    size_t chunk = ring->available() ? ring->entries : block_indices.size();
+    for (size_t first = 0; first < block_indices.size(); first += chunk)
+    {
+        size_t last = std::min(first + chunk, block_indices.size());
+        uint64_t first_request_id = ring->next_request_id;
+
+        FileSystemStatus status = FileSystemStatus::OK;
+        for (size_t i = first; i < last && status == FileSystemStatus::OK; i++)
+        {
+            auto request_res = ring->queue(block_indices[i], buffer + i * BLOCK_SIZE, is_read);
+            if (!request_res.has_value())
+                status = request_res.error();
+        }
+
+        FileSystemStatus completion_status = ring->complete_range(first_request_id, ring->next_request_id - 1);
+        if (status == FileSystemStatus::OK)
+            status = completion_status;
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus IoUringBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    return run_batch(std::span<const int>(&block_index, 1), buffer, true);
+}
+
+FileSystemStatus IoUringBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    return run_batch(std::span<const int>(&block_index, 1), const_cast<uint8_t *>(buffer), false);
+}
+
+FileSystemStatus IoUringBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    return run_batch(block_indices, buffer, true);
+}
+
+FileSystemStatus IoUringBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    return run_batch(block_indices, const_cast<uint8_t *>(buffer), false);
+}
+
+FileSystemStatus IoUringBlockDevice::flush()
+{
+    if (fd < 0)
+        return FileSystemStatus::DeviceError;
+
+    if (fdatasync(fd) < 0)
+        return FileSystemStatus::DeviceError;
+
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus IoUringBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (fd < 0)
+        return FileSystemStatus::DeviceError;
+
+    if (first_block < 0 || blocks_count < 0 || first_block > total_blocks - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+    if (blocks_count == 0)
+        return FileSystemStatus::OK;
+
+    off_t offset = static_cast<off_t>(first_block) * BLOCK_SIZE;
+    off_t length = static_cast<off_t>(blocks_count) * BLOCK_SIZE;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0)
+        return errno == EOPNOTSUPP ? FileSystemStatus::NotSupported : FileSystemStatus::DeviceError;
+
+    return FileSystemStatus::OK;
+}
+
+/********** Asynchronous interface ************/
+
+std::expected<uint64_t, FileSystemStatus> IoUringBlockDevice::queue_read(int block_index, uint8_t *buffer)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    return ring->queue(block_index, buffer, true);
+}
+
+std::expected<uint64_t, FileSystemStatus> IoUringBlockDevice::queue_write(int block_index, const uint8_t *buffer)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    return ring->queue(block_index, const_cast<uint8_t *>(buffer), false);
+}
+
+FileSystemStatus IoUringBlockDevice::submit()
+{
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    if (!ring->available())
+        return FileSystemStatus::OK; // pread / pwrite completed at queue time
+
+    return ring->submit();
+}
+
+std::expected<IoCompletion, FileSystemStatus> IoUringBlockDevice::wait_completion()
+{
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    if (!ring->completed.empty())
+    {
+        IoCompletion completion = ring->completed.front();
+        ring->completed.pop_front();
+        return completion;
+    }
+
+    if (!ring->available())
+        return std::unexpected(FileSystemStatus::NotFound);
+
+    IoCompletion completion;
+    FileSystemStatus status = ring->wait_one(completion);
+    if (status != FileSystemStatus::OK)
+        return std::unexpected(status);
+
+    return completion;
+}
+
+int IoUringBlockDevice::in_flight() const
+{
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    return static_cast<int>(ring->pending.size() + ring->completed.size());
+}
@@ -0,0 +1,876 @@
+#include "journal.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "fs_status.hpp"
+
+static const uint32_t JOURNAL_MAGIC = 0x4A524E4C; // "JRNL"
+static const uint32_t JOURNAL_VERSION = 1;
+static const int LOG_START_INDEX = JOURNAL_START_INDEX + 1;
+
+enum class JournalBlockType : uint32_t
+{
+    Superblock = 1,
+    Descriptor = 2,
+    Commit = 3
+};
+
+struct JournalHeader
+{
+    uint32_t magic;
+    JournalBlockType type;
+    uint64_t sequence;
+};
+
+struct JournalSuperblock
+{
+    JournalHeader header;
+    uint32_t version;
+};
+
+/* followed by block_count home block numbers, then revoke_count revoked ones */
+struct JournalDescriptor
+{
+    JournalHeader header;
+    int block_count;
+    int revoke_count;
+};
+
+struct JournalCommit
+{
+    JournalHeader header;
+    int block_count;
+    uint32_t checksum; // of the descriptor block and the images
+};
+
+static const int MAX_DESCRIPTOR_TAGS = (BLOCK_SIZE - sizeof(JournalDescriptor)) / sizeof(int);
+
+/* the journal a handle of this thread is open on, so handles of nested FileSystem calls join it */
+static thread_local const Journal *handle_owner = nullptr;
+/* the credits left to the handle of this thread, -1 when it did not start on an active journal */
+static thread_local int handle_credits = -1;
+/* the journal a read pin of this thread is held on */
+static thread_local const Journal *pin_owner = nullptr;
+
+Journal::Handle::Handle(Journal &_journal) : journal(_journal), outermost(false), started(false)
+{
+    if (handle_owner != nullptr)
+        return;
+
+    handle_owner = &journal;
+    outermost = true;
+    started = journal.start_handle();
+}
+
+Journal::Handle::~Handle()
+{
+    if (!outermost)
+        return;
+
+    if (started)
+        journal.stop_handle();
+    handle_owner = nullptr;
+    handle_credits = -1;
+}
+
+Journal::ReadPin::ReadPin(Journal &_journal) : journal(_journal), pinned(false)
+{
+    if (handle_owner != nullptr || pin_owner != nullptr)
+        return;
+
+    std::unique_lock<std::mutex> lock(journal.journal_mutex);
+    journal.state_changed.wait(lock, [this]
+                               { return !journal.checkpoint_waiting; });
+    journal.readers++;
+    pin_owner = &journal;
+    pinned = true;
+}
+
+Journal::ReadPin::~ReadPin()
+{
+    if (!pinned)
+        return;
+
+    std::lock_guard<std::mutex> lock(journal.journal_mutex);
+    if (--journal.readers == 0)
+        journal.state_changed.notify_all();
+    pin_owner = nullptr;
+}
+
+Journal::Journal(BlockDevice &_backing)
+    : backing(_backing), active(false), concurrent_reads(_backing.is_thread_safe()), running(std::make_unique<Transaction>()), readers(0),
+      checkpoint_waiting(false), log_head(0),
+      committed_sequence(0), failed_sequence(0), stats{}
+{
+}
+
+Journal::~Journal()
+{
+    if (active)
+        checkpoint();
+}
+
+bool Journal::is_valid_index(int block_index) const
+{
+    return block_index >= 0 && block_index < backing.get_total_blocks_number();
+}
+
+/* journal_mutex is held */
+const Journal::Block *Journal::find_logged(int block_index) const
+{
+    auto running_it = running->blocks.find(block_index);
+    if (running_it != running->blocks.end())
+        return running_it->second.get();
+
+    for (const Transaction *older : {committing.get(), failed.get()})
+    {
+        if (older == nullptr)
+            continue;
+        auto older_it = older->blocks.find(block_index);
+        if (older_it != older->blocks.end())
+            return older_it->second.get();
+    }
+
+    auto checkpoint_it = checkpoint_blocks.find(block_index);
+    if (checkpoint_it != checkpoint_blocks.end())
+        return checkpoint_it->second.get();
+
+    return nullptr;
+}
+
+/*
+ * This function returns the image of a block in the running transaction,
+ * copying in the newest version first. journal_mutex is held
+ */
+Journal::Block &Journal::running_block(int block_index, FileSystemStatus &status)
+{
+    status = FileSystemStatus::OK;
+    running->revoked.erase(block_index); // logged again, replay must apply it
+
+    const Block *logged = find_logged(block_index);
+    std::unique_ptr<Block> &image = running->blocks[block_index];
+    if (image != nullptr)
+        return *image;
+
+    image = std::make_unique<Block>();
+    charge_block();
+    if (logged != nullptr)
+    {
+        *image = *logged;
+        return *image;
+    }
+
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    status = backing.read_block(block_index, image->data());
+    return *image;
+}
+
+/*
+ * A block read from the backing device is not logged, so no checkpoint writes
+ * it home meanwhile and the inode locks keep file data writes off it
+ */
+std::unique_lock<std::mutex> Journal::read_lock() const
+{
+    std::unique_lock<std::mutex> io_lock(io_mutex, std::defer_lock);
+    if (!concurrent_reads)
+        io_lock.lock();
+    return io_lock;
+}
+
+/*
+ * The credits of the running handles are set aside, so the transaction still
+ * fits the log whatever all of them dirty before they stop
+ */
+bool Journal::has_room(int credits) const
+{
+    return running->blocks.size() + static_cast<size_t>(running->reserved + credits) <= MAX_TRANSACTION_BLOCKS;
+}
+
+/* journal_mutex is held, a handle that ran out of credits was not extended where it should have been */
+void Journal::charge_block()
+{
+    if (handle_owner != this || handle_credits <= 0)
+        return;
+    handle_credits--;
+    running->reserved--;
+}
+
+/*
+ * This function starts a handle on the running transaction. A handle whose
+ * credits do not fit waits for the running ones to stop, and once none runs
+ * the transaction is committed. A handle never starts while a commit waits
+ * for the running ones to finish
+ */
+bool Journal::start_handle()
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (!active)
+        return false;
+
+    while (true)
+    {
+        state_changed.wait(lock, [this]
+                           { return !running->locked; });
+        if (has_room(MAX_HANDLE_BLOCKS))
+            break;
+        if (running->updates > 0)
+        {
+            state_changed.wait(lock);
+            continue;
+        }
+        if (commit_locked(lock) != FileSystemStatus::OK)
+        {
+            /* the error reaches the caller on its own commit */
+            state_changed.wait(lock, [this]
+                               { return !running->locked; });
+            break;
+        }
+    }
+    running->updates++;
+    running->handles++;
+    running->reserved += MAX_HANDLE_BLOCKS;
+    handle_credits = MAX_HANDLE_BLOCKS;
+    return true;
+}
+
+/* the unused credits of a stopped handle are free again, a waiting one may start */
+void Journal::stop_handle()
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    running->updates--;
+    running->reserved -= handle_credits;
+    handle_credits = 0;
+    state_changed.notify_all();
+}
+
+void Journal::extend_handle(int blocks)
+{
+    if (handle_owner != this || handle_credits < 0 || handle_credits >= blocks)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        if (has_room(blocks - handle_credits))
+        {
+            running->reserved += blocks - handle_credits;
+            handle_credits = blocks;
+            return;
+        }
+    }
+
+    // start_handle() commits the transaction once no other handle runs
+    stop_handle();
+    start_handle();
+}
+
+FileSystemStatus Journal::recover()
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    active = false;
+
+    uint8_t buffer[BLOCK_SIZE];
+    if (backing.get_total_blocks_number() < JOURNAL_START_INDEX + JOURNAL_BLOCKS)
+        return FileSystemStatus::OK;
+    FileSystemStatus status = backing.read_block(JOURNAL_START_INDEX, buffer);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    JournalSuperblock journal_superblock;
+    std::memcpy(&journal_superblock, buffer, sizeof(journal_superblock));
+    if (journal_superblock.header.magic != JOURNAL_MAGIC || journal_superblock.header.type != JournalBlockType::Superblock ||
+        journal_superblock.version != JOURNAL_VERSION)
+        return FileSystemStatus::OK; // no journal, nothing to replay
+
+    /* collect the newest image of every block the complete transactions logged */
+    uint64_t sequence = journal_superblock.header.sequence;
+    std::map<int, std::unique_ptr<Block>> replay;
+    std::vector<uint8_t> transaction_buffer(static_cast<size_t>(JOURNAL_LOG_BLOCKS) * BLOCK_SIZE);
+    std::vector<int> log_indices(JOURNAL_LOG_BLOCKS);
+    int offset = 0;
+    while (offset + 2 <= JOURNAL_LOG_BLOCKS)
+    {
+        uint8_t *descriptor_block = transaction_buffer.data();
+        if (backing.read_block(LOG_START_INDEX + offset, descriptor_block) != FileSystemStatus::OK)
+            break;
+
+        JournalDescriptor descriptor;
+        std::memcpy(&descriptor, descriptor_block, sizeof(descriptor));
+        if (descriptor.header.magic != JOURNAL_MAGIC || descriptor.header.type != JournalBlockType::Descriptor ||
+            descriptor.header.sequence != sequence || descriptor.block_count < 0 || descriptor.revoke_count < 0 ||
+            descriptor.block_count + descriptor.revoke_count > MAX_DESCRIPTOR_TAGS ||
+            offset + descriptor.block_count + 2 > JOURNAL_LOG_BLOCKS)
+            break;
+
+        /* the images and the commit block in one batch */
+        int count = descriptor.block_count + 1;
+        for (int i = 0; i < count; i++)
+            log_indices[i] = LOG_START_INDEX + offset + 1 + i;
+        if (backing.read_blocks(std::span<const int>(log_indices.data(), count), descriptor_block + BLOCK_SIZE) != FileSystemStatus::OK)
+            break;
+
+        JournalCommit commit_record;
+        std::memcpy(&commit_record, descriptor_block + static_cast<size_t>(count) * BLOCK_SIZE, sizeof(commit_record));
+        size_t checked_bytes = static_cast<size_t>(count) * BLOCK_SIZE;
+        if (commit_record.header.magic != JOURNAL_MAGIC || commit_record.header.type != JournalBlockType::Commit ||
+            commit_record.header.sequence != sequence || commit_record.block_count != descriptor.block_count ||
+            commit_record.checksum != crc32c(descriptor_block, checked_bytes))
+            break; // torn or never completed, this and everything after it is ignored
+
+        std::vector<int> tags(descriptor.block_count + descriptor.revoke_count);
+        std::memcpy(tags.data(), descriptor_block + sizeof(descriptor), tags.size() * sizeof(int));
+        if (std::any_of(tags.begin(), tags.end(), [this](int block_index)
+                        { return !is_valid_index(block_index) ||
+                                 (block_index >= JOURNAL_START_INDEX && block_index < JOURNAL_START_INDEX + JOURNAL_BLOCKS); }))
+            break;
+
+        for (int i = 0; i < descriptor.revoke_count; i++)
+            replay.erase(tags[descriptor.block_count + i]);
+        for (int i = 0; i < descriptor.block_count; i++)
+        {
+            std::unique_ptr<Block> &image = replay[tags[i]];
+            if (image == nullptr)
+                image = std::make_unique<Block>();
+            std::memcpy(image->data(), descriptor_block + static_cast<size_t>(i + 1) * BLOCK_SIZE, BLOCK_SIZE);
+            stats.replayed_blocks++;
+        }
+
+        stats.replayed_transactions++;
+        offset += descriptor.block_count + 2;
+        sequence++;
+    }
+
+    if (!replay.empty())
+    {
+        std::map<int, const Block *> home;
+        for (const auto &[block_index, image] : replay)
+            home[block_index] = image.get();
+        status = write_home(home);
+        if (status == FileSystemStatus::OK)
+            status = backing.flush();
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    /* the replayed transactions are home, the log starts over */
+    if (offset != 0)
+    {
+        status = write_journal_superblock(sequence);
+        if (status == FileSystemStatus::OK)
+            status = backing.flush();
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    running = std::make_unique<Transaction>();
+    running->sequence = sequence;
+    failed.reset();
+    committed_sequence = sequence - 1;
+    failed_sequence = 0;
+    log_head = 0;
+    active = true;
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function writes an empty journal. The sequence continues past every
+ * transaction the old log could hold, so its stale blocks never match
+ */
+FileSystemStatus Journal::format()
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+
+    if (backing.get_total_blocks_number() < JOURNAL_START_INDEX + JOURNAL_BLOCKS)
+        return FileSystemStatus::OutOfBounds;
+
+    uint64_t sequence = 1;
+    uint8_t buffer[BLOCK_SIZE];
+    if (backing.read_block(JOURNAL_START_INDEX, buffer) == FileSystemStatus::OK)
+    {
+        JournalSuperblock old_superblock;
+        std::memcpy(&old_superblock, buffer, sizeof(old_superblock));
+        if (old_superblock.header.magic == JOURNAL_MAGIC && old_superblock.header.type == JournalBlockType::Superblock)
+            sequence = old_superblock.header.sequence + JOURNAL_LOG_BLOCKS;
+    }
+
+    FileSystemStatus status = write_journal_superblock(sequence);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    /* a handle of the formatting call may be running, it stays on the emptied transaction */
+    running->blocks.clear();
+    running->revoked.clear();
+    running->sequence = sequence;
+    failed.reset();
+    checkpoint_blocks.clear();
+    committed_sequence = sequence - 1;
+    failed_sequence = 0;
+    log_head = 0;
+    active = true;
+    return FileSystemStatus::OK;
+}
+
+JournalStats Journal::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    return stats;
+}
+
+/* io_mutex is held */
+FileSystemStatus Journal::write_journal_superblock(uint64_t sequence)
+{
+    uint8_t buffer[BLOCK_SIZE] = {};
+    JournalSuperblock journal_superblock{{JOURNAL_MAGIC, JournalBlockType::Superblock, sequence}, JOURNAL_VERSION};
+    std::memcpy(buffer, &journal_superblock, sizeof(journal_superblock));
+    return backing.write_block(JOURNAL_START_INDEX, buffer);
+}
+
+/* io_mutex is held, the blocks go home in sorted batches */
+FileSystemStatus Journal::write_home(const std::map<int, const Block *> &blocks)
+{
+    std::vector<int> indices;
+    std::vector<uint8_t> buffer(static_cast<size_t>(MAX_BATCH_BLOCKS) * BLOCK_SIZE);
+    auto it = blocks.begin();
+    while (it != blocks.end())
+    {
+        indices.clear();
+        for (; it != blocks.end() && indices.size() < static_cast<size_t>(MAX_BATCH_BLOCKS); ++it)
+        {
+            std::memcpy(buffer.data() + indices.size() * BLOCK_SIZE, it->second->data(), BLOCK_SIZE);
+            indices.push_back(it->first);
+        }
+
+        FileSystemStatus status = backing.write_blocks(indices, buffer.data());
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+    return FileSystemStatus::OK;
+}
+
+/*
+ * the descriptor, the images and the commit block as one sequential write, then one flush.
+ * The file data written home meanwhile is flushed first, a commit block never reaches the
+ * device before the data the logged metadata points to
+ */
+FileSystemStatus Journal::write_transaction(const Transaction &transaction, int log_offset)
+{
+    int block_count = static_cast<int>(transaction.blocks.size());
+    int total = block_count + 2;
+    std::vector<uint8_t> buffer(static_cast<size_t>(total) * BLOCK_SIZE, 0);
+    std::vector<int> indices(total);
+    for (int i = 0; i < total; i++)
+        indices[i] = LOG_START_INDEX + log_offset + i;
+
+    JournalDescriptor descriptor{{JOURNAL_MAGIC, JournalBlockType::Descriptor, transaction.sequence}, block_count,
+                                 static_cast<int>(transaction.revoked.size())};
+    std::memcpy(buffer.data(), &descriptor, sizeof(descriptor));
+    int *tags = reinterpret_cast<int *>(buffer.data() + sizeof(descriptor));
+    int i = 0;
+    for (const auto &[block_index, image] : transaction.blocks)
+    {
+        tags[i] = block_index;
+        std::memcpy(buffer.data() + static_cast<size_t>(i + 1) * BLOCK_SIZE, image->data(), BLOCK_SIZE);
+        i++;
+    }
+    for (int block_index : transaction.revoked)
+        tags[i++] = block_index;
+
+    size_t checked_bytes = static_cast<size_t>(block_count + 1) * BLOCK_SIZE;
+    JournalCommit commit_record{{JOURNAL_MAGIC, JournalBlockType::Commit, transaction.sequence}, block_count,
+                                crc32c(buffer.data(), checked_bytes)};
+    std::memcpy(buffer.data() + checked_bytes, &commit_record, sizeof(commit_record));
+
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    FileSystemStatus status = transaction.ordered_data ? backing.flush() : FileSystemStatus::OK;
+    if (status == FileSystemStatus::OK)
+        status = backing.write_blocks(indices, buffer.data());
+    if (status == FileSystemStatus::OK)
+        status = backing.flush();
+    return status;
+}
+
+/*
+ * This function writes every logged block home and empties the log.
+ * journal_mutex is held, no commit is in flight and no handle runs. The
+ * pinned readers may read those blocks from the backing device, they finish first
+ */
+FileSystemStatus Journal::checkpoint_locked(std::unique_lock<std::mutex> &lock)
+{
+    checkpoint_waiting = true;
+    state_changed.wait(lock, [this]
+                       { return readers == 0; });
+    checkpoint_waiting = false;
+    state_changed.notify_all(); // the readers waiting start once journal_mutex is free
+
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    FileSystemStatus status = FileSystemStatus::OK;
+    if (!checkpoint_blocks.empty())
+    {
+        std::map<int, const Block *> home;
+        for (const auto &[block_index, image] : checkpoint_blocks)
+            home[block_index] = image.get();
+        status = write_home(home);
+        if (status == FileSystemStatus::OK)
+            status = backing.flush();
+        if (status != FileSystemStatus::OK)
+            return status;
+    }
+
+    /* the log is empty once the superblock skips past the checkpointed transactions */
+    status = write_journal_superblock(failed != nullptr ? failed->sequence : running->sequence);
+    if (status == FileSystemStatus::OK)
+        status = backing.flush();
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    checkpoint_blocks.clear();
+    log_head = 0;
+    stats.checkpoints++;
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function commits the running transaction. While another commit is in
+ * flight it waits for it, the running transaction keeps gathering handles
+ * and the callers that arrived meanwhile are all committed by one of them.
+ * The log is written outside journal_mutex, so new handles start on the next
+ * running transaction in the meantime
+ */
+FileSystemStatus Journal::commit_locked(std::unique_lock<std::mutex> &lock)
+{
+    uint64_t target = running->sequence;
+    while (true)
+    {
+        if (committed_sequence >= target)
+            return FileSystemStatus::OK;
+        if (failed_sequence >= target)
+            return FileSystemStatus::DeviceError;
+        if (committing == nullptr && !running->locked && running->sequence == target)
+            break;
+        state_changed.wait(lock);
+    }
+
+    if (failed == nullptr && running->blocks.empty() && running->revoked.empty())
+    {
+        /* nothing logged, the data written so far only needs the flush */
+        lock.unlock();
+        FileSystemStatus status;
+        {
+            std::lock_guard<std::mutex> io_lock(io_mutex);
+            status = backing.flush();
+        }
+        lock.lock();
+        return status;
+    }
+
+    running->locked = true;
+    state_changed.wait(lock, [this]
+                       { return running->updates == 0; });
+
+    /* a transaction whose log write failed goes first, the running one follows it in the log */
+    FileSystemStatus status = FileSystemStatus::OK;
+    if (failed != nullptr)
+    {
+        status = make_log_room(lock, *failed);
+        if (status == FileSystemStatus::OK)
+        {
+            committing = std::move(failed);
+            status = log_committing(lock);
+        }
+    }
+    bool running_empty = running->blocks.empty() && running->revoked.empty();
+    if (status == FileSystemStatus::OK && !running_empty)
+        status = make_log_room(lock, *running);
+    if (status != FileSystemStatus::OK || running_empty)
+    {
+        running->locked = false;
+        state_changed.notify_all();
+        return status;
+    }
+
+    committing = std::move(running);
+    running = std::make_unique<Transaction>();
+    running->sequence = committing->sequence + 1;
+    return log_committing(lock);
+}
+
+/* journal_mutex is held and no commit is in flight, the log is checkpointed when the transaction does not fit after log_head */
+FileSystemStatus Journal::make_log_room(std::unique_lock<std::mutex> &lock, const Transaction &transaction)
+{
+    int needed = static_cast<int>(transaction.blocks.size()) + 2;
+    if (needed > JOURNAL_LOG_BLOCKS ||
+        transaction.blocks.size() + transaction.revoked.size() > static_cast<size_t>(MAX_DESCRIPTOR_TAGS))
+        return FileSystemStatus::FullDisk;
+    if (log_head + needed > JOURNAL_LOG_BLOCKS)
+        return checkpoint_locked(lock);
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function writes the committing transaction at log_head outside
+ * journal_mutex. A transaction that fails stays apart from the running one,
+ * so it never grows past the log, and the next commit writes it again first
+ */
+FileSystemStatus Journal::log_committing(std::unique_lock<std::mutex> &lock)
+{
+    int log_offset = log_head;
+    log_head += static_cast<int>(committing->blocks.size()) + 2;
+
+    lock.unlock();
+    state_changed.notify_all();
+    FileSystemStatus status = write_transaction(*committing, log_offset);
+    lock.lock();
+
+    if (status == FileSystemStatus::OK)
+    {
+        /* images revoked by the running transaction are stale, the rest wait for the checkpoint */
+        for (auto &[block_index, image] : committing->blocks)
+            if (running->revoked.count(block_index) == 0)
+                checkpoint_blocks[block_index] = std::move(image);
+
+        committed_sequence = committing->sequence;
+        stats.commits++;
+        stats.handles_committed += committing->handles;
+        stats.blocks_logged += committing->blocks.size();
+        stats.revokes_logged += committing->revoked.size();
+        committing.reset();
+    }
+    else
+    {
+        failed = std::move(committing);
+        failed_sequence = failed->sequence;
+        log_head = log_offset;
+    }
+
+    state_changed.notify_all();
+    return status;
+}
+
+FileSystemStatus Journal::commit()
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (!active)
+    {
+        lock.unlock();
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        return backing.flush();
+    }
+    return commit_locked(lock);
+}
+
+FileSystemStatus Journal::checkpoint()
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (!active)
+        return FileSystemStatus::OK;
+
+    FileSystemStatus status = commit_locked(lock);
+    if (status != FileSystemStatus::OK)
+        return status;
+
+    /* no handle starts while the pinned readers are waited for */
+    state_changed.wait(lock, [this]
+                       { return committing == nullptr && !running->locked; });
+    running->locked = true;
+    state_changed.wait(lock, [this]
+                       { return running->updates == 0; });
+    status = checkpoint_locked(lock);
+    running->locked = false;
+    state_changed.notify_all();
+    return status;
+}
+
+/*
+ * This function drops the logged images of a block that is about to be written
+ * in place, and revokes the committed ones so neither a checkpoint nor replay
+ * writes them over the new content. journal_mutex is held
+ */
+void Journal::forget_logged(int block_index)
+{
+    running->blocks.erase(block_index);
+    if (failed != nullptr)
+        failed->blocks.erase(block_index);
+    bool committing_logged = committing != nullptr && committing->blocks.count(block_index) != 0;
+    if (checkpoint_blocks.erase(block_index) != 0 || committing_logged)
+    {
+        running->revoked.insert(block_index);
+        if (failed != nullptr)
+            failed->revoked.insert(block_index); // it reaches the log before the running one
+    }
+}
+
+FileSystemStatus Journal::write_data_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        if (active)
+        {
+            running->ordered_data = true;
+            for (int block_index : block_indices)
+                forget_logged(block_index);
+        }
+    }
+
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    return backing.write_blocks(block_indices, buffer);
+}
+
+FileSystemStatus Journal::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > get_total_blocks_number() - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        if (active)
+            for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+                forget_logged(block_index);
+    }
+
+    std::lock_guard<std::mutex> io_lock(io_mutex);
+    return backing.discard_blocks(first_block, blocks_count);
+}
+
+FileSystemStatus Journal::prefetch_blocks(std::span<const int> block_indices) const
+{
+    auto io_lock = read_lock();
+    return backing.prefetch_blocks(block_indices);
+}
+
+void Journal::cancel_prefetch(std::span<const int> block_indices) const
+{
+    auto io_lock = read_lock();
+    backing.cancel_prefetch(block_indices);
+}
+
+int Journal::get_total_blocks_number() const
+{
+    return backing.get_total_blocks_number();
+}
+
+FileSystemStatus Journal::read_block(int block_index, uint8_t *buffer) const
+{
+    return read_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+FileSystemStatus Journal::write_block(int block_index, const uint8_t *buffer)
+{
+    return write_blocks(std::span<const int>(&block_index, 1), buffer);
+}
+
+/* logged blocks are copied from their newest image, the rest is read in one batch */
+FileSystemStatus Journal::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    std::vector<int> missing_indices;
+    std::vector<size_t> missing_positions;
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        for (size_t i = 0; i < block_indices.size(); i++)
+        {
+            if (!is_valid_index(block_indices[i]))
+                return FileSystemStatus::OutOfBounds;
+
+            const Block *logged = active ? find_logged(block_indices[i]) : nullptr;
+            if (logged != nullptr)
+                std::memcpy(buffer + i * BLOCK_SIZE, logged->data(), BLOCK_SIZE);
+            else
+            {
+                missing_indices.push_back(block_indices[i]);
+                missing_positions.push_back(i);
+            }
+        }
+    }
+
+    if (missing_indices.empty())
+        return FileSystemStatus::OK;
+
+    auto io_lock = read_lock();
+    if (missing_indices.size() == block_indices.size())
+        return backing.read_blocks(block_indices, buffer);
+
+    std::vector<uint8_t> missing_buffer(missing_indices.size() * BLOCK_SIZE);
+    FileSystemStatus status = backing.read_blocks(missing_indices, missing_buffer.data());
+    if (status != FileSystemStatus::OK)
+        return status;
+    for (size_t i = 0; i < missing_indices.size(); i++)
+        std::memcpy(buffer + missing_positions[i] * BLOCK_SIZE, missing_buffer.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus Journal::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (!active)
+    {
+        lock.unlock();
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        return backing.write_blocks(block_indices, buffer);
+    }
+
+    for (int block_index : block_indices)
+        if (!is_valid_index(block_index))
+            return FileSystemStatus::OutOfBounds;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        running->revoked.erase(block_indices[i]);
+        std::unique_ptr<Block> &image = running->blocks[block_indices[i]];
+        if (image == nullptr)
+        {
+            image = std::make_unique<Block>();
+            charge_block();
+        }
+        std::memcpy(image->data(), buffer + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> Journal::view_block(int block_index) const
+{
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex);
+        if (!is_valid_index(block_index))
+            return std::unexpected(FileSystemStatus::OutOfBounds);
+
+        const Block *logged = active ? find_logged(block_index) : nullptr;
+        if (logged != nullptr && handle_owner != this)
+            return std::unexpected(FileSystemStatus::NotSupported);
+        if (logged != nullptr)
+            return std::span<const uint8_t, BLOCK_SIZE>(logged->data(), BLOCK_SIZE);
+    }
+
+    /* the view of a device that is not thread safe ends at the next call of any thread, the caller reads a copy */
+    if (!concurrent_reads)
+        return std::unexpected(FileSystemStatus::NotSupported);
+    return backing.view_block(block_index);
+}
+
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> Journal::mutable_view_block(int block_index)
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (!active)
+    {
+        lock.unlock();
+        std::lock_guard<std::mutex> io_lock(io_mutex);
+        return backing.mutable_view_block(block_index);
+    }
+
+    if (!is_valid_index(block_index))
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    FileSystemStatus status;
+    Block &image = running_block(block_index, status);
+    if (status != FileSystemStatus::OK)
+    {
+        running->blocks.erase(block_index);
+        return std::unexpected(status);
+    }
+    return std::span<uint8_t, BLOCK_SIZE>(image.data(), BLOCK_SIZE);
+}
+
+FileSystemStatus Journal::flush()
+{
+    return commit();
+}
@@ -0,0 +1,170 @@
+#include "lz_codec.hpp"
+#include <cstring>
+
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5; // the stream always ends with literals
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 12;
+
+static uint32_t load32(const uint8_t *source)
+{
+    uint32_t value;
+    std::memcpy(&value, source, sizeof(value));
+    return value;
+}
+
+static uint32_t hash_sequence(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* writes a length that did not fit in its 4 token bits, 255 at a time */
+static bool write_length_extension(size_t length, uint8_t *dst, size_t dst_capacity, size_t &out)
+{
+    while (length >= 255)
+    {
+        if (out >= dst_capacity)
+            return false;
+        dst[out++] = 255;
+        length -= 255;
+    }
+    if (out >= dst_capacity)
+        return false;
+    dst[out++] = static_cast<uint8_t>(length);
+    return true;
+}
+
+/* writes one sequence, match_length 0 marks the last sequence */
+static bool write_sequence(const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length,
+                           uint8_t *dst, size_t dst_capacity, size_t &out)
+{
+    if (out >= dst_capacity)
+        return false;
+
+    size_t match_code = match_length == 0 ? 0 : match_length - MIN_MATCH;
+    size_t token = out++;
+    dst[token] = static_cast<uint8_t>(((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15));
+
+    if (literal_length >= 15 && !write_length_extension(literal_length - 15, dst, dst_capacity, out))
+        return false;
+
+    if (out + literal_length > dst_capacity)
+        return false;
+    if (literal_length > 0)
+        std::memcpy(dst + out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length == 0)
+        return true;
+
+    if (out + 2 > dst_capacity)
+        return false;
+    dst[out++] = static_cast<uint8_t>(offset & 0xFF);
+    dst[out++] = static_cast<uint8_t>(offset >> 8);
+
+    if (match_code >= 15 && !write_length_extension(match_code - 15, dst, dst_capacity, out))
+        return false;
+    return true;
+}
+
+/*
+ * This function finds matches through a hash table of the last position of
+ * every 4 byte sequence, greedy, one candidate per position
+ */
+size_t lz_compress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_capacity)
+{
+    uint32_t last_position[1 << HASH_BITS]; // position + 1, 0 is empty
+    std::memset(last_position, 0, sizeof(last_position));
+
+    size_t out = 0;
+    size_t anchor = 0;
+    size_t position = 0;
+    size_t match_limit = src_size > LAST_LITERALS + MIN_MATCH ? src_size - LAST_LITERALS : 0;
+
+    while (position + MIN_MATCH <= match_limit)
+    {
+        uint32_t sequence = load32(src + position);
+        uint32_t hash = hash_sequence(sequence);
+        size_t candidate = last_position[hash];
+        last_position[hash] = static_cast<uint32_t>(position + 1);
+
+        if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET || load32(src + candidate - 1) != sequence)
+        {
+            position++;
+            continue;
+        }
+        candidate--;
+
+        size_t match_length = MIN_MATCH;
+        while (position + match_length < match_limit && src[candidate + match_length] == src[position + match_length])
+            match_length++;
+
+        if (!write_sequence(src + anchor, position - anchor, position - candidate, match_length, dst, dst_capacity, out))
+            return 0;
+
+        position += match_length;
+        anchor = position;
+    }
+
+    if (!write_sequence(src + anchor, src_size - anchor, 0, 0, dst, dst_capacity, out))
+        return 0;
+    return out;
+}
+
+/* reads a length extension, false if the input ends first */
+static bool read_length_extension(const uint8_t *src, size_t src_size, size_t &in, size_t &length)
+{
+    uint8_t byte;
+    do
+    {
+        if (in >= src_size)
+            return false;
+        byte = src[in++];
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < src_size)
+    {
+        uint8_t token = src[in++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length_extension(src, src_size, in, literal_length))
+            return false;
+        if (literal_length > src_size - in || literal_length > dst_size - out)
+            return false;
+        if (literal_length > 0)
+            std::memcpy(dst + out, src + in, literal_length);
+        in += literal_length;
+        out += literal_length;
+
+        if (in == src_size) // the last sequence
+            break;
+
+        if (src_size - in < 2)
+            return false;
+        size_t offset = src[in] | (static_cast<size_t>(src[in + 1]) << 8);
+        in += 2;
+        if (offset == 0 || offset > out)
+            return false;
+
+        size_t match_length = token & 0x0F;
+        if (match_length == 15 && !read_length_extension(src, src_size, in, match_length))
+            return false;
+        match_length += MIN_MATCH;
+        if (match_length > dst_size - out)
+            return false;
+
+        // byte by byte since the match may overlap its own output
+        for (size_t i = 0; i < match_length; i++, out++)
+            dst[out] = dst[out - offset];
+    }
+
+    return out == dst_size;
+}
@@ -0,0 +1,255 @@
+#include "mmap_block_device.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "fs_status.hpp"
+
+/*
+ * msync and madvise work on whole pages, the page may be larger than a block
+ * returns the page aligned [begin, begin + length) range covering the blocks
+ */
+static void page_align_range(int first_block, int blocks_count, size_t &begin, size_t &length)
+{
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = static_cast<size_t>(first_block) * BLOCK_SIZE;
+    size_t end = start + static_cast<size_t>(blocks_count) * BLOCK_SIZE;
+
+    begin = start - start % page_size;
+    length = end - begin;
+}
+
+/*
+ * This constructor opens the image file and maps it into memory
+ * A new image is extended with ftruncate so it stays sparse on disk
+ */
+MmapBlockDevice::MmapBlockDevice(const std::string &image_path, uint64_t size_byte)
+    : fd(-1), mapping(nullptr), total_blocks(0)
+{
+    fd = open(image_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+
+    struct stat image_stat;
+    if (fstat(fd, &image_stat) < 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    uint64_t required_blocks = (size_byte + BLOCK_SIZE - 1) / BLOCK_SIZE; // ceiling value
+    uint64_t existing_blocks = static_cast<uint64_t>(image_stat.st_size) / BLOCK_SIZE;
+    if (existing_blocks > required_blocks) // never truncate a volume
+        required_blocks = existing_blocks;
+    if (required_blocks == 0)
+        required_blocks = 1;
+
+    uint64_t image_size = required_blocks * BLOCK_SIZE;
+    if (static_cast<uint64_t>(image_stat.st_size) < image_size && ftruncate(fd, image_size) < 0)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    void *address = mmap(nullptr, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    mapping = static_cast<uint8_t *>(address);
+    total_blocks = static_cast<int>(required_blocks);
+}
+
+MmapBlockDevice::~MmapBlockDevice()
+{
+    if (mapping != nullptr)
+    {
+        msync(mapping, static_cast<size_t>(total_blocks) * BLOCK_SIZE, MS_SYNC);
+        munmap(mapping, static_cast<size_t>(total_blocks) * BLOCK_SIZE);
+    }
+
+    if (fd >= 0)
+        close(fd);
+}
+
+int MmapBlockDevice::get_total_blocks_number() const
+{
+    return total_blocks;
+}
+
+FileSystemStatus MmapBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    std::memcpy(buffer, mapping + static_cast<size_t>(block_index) * BLOCK_SIZE, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus MmapBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    std::memcpy(mapping + static_cast<size_t>(block_index) * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+/* the whole batch is validated first so a bad index leaves the image untouched */
+FileSystemStatus MmapBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+        std::memcpy(buffer + i * BLOCK_SIZE, mapping + static_cast<size_t>(block_indices[i]) * BLOCK_SIZE, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus MmapBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    for (size_t i = 0; i < block_indices.size(); i++)
+        std::memcpy(mapping + static_cast<size_t>(block_indices[i]) * BLOCK_SIZE, buffer + i * BLOCK_SIZE, BLOCK_SIZE);
+    return FileSystemStatus::OK;
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> MmapBlockDevice::view_block(int block_index) const
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    return std::span<const uint8_t, BLOCK_SIZE>(mapping + static_cast<size_t>(block_index) * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> MmapBlockDevice::mutable_view_block(int block_index)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    return std::span<uint8_t, BLOCK_SIZE>(mapping + static_cast<size_t>(block_index) * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+FileSystemStatus MmapBlockDevice::flush()
+{
+    return flush_blocks(0, total_blocks);
+}
+
+/*
+ * This function writes the dirty pages of a block range back to the image
+ * and waits for the write to complete
+ */
+FileSystemStatus MmapBlockDevice::flush_blocks(int first_block, int blocks_count)
+{
+    if (mapping == nullptr)
+        return FileSystemStatus::DeviceError;
+
+    if (first_block < 0 || blocks_count < 0 || first_block + blocks_count > total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    size_t begin, length;
+    page_align_range(first_block, blocks_count, begin, length);
+
+    if (msync(mapping + begin, length, MS_SYNC) < 0)
+        return FileSystemStatus::DeviceError;
+
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function gives the storage of a block range back to the file system
+ * holding the image, which keeps the image sparse. The size stays the same
+ */
+FileSystemStatus MmapBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (mapping == nullptr)
+        return FileSystemStatus::DeviceError;
+
+    if (first_block < 0 || blocks_count < 0 || first_block > total_blocks - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+    if (blocks_count == 0)
+        return FileSystemStatus::OK;
+
+    off_t offset = static_cast<off_t>(first_block) * BLOCK_SIZE;
+    off_t length = static_cast<off_t>(blocks_count) * BLOCK_SIZE;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0)
+        return errno == EOPNOTSUPP ? FileSystemStatus::NotSupported : FileSystemStatus::DeviceError;
+
+    return FileSystemStatus::OK;
+}
+
+/*
+ * This function tells the kernel how a block range is about to be accessed
+ * e.g. WillNeed pages the range in ahead of time, Random disables readahead
+ */
+FileSystemStatus MmapBlockDevice::prefetch_blocks(std::span<const int> block_indices) const
+{
+    if (mapping == nullptr)
+        return FileSystemStatus::DeviceError;
+
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    size_t run_start = 0;
+    for (size_t i = 1; i <= block_indices.size(); i++)
+    {
+        if (i < block_indices.size() && block_indices[i] == block_indices[i - 1] + 1)
+            continue;
+
+        size_t begin, length;
+        page_align_range(block_indices[run_start], static_cast<int>(i - run_start), begin, length);
+        if (madvise(mapping + begin, length, MADV_WILLNEED) < 0)
+            return FileSystemStatus::DeviceError;
+        run_start = i;
+    }
+    return FileSystemStatus::OK;
+}
+
+FileSystemStatus MmapBlockDevice::advise_blocks(int first_block, int blocks_count, BlockAccessHint hint)
+{
+    if (mapping == nullptr)
+        return FileSystemStatus::DeviceError;
+
+    if (first_block < 0 || blocks_count < 0 || first_block + blocks_count > total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    int advice = MADV_NORMAL;
+    switch (hint)
+    {
+    case BlockAccessHint::Normal:
+        advice = MADV_NORMAL;
+        break;
+    case BlockAccessHint::Sequential:
+        advice = MADV_SEQUENTIAL;
+        break;
+    case BlockAccessHint::Random:
+        advice = MADV_RANDOM;
+        break;
+    case BlockAccessHint::WillNeed:
+        advice = MADV_WILLNEED;
+        break;
+    case BlockAccessHint::DontNeed:
+        advice = MADV_DONTNEED;
+        break;
+    }
+
+    size_t begin, length;
+    page_align_range(first_block, blocks_count, begin, length);
+
+    if (madvise(mapping + begin, length, advice) < 0)
+        return FileSystemStatus::DeviceError;
+
+    return FileSystemStatus::OK;
+}
@@ -0,0 +1,348 @@
+#include "stats_block_device.hpp"
+#include <algorithm>
+#include <bit>
+#include <sstream>
+#include "fs_status.hpp"
+
+static const char *OPERATION_NAMES[DEVICE_OPERATIONS_NUMBER] = {
+    "read", "write", "read_batch", "write_batch", "view", "mutable_view", "flush", "discard", "prefetch"};
+
+/* the device calls made by this thread, FileSystem calls run concurrently so a CallScope counts its own thread only */
+static thread_local uint64_t thread_device_ops = 0;
+static thread_local uint64_t thread_blocks = 0;
+
+/********** LatencyHistogram ************/
+
+LatencyHistogram::LatencyHistogram()
+    : buckets{}, total_count(0), total_sum(0), min_value(UINT64_MAX), max_value(0)
+{
+}
+
+/* values below SUB_BUCKETS get a bucket each, above that 16 buckets per power of two */
+int LatencyHistogram::bucket_of(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return static_cast<int>(value);
+
+    int exponent = 63 - std::countl_zero(value); // >= SUB_BUCKET_BITS
+    int shift = exponent - SUB_BUCKET_BITS;
+    int sub_bucket = static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    return SUB_BUCKETS + shift * SUB_BUCKETS + sub_bucket;
+}
+
+uint64_t LatencyHistogram::bucket_upper_value(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return static_cast<uint64_t>(bucket);
+
+    int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t sub_bucket = static_cast<uint64_t>((bucket - SUB_BUCKETS) % SUB_BUCKETS);
+    return ((SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    buckets[bucket_of(value)]++;
+    total_count++;
+    total_sum += value;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < BUCKETS_NUMBER; i++)
+        buckets[i] += other.buckets[i];
+    total_count += other.total_count;
+    total_sum += other.total_sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+}
+
+double LatencyHistogram::mean() const
+{
+    return total_count == 0 ? 0 : static_cast<double>(total_sum) / total_count;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const
+{
+    if (total_count == 0)
+        return 0;
+
+    uint64_t wanted = static_cast<uint64_t>(percent / 100.0 * total_count + 0.5);
+    wanted = std::clamp<uint64_t>(wanted, 1, total_count);
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS_NUMBER; i++)
+    {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return std::clamp(bucket_upper_value(i), min(), max_value);
+    }
+    return max_value;
+}
+
+/********** StatsBlockDevice ************/
+
+StatsBlockDevice::CallScope::CallScope(StatsBlockDevice *_device, std::string _call_name)
+    : device(_device), call_name(std::move(_call_name)), device_ops_at_start(0), blocks_at_start(0)
+{
+    if (device == nullptr)
+        return;
+
+    device_ops_at_start = thread_device_ops;
+    blocks_at_start = thread_blocks;
+}
+
+StatsBlockDevice::CallScope::~CallScope()
+{
+    if (device == nullptr)
+        return;
+
+    uint64_t device_ops = thread_device_ops - device_ops_at_start;
+
+    std::lock_guard<std::mutex> lock(device->stats_mutex);
+    FileSystemCallStats &stats = device->call_stats[call_name];
+    stats.calls++;
+    stats.device_ops += device_ops;
+    stats.blocks += thread_blocks - blocks_at_start;
+    stats.max_device_ops = std::max(stats.max_device_ops, device_ops);
+}
+
+StatsBlockDevice::StatsBlockDevice(BlockDevice &_backing, int _heat_region_blocks)
+    : backing(_backing), heat_region_blocks(std::max(1, _heat_region_blocks)), total_device_ops(0), total_blocks(0)
+{
+    int regions = (backing.get_total_blocks_number() + heat_region_blocks - 1) / heat_region_blocks;
+    region_reads.assign(regions, 0);
+    region_writes.assign(regions, 0);
+}
+
+/* out of range indices are left out of the heat map, the call still counts */
+void StatsBlockDevice::record(DeviceOperation operation, std::span<const int> block_indices,
+                              std::chrono::steady_clock::time_point start, FileSystemStatus status) const
+{
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    bool is_write = operation == DeviceOperation::Write || operation == DeviceOperation::WriteBatch ||
+                    operation == DeviceOperation::MutableView || operation == DeviceOperation::Discard;
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    OperationStats &stats = operations[static_cast<int>(operation)];
+    stats.calls++;
+    stats.latency_ns.record(elapsed);
+    total_device_ops++;
+    thread_device_ops++;
+
+    if (status != FileSystemStatus::OK)
+    {
+        stats.errors++;
+        return;
+    }
+
+    stats.blocks += block_indices.size();
+    stats.bytes += block_indices.size() * BLOCK_SIZE;
+    total_blocks += block_indices.size();
+    thread_blocks += block_indices.size();
+
+    std::vector<uint64_t> &heat_map = is_write ? region_writes : region_reads;
+    for (int block_index : block_indices)
+    {
+        size_t region = static_cast<size_t>(block_index / heat_region_blocks);
+        if (block_index >= 0 && region < heat_map.size())
+            heat_map[region]++;
+    }
+}
+
+OperationStats StatsBlockDevice::get_operation_stats(DeviceOperation operation) const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return operations[static_cast<int>(operation)];
+}
+
+std::map<std::string, FileSystemCallStats> StatsBlockDevice::get_call_stats() const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return call_stats;
+}
+
+uint64_t StatsBlockDevice::get_total_device_ops() const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return total_device_ops;
+}
+
+uint64_t StatsBlockDevice::get_region_reads(int region) const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (region < 0 || static_cast<size_t>(region) >= region_reads.size())
+        return 0;
+    return region_reads[region];
+}
+
+uint64_t StatsBlockDevice::get_region_writes(int region) const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    if (region < 0 || static_cast<size_t>(region) >= region_writes.size())
+        return 0;
+    return region_writes[region];
+}
+
+/*
+ * This function writes all the figures as one JSON object:
+ * {"operations": {...}, "calls": {...}, "heat_map": {"region_blocks": n, "regions": [[first_block, reads, writes], ...]}}
+ */
+std::string StatsBlockDevice::to_json(std::string_view extra_members) const
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    std::ostringstream json;
+
+    json << "{\"operations\": {";
+    for (int i = 0; i < DEVICE_OPERATIONS_NUMBER; i++)
+    {
+        const OperationStats &stats = operations[i];
+        const LatencyHistogram &latency = stats.latency_ns;
+        json << (i == 0 ? "" : ", ") << "\"" << OPERATION_NAMES[i] << "\": {"
+             << "\"calls\": " << stats.calls << ", \"blocks\": " << stats.blocks
+             << ", \"bytes\": " << stats.bytes << ", \"errors\": " << stats.errors
+             << ", \"latency_ns\": {\"min\": " << latency.min() << ", \"mean\": " << latency.mean()
+             << ", \"p50\": " << latency.percentile(50) << ", \"p90\": " << latency.percentile(90)
+             << ", \"p99\": " << latency.percentile(99) << ", \"p999\": " << latency.percentile(99.9)
+             << ", \"max\": " << latency.max() << "}}";
+    }
+
+    json << "}, \"calls\": {";
+    bool first = true;
+    for (const auto &[call_name, stats] : call_stats)
+    {
+        json << (first ? "" : ", ") << "\"" << call_name << "\": {"
+             << "\"calls\": " << stats.calls << ", \"device_ops\": " << stats.device_ops
+             << ", \"device_ops_per_call\": " << stats.device_ops_per_call()
+             << ", \"max_device_ops\": " << stats.max_device_ops << ", \"blocks\": " << stats.blocks << "}";
+        first = false;
+    }
+
+    json << "}, \"heat_map\": {\"region_blocks\": " << heat_region_blocks << ", \"regions\": [";
+    first = true;
+    for (size_t region = 0; region < region_reads.size(); region++)
+    {
+        if (region_reads[region] == 0 && region_writes[region] == 0)
+            continue;
+        json << (first ? "" : ", ") << "[" << region * heat_region_blocks << ", "
+             << region_reads[region] << ", " << region_writes[region] << "]";
+        first = false;
+    }
+    json << "]}";
+    if (!extra_members.empty())
+        json << ", " << extra_members;
+    json << "}";
+
+    return json.str();
+}
+
+void StatsBlockDevice::reset()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    operations = {};
+    std::fill(region_reads.begin(), region_reads.end(), 0);
+    std::fill(region_writes.begin(), region_writes.end(), 0);
+    total_device_ops = 0;
+    total_blocks = 0;
+    call_stats.clear();
+}
+
+int StatsBlockDevice::get_total_blocks_number() const
+{
+    return backing.get_total_blocks_number();
+}
+
+FileSystemStatus StatsBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.read_block(block_index, buffer);
+    record(DeviceOperation::Read, std::span<const int>(&block_index, 1), start, status);
+    return status;
+}
+
+FileSystemStatus StatsBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.write_block(block_index, buffer);
+    record(DeviceOperation::Write, std::span<const int>(&block_index, 1), start, status);
+    return status;
+}
+
+FileSystemStatus StatsBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.read_blocks(block_indices, buffer);
+    record(DeviceOperation::ReadBatch, block_indices, start, status);
+    return status;
+}
+
+FileSystemStatus StatsBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.write_blocks(block_indices, buffer);
+    record(DeviceOperation::WriteBatch, block_indices, start, status);
+    return status;
+}
+
+/* a device without views did no I/O, so NotSupported is not recorded */
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> StatsBlockDevice::view_block(int block_index) const
+{
+    auto start = std::chrono::steady_clock::now();
+    auto view_res = backing.view_block(block_index);
+    FileSystemStatus status = view_res ? FileSystemStatus::OK : view_res.error();
+    if (status != FileSystemStatus::NotSupported)
+        record(DeviceOperation::View, std::span<const int>(&block_index, 1), start, status);
+    return view_res;
+}
+
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> StatsBlockDevice::mutable_view_block(int block_index)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto view_res = backing.mutable_view_block(block_index);
+    FileSystemStatus status = view_res ? FileSystemStatus::OK : view_res.error();
+    if (status != FileSystemStatus::NotSupported)
+        record(DeviceOperation::MutableView, std::span<const int>(&block_index, 1), start, status);
+    return view_res;
+}
+
+/* a device without discard did no I/O, so NotSupported is not recorded */
+FileSystemStatus StatsBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.discard_blocks(first_block, blocks_count);
+    if (status == FileSystemStatus::NotSupported)
+        return status;
+
+    std::vector<int> block_indices;
+    for (int block_index = first_block; block_index < first_block + std::max(blocks_count, 0); block_index++)
+        block_indices.push_back(block_index);
+    record(DeviceOperation::Discard, block_indices, start, status);
+    return status;
+}
+
+/* the latency is the time to issue the hint, a device without a cache is not recorded */
+FileSystemStatus StatsBlockDevice::prefetch_blocks(std::span<const int> block_indices) const
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.prefetch_blocks(block_indices);
+    if (status == FileSystemStatus::NotSupported)
+        return status;
+
+    record(DeviceOperation::Prefetch, block_indices, start, status);
+    return status;
+}
+
+void StatsBlockDevice::cancel_prefetch(std::span<const int> block_indices) const
+{
+    backing.cancel_prefetch(block_indices);
+}
+
+FileSystemStatus StatsBlockDevice::flush()
+{
+    auto start = std::chrono::steady_clock::now();
+    FileSystemStatus status = backing.flush();
+    record(DeviceOperation::Flush, {}, start, status);
+    return status;
+}
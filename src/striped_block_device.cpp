@@ -0,0 +1,339 @@
+#include "striped_block_device.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <latch>
+#include <mutex>
+#include <thread>
+#include "fs_status.hpp"
+
+struct StripeWorker
+{
+    std::mutex mutex;
+    std::condition_variable has_task;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::thread thread; // declared last, it starts once the queue is ready
+
+    StripeWorker() : thread([this]
+                            { run(); }) {}
+
+    ~StripeWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        has_task.notify_one();
+        thread.join();
+    }
+
+    void post(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        has_task.notify_one();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                has_task.wait(lock, [this]
+                              { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+/*
+ * This constructor starts one worker per child
+ * The volume ends at the last full stripe that every child can hold
+ */
+StripedBlockDevice::StripedBlockDevice(std::vector<BlockDevice *> _children, int _stripe_blocks)
+    : children(std::move(_children)), stripe_blocks(std::max(1, _stripe_blocks)), total_blocks(0)
+{
+    if (children.empty())
+        return;
+
+    int smallest_child = children[0]->get_total_blocks_number();
+    for (BlockDevice *child : children)
+        smallest_child = std::min(smallest_child, child->get_total_blocks_number());
+
+    int64_t stripes_per_child = smallest_child / stripe_blocks;
+    total_blocks = static_cast<int>(stripes_per_child * stripe_blocks * static_cast<int64_t>(children.size()));
+
+    for (size_t i = 0; i < children.size(); i++)
+        workers.push_back(std::make_unique<StripeWorker>());
+}
+
+StripedBlockDevice::~StripedBlockDevice() = default;
+
+/* maps a logical block to its child and the block index inside that child */
+void StripedBlockDevice::locate(int block_index, int &child, int &child_block) const
+{
+    int stripe = block_index / stripe_blocks;
+    int children_number = static_cast<int>(children.size());
+
+    child = stripe % children_number;
+    child_block = (stripe / children_number) * stripe_blocks + block_index % stripe_blocks;
+}
+
+/* groups a batch by child, keeping the order of the blocks inside each child */
+std::vector<StripedBlockDevice::ChildRequest> StripedBlockDevice::split(std::span<const int> block_indices) const
+{
+    std::vector<ChildRequest> requests(children.size());
+    for (size_t i = 0; i < block_indices.size(); i++)
+    {
+        int child, child_block;
+        locate(block_indices[i], child, child_block);
+        requests[child].child_blocks.push_back(child_block);
+        requests[child].positions.push_back(i);
+    }
+    return requests;
+}
+
+/*
+ * This function runs tasks[i] on the worker of child i, empty tasks are skipped
+ * The first task runs on the calling thread. Returns the first failure in child order
+ */
+FileSystemStatus StripedBlockDevice::run_parallel(std::vector<std::function<FileSystemStatus()>> &tasks) const
+{
+    std::vector<size_t> active;
+    for (size_t i = 0; i < tasks.size(); i++)
+        if (tasks[i])
+            active.push_back(i);
+
+    if (active.empty())
+        return FileSystemStatus::OK;
+
+    std::vector<FileSystemStatus> statuses(tasks.size(), FileSystemStatus::OK);
+    std::latch done(static_cast<std::ptrdiff_t>(active.size() - 1));
+    for (size_t i = 1; i < active.size(); i++)
+    {
+        size_t child = active[i];
+        workers[child]->post([&tasks, &statuses, &done, child]
+                             {
+                                 statuses[child] = tasks[child]();
+                                 done.count_down(); });
+    }
+
+    statuses[active[0]] = tasks[active[0]]();
+    done.wait();
+
+    for (FileSystemStatus status : statuses)
+        if (status != FileSystemStatus::OK)
+            return status;
+    return FileSystemStatus::OK;
+}
+
+int StripedBlockDevice::get_total_blocks_number() const
+{
+    return total_blocks;
+}
+
+FileSystemStatus StripedBlockDevice::read_block(int block_index, uint8_t *buffer) const
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    int child, child_block;
+    locate(block_index, child, child_block);
+    return children[child]->read_block(child_block, buffer);
+}
+
+FileSystemStatus StripedBlockDevice::write_block(int block_index, const uint8_t *buffer)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return FileSystemStatus::OutOfBounds;
+
+    int child, child_block;
+    locate(block_index, child, child_block);
+    return children[child]->write_block(child_block, buffer);
+}
+
+/*
+ * This function reads each child's share of the batch in parallel
+ * Every child reads into its own buffer and scatters it into the caller's buffer
+ */
+FileSystemStatus StripedBlockDevice::read_blocks(std::span<const int> block_indices, uint8_t *buffer) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<ChildRequest> requests = split(block_indices);
+    std::vector<std::function<FileSystemStatus()>> tasks(children.size());
+    for (size_t child = 0; child < children.size(); child++)
+    {
+        if (requests[child].child_blocks.empty())
+            continue;
+
+        tasks[child] = [this, &requests, buffer, child]
+        {
+            ChildRequest &request = requests[child];
+            std::vector<uint8_t> child_buffer(request.child_blocks.size() * BLOCK_SIZE);
+
+            FileSystemStatus status = children[child]->read_blocks(request.child_blocks, child_buffer.data());
+            if (status != FileSystemStatus::OK)
+                return status;
+
+            for (size_t i = 0; i < request.positions.size(); i++)
+                std::memcpy(buffer + request.positions[i] * BLOCK_SIZE, child_buffer.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+            return FileSystemStatus::OK;
+        };
+    }
+
+    return run_parallel(tasks);
+}
+
+FileSystemStatus StripedBlockDevice::write_blocks(std::span<const int> block_indices, const uint8_t *buffer)
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<ChildRequest> requests = split(block_indices);
+    std::vector<std::function<FileSystemStatus()>> tasks(children.size());
+    for (size_t child = 0; child < children.size(); child++)
+    {
+        if (requests[child].child_blocks.empty())
+            continue;
+
+        tasks[child] = [this, &requests, buffer, child]
+        {
+            ChildRequest &request = requests[child];
+            std::vector<uint8_t> child_buffer(request.child_blocks.size() * BLOCK_SIZE);
+
+            for (size_t i = 0; i < request.positions.size(); i++)
+                std::memcpy(child_buffer.data() + i * BLOCK_SIZE, buffer + request.positions[i] * BLOCK_SIZE, BLOCK_SIZE);
+
+            return children[child]->write_blocks(request.child_blocks, child_buffer.data());
+        };
+    }
+
+    return run_parallel(tasks);
+}
+
+std::expected<std::span<const uint8_t, BLOCK_SIZE>, FileSystemStatus> StripedBlockDevice::view_block(int block_index) const
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    int child, child_block;
+    locate(block_index, child, child_block);
+    return children[child]->view_block(child_block);
+}
+
+std::expected<std::span<uint8_t, BLOCK_SIZE>, FileSystemStatus> StripedBlockDevice::mutable_view_block(int block_index)
+{
+    if (block_index < 0 || block_index >= total_blocks)
+        return std::unexpected(FileSystemStatus::OutOfBounds);
+
+    int child, child_block;
+    locate(block_index, child, child_block);
+    return children[child]->mutable_view_block(child_block);
+}
+
+/*
+ * This function splits the range into stripe units. The units of one child are
+ * consecutive on the child, so each child gets a few merged ranges
+ */
+FileSystemStatus StripedBlockDevice::discard_blocks(int first_block, int blocks_count)
+{
+    if (first_block < 0 || blocks_count < 0 || first_block > total_blocks - blocks_count)
+        return FileSystemStatus::OutOfBounds;
+
+    std::vector<std::vector<std::pair<int, int>>> child_ranges(children.size()); // (first child block, count)
+    int block_index = first_block;
+    int end = first_block + blocks_count;
+    while (block_index < end)
+    {
+        int count = std::min(stripe_blocks - block_index % stripe_blocks, end - block_index);
+        int child, child_block;
+        locate(block_index, child, child_block);
+
+        std::vector<std::pair<int, int>> &ranges = child_ranges[child];
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == child_block)
+            ranges.back().second += count;
+        else
+            ranges.emplace_back(child_block, count);
+        block_index += count;
+    }
+
+    std::vector<std::function<FileSystemStatus()>> tasks(children.size());
+    for (size_t child = 0; child < children.size(); child++)
+    {
+        if (child_ranges[child].empty())
+            continue;
+        tasks[child] = [this, child, &child_ranges]
+        {
+            for (auto [child_block, count] : child_ranges[child])
+            {
+                FileSystemStatus status = children[child]->discard_blocks(child_block, count);
+                if (status != FileSystemStatus::OK)
+                    return status;
+            }
+            return FileSystemStatus::OK;
+        };
+    }
+
+    return run_parallel(tasks);
+}
+
+/* a child without a cache ignores its part, the hint is supported if any child takes it */
+FileSystemStatus StripedBlockDevice::prefetch_blocks(std::span<const int> block_indices) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return FileSystemStatus::OutOfBounds;
+
+    std::vector<ChildRequest> requests = split(block_indices);
+    FileSystemStatus result = FileSystemStatus::NotSupported;
+    for (size_t child = 0; child < children.size(); child++)
+    {
+        if (requests[child].child_blocks.empty())
+            continue;
+
+        FileSystemStatus status = children[child]->prefetch_blocks(requests[child].child_blocks);
+        if (status == FileSystemStatus::NotSupported)
+            continue;
+        if (status != FileSystemStatus::OK)
+            return status;
+        result = FileSystemStatus::OK;
+    }
+    return result;
+}
+
+void StripedBlockDevice::cancel_prefetch(std::span<const int> block_indices) const
+{
+    for (int block_index : block_indices)
+        if (block_index < 0 || block_index >= total_blocks)
+            return;
+
+    std::vector<ChildRequest> requests = split(block_indices);
+    for (size_t child = 0; child < children.size(); child++)
+        if (!requests[child].child_blocks.empty())
+            children[child]->cancel_prefetch(requests[child].child_blocks);
+}
+
+FileSystemStatus StripedBlockDevice::flush()
+{
+    std::vector<std::function<FileSystemStatus()>> tasks(children.size());
+    for (size_t child = 0; child < children.size(); child++)
+        tasks[child] = [this, child]
+        { return children[child]->flush(); };
+
+    return run_parallel(tasks);
+}
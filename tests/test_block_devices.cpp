@@ -0,0 +1,2391 @@
+#include <gtest/gtest.h>
+#include "in_memory_block_device.hpp"
+#include "mmap_block_device.hpp"
+#include "io_uring_block_device.hpp"
+#include "buffer_cache.hpp"
+#include "striped_block_device.hpp"
+#include "checksum_block_device.hpp"
+#include "crc32c.hpp"
+#include "compressed_block_device.hpp"
+#include "lz_codec.hpp"
+#include "stats_block_device.hpp"
+#include "dedup_block_device.hpp"
+#include "block_hash.hpp"
+#include "journal.hpp"
+#include "file_system.hpp"
+#include "fs_status.hpp"
+#include "fs_constants.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+
+// ── Batched I/O ───────────────────────────────────────────────────────────────
+
+TEST(BatchedBlockIoTest, WriteBlocks_ThenReadBlocks_ScatteredIndices)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    std::vector<int> indices = {9, 2, 40};
+
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE);
+    for (size_t i = 0; i < indices.size(); i++)
+        std::fill_n(written.begin() + i * BLOCK_SIZE, BLOCK_SIZE, static_cast<uint8_t>(i + 1));
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+
+    uint8_t single[BLOCK_SIZE];
+    device.read_block(2, single);
+    EXPECT_EQ(single[0], 2);
+
+    std::vector<uint8_t> read(written.size());
+    ASSERT_EQ(device.read_blocks(indices, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+}
+
+TEST(BatchedBlockIoTest, WriteBlocks_BadIndex_LeavesDeviceUntouched)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    std::vector<int> indices = {3, DEFAULT_TOTAL_BLOCKS};
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE, 0xEE);
+
+    EXPECT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OutOfBounds);
+
+    uint8_t single[BLOCK_SIZE];
+    device.read_block(3, single);
+    EXPECT_EQ(single[0], 0);
+}
+
+// ── Sparse In-Memory Device ───────────────────────────────────────────────────
+
+TEST(SparseBlockDeviceTest, HugeVolume_AllocatesOnlyWrittenBlocks)
+{
+    const uint64_t volume_size = 64ULL * 1024 * 1024 * 1024; // 64 GiB
+    InMemoryBlockDevice device(volume_size, InMemoryLayout::Sparse);
+    EXPECT_EQ(device.get_total_blocks_number(), static_cast<int>(volume_size / BLOCK_SIZE));
+    EXPECT_EQ(device.allocated_blocks_number(), 0);
+
+    int last_block = device.get_total_blocks_number() - 1;
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x6D);
+    ASSERT_EQ(device.write_block(last_block, written.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.allocated_blocks_number(), 1);
+
+    std::vector<uint8_t> read(BLOCK_SIZE, 0xFF);
+    ASSERT_EQ(device.read_block(last_block, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+
+    ASSERT_EQ(device.read_block(last_block - 1, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, std::vector<uint8_t>(BLOCK_SIZE, 0));
+    EXPECT_EQ(device.read_block(last_block + 1, read.data()), FileSystemStatus::OutOfBounds);
+}
+
+TEST(SparseBlockDeviceTest, ZeroWrite_ToHole_StaysUnallocated)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+
+    std::vector<uint8_t> zeros(2 * BLOCK_SIZE, 0);
+    std::vector<int> indices = {10, 11};
+    ASSERT_EQ(device.write_blocks(indices, zeros.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.allocated_blocks_number(), 0);
+
+    auto view_res = device.view_block(10);
+    ASSERT_TRUE(view_res.has_value());
+    EXPECT_EQ(view_res.value()[0], 0);
+    EXPECT_EQ(device.allocated_blocks_number(), 0);
+
+    auto mutable_res = device.mutable_view_block(10);
+    ASSERT_TRUE(mutable_res.has_value());
+    mutable_res.value()[0] = 9;
+    EXPECT_EQ(device.allocated_blocks_number(), 1);
+
+    uint8_t read[BLOCK_SIZE];
+    device.read_block(10, read);
+    EXPECT_EQ(read[0], 9);
+}
+
+// every block differs, so a block written to or read from the wrong place shows
+static std::vector<uint8_t> make_distinct_blocks(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = static_cast<uint8_t>((i / BLOCK_SIZE) * 37 + i % 253 + 1);
+    return data;
+}
+
+// the device blocks holding a whole block of data, in the order of data
+static std::vector<int> find_data_blocks(const BlockDevice &device, const std::vector<uint8_t> &data)
+{
+    std::vector<int> found;
+    for (size_t first = 0; first + BLOCK_SIZE <= data.size(); first += BLOCK_SIZE)
+    {
+        for (int block_index = 0; block_index < device.get_total_blocks_number(); block_index++)
+        {
+            auto view_res = device.view_block(block_index);
+            if (view_res.has_value() && std::equal(view_res->begin(), view_res->end(), data.begin() + first))
+            {
+                found.push_back(block_index);
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+TEST(SparseBlockDeviceTest, FileSystem_FreedBlocksBecomeHolesAgain)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+    fs.set_online_discard(true);
+    const uint8_t *zero_block = device.view_block(DEFAULT_TOTAL_BLOCKS - 1)->data(); // never written
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "sparse.bin");
+    ASSERT_TRUE(file_res.has_value());
+    std::vector<uint8_t> data = make_distinct_blocks(6 * BLOCK_SIZE + 5);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+
+    // each block of the file got its own allocated block
+    std::vector<int> data_blocks = find_data_blocks(device, data);
+    ASSERT_EQ(data_blocks.size(), 6u);
+    EXPECT_EQ(std::set<int>(data_blocks.begin(), data_blocks.end()).size(), 6u);
+    for (int block_index : data_blocks)
+        EXPECT_NE(device.view_block(block_index)->data(), zero_block);
+    EXPECT_LT(device.allocated_blocks_number(), DEFAULT_TOTAL_BLOCKS / 4);
+
+    // once the free is committed, the blocks are released and read as the shared zero block
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, file_res.value(), "sparse.bin"), FileSystemStatus::OK);
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    for (int block_index : data_blocks)
+        EXPECT_EQ(device.view_block(block_index)->data(), zero_block);
+
+    // the commit wrote new journal blocks, but only the blocks that are not holes hold memory
+    int held_blocks = 0;
+    for (int block_index = 0; block_index < DEFAULT_TOTAL_BLOCKS; block_index++)
+        held_blocks += device.view_block(block_index)->data() != zero_block;
+    EXPECT_EQ(device.allocated_blocks_number(), held_blocks);
+}
+
+// ── Hugepage In-Memory Device ─────────────────────────────────────────────────
+
+TEST(HugePageBlockDeviceTest, Slab_IsHugePageAligned_AndStartsZeroed)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::HugePage);
+    ASSERT_EQ(device.get_layout(), InMemoryLayout::HugePage);
+    EXPECT_EQ(device.allocated_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+
+    auto view_res = device.view_block(0);
+    ASSERT_TRUE(view_res.has_value());
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(view_res.value().data()) % HUGE_PAGE_SIZE, 0u);
+
+    std::vector<uint8_t> read(BLOCK_SIZE, 0xFF);
+    ASSERT_EQ(device.read_block(DEFAULT_TOTAL_BLOCKS - 1, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, std::vector<uint8_t>(BLOCK_SIZE, 0));
+    EXPECT_EQ(device.read_block(DEFAULT_TOTAL_BLOCKS, read.data()), FileSystemStatus::OutOfBounds);
+}
+
+TEST(HugePageBlockDeviceTest, NoPrefault_UnknownNumaNode_StillWorks)
+{
+    HugePageOptions options;
+    options.prefault = false;
+    options.numa_node = 1000;
+    InMemoryBlockDevice device(3 * BLOCK_SIZE, InMemoryLayout::HugePage, options);
+    EXPECT_FALSE(device.is_numa_bound());
+
+    std::vector<uint8_t> written(BLOCK_SIZE);
+    for (int i = 0; i < BLOCK_SIZE; i++)
+        written[i] = static_cast<uint8_t>(i * 7 + 3);
+    std::vector<int> indices = {2, 0};
+    std::vector<uint8_t> batch(2 * BLOCK_SIZE);
+    std::copy(written.begin(), written.end(), batch.begin());
+    std::copy(written.rbegin(), written.rend(), batch.begin() + BLOCK_SIZE);
+    ASSERT_EQ(device.write_blocks(indices, batch.data()), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(2, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+    ASSERT_EQ(device.read_block(0, read.data()), FileSystemStatus::OK);
+    EXPECT_TRUE(std::equal(read.begin(), read.end(), written.rbegin()));
+}
+
+TEST(HugePageBlockDeviceTest, FileSystem_DataLandsInPlaceInTheSlab)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::HugePage);
+    if (device.get_layout() == InMemoryLayout::Dense) // the slab could not be mapped at all
+    {
+        EXPECT_EQ(device.get_hugepage_backing(), HugePageBacking::None);
+    }
+
+    // one slab that never moves, every block at its fixed offset
+    const uint8_t *slab = device.view_block(0)->data();
+    if (device.get_layout() == InMemoryLayout::HugePage)
+    {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(slab) % HUGE_PAGE_SIZE, 0u);
+    }
+
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+    fs.set_online_discard(true);
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "huge.bin");
+    ASSERT_TRUE(file_res.has_value());
+    std::vector<uint8_t> data = make_distinct_blocks(5 * BLOCK_SIZE + 7);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+
+    std::vector<int> data_blocks = find_data_blocks(device, data);
+    ASSERT_EQ(data_blocks.size(), 5u);
+    for (int block_index : data_blocks)
+        EXPECT_EQ(device.view_block(block_index)->data(), slab + static_cast<size_t>(block_index) * BLOCK_SIZE);
+    EXPECT_EQ(device.allocated_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+
+    // a discard zeroes the blocks in place, nothing is released
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, file_res.value(), "huge.bin"), FileSystemStatus::OK);
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    for (int block_index : data_blocks)
+    {
+        const uint8_t *block = slab + static_cast<size_t>(block_index) * BLOCK_SIZE;
+        EXPECT_TRUE(std::all_of(block, block + BLOCK_SIZE, [](uint8_t byte)
+                                { return byte == 0; }));
+    }
+    EXPECT_EQ(device.allocated_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+}
+
+// ── Zero-copy Views ───────────────────────────────────────────────────────────
+
+// forwards plain block I/O only, so FileSystem takes its copying paths
+class CopyOnlyBlockDevice : public BlockDevice
+{
+public:
+    explicit CopyOnlyBlockDevice(BlockDevice &_inner) : inner(_inner) {}
+
+    int get_total_blocks_number() const override { return inner.get_total_blocks_number(); }
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override { return inner.read_block(block_index, buffer); }
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override { return inner.write_block(block_index, buffer); }
+
+private:
+    BlockDevice &inner;
+};
+
+TEST(BlockViewTest, View_ReflectsWrites)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x42);
+    device.write_block(5, written.data());
+
+    auto view_res = device.view_block(5);
+    ASSERT_TRUE(view_res.has_value());
+    EXPECT_EQ(view_res.value()[BLOCK_SIZE - 1], 0x42);
+
+    EXPECT_FALSE(device.view_block(DEFAULT_TOTAL_BLOCKS).has_value());
+}
+
+TEST(BlockViewTest, MutableView_WritesLandOnDevice)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+
+    auto view_res = device.mutable_view_block(6);
+    ASSERT_TRUE(view_res.has_value());
+    view_res.value()[10] = 0x99;
+
+    uint8_t buffer[BLOCK_SIZE];
+    device.read_block(6, buffer);
+    EXPECT_EQ(buffer[10], 0x99);
+}
+
+TEST(BlockViewTest, DeviceWithoutViews_ReturnsNotSupported)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CopyOnlyBlockDevice device(inner);
+
+    auto view_res = device.view_block(0);
+    ASSERT_FALSE(view_res.has_value());
+    EXPECT_EQ(view_res.error(), FileSystemStatus::NotSupported);
+}
+
+TEST(BlockViewTest, FileSystem_WithoutViews_SameResults)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CopyOnlyBlockDevice device(inner);
+    FileSystem fs(device);
+    fs.format();
+
+    auto dir_res = fs.create_directory(ROOT_INODE_ID, "dir");
+    ASSERT_TRUE(dir_res.has_value());
+    auto file_res = fs.create_file(dir_res.value(), "file.bin");
+    ASSERT_TRUE(file_res.has_value());
+
+    std::vector<uint8_t> data(BLOCK_SIZE + 100, 0x7C);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 10).has_value());
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 10).has_value());
+    EXPECT_EQ(read, data);
+
+    auto lookup_res = fs.get_inode_by_path("/dir/file.bin");
+    ASSERT_TRUE(lookup_res.has_value());
+    EXPECT_EQ(lookup_res.value(), file_res.value());
+
+    EXPECT_EQ(fs.delete_entry(dir_res.value(), file_res.value()), FileSystemStatus::OK);
+    EXPECT_FALSE(fs.lookup(dir_res.value(), "file.bin").has_value());
+}
+
+// ── Buffer Cache ──────────────────────────────────────────────────────────────
+
+// counts the block I/O that reaches the wrapped device
+class CountingBlockDevice : public BlockDevice
+{
+public:
+    explicit CountingBlockDevice(BlockDevice &_inner) : inner(_inner) {}
+
+    int get_total_blocks_number() const override { return inner.get_total_blocks_number(); }
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override
+    {
+        blocks_read++;
+        return inner.read_block(block_index, buffer);
+    }
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override
+    {
+        blocks_written++;
+        return inner.write_block(block_index, buffer);
+    }
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override
+    {
+        read_calls++;
+        blocks_read += block_indices.size();
+        return inner.read_blocks(block_indices, buffer);
+    }
+    FileSystemStatus write_blocks(std::span<const int> block_indices, const uint8_t *buffer) override
+    {
+        write_calls++;
+        blocks_written += block_indices.size();
+        return inner.write_blocks(block_indices, buffer);
+    }
+
+    mutable int read_calls = 0;
+    mutable size_t blocks_read = 0;
+    int write_calls = 0;
+    size_t blocks_written = 0;
+
+private:
+    BlockDevice &inner;
+};
+
+TEST(BufferCacheTest, RepeatedReads_ServedFromCache)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    BufferCache cache(backing, 8 * BLOCK_SIZE);
+
+    uint8_t buffer[BLOCK_SIZE];
+    ASSERT_EQ(cache.read_block(5, buffer), FileSystemStatus::OK);
+    ASSERT_EQ(cache.read_block(5, buffer), FileSystemStatus::OK);
+    ASSERT_TRUE(cache.view_block(5).has_value());
+
+    EXPECT_EQ(backing.blocks_read, 1u);
+    BufferCacheStats stats = cache.get_stats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 2u);
+
+    EXPECT_EQ(cache.read_block(DEFAULT_TOTAL_BLOCKS, buffer), FileSystemStatus::OutOfBounds);
+}
+
+TEST(BufferCacheTest, Writes_ReachBackingOnlyOnFlush)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    BufferCache cache(backing, 8 * BLOCK_SIZE);
+
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x5A);
+    for (int i = 0; i < 4; i++)
+        ASSERT_EQ(cache.write_block(7, written.data()), FileSystemStatus::OK);
+    EXPECT_EQ(cache.dirty_blocks_number(), 1);
+    EXPECT_EQ(backing.blocks_written, 0u);
+
+    uint8_t read[BLOCK_SIZE];
+    cache.read_block(7, read);
+    EXPECT_EQ(read[0], 0x5A);
+
+    ASSERT_EQ(cache.flush(), FileSystemStatus::OK);
+    EXPECT_EQ(backing.blocks_written, 1u);
+    EXPECT_EQ(cache.dirty_blocks_number(), 0);
+    inner.read_block(7, read);
+    EXPECT_EQ(read[BLOCK_SIZE - 1], 0x5A);
+}
+
+TEST(BufferCacheTest, Eviction_WritesBackLeastRecentlyUsed)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    BufferCache cache(inner, 2 * BLOCK_SIZE);
+
+    std::vector<uint8_t> written(BLOCK_SIZE);
+    for (int i = 0; i < 3; i++)
+    {
+        std::fill(written.begin(), written.end(), static_cast<uint8_t>(i + 1));
+        ASSERT_EQ(cache.write_block(i, written.data()), FileSystemStatus::OK);
+    }
+
+    EXPECT_EQ(cache.cached_blocks_number(), 2);
+    EXPECT_EQ(cache.get_stats().evictions, 1u);
+    EXPECT_EQ(cache.get_stats().write_backs, 1u);
+
+    uint8_t read[BLOCK_SIZE];
+    inner.read_block(0, read);
+    EXPECT_EQ(read[0], 1); // the oldest block was written back
+    inner.read_block(2, read);
+    EXPECT_EQ(read[0], 0); // the newest is still only cached
+}
+
+TEST(BufferCacheTest, ReadBlocks_MissesFetchedInOneBatch)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    BufferCache cache(backing, 16 * BLOCK_SIZE);
+
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x11);
+    inner.write_block(30, written.data());
+
+    uint8_t single[BLOCK_SIZE];
+    cache.read_block(4, single);
+
+    std::vector<int> indices = {4, 30, 31, 12};
+    std::vector<uint8_t> read(indices.size() * BLOCK_SIZE);
+    ASSERT_EQ(cache.read_blocks(indices, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read[BLOCK_SIZE], 0x11);
+
+    EXPECT_EQ(backing.read_calls, 1);
+    EXPECT_EQ(backing.blocks_read, 4u); // block 4 once, then the three misses together
+    EXPECT_EQ(cache.cached_blocks_number(), 4);
+}
+
+TEST(BufferCacheTest, FileSystem_OnCache_PersistsAfterFlush)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    std::vector<uint8_t> data(3 * BLOCK_SIZE + 17, 0x3C);
+    int inode_id;
+
+    {
+        BufferCache cache(inner, 8 * BLOCK_SIZE);
+        FileSystem fs(cache);
+        fs.format();
+
+        auto create_res = fs.create_file(ROOT_INODE_ID, "cached.bin");
+        ASSERT_TRUE(create_res.has_value());
+        inode_id = create_res.value();
+        ASSERT_TRUE(fs.write_file(inode_id, data, 0).has_value());
+
+        std::vector<uint8_t> read(data.size());
+        ASSERT_TRUE(fs.read_file(inode_id, read, 0).has_value());
+        EXPECT_EQ(read, data);
+        EXPECT_GT(cache.get_stats().hits, 0u);
+    } // the cache writes back on destruction
+
+    FileSystem fs(inner);
+    ASSERT_TRUE(fs.is_device_formatted());
+    auto lookup_res = fs.lookup(ROOT_INODE_ID, "cached.bin");
+    ASSERT_TRUE(lookup_res.has_value());
+    EXPECT_EQ(lookup_res.value().inode_id, inode_id);
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(inode_id, read, 0).has_value());
+    EXPECT_EQ(read, data);
+}
+
+// ── Striped Block Device ──────────────────────────────────────────────────────
+
+TEST(StripedBlockDeviceTest, Capacity_LimitedBySmallestChild)
+{
+    InMemoryBlockDevice first(10 * BLOCK_SIZE), second(7 * BLOCK_SIZE), third(9 * BLOCK_SIZE);
+    StripedBlockDevice device({&first, &second, &third}, 2);
+
+    EXPECT_EQ(device.get_children_number(), 3);
+    EXPECT_EQ(device.get_total_blocks_number(), 18); // 3 full stripes of 2 blocks on each child
+}
+
+TEST(StripedBlockDeviceTest, WriteBlocks_LandRoundRobinOnChildren)
+{
+    InMemoryBlockDevice first(8 * BLOCK_SIZE), second(8 * BLOCK_SIZE), third(8 * BLOCK_SIZE);
+    StripedBlockDevice device({&first, &second, &third}, 2);
+
+    std::vector<int> indices;
+    for (int i = 0; i < 12; i++)
+        indices.push_back(i);
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE);
+    for (size_t i = 0; i < indices.size(); i++)
+        std::fill_n(written.begin() + i * BLOCK_SIZE, BLOCK_SIZE, static_cast<uint8_t>(i + 1));
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+
+    uint8_t read[BLOCK_SIZE];
+    first.read_block(1, read);
+    EXPECT_EQ(read[0], 2); // logical block 1
+    second.read_block(0, read);
+    EXPECT_EQ(read[0], 3); // logical block 2
+    first.read_block(2, read);
+    EXPECT_EQ(read[0], 7); // logical block 6, second stripe row
+    third.read_block(3, read);
+    EXPECT_EQ(read[0], 12); // logical block 11
+
+    std::vector<int> scattered = {11, 0, 5, 6};
+    std::vector<uint8_t> read_back(scattered.size() * BLOCK_SIZE);
+    ASSERT_EQ(device.read_blocks(scattered, read_back.data()), FileSystemStatus::OK);
+    for (size_t i = 0; i < scattered.size(); i++)
+        EXPECT_EQ(read_back[i * BLOCK_SIZE], scattered[i] + 1);
+
+    std::vector<int> bad = {0, device.get_total_blocks_number()};
+    EXPECT_EQ(device.read_blocks(bad, read_back.data()), FileSystemStatus::OutOfBounds);
+}
+
+TEST(StripedBlockDeviceTest, FileSystem_RunsOnStripedDevice)
+{
+    std::vector<std::unique_ptr<InMemoryBlockDevice>> children;
+    std::vector<BlockDevice *> child_pointers;
+    for (int i = 0; i < 4; i++)
+    {
+        children.push_back(std::make_unique<InMemoryBlockDevice>(64 * BLOCK_SIZE));
+        child_pointers.push_back(children.back().get());
+    }
+    StripedBlockDevice device(child_pointers, 4);
+    ASSERT_GE(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+
+    FileSystem fs(device);
+    fs.format();
+    ASSERT_TRUE(fs.is_device_formatted());
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "striped.bin");
+    ASSERT_TRUE(file_res.has_value());
+
+    std::vector<uint8_t> data(TOTAL_DIRECT_BLOCKS * BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8_t>(i * 7);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+    EXPECT_EQ(device.flush(), FileSystemStatus::OK);
+}
+
+// ── Checksums ─────────────────────────────────────────────────────────────────
+
+TEST(Crc32cTest, KnownVector)
+{
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    EXPECT_EQ(crc32c_portable(check, sizeof(check)), 0xE3069283u);
+    EXPECT_EQ(crc32c(check, sizeof(check)), 0xE3069283u);
+}
+
+TEST(Crc32cTest, Accelerated_MatchesPortable)
+{
+    std::mt19937 generator(7);
+    std::vector<uint8_t> data(3 * BLOCK_SIZE + 11);
+    for (uint8_t &byte : data)
+        byte = static_cast<uint8_t>(generator());
+
+    for (size_t length : {size_t(0), size_t(1), size_t(7), size_t(100), size_t(BLOCK_SIZE), data.size()})
+        EXPECT_EQ(crc32c(data.data(), length), crc32c_portable(data.data(), length)) << "length " << length;
+
+    uint32_t chained = crc32c(data.data() + 5, data.size() - 5, crc32c(data.data(), 5));
+    EXPECT_EQ(chained, crc32c(data.data(), data.size()));
+}
+
+TEST(ChecksumBlockDeviceTest, Layout_ReservesChecksumArea)
+{
+    InMemoryBlockDevice backing(ChecksumBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    ChecksumBlockDevice device(backing);
+
+    ASSERT_TRUE(device.is_loaded());
+    EXPECT_GE(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+    EXPECT_LT(device.get_total_blocks_number(), backing.get_total_blocks_number());
+}
+
+TEST(ChecksumBlockDeviceTest, WriteBlocks_DataAndChecksumInOneBatch)
+{
+    InMemoryBlockDevice inner(2000 * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    ChecksumBlockDevice device(backing);
+    ASSERT_TRUE(device.is_loaded());
+
+    std::vector<int> indices = {3, 1500, 4};
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE, 0x77);
+    int writes_before = backing.write_calls;
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+    EXPECT_EQ(backing.write_calls - writes_before, 1);
+    EXPECT_EQ(backing.blocks_written, indices.size() + 2); // the blocks span two checksum blocks
+
+    std::vector<uint8_t> read(written.size());
+    ASSERT_EQ(device.read_blocks(indices, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+}
+
+TEST(ChecksumBlockDeviceTest, CorruptedBlock_ReturnsChecksumMismatch)
+{
+    InMemoryBlockDevice backing(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x31);
+
+    {
+        ChecksumBlockDevice device(backing);
+        ASSERT_EQ(device.write_block(8, written.data()), FileSystemStatus::OK);
+    }
+
+    // flip one bit behind the decorator's back
+    written[100] ^= 0x01;
+    backing.write_block(8, written.data());
+
+    ChecksumBlockDevice device(backing); // the checksums are reloaded from the device
+    uint8_t read[BLOCK_SIZE];
+    EXPECT_EQ(device.read_block(8, read), FileSystemStatus::ChecksumMismatch);
+
+    auto view_res = device.view_block(8);
+    ASSERT_FALSE(view_res.has_value());
+    EXPECT_EQ(view_res.error(), FileSystemStatus::ChecksumMismatch);
+    EXPECT_EQ(device.get_mismatches(), 2u);
+
+    EXPECT_EQ(device.read_block(9, read), FileSystemStatus::OK); // never written, not verified
+    EXPECT_FALSE(device.mutable_view_block(9).has_value());
+}
+
+TEST(ChecksumBlockDeviceTest, FileSystem_RunsOnChecksumDevice)
+{
+    InMemoryBlockDevice backing(ChecksumBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    ChecksumBlockDevice device(backing);
+    FileSystem fs(device);
+    fs.format();
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "checked.bin");
+    ASSERT_TRUE(file_res.has_value());
+
+    std::vector<uint8_t> data(BLOCK_SIZE * 2 + 3, 0x4E);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 1).has_value());
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 1).has_value());
+    EXPECT_EQ(read, data);
+    EXPECT_EQ(device.get_mismatches(), 0u);
+}
+
+// ── Compression ───────────────────────────────────────────────────────────────
+
+// a log-like block, compresses well
+static std::vector<uint8_t> make_text_block(int seed)
+{
+    std::string text;
+    for (int line = 0; text.size() < BLOCK_SIZE; line++)
+        text += "2024-05-0" + std::to_string(seed % 10) + " INFO request " + std::to_string(line) + " served in 3ms\n";
+    return std::vector<uint8_t>(text.begin(), text.begin() + BLOCK_SIZE);
+}
+
+static std::vector<uint8_t> make_random_block(int seed)
+{
+    std::mt19937 generator(seed);
+    std::vector<uint8_t> block(BLOCK_SIZE);
+    for (uint8_t &byte : block)
+        byte = static_cast<uint8_t>(generator());
+    return block;
+}
+
+TEST(LzCodecTest, RoundTrip_CompressibleAndRandom)
+{
+    std::vector<uint8_t> compressed(2 * BLOCK_SIZE);
+    std::vector<uint8_t> decompressed(BLOCK_SIZE);
+
+    std::vector<uint8_t> text = make_text_block(1);
+    size_t text_size = lz_compress(text.data(), text.size(), compressed.data(), compressed.size());
+    ASSERT_GT(text_size, 0u);
+    EXPECT_LT(text_size, text.size() / 2);
+    ASSERT_TRUE(lz_decompress(compressed.data(), text_size, decompressed.data(), decompressed.size()));
+    EXPECT_EQ(decompressed, text);
+
+    std::vector<uint8_t> random = make_random_block(2);
+    size_t random_size = lz_compress(random.data(), random.size(), compressed.data(), compressed.size());
+    ASSERT_GT(random_size, 0u);
+    ASSERT_TRUE(lz_decompress(compressed.data(), random_size, decompressed.data(), decompressed.size()));
+    EXPECT_EQ(decompressed, random);
+
+    // does not fit, reported instead of overflowing
+    EXPECT_EQ(lz_compress(random.data(), random.size(), compressed.data(), BLOCK_SIZE / 2), 0u);
+}
+
+TEST(LzCodecTest, Decompress_CorruptInput_Fails)
+{
+    std::vector<uint8_t> text = make_text_block(3);
+    std::vector<uint8_t> compressed(2 * BLOCK_SIZE);
+    size_t size = lz_compress(text.data(), text.size(), compressed.data(), compressed.size());
+    ASSERT_GT(size, 0u);
+
+    std::vector<uint8_t> decompressed(BLOCK_SIZE);
+    EXPECT_FALSE(lz_decompress(compressed.data(), size - 1, decompressed.data(), decompressed.size()));
+    EXPECT_FALSE(lz_decompress(compressed.data(), size, decompressed.data(), decompressed.size() - 1));
+}
+
+TEST(CompressedBlockDeviceTest, TextBlocks_TakeFewerBackingBytes)
+{
+    InMemoryBlockDevice inner(CompressedBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    CompressedBlockDevice device(backing, 64);
+    ASSERT_TRUE(device.is_loaded());
+    EXPECT_EQ(device.get_total_blocks_number(), 64);
+
+    std::vector<int> indices;
+    std::vector<uint8_t> written;
+    for (int i = 0; i < 16; i++)
+    {
+        indices.push_back(i);
+        std::vector<uint8_t> block = make_text_block(i);
+        written.insert(written.end(), block.begin(), block.end());
+    }
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+    EXPECT_LT(backing.blocks_written, indices.size()); // payloads share backing blocks
+    EXPECT_GT(device.get_compression_ratio(), 2.0);
+    EXPECT_LT(device.get_used_bytes(), written.size() / 2);
+
+    std::vector<uint8_t> read(written.size());
+    ASSERT_EQ(device.read_blocks(indices, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+    EXPECT_EQ(device.get_stats().cache_hits, indices.size());
+}
+
+TEST(CompressedBlockDeviceTest, ZeroAndRandomBlocks)
+{
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    CompressedBlockDevice device(backing, DEFAULT_TOTAL_BLOCKS, BLOCK_SIZE);
+
+    std::vector<uint8_t> zeros(BLOCK_SIZE, 0);
+    ASSERT_EQ(device.write_block(5, zeros.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.get_used_bytes(), 0u);
+
+    std::vector<uint8_t> random = make_random_block(4);
+    ASSERT_EQ(device.write_block(6, random.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.get_used_bytes(), static_cast<uint64_t>(BLOCK_SIZE));
+    EXPECT_EQ(device.get_stats().raw_blocks, 1u);
+
+    std::vector<uint8_t> other = make_random_block(5);
+    ASSERT_EQ(device.write_block(7, other.data()), FileSystemStatus::OK); // the one block cache now holds block 7
+
+    std::vector<uint8_t> read(BLOCK_SIZE, 0xFF);
+    ASSERT_EQ(device.read_block(5, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, zeros);
+    ASSERT_EQ(device.read_block(6, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, random);
+    EXPECT_GT(device.get_stats().blocks_decompressed, 0u);
+    EXPECT_FALSE(device.mutable_view_block(6).has_value());
+}
+
+TEST(CompressedBlockDeviceTest, UnformattedBacking_NotWrittenUntilFirstWrite)
+{
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    std::vector<uint8_t> foreign = make_random_block(7); // another volume starts here
+    ASSERT_EQ(backing.write_block(0, foreign.data()), FileSystemStatus::OK);
+    ASSERT_EQ(backing.write_block(1, foreign.data()), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    {
+        CompressedBlockDevice device(backing, 64);
+        ASSERT_TRUE(device.is_loaded());
+        ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    }
+    ASSERT_EQ(backing.read_block(0, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, foreign);
+    ASSERT_EQ(backing.read_block(1, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, foreign);
+
+    {
+        CompressedBlockDevice device(backing, 64);
+        ASSERT_EQ(device.write_block(3, make_text_block(3).data()), FileSystemStatus::OK);
+    }
+    CompressedBlockDevice device(backing, 1);
+    EXPECT_EQ(device.get_total_blocks_number(), 64); // the write formatted it
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_text_block(3));
+}
+
+TEST(CompressedBlockDeviceTest, Remount_AfterFlush_KeepsBlocks)
+{
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    std::vector<uint8_t> first = make_text_block(5);
+    std::vector<uint8_t> second = make_text_block(6);
+
+    {
+        CompressedBlockDevice device(backing, DEFAULT_TOTAL_BLOCKS);
+        ASSERT_EQ(device.write_block(1, first.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(2, second.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+
+        // the overwrite must not reuse slots the flushed table still points at
+        ASSERT_EQ(device.write_block(1, second.data()), FileSystemStatus::OK);
+    }
+
+    CompressedBlockDevice device(backing, 1); // the stored size wins
+    ASSERT_TRUE(device.is_loaded());
+    EXPECT_EQ(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(1, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, second);
+    ASSERT_EQ(device.read_block(2, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, second);
+}
+
+TEST(CompressedBlockDeviceTest, FullDevice_OverwritesReclaimSlots)
+{
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    CompressedBlockDevice device(backing, 64);
+    for (int i = 0; i < 64; i++) // nothing compresses, every slot is taken
+        ASSERT_EQ(device.write_block(i, make_random_block(i).data()), FileSystemStatus::OK);
+
+    for (int round = 0; round < 3; round++) // no flush in between, the slots wait for one
+    {
+        std::vector<uint8_t> other = make_random_block(100 + round);
+        ASSERT_EQ(device.write_block(3, other.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(4, other.data()), FileSystemStatus::OK);
+    }
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(102));
+    ASSERT_EQ(device.read_block(5, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(5));
+}
+
+TEST(CompressedBlockDeviceTest, FullDevice_BatchThatDoesNotFit_KeepsOldBlocks)
+{
+    InMemoryBlockDevice backing((CompressedBlockDevice::backing_blocks_for(64) - 1) * BLOCK_SIZE);
+    CompressedBlockDevice device(backing, 64);
+    for (int i = 0; i < 63; i++) // every slot is taken, block 63 has none
+        ASSERT_EQ(device.write_block(i, make_random_block(i).data()), FileSystemStatus::OK);
+
+    // unmapping block 3 frees one backing block, the batch needs two
+    std::vector<int> indices = {3, 63};
+    std::vector<uint8_t> written = make_random_block(200);
+    std::vector<uint8_t> other = make_random_block(201);
+    written.insert(written.end(), other.begin(), other.end());
+    EXPECT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::FullDisk);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(3));
+    ASSERT_EQ(device.write_block(3, other.data()), FileSystemStatus::OK); // a batch that fits still does
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, other);
+}
+
+TEST(CompressedBlockDeviceTest, FileSystem_RunsOnCompressedDevice)
+{
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    CompressedBlockDevice device(backing, DEFAULT_TOTAL_BLOCKS);
+    FileSystem fs(device);
+    fs.format();
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "app.log");
+    ASSERT_TRUE(file_res.has_value());
+
+    std::vector<uint8_t> data;
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<uint8_t> block = make_text_block(i);
+        data.insert(data.end(), block.begin(), block.end());
+    }
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(fs.read_file(file_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+    EXPECT_GT(device.get_compression_ratio(), 1.0);
+}
+
+// ── Instrumentation ───────────────────────────────────────────────────────────
+
+TEST(LatencyHistogramTest, Percentiles_WithinBucketPrecision)
+{
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++)
+        histogram.record(value);
+
+    EXPECT_EQ(histogram.count(), 1000u);
+    EXPECT_EQ(histogram.min(), 1u);
+    EXPECT_EQ(histogram.max(), 1000u);
+    EXPECT_DOUBLE_EQ(histogram.mean(), 500.5);
+    EXPECT_NEAR(static_cast<double>(histogram.percentile(50)), 500.0, 500.0 / 16);
+    EXPECT_NEAR(static_cast<double>(histogram.percentile(99)), 990.0, 990.0 / 16);
+    EXPECT_EQ(histogram.percentile(100), 1000u);
+}
+
+TEST(StatsBlockDeviceTest, CountsOperationsAndHeat)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    StatsBlockDevice device(inner);
+
+    std::vector<int> indices = {4, 5, 4};
+    std::vector<uint8_t> buffer(indices.size() * BLOCK_SIZE, 0x10);
+    ASSERT_EQ(device.write_blocks(indices, buffer.data()), FileSystemStatus::OK);
+    ASSERT_EQ(device.read_block(5, buffer.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.read_block(DEFAULT_TOTAL_BLOCKS, buffer.data()), FileSystemStatus::OutOfBounds);
+
+    OperationStats writes = device.get_operation_stats(DeviceOperation::WriteBatch);
+    EXPECT_EQ(writes.calls, 1u);
+    EXPECT_EQ(writes.blocks, 3u);
+    EXPECT_EQ(writes.bytes, 3u * BLOCK_SIZE);
+    EXPECT_EQ(writes.latency_ns.count(), 1u);
+
+    OperationStats reads = device.get_operation_stats(DeviceOperation::Read);
+    EXPECT_EQ(reads.calls, 2u);
+    EXPECT_EQ(reads.errors, 1u);
+
+    EXPECT_EQ(device.get_region_writes(4), 2u);
+    EXPECT_EQ(device.get_region_reads(5), 1u);
+    EXPECT_EQ(device.get_total_device_ops(), 3u);
+
+    device.reset();
+    EXPECT_EQ(device.get_total_device_ops(), 0u);
+    EXPECT_EQ(device.get_region_writes(4), 0u);
+}
+
+TEST(StatsBlockDeviceTest, CallScope_DeviceOpsPerFileSystemCall)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    StatsBlockDevice device(inner, 4);
+    FileSystem fs(device);
+    fs.format();
+
+    for (int i = 0; i < 3; i++)
+    {
+        StatsBlockDevice::CallScope scope(&device, "create_file");
+        ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "file" + std::to_string(i)).has_value());
+        ASSERT_EQ(fs.sync(), FileSystemStatus::OK); // the metadata reaches the device on commit
+    }
+    {
+        StatsBlockDevice::CallScope scope(nullptr, "ignored"); // no device, no effect
+        ASSERT_TRUE(fs.lookup(ROOT_INODE_ID, "file0").has_value());
+    }
+
+    auto call_stats = device.get_call_stats();
+    ASSERT_EQ(call_stats.size(), 1u);
+    const FileSystemCallStats &create_stats = call_stats["create_file"];
+    EXPECT_EQ(create_stats.calls, 3u);
+    EXPECT_GT(create_stats.device_ops, 0u);
+    EXPECT_GE(create_stats.max_device_ops, create_stats.device_ops_per_call());
+
+    std::string json = device.to_json();
+    EXPECT_NE(json.find("\"create_file\": {\"calls\": 3"), std::string::npos);
+    EXPECT_NE(json.find("\"write_batch\""), std::string::npos);
+    EXPECT_NE(json.find("\"region_blocks\": 4"), std::string::npos);
+}
+
+// ── Deduplication ─────────────────────────────────────────────────────────────
+
+TEST(BlockHashTest, Vectorized_MatchesPortable)
+{
+    for (int seed = 0; seed < 32; seed++)
+    {
+        std::vector<uint8_t> block = make_random_block(seed);
+        EXPECT_EQ(block_hash(block.data()), block_hash_portable(block.data()));
+    }
+}
+
+TEST(BlockHashTest, SmallChanges_ChangeTheFingerprint)
+{
+    std::vector<uint8_t> block = make_text_block(1);
+    uint64_t original = block_hash(block.data());
+
+    std::vector<uint8_t> flipped = block;
+    flipped[BLOCK_SIZE - 1] ^= 1;
+    EXPECT_NE(block_hash(flipped.data()), original);
+
+    // the same stripes in another order
+    std::vector<uint8_t> swapped = block;
+    std::swap_ranges(swapped.begin(), swapped.begin() + 64, swapped.begin() + 64);
+    EXPECT_NE(block_hash(swapped.data()), original);
+}
+
+TEST(DedupBlockDeviceTest, RepeatedAndZeroBlocks_ShareStorage)
+{
+    InMemoryBlockDevice inner(DedupBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    DedupBlockDevice device(backing, 64);
+    ASSERT_TRUE(device.is_loaded());
+    EXPECT_EQ(device.get_total_blocks_number(), 64);
+
+    std::vector<uint8_t> repeated = make_random_block(7);
+    std::vector<int> indices;
+    std::vector<uint8_t> written;
+    for (int i = 0; i < 12; i++)
+    {
+        indices.push_back(i);
+        if (i < 8)
+            written.insert(written.end(), repeated.begin(), repeated.end());
+        else
+            written.resize(written.size() + BLOCK_SIZE, 0);
+    }
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+    EXPECT_EQ(backing.blocks_written, 1u); // duplicates inside one batch are found too
+    EXPECT_EQ(device.get_physical_blocks_used(), 1);
+    EXPECT_DOUBLE_EQ(device.get_dedup_ratio(), 8.0);
+    EXPECT_EQ(device.get_stats().zero_blocks, 4u);
+    EXPECT_EQ(device.get_stats().duplicate_blocks, 7u);
+    EXPECT_GT(device.get_index_memory_bytes(), 0u);
+
+    // a later batch matches the stored block after comparing its bytes
+    ASSERT_EQ(device.write_block(20, repeated.data()), FileSystemStatus::OK);
+    EXPECT_EQ(backing.blocks_written, 1u);
+    EXPECT_EQ(device.get_stats().hash_collisions, 0u);
+
+    std::vector<uint8_t> read(written.size());
+    ASSERT_EQ(device.read_blocks(indices, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+    EXPECT_FALSE(device.mutable_view_block(0).has_value());
+}
+
+TEST(DedupBlockDeviceTest, Remount_RebuildsIndexAndReferences)
+{
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    std::vector<uint8_t> first = make_random_block(8);
+    std::vector<uint8_t> second = make_random_block(9);
+
+    {
+        DedupBlockDevice device(backing, DEFAULT_TOTAL_BLOCKS);
+        ASSERT_EQ(device.write_block(1, first.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(2, first.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+
+        // the old block loses its references, but the flushed map still points at it
+        ASSERT_EQ(device.write_block(1, second.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(2, second.data()), FileSystemStatus::OK);
+        EXPECT_EQ(device.get_physical_blocks_used(), 1);
+    }
+
+    DedupBlockDevice device(backing, 1); // the stored size wins
+    ASSERT_TRUE(device.is_loaded());
+    EXPECT_EQ(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+    EXPECT_EQ(device.get_physical_blocks_used(), 1);
+    EXPECT_DOUBLE_EQ(device.get_dedup_ratio(), 2.0);
+
+    ASSERT_EQ(device.write_block(3, second.data()), FileSystemStatus::OK);
+    EXPECT_EQ(device.get_stats().duplicate_blocks, 1u);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    for (int block_index : {1, 2, 3})
+    {
+        ASSERT_EQ(device.read_block(block_index, read.data()), FileSystemStatus::OK);
+        EXPECT_EQ(read, second);
+    }
+}
+
+TEST(DedupBlockDeviceTest, UnformattedBacking_NotWrittenUntilFirstWrite)
+{
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    std::vector<uint8_t> foreign = make_random_block(8); // another volume starts here
+    ASSERT_EQ(backing.write_block(0, foreign.data()), FileSystemStatus::OK);
+    ASSERT_EQ(backing.write_block(1, foreign.data()), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    {
+        DedupBlockDevice device(backing, 64);
+        ASSERT_TRUE(device.is_loaded());
+        ASSERT_EQ(device.discard_blocks(0, 64), FileSystemStatus::OK);
+        ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    }
+    ASSERT_EQ(backing.read_block(0, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, foreign);
+    ASSERT_EQ(backing.read_block(1, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, foreign);
+
+    {
+        DedupBlockDevice device(backing, 64);
+        ASSERT_EQ(device.write_block(3, make_random_block(3).data()), FileSystemStatus::OK);
+    }
+    DedupBlockDevice device(backing, 1);
+    EXPECT_EQ(device.get_total_blocks_number(), 64); // the write formatted it
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(3));
+}
+
+TEST(DedupBlockDeviceTest, RandomOverwrites_MatchAModel)
+{
+    const int logical_blocks = 48;
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(logical_blocks) * BLOCK_SIZE);
+    auto device = std::make_unique<DedupBlockDevice>(backing, logical_blocks);
+
+    std::vector<std::vector<uint8_t>> contents = {std::vector<uint8_t>(BLOCK_SIZE, 0)};
+    for (int i = 1; i < 6; i++)
+        contents.push_back(make_random_block(100 + i));
+
+    std::vector<int> model(logical_blocks, 0);
+    std::mt19937 generator(11);
+    for (int round = 0; round < 400; round++)
+    {
+        std::vector<int> indices;
+        std::vector<uint8_t> batch;
+        for (int i = 0, count = 1 + static_cast<int>(generator() % 6); i < count; i++)
+        {
+            int block_index = static_cast<int>(generator() % logical_blocks);
+            int content = static_cast<int>(generator() % contents.size());
+            indices.push_back(block_index);
+            batch.insert(batch.end(), contents[content].begin(), contents[content].end());
+            model[block_index] = content;
+        }
+        ASSERT_EQ(device->write_blocks(indices, batch.data()), FileSystemStatus::OK);
+
+        if (round % 50 == 49)
+        {
+            device.reset(); // flushes
+            device = std::make_unique<DedupBlockDevice>(backing, logical_blocks);
+        }
+        else if (round % 10 == 9)
+        {
+            ASSERT_EQ(device->flush(), FileSystemStatus::OK);
+        }
+
+        EXPECT_LE(device->get_physical_blocks_used(), static_cast<int>(contents.size()) - 1);
+    }
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    for (int block_index = 0; block_index < logical_blocks; block_index++)
+    {
+        ASSERT_EQ(device->read_block(block_index, read.data()), FileSystemStatus::OK);
+        EXPECT_EQ(read, contents[model[block_index]]) << "block " << block_index;
+    }
+}
+
+TEST(DedupBlockDeviceTest, FullDevice_OverwritesReclaimBlocks)
+{
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(64) * BLOCK_SIZE);
+    DedupBlockDevice device(backing, 64);
+    for (int i = 0; i < 64; i++) // every physical block is taken
+        ASSERT_EQ(device.write_block(i, make_random_block(i).data()), FileSystemStatus::OK);
+
+    // block 7 takes the stored copy of block 5, so the room comes from block 7, not 5
+    std::vector<int> indices = {7, 5};
+    std::vector<uint8_t> batch = make_random_block(5);
+    std::vector<uint8_t> fresh = make_random_block(300);
+    batch.insert(batch.end(), fresh.begin(), fresh.end());
+    ASSERT_EQ(device.write_blocks(indices, batch.data()), FileSystemStatus::OK);
+
+    for (int round = 0; round < 3; round++) // no flush in between, the blocks wait for one
+    {
+        ASSERT_EQ(device.write_block(3, make_random_block(100 + round).data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(4, make_random_block(200 + round).data()), FileSystemStatus::OK);
+    }
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(7, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(5));
+    ASSERT_EQ(device.read_block(5, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, fresh);
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(102));
+    ASSERT_EQ(device.read_block(4, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(202));
+}
+
+TEST(DedupBlockDeviceTest, FullDevice_BatchThatDoesNotFit_KeepsOldBlocks)
+{
+    InMemoryBlockDevice backing((DedupBlockDevice::backing_blocks_for(64) - 1) * BLOCK_SIZE);
+    DedupBlockDevice device(backing, 64);
+    for (int i = 0; i < 63; i++) // every physical block is taken, block 63 has none
+        ASSERT_EQ(device.write_block(i, make_random_block(i).data()), FileSystemStatus::OK);
+
+    // unmapping block 3 frees one physical block, the batch needs two
+    std::vector<int> indices = {3, 63};
+    std::vector<uint8_t> batch = make_random_block(400);
+    std::vector<uint8_t> fresh = make_random_block(401);
+    batch.insert(batch.end(), fresh.begin(), fresh.end());
+    EXPECT_EQ(device.write_blocks(indices, batch.data()), FileSystemStatus::FullDisk);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(3, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, make_random_block(3));
+    EXPECT_EQ(device.get_physical_blocks_used(), 63);
+
+    // the same content twice needs one physical block, which fits
+    std::copy(fresh.begin(), fresh.end(), batch.begin());
+    ASSERT_EQ(device.write_blocks(indices, batch.data()), FileSystemStatus::OK);
+    ASSERT_EQ(device.read_block(63, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, fresh);
+    EXPECT_EQ(device.get_physical_blocks_used(), 63);
+}
+
+TEST(DedupBlockDeviceTest, FileSystem_SameFileTwice_StoredOnce)
+{
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    DedupBlockDevice device(backing, DEFAULT_TOTAL_BLOCKS);
+    FileSystem fs(device);
+    fs.format();
+    int physical_after_format = device.get_physical_blocks_used();
+
+    std::vector<uint8_t> data;
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<uint8_t> block = make_random_block(200 + i);
+        data.insert(data.end(), block.begin(), block.end());
+    }
+
+    for (const char *name : {"layer.tar", "layer-copy.tar"})
+    {
+        auto file_res = fs.create_file(ROOT_INODE_ID, name);
+        ASSERT_TRUE(file_res.has_value());
+        ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+
+        std::vector<uint8_t> read(data.size());
+        ASSERT_TRUE(fs.read_file(file_res.value(), read, 0).has_value());
+        EXPECT_EQ(read, data);
+    }
+
+    EXPECT_GE(device.get_stats().duplicate_blocks, 4u);
+    EXPECT_LE(device.get_physical_blocks_used(), physical_after_format + 4 + 2); // + the changed metadata blocks
+}
+
+// ── Journal ───────────────────────────────────────────────────────────────────
+
+/* the state a crash would leave, the journal in memory is lost */
+static void copy_device(const BlockDevice &source, BlockDevice &target)
+{
+    std::vector<uint8_t> buffer(BLOCK_SIZE);
+    for (int block_index = 0; block_index < source.get_total_blocks_number(); block_index++)
+    {
+        ASSERT_EQ(source.read_block(block_index, buffer.data()), FileSystemStatus::OK);
+        ASSERT_EQ(target.write_block(block_index, buffer.data()), FileSystemStatus::OK);
+    }
+}
+
+TEST(JournalTest, Sync_FinishedCallsShareOneCommit)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+    JournalStats before = fs.get_journal_stats();
+
+    for (int i = 0; i < 3; i++)
+        ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "file" + std::to_string(i)).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    JournalStats after = fs.get_journal_stats();
+    EXPECT_EQ(after.commits, before.commits + 1);
+    EXPECT_GE(after.handles_committed - before.handles_committed, 3u);
+    EXPECT_EQ(fs.sync(), FileSystemStatus::OK); // nothing left, no commit
+    EXPECT_EQ(fs.get_journal_stats().commits, after.commits);
+}
+
+TEST(JournalTest, Replay_CommittedCallsSurviveCrash)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+
+    std::vector<uint8_t> data = make_text_block(1);
+    auto dir_res = fs.create_directory(ROOT_INODE_ID, "dir");
+    ASSERT_TRUE(dir_res.has_value());
+    auto file_res = fs.create_file(dir_res.value(), "file");
+    ASSERT_TRUE(file_res.has_value());
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    InMemoryBlockDevice crashed(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    copy_device(device, crashed);
+    FileSystem recovered(crashed);
+    ASSERT_TRUE(recovered.is_device_formatted());
+    EXPECT_GT(recovered.get_journal_stats().replayed_transactions, 0u);
+
+    auto inode_res = recovered.get_inode_by_path("/dir/file");
+    ASSERT_TRUE(inode_res.has_value());
+    EXPECT_EQ(inode_res.value(), file_res.value());
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(recovered.read_file(inode_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+}
+
+TEST(JournalTest, Replay_TornCommitIgnored)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+    ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "first").has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    InMemoryBlockDevice torn(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    copy_device(device, torn);
+
+    ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "second").has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    // everything but the commit block of the second transaction reached the device
+    int commit_block_index = -1;
+    std::vector<uint8_t> old_block(BLOCK_SIZE), new_block(BLOCK_SIZE);
+    for (int block_index = JOURNAL_START_INDEX + 1; block_index < JOURNAL_START_INDEX + JOURNAL_BLOCKS; block_index++)
+    {
+        ASSERT_EQ(torn.read_block(block_index, old_block.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.read_block(block_index, new_block.data()), FileSystemStatus::OK);
+        if (old_block != new_block)
+            commit_block_index = block_index;
+    }
+    ASSERT_NE(commit_block_index, -1);
+
+    for (int block_index = 0; block_index < device.get_total_blocks_number(); block_index++)
+    {
+        if (block_index == commit_block_index)
+            continue;
+        ASSERT_EQ(device.read_block(block_index, new_block.data()), FileSystemStatus::OK);
+        ASSERT_EQ(torn.write_block(block_index, new_block.data()), FileSystemStatus::OK);
+    }
+
+    FileSystem recovered(torn);
+    ASSERT_TRUE(recovered.is_device_formatted());
+    EXPECT_TRUE(recovered.lookup(ROOT_INODE_ID, "first").has_value());
+    EXPECT_FALSE(recovered.lookup(ROOT_INODE_ID, "second").has_value());
+}
+
+TEST(JournalTest, Replay_RevokedBlockKeepsFileData)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+
+    // the directory block is logged, freed, then reused for file data
+    auto dir_res = fs.create_directory(ROOT_INODE_ID, "dir");
+    ASSERT_TRUE(dir_res.has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, dir_res.value()), FileSystemStatus::OK);
+
+    std::vector<uint8_t> data = make_random_block(7);
+    auto file_res = fs.create_file(ROOT_INODE_ID, "file");
+    ASSERT_TRUE(file_res.has_value());
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    EXPECT_GT(fs.get_journal_stats().revokes_logged, 0u);
+
+    InMemoryBlockDevice crashed(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    copy_device(device, crashed);
+    FileSystem recovered(crashed);
+    std::vector<uint8_t> read(data.size());
+    ASSERT_TRUE(recovered.read_file(file_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, data);
+}
+
+TEST(JournalTest, GroupCommit_ConcurrentCallers)
+{
+    const int threads_number = 4;
+    const int files_per_thread = 8;
+
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+    JournalStats before = fs.get_journal_stats();
+
+    std::vector<std::thread> threads; // the FileSystem calls run concurrently, as in the server
+    for (int t = 0; t < threads_number; t++)
+        threads.emplace_back([&, t]
+                             {
+            for (int i = 0; i < files_per_thread; i++)
+            {
+                ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "f" + std::to_string(t) + "_" + std::to_string(i)).has_value());
+                ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+            } });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    EXPECT_LE(fs.get_journal_stats().commits - before.commits, static_cast<uint64_t>(threads_number * files_per_thread));
+    EXPECT_GT(fs.get_journal_stats().checkpoints, before.checkpoints); // the log filled up on the way
+
+    InMemoryBlockDevice crashed(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    copy_device(device, crashed);
+    FileSystem recovered(crashed);
+    for (int t = 0; t < threads_number; t++)
+        for (int i = 0; i < files_per_thread; i++)
+            EXPECT_TRUE(recovered.lookup(ROOT_INODE_ID, "f" + std::to_string(t) + "_" + std::to_string(i)).has_value());
+}
+
+TEST(JournalTest, GroupCommit_ManyWriters_TransactionsFitTheLog)
+{
+    const int threads_number = 16;
+    const int files_per_thread = 20;
+
+    InMemoryBlockDevice device(4096 * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+
+    std::vector<std::thread> threads; // writers in their own directories run their handles together
+    for (int t = 0; t < threads_number; t++)
+        threads.emplace_back([&, t]
+                             {
+            std::vector<uint8_t> data(BLOCK_SIZE, static_cast<uint8_t>(t));
+            auto dir_res = fs.create_directory(ROOT_INODE_ID, "d" + std::to_string(t));
+            ASSERT_TRUE(dir_res.has_value());
+            for (int i = 0; i < files_per_thread; i++)
+            {
+                auto file_res = fs.create_file(dir_res.value(), "f" + std::to_string(t) + "_" + std::to_string(i));
+                ASSERT_TRUE(file_res.has_value());
+                ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+                ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+            } });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    InMemoryBlockDevice crashed(4096 * BLOCK_SIZE);
+    copy_device(device, crashed);
+    FileSystem recovered(crashed);
+    for (int t = 0; t < threads_number; t++)
+    {
+        auto dir_res = recovered.lookup(ROOT_INODE_ID, "d" + std::to_string(t));
+        ASSERT_TRUE(dir_res.has_value());
+        for (int i = 0; i < files_per_thread; i++)
+            EXPECT_TRUE(recovered.lookup(dir_res.value().inode_id, "f" + std::to_string(t) + "_" + std::to_string(i)).has_value());
+    }
+}
+
+// fails the block writes while fail_writes is set
+class FailingWritesBlockDevice : public BlockDevice
+{
+public:
+    explicit FailingWritesBlockDevice(BlockDevice &_inner) : inner(_inner) {}
+
+    int get_total_blocks_number() const override { return inner.get_total_blocks_number(); }
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override { return inner.read_block(block_index, buffer); }
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override
+    {
+        return fail_writes ? FileSystemStatus::DeviceError : inner.write_block(block_index, buffer);
+    }
+
+    bool fail_writes = false;
+
+private:
+    BlockDevice &inner;
+};
+
+TEST(JournalTest, FailedCommit_WrittenAgainApart)
+{
+    const int first_block = JOURNAL_START_INDEX + JOURNAL_BLOCKS;
+    const int blocks_count = MAX_TRANSACTION_BLOCKS * 2 / 3; // the two transactions together overflow the log
+
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FailingWritesBlockDevice device(inner);
+    Journal journal(device);
+    ASSERT_EQ(journal.format(), FileSystemStatus::OK);
+
+    for (int i = 0; i < blocks_count; i++)
+        ASSERT_EQ(journal.write_block(first_block + i, make_text_block(i).data()), FileSystemStatus::OK);
+    device.fail_writes = true;
+    EXPECT_NE(journal.commit(), FileSystemStatus::OK);
+    device.fail_writes = false;
+
+    for (int i = blocks_count; i < 2 * blocks_count; i++)
+        ASSERT_EQ(journal.write_block(first_block + i, make_text_block(i).data()), FileSystemStatus::OK);
+    ASSERT_EQ(journal.commit(), FileSystemStatus::OK);
+    EXPECT_EQ(journal.get_stats().commits, 2u);
+
+    InMemoryBlockDevice crashed(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    copy_device(inner, crashed);
+    Journal replayed(crashed);
+    ASSERT_EQ(replayed.recover(), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    for (int i = 0; i < 2 * blocks_count; i++)
+    {
+        ASSERT_EQ(crashed.read_block(first_block + i, read.data()), FileSystemStatus::OK);
+        EXPECT_EQ(read, make_text_block(i));
+    }
+}
+
+// records the blocks written to the wrapped device in order, -1 for a flush
+class OrderRecordingBlockDevice : public BlockDevice
+{
+public:
+    explicit OrderRecordingBlockDevice(BlockDevice &_inner) : inner(_inner) {}
+
+    int get_total_blocks_number() const override { return inner.get_total_blocks_number(); }
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override { return inner.read_block(block_index, buffer); }
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override
+    {
+        events.push_back(block_index);
+        return inner.write_block(block_index, buffer);
+    }
+    FileSystemStatus flush() override
+    {
+        events.push_back(-1);
+        return inner.flush();
+    }
+
+    std::vector<int> events;
+
+private:
+    BlockDevice &inner;
+};
+
+TEST(JournalTest, OrderedData_FlushedBeforeCommitBlock)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    OrderRecordingBlockDevice device(inner);
+    FileSystem fs(device);
+    fs.format();
+    auto file_res = fs.create_file(ROOT_INODE_ID, "file");
+    ASSERT_TRUE(file_res.has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    device.events.clear();
+    std::vector<uint8_t> data = make_random_block(3);
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    // the data block is the only write past the journal, the commit block the last one in it
+    auto in_journal = [](int block_index)
+    { return block_index >= JOURNAL_START_INDEX && block_index < JOURNAL_START_INDEX + JOURNAL_BLOCKS; };
+    auto data_it = std::find_if(device.events.begin(), device.events.end(), [&](int block_index)
+                                { return block_index != -1 && !in_journal(block_index); });
+    auto commit_it = std::find_if(device.events.rbegin(), device.events.rend(), in_journal);
+    ASSERT_NE(data_it, device.events.end());
+    ASSERT_NE(commit_it, device.events.rend());
+    EXPECT_NE(std::find(data_it, commit_it.base(), -1), commit_it.base());
+}
+
+TEST(JournalTest, ReadPin_NotBlockedByWaitingCommit)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    Journal journal(device);
+    ASSERT_EQ(journal.format(), FileSystemStatus::OK);
+    const int block_index = JOURNAL_START_INDEX + JOURNAL_BLOCKS;
+    std::vector<uint8_t> data = make_text_block(2);
+    ASSERT_EQ(journal.write_block(block_index, data.data()), FileSystemStatus::OK);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool handle_started = false;
+    bool release = false;
+    std::thread writer([&]
+                       {
+        Journal::Handle handle(journal);
+        std::unique_lock<std::mutex> lock(mutex);
+        handle_started = true;
+        changed.notify_all();
+        changed.wait(lock, [&]
+                     { return release; }); });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]
+                     { return handle_started; });
+    }
+
+    // the commit waits for the handle and no new handle starts meanwhile, a reader still does
+    std::thread committer([&]
+                          { EXPECT_EQ(journal.commit(), FileSystemStatus::OK); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    {
+        Journal::ReadPin pin(journal);
+        EXPECT_EQ(journal.read_block(block_index, read.data()), FileSystemStatus::OK);
+        EXPECT_FALSE(journal.view_block(block_index).has_value()); // the logged image is copied
+    }
+    EXPECT_EQ(read, data);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+    }
+    changed.notify_all();
+    writer.join();
+    committer.join();
+}
+
+TEST(JournalTest, View_OnlyOfThreadSafeBackingDevice)
+{
+    InMemoryBlockDevice dense(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    Journal over_dense(dense);
+    ASSERT_EQ(over_dense.format(), FileSystemStatus::OK);
+    EXPECT_TRUE(over_dense.view_block(DEFAULT_TOTAL_BLOCKS - 1).has_value());
+
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    CompressedBlockDevice compressed(backing, DEFAULT_TOTAL_BLOCKS);
+    Journal over_compressed(compressed);
+    ASSERT_EQ(over_compressed.format(), FileSystemStatus::OK);
+    auto view_res = over_compressed.view_block(DEFAULT_TOTAL_BLOCKS - 1); // another thread may evict its cached copy
+    ASSERT_FALSE(view_res.has_value());
+    EXPECT_EQ(view_res.error(), FileSystemStatus::NotSupported);
+}
+
+TEST(JournalTest, ConcurrentReaders_OverCompressedDevice)
+{
+    const int threads_number = 8;
+    const int rounds = 5000;
+
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(1024) * BLOCK_SIZE);
+    CompressedBlockDevice device(backing, 1024, 2 * BLOCK_SIZE); // the readers evict each other
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+
+    std::vector<int> files;
+    for (int t = 0; t < threads_number; t++)
+    {
+        auto file_res = fs.create_file(ROOT_INODE_ID, "f" + std::to_string(t));
+        ASSERT_TRUE(file_res.has_value());
+        std::vector<uint8_t> data = make_text_block(t);
+        ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+        files.push_back(file_res.value());
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_number; t++)
+        threads.emplace_back([&, t]
+                             {
+            std::vector<uint8_t> expected = make_text_block(t);
+            std::vector<uint8_t> read(BLOCK_SIZE);
+            for (int round = 0; round < rounds; round++)
+            {
+                ASSERT_TRUE(fs.read_file(files[t], read, 0).has_value());
+                EXPECT_EQ(read, expected);
+            } });
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+// ── Discard ───────────────────────────────────────────────────────────────────
+
+static bool reads_as_zeros(const BlockDevice &device, int first_block, int blocks_count)
+{
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    for (int block_index = first_block; block_index < first_block + blocks_count; block_index++)
+        if (device.read_block(block_index, read.data()) != FileSystemStatus::OK ||
+            std::any_of(read.begin(), read.end(), [](uint8_t byte)
+                        { return byte != 0; }))
+            return false;
+    return true;
+}
+
+TEST(DiscardTest, SparseInMemory_ReleasesBlocks)
+{
+    InMemoryBlockDevice device(2 * SPARSE_LEAF_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x3C);
+    for (int block_index : {0, 1, 2, 3, SPARSE_LEAF_BLOCKS + 5})
+        ASSERT_EQ(device.write_block(block_index, written.data()), FileSystemStatus::OK);
+
+    ASSERT_EQ(device.discard_blocks(1, SPARSE_LEAF_BLOCKS + 10), FileSystemStatus::OK);
+    EXPECT_EQ(device.allocated_blocks_number(), 1);
+    EXPECT_TRUE(reads_as_zeros(device, 1, SPARSE_LEAF_BLOCKS + 10));
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(0, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+    EXPECT_EQ(device.discard_blocks(2 * SPARSE_LEAF_BLOCKS - 1, 2), FileSystemStatus::OutOfBounds);
+}
+
+TEST(DiscardTest, DenseInMemory_ZeroesRange)
+{
+    InMemoryBlockDevice device(8 * BLOCK_SIZE);
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x11);
+    for (int block_index = 0; block_index < 8; block_index++)
+        ASSERT_EQ(device.write_block(block_index, written.data()), FileSystemStatus::OK);
+
+    ASSERT_EQ(device.discard_blocks(2, 3), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(device, 2, 3));
+    EXPECT_FALSE(reads_as_zeros(device, 1, 1));
+    EXPECT_FALSE(reads_as_zeros(device, 5, 1));
+}
+
+TEST(DiscardTest, Striped_EveryChildDiscardsItsPart)
+{
+    InMemoryBlockDevice first(4 * BLOCK_SIZE, InMemoryLayout::Sparse), second(4 * BLOCK_SIZE, InMemoryLayout::Sparse),
+        third(4 * BLOCK_SIZE, InMemoryLayout::Sparse);
+    StripedBlockDevice device({&first, &second, &third}, 2);
+
+    std::vector<int> indices;
+    for (int i = 0; i < 12; i++)
+        indices.push_back(i);
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE, 0x7E);
+    ASSERT_EQ(device.write_blocks(indices, written.data()), FileSystemStatus::OK);
+
+    ASSERT_EQ(device.discard_blocks(1, 9), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(device, 1, 9));
+    EXPECT_FALSE(reads_as_zeros(device, 0, 1));
+    EXPECT_FALSE(reads_as_zeros(device, 10, 2));
+    EXPECT_EQ(first.allocated_blocks_number() + second.allocated_blocks_number() + third.allocated_blocks_number(), 3);
+}
+
+TEST(DiscardTest, Checksum_DiscardedBlocksVerify)
+{
+    InMemoryBlockDevice backing(ChecksumBlockDevice::backing_blocks_for(16) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    ChecksumBlockDevice device(backing);
+    ASSERT_TRUE(device.is_loaded());
+
+    std::vector<uint8_t> written = make_text_block(3);
+    for (int block_index = 0; block_index < 4; block_index++)
+        ASSERT_EQ(device.write_block(block_index, written.data()), FileSystemStatus::OK);
+
+    ASSERT_EQ(device.discard_blocks(0, 4), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(device, 0, 4)); // would fail with ChecksumMismatch on a stale checksum
+
+    ChecksumBlockDevice remounted(backing);
+    EXPECT_TRUE(reads_as_zeros(remounted, 0, 4));
+}
+
+TEST(DiscardTest, Compressed_FlushDiscardsEmptiedSlotBlocks)
+{
+    const int logical_blocks = 32;
+    InMemoryBlockDevice backing(CompressedBlockDevice::backing_blocks_for(logical_blocks) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    CompressedBlockDevice device(backing, logical_blocks);
+
+    for (int block_index = 0; block_index < 8; block_index++)
+    {
+        std::vector<uint8_t> block = make_random_block(block_index); // stored raw, a backing block each
+        ASSERT_EQ(device.write_block(block_index, block.data()), FileSystemStatus::OK);
+    }
+    ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    int allocated_before = backing.allocated_blocks_number();
+
+    ASSERT_EQ(device.discard_blocks(0, 8), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(device, 0, 8));
+    EXPECT_EQ(device.get_used_bytes(), 0u);
+    EXPECT_EQ(backing.allocated_blocks_number(), allocated_before); // slots are released on flush
+
+    ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    EXPECT_EQ(backing.allocated_blocks_number(), allocated_before - 8);
+}
+
+TEST(DiscardTest, Dedup_FlushDiscardsReleasedBlocks)
+{
+    const int logical_blocks = 32;
+    InMemoryBlockDevice backing(DedupBlockDevice::backing_blocks_for(logical_blocks) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    DedupBlockDevice device(backing, logical_blocks);
+
+    std::vector<uint8_t> shared = make_random_block(50);
+    for (int block_index = 0; block_index < 4; block_index++)
+    {
+        std::vector<uint8_t> block = make_random_block(block_index);
+        ASSERT_EQ(device.write_block(block_index, block.data()), FileSystemStatus::OK);
+        ASSERT_EQ(device.write_block(10 + block_index, shared.data()), FileSystemStatus::OK);
+    }
+    ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    int allocated_before = backing.allocated_blocks_number();
+
+    // the shared block keeps a reference outside the range
+    ASSERT_EQ(device.discard_blocks(0, 13), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(device, 0, 13));
+    ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+    EXPECT_EQ(device.get_physical_blocks_used(), 1);
+    EXPECT_EQ(backing.allocated_blocks_number(), allocated_before - 4);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(13, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, shared);
+}
+
+TEST(DiscardTest, FileSystem_DeleteDiscardsOnceCommitted)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+    StatsBlockDevice device(inner);
+    FileSystem fs(device);
+    fs.format();
+    fs.set_online_discard(true);
+
+    std::vector<uint8_t> data;
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<uint8_t> block = make_random_block(80 + i);
+        data.insert(data.end(), block.begin(), block.end());
+    }
+    auto file_res = fs.create_file(ROOT_INODE_ID, "file");
+    ASSERT_TRUE(file_res.has_value());
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    device.reset(); // format discards the inode table and the data area
+
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, file_res.value()), FileSystemStatus::OK);
+    int first_file_block = fs.get_superblock().data_start + 1; // the root directory holds the first data block
+    EXPECT_FALSE(reads_as_zeros(inner, first_file_block, 4));   // the delete is not committed yet
+
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    EXPECT_TRUE(reads_as_zeros(inner, first_file_block, 4));
+    OperationStats discard_stats = device.get_operation_stats(DeviceOperation::Discard);
+    EXPECT_EQ(discard_stats.calls, 1u); // the four blocks are one range
+    EXPECT_EQ(discard_stats.blocks, 4u);
+}
+
+TEST(DiscardTest, FileSystem_ReusedBlockNotDiscarded)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+    FileSystem fs(device);
+    fs.format();
+    fs.set_online_discard(true);
+
+    std::vector<uint8_t> old_data = make_random_block(90), new_data = make_random_block(91);
+    auto old_res = fs.create_file(ROOT_INODE_ID, "old");
+    ASSERT_TRUE(old_res.has_value());
+    ASSERT_TRUE(fs.write_file(old_res.value(), old_data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    // the freed block is handed out again before the delete is committed
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, old_res.value()), FileSystemStatus::OK);
+    auto new_res = fs.create_file(ROOT_INODE_ID, "new");
+    ASSERT_TRUE(new_res.has_value());
+    ASSERT_TRUE(fs.write_file(new_res.value(), new_data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_TRUE(fs.read_file(new_res.value(), read, 0).has_value());
+    EXPECT_EQ(read, new_data);
+}
+
+TEST(DiscardTest, FileSystem_TrimFreeBlocks)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, InMemoryLayout::Sparse);
+    FileSystem fs(device);
+    fs.format();
+
+    std::vector<uint8_t> data = make_random_block(95);
+    auto file_res = fs.create_file(ROOT_INODE_ID, "file");
+    ASSERT_TRUE(file_res.has_value());
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, file_res.value()), FileSystemStatus::OK);
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    int allocated_before = device.allocated_blocks_number(); // no online discard
+
+    auto trim_res = fs.trim_free_blocks();
+    ASSERT_TRUE(trim_res.has_value());
+    EXPECT_EQ(trim_res.value(), fs.get_superblock().data_blocks - 1); // all but the root directory block
+    EXPECT_EQ(device.allocated_blocks_number(), allocated_before - 1);
+    EXPECT_TRUE(fs.lookup(ROOT_INODE_ID, "file").has_value() == false);
+}
+
+// ── Readahead ─────────────────────────────────────────────────────────────────
+
+// a batch counts as queued until it is cached
+static void wait_for_prefetch(const BufferCache &cache)
+{
+    for (int i = 0; i < 1000 && cache.queued_prefetch_number() > 0; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+// a file of STREAM_BLOCKS distinct blocks, the last ones behind an indirect block
+static const int STREAM_BLOCKS = 12;
+
+static std::vector<uint8_t> write_full_file(FileSystem &fs, int &inode_id)
+{
+    std::vector<uint8_t> data;
+    for (int i = 0; i < STREAM_BLOCKS; i++)
+    {
+        std::vector<uint8_t> block = make_random_block(100 + i);
+        data.insert(data.end(), block.begin(), block.end());
+    }
+    auto file_res = fs.create_file(ROOT_INODE_ID, "stream");
+    inode_id = file_res.value_or(-1);
+    if (file_res.has_value())
+        fs.write_file(inode_id, data, 0);
+    return data;
+}
+
+TEST(ReadaheadTest, BufferCache_PrefetchedBlocksServedFromCache)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice backing(inner);
+    BufferCache cache(backing, 8 * BLOCK_SIZE);
+
+    std::vector<int> indices = {3, 4, 5};
+    ASSERT_EQ(cache.prefetch_blocks(indices), FileSystemStatus::OK);
+    wait_for_prefetch(cache);
+    EXPECT_EQ(cache.cached_blocks_number(), 3);
+    EXPECT_EQ(backing.read_calls, 1); // one batch
+
+    std::vector<uint8_t> buffer(indices.size() * BLOCK_SIZE);
+    ASSERT_EQ(cache.read_blocks(indices, buffer.data()), FileSystemStatus::OK);
+    EXPECT_EQ(backing.blocks_read, 3u);
+
+    BufferCacheStats stats = cache.get_stats();
+    EXPECT_EQ(stats.prefetched, 3u);
+    EXPECT_EQ(stats.prefetch_hits, 3u);
+    EXPECT_EQ(stats.prefetch_wasted, 0u);
+    EXPECT_EQ(cache.prefetch_blocks(std::vector<int>{DEFAULT_TOTAL_BLOCKS}), FileSystemStatus::OutOfBounds);
+}
+
+// holds the batch reads while gated is set, until open() or a timeout
+class GatedBlockDevice : public BlockDevice
+{
+public:
+    explicit GatedBlockDevice(BlockDevice &_inner) : inner(_inner) {}
+
+    int get_total_blocks_number() const override { return inner.get_total_blocks_number(); }
+    FileSystemStatus read_block(int block_index, uint8_t *buffer) const override { return inner.read_block(block_index, buffer); }
+    FileSystemStatus write_block(int block_index, const uint8_t *buffer) override { return inner.write_block(block_index, buffer); }
+    FileSystemStatus read_blocks(std::span<const int> block_indices, uint8_t *buffer) const override
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            held++;
+            changed.notify_all();
+            changed.wait_for(lock, std::chrono::seconds(2), [this]
+                             { return !gated; });
+        }
+        return inner.read_blocks(block_indices, buffer);
+    }
+
+    void wait_until_held() const
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]
+                     { return held > 0; });
+    }
+
+    void open()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            gated = false;
+        }
+        changed.notify_all();
+    }
+
+    bool gated = true;
+
+private:
+    BlockDevice &inner;
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+    mutable int held = 0;
+};
+
+TEST(ReadaheadTest, BufferCache_HitsServedWhilePrefetchReads_CancelDropsQueued)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    GatedBlockDevice backing(inner);
+    BufferCache cache(backing, 4 * BLOCK_SIZE);
+
+    uint8_t buffer[BLOCK_SIZE];
+    ASSERT_EQ(cache.read_block(0, buffer), FileSystemStatus::OK);
+    ASSERT_EQ(cache.prefetch_blocks(std::vector<int>{3, 4, 5, 6}), FileSystemStatus::OK);
+    backing.wait_until_held();
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(cache.read_block(0, buffer), FileSystemStatus::OK); // a hit does not wait for the batch
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+
+    ASSERT_EQ(cache.prefetch_blocks(std::vector<int>{7, 8, 9, 10}), FileSystemStatus::OK);
+    cache.cancel_prefetch(std::vector<int>{7, 8});
+    EXPECT_EQ(cache.queued_prefetch_number(), 6); // the batch being read and blocks 9, 10
+
+    backing.open();
+    wait_for_prefetch(cache);
+    EXPECT_EQ(cache.get_stats().prefetched, 6u);
+}
+
+TEST(ReadaheadTest, BufferCache_ViewedBlockNotEvictedByPrefetch)
+{
+    InMemoryBlockDevice backing(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    std::vector<uint8_t> data(BLOCK_SIZE, 0x5A);
+    ASSERT_EQ(backing.write_block(2, data.data()), FileSystemStatus::OK);
+    BufferCache cache(backing, 2 * BLOCK_SIZE);
+
+    auto view = cache.view_block(2);
+    ASSERT_TRUE(view.has_value());
+    ASSERT_EQ(cache.prefetch_blocks(std::vector<int>{5, 6, 7, 8}), FileSystemStatus::OK);
+    wait_for_prefetch(cache);
+
+    // the view is still the cached copy, only one prefetched block fits beside it
+    EXPECT_TRUE(std::equal(view->begin(), view->end(), data.begin()));
+    EXPECT_EQ(cache.cached_blocks_number(), 2);
+    EXPECT_EQ(cache.get_stats().misses, 1u);
+    uint8_t buffer[BLOCK_SIZE];
+    ASSERT_EQ(cache.read_block(2, buffer), FileSystemStatus::OK);
+    EXPECT_EQ(cache.get_stats().misses, 1u);
+}
+
+TEST(ReadaheadTest, BufferCache_EvictedUnreadIsWasted)
+{
+    InMemoryBlockDevice backing(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    BufferCache cache(backing, 2 * BLOCK_SIZE);
+
+    ASSERT_EQ(cache.prefetch_blocks(std::vector<int>{0, 1}), FileSystemStatus::OK);
+    wait_for_prefetch(cache);
+
+    uint8_t buffer[BLOCK_SIZE];
+    ASSERT_EQ(cache.read_block(0, buffer), FileSystemStatus::OK);
+    ASSERT_EQ(cache.read_block(7, buffer), FileSystemStatus::OK); // evicts block 1
+    ASSERT_EQ(cache.read_block(8, buffer), FileSystemStatus::OK);
+
+    BufferCacheStats stats = cache.get_stats();
+    EXPECT_EQ(stats.prefetch_hits, 1u);
+    EXPECT_EQ(stats.prefetch_wasted, 1u);
+}
+
+TEST(ReadaheadTest, FileSystem_SequentialReaderGrowsWindow)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    BufferCache cache(inner, 64 * BLOCK_SIZE);
+    StatsBlockDevice device(cache);
+    FileSystem fs(device);
+    fs.format();
+
+    int inode_id;
+    std::vector<uint8_t> data = write_full_file(fs, inode_id);
+    ASSERT_GE(inode_id, 0);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    for (int block = 0; block < STREAM_BLOCKS; block++)
+    {
+        ASSERT_TRUE(fs.read_file(inode_id, read, block * BLOCK_SIZE).has_value());
+        EXPECT_TRUE(std::equal(read.begin(), read.end(), data.begin() + block * BLOCK_SIZE));
+    }
+
+    ReadaheadStats stats = fs.get_readahead_stats();
+    EXPECT_EQ(stats.sequential_reads, static_cast<uint64_t>(STREAM_BLOCKS));
+    EXPECT_EQ(stats.random_reads, 0u);
+    EXPECT_EQ(stats.prefetched_blocks, static_cast<uint64_t>(STREAM_BLOCKS - 1)); // all but the first block
+    EXPECT_EQ(stats.hit_blocks, static_cast<uint64_t>(STREAM_BLOCKS - 1));
+    EXPECT_EQ(stats.wasted_bytes(), 0u);
+    EXPECT_GT(stats.hit_rate(), 0.9);
+
+    // a window of 4 blocks, then one of 8 once half of it was read
+    OperationStats prefetch_stats = device.get_operation_stats(DeviceOperation::Prefetch);
+    EXPECT_EQ(prefetch_stats.calls, 2u);
+    EXPECT_EQ(prefetch_stats.blocks, static_cast<uint64_t>(STREAM_BLOCKS - 1));
+}
+
+TEST(ReadaheadTest, FileSystem_RandomReadCancelsWindow)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    BufferCache cache(inner, 64 * BLOCK_SIZE);
+    FileSystem fs(cache);
+    fs.format();
+
+    int inode_id;
+    write_full_file(fs, inode_id);
+    ASSERT_GE(inode_id, 0);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_TRUE(fs.read_file(inode_id, read, 0).has_value()); // prefetches blocks 1..4
+    ASSERT_TRUE(fs.read_file(inode_id, read, 9 * BLOCK_SIZE).has_value());
+    ASSERT_TRUE(fs.read_file(inode_id, read, 2 * BLOCK_SIZE).has_value());
+
+    ReadaheadStats stats = fs.get_readahead_stats();
+    EXPECT_EQ(stats.sequential_reads, 1u);
+    EXPECT_EQ(stats.random_reads, 2u);
+    EXPECT_EQ(stats.prefetched_blocks, 4u);
+    EXPECT_EQ(stats.hit_blocks, 0u);
+    EXPECT_EQ(stats.wasted_bytes(), static_cast<uint64_t>(4 * BLOCK_SIZE));
+}
+
+TEST(ReadaheadTest, FileSystem_DeviceWithoutCacheGetsNoHints)
+{
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    FileSystem fs(device);
+    fs.format();
+
+    int inode_id;
+    std::vector<uint8_t> data = write_full_file(fs, inode_id);
+    ASSERT_GE(inode_id, 0);
+
+    std::vector<uint8_t> read(data.size());
+    for (int block = 0; block < STREAM_BLOCKS; block += 2)
+        ASSERT_TRUE(fs.read_file(inode_id, std::span<uint8_t>(read).subspan(block * BLOCK_SIZE, 2 * BLOCK_SIZE), block * BLOCK_SIZE).has_value());
+    EXPECT_EQ(read, data);
+    EXPECT_EQ(fs.get_readahead_stats().prefetched_blocks, 0u);
+}
+
+// ── Extents ───────────────────────────────────────────────────────────────────
+
+TEST(ExtentIoTest, FileSystem_ReadsAnExtentInOneRequest)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice device(inner);
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+    fs.set_file_layout(InodeLayout::Extents);
+
+    auto file_res = fs.create_file(ROOT_INODE_ID, "extent");
+    ASSERT_TRUE(file_res.has_value());
+    std::vector<uint8_t> data(40 * BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i += BLOCK_SIZE)
+        std::fill_n(data.begin() + i, BLOCK_SIZE, static_cast<uint8_t>(i / BLOCK_SIZE));
+
+    int write_calls = device.write_calls;
+    ASSERT_TRUE(fs.write_file(file_res.value(), data, 0).has_value());
+    EXPECT_EQ(device.write_calls - write_calls, 1); // one batch, straight from the caller's buffer
+
+    int read_calls = device.read_calls;
+    std::vector<uint8_t> read(data.size());
+    auto read_res = fs.read_file(file_res.value(), read, 0);
+    ASSERT_TRUE(read_res.has_value());
+    EXPECT_EQ(read, data);
+    EXPECT_EQ(device.read_calls - read_calls, 1);
+}
+
+// ── Dentry Cache ──────────────────────────────────────────────────────────────
+
+TEST(DentryCacheIoTest, ResolvedPath_ResolvesAgainWithoutDeviceReads)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice device(inner);
+    int file_id;
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+        int dir_id = ROOT_INODE_ID;
+        for (const char *name : {"a", "b", "c", "d"})
+            dir_id = fs.create_directory(dir_id, name).value();
+        file_id = fs.create_file(dir_id, "file").value();
+    }
+
+    // mounted again, the first resolution reads the directories from the device
+    FileSystem fs(device);
+    ASSERT_EQ(fs.get_inode_by_path("/a/b/c/d/file").value(), file_id);
+    size_t blocks_read = device.blocks_read;
+    ASSERT_EQ(fs.get_inode_by_path("/a/b/c/d/file").value(), file_id);
+    EXPECT_EQ(device.blocks_read, blocks_read);
+    EXPECT_EQ(fs.get_dentry_cache_stats().hits, 5u);
+}
+
+// ── Inode Cache ───────────────────────────────────────────────────────────────
+
+TEST(InodeCacheIoTest, Attributes_ReadAgainWithoutDeviceReads)
+{
+    InMemoryBlockDevice inner(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    CountingBlockDevice device(inner);
+    int file_id;
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+        file_id = fs.create_file(ROOT_INODE_ID, "file").value();
+        std::vector<uint8_t> data(BLOCK_SIZE * (TOTAL_DIRECT_BLOCKS + 1), 1);
+        ASSERT_TRUE(fs.write_file(file_id, data, 0).has_value());
+    }
+
+    // mounted again, the first call reads the inode and the indirect block
+    FileSystem fs(device);
+    ASSERT_TRUE(fs.get_attributes(file_id).has_value());
+    ASSERT_TRUE(fs.lookup(ROOT_INODE_ID, "file").has_value());
+    size_t blocks_read = device.blocks_read;
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_EQ(fs.get_attributes(file_id).value().blocks_used, static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS + 2));
+        ASSERT_EQ(fs.lookup(ROOT_INODE_ID, "file").value().inode_id, file_id);
+    }
+    EXPECT_EQ(device.blocks_read, blocks_read);
+}
+
+// ── Mmap Block Device ─────────────────────────────────────────────────────────
+
+class MmapBlockDeviceTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        image_path = ::testing::TempDir() + "mmap_block_device_test.img";
+        std::remove(image_path.c_str());
+    }
+
+    void TearDown() override
+    {
+        std::remove(image_path.c_str());
+    }
+
+    std::string image_path;
+};
+
+TEST_F(MmapBlockDeviceTest, NewImage_HasRequestedSize)
+{
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+    EXPECT_EQ(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+}
+
+TEST_F(MmapBlockDeviceTest, WriteBlock_ThenReadBack_DataMatches)
+{
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x5A);
+    ASSERT_EQ(device.write_block(7, written.data()), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(BLOCK_SIZE);
+    ASSERT_EQ(device.read_block(7, read.data()), FileSystemStatus::OK);
+    EXPECT_EQ(read, written);
+}
+
+TEST_F(MmapBlockDeviceTest, OutOfBounds_ReturnsError)
+{
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+
+    uint8_t buffer[BLOCK_SIZE] = {};
+    EXPECT_EQ(device.read_block(DEFAULT_TOTAL_BLOCKS, buffer), FileSystemStatus::OutOfBounds);
+    EXPECT_EQ(device.write_block(-1, buffer), FileSystemStatus::OutOfBounds);
+    EXPECT_EQ(device.flush_blocks(0, DEFAULT_TOTAL_BLOCKS + 1), FileSystemStatus::OutOfBounds);
+}
+
+TEST_F(MmapBlockDeviceTest, Reopen_ExistingLargerImage_KeepsSize)
+{
+    {
+        MmapBlockDevice device(image_path, 2 * DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+        ASSERT_TRUE(device.is_open());
+    }
+
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+    EXPECT_EQ(device.get_total_blocks_number(), 2 * DEFAULT_TOTAL_BLOCKS);
+}
+
+TEST_F(MmapBlockDeviceTest, FileSystem_RemountsImage_WithoutFormat)
+{
+    std::vector<uint8_t> message = {'p', 'e', 'r', 's', 'i', 's', 't'};
+    int inode_id;
+
+    {
+        MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+        ASSERT_TRUE(device.is_open());
+        FileSystem fs(device);
+        EXPECT_FALSE(fs.is_device_formatted());
+        fs.format();
+
+        auto create_res = fs.create_file(ROOT_INODE_ID, "kept.txt");
+        ASSERT_TRUE(create_res.has_value());
+        inode_id = create_res.value();
+        ASSERT_TRUE(fs.write_file(inode_id, message, 0).has_value());
+        EXPECT_EQ(device.flush(), FileSystemStatus::OK);
+    }
+
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+    FileSystem fs(device);
+    ASSERT_TRUE(fs.is_device_formatted());
+
+    auto lookup_res = fs.lookup(ROOT_INODE_ID, "kept.txt");
+    ASSERT_TRUE(lookup_res.has_value());
+    EXPECT_EQ(lookup_res.value().inode_id, inode_id);
+
+    std::vector<uint8_t> read(message.size());
+    ASSERT_TRUE(fs.read_file(inode_id, read, 0).has_value());
+    EXPECT_EQ(read, message);
+}
+
+TEST_F(MmapBlockDeviceTest, DiscardBlocks_PunchesHole)
+{
+    MmapBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+
+    std::vector<uint8_t> written(BLOCK_SIZE, 0x6B);
+    for (int block_index = 0; block_index < 16; block_index++)
+        ASSERT_EQ(device.write_block(block_index, written.data()), FileSystemStatus::OK);
+    ASSERT_EQ(device.flush(), FileSystemStatus::OK);
+
+    struct stat before;
+    ASSERT_EQ(stat(image_path.c_str(), &before), 0);
+
+    FileSystemStatus status = device.discard_blocks(4, 8);
+    if (status == FileSystemStatus::NotSupported)
+        GTEST_SKIP() << "the file system of the temp dir cannot punch holes";
+    ASSERT_EQ(status, FileSystemStatus::OK);
+
+    struct stat after;
+    ASSERT_EQ(stat(image_path.c_str(), &after), 0);
+    EXPECT_EQ(after.st_size, before.st_size);
+    EXPECT_LT(after.st_blocks, before.st_blocks);
+    EXPECT_TRUE(reads_as_zeros(device, 4, 8));
+    EXPECT_FALSE(reads_as_zeros(device, 3, 1));
+}
+
+// ── io_uring Block Device ─────────────────────────────────────────────────────
+
+class IoUringBlockDeviceTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        image_path = ::testing::TempDir() + "io_uring_block_device_test.img";
+        std::remove(image_path.c_str());
+    }
+
+    void TearDown() override
+    {
+        std::remove(image_path.c_str());
+    }
+
+    std::string image_path;
+};
+
+TEST_F(IoUringBlockDeviceTest, WriteBlocks_ThenReadBlocks_UnalignedBuffer)
+{
+    IoUringBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+    EXPECT_EQ(device.get_total_blocks_number(), DEFAULT_TOTAL_BLOCKS);
+
+    // a vector's storage is not block aligned, so the bounce buffers are used
+    std::vector<int> indices;
+    for (int i = 0; i < TOTAL_DIRECT_BLOCKS; i++)
+        indices.push_back(20 + 3 * i);
+
+    std::vector<uint8_t> written(indices.size() * BLOCK_SIZE + 1);
+    for (size_t i = 0; i < written.size(); i++)
+        written[i] = static_cast<uint8_t>(i * 7);
+    ASSERT_EQ(device.write_blocks(indices, written.data() + 1), FileSystemStatus::OK);
+
+    std::vector<uint8_t> read(written.size());
+    ASSERT_EQ(device.read_blocks(indices, read.data() + 1), FileSystemStatus::OK);
+    EXPECT_TRUE(std::equal(read.begin() + 1, read.end(), written.begin() + 1));
+}
+
+TEST_F(IoUringBlockDeviceTest, AsyncQueue_AllCompleteAfterSubmit)
+{
+    IoUringBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE, 8);
+    ASSERT_TRUE(device.is_open());
+
+    const int requests = 12; // more than the queue depth
+    auto *buffers = static_cast<uint8_t *>(std::aligned_alloc(BLOCK_SIZE, requests * BLOCK_SIZE));
+    for (int i = 0; i < requests; i++)
+        std::fill_n(buffers + i * BLOCK_SIZE, BLOCK_SIZE, static_cast<uint8_t>(i + 1));
+
+    std::set<uint64_t> request_ids;
+    for (int i = 0; i < requests; i++)
+    {
+        auto request_res = device.queue_write(i, buffers + i * BLOCK_SIZE);
+        ASSERT_TRUE(request_res.has_value());
+        request_ids.insert(request_res.value());
+    }
+    ASSERT_EQ(device.submit(), FileSystemStatus::OK);
+
+    while (!request_ids.empty())
+    {
+        auto completion_res = device.wait_completion();
+        ASSERT_TRUE(completion_res.has_value());
+        EXPECT_EQ(completion_res.value().status, FileSystemStatus::OK);
+        EXPECT_EQ(request_ids.erase(completion_res.value().request_id), 1u);
+    }
+    EXPECT_EQ(device.in_flight(), 0);
+
+    uint8_t read[BLOCK_SIZE];
+    ASSERT_EQ(device.read_block(requests - 1, read), FileSystemStatus::OK);
+    EXPECT_EQ(read[0], requests);
+
+    std::free(buffers);
+}
+
+TEST_F(IoUringBlockDeviceTest, FileSystem_RunsOnDevice)
+{
+    IoUringBlockDevice device(image_path, DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+    ASSERT_TRUE(device.is_open());
+    FileSystem fs(device);
+    fs.format();
+
+    auto create_res = fs.create_file(ROOT_INODE_ID, "direct.bin");
+    ASSERT_TRUE(create_res.has_value());
+
+    std::vector<uint8_t> data(TOTAL_DIRECT_BLOCKS * BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8_t>(i / BLOCK_SIZE + i);
+    ASSERT_TRUE(fs.write_file(create_res.value(), data, 0).has_value());
+
+    std::vector<uint8_t> read(data.size());
+    auto read_res = fs.read_file(create_res.value(), read, 0);
+    ASSERT_TRUE(read_res.has_value());
+    EXPECT_EQ(read, data);
+}
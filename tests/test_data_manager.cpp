@@ -3,6 +3,8 @@
 #include "file_system.hpp"
 #include "fs_status.hpp"
 #include "fs_constants.hpp"
+#include "allocation_bitmap.hpp"
+#include <vector>
 
 class DataManagerTest : public ::testing::Test
 {
@@ -24,6 +26,17 @@ protected:
     {
         return fs.free_data_block(block_number);
     }
+
+    std::expected<std::vector<DataBlockRun>, FileSystemStatus> call_allocate_data_blocks(FileSystem &fs, int count, int goal)
+    {
+        return fs.allocate_data_blocks(count, goal);
+    }
+
+    FileSystemStatus call_map_blocks(FileSystem &fs, int inode_id, int first_block, int blocks_count, std::vector<BlockRun> &runs)
+    {
+        Inode inode = fs.get_inode(inode_id).value();
+        return fs.map_blocks(inode_id, inode, first_block, blocks_count, false, runs);
+    }
 };
 
 TEST_F(DataManagerTest, init_data_bitmap)
@@ -33,24 +46,24 @@ TEST_F(DataManagerTest, init_data_bitmap)
 
 TEST_F(DataManagerTest, allocate_data_block_FirstBlock)
 {
-    int size_byte = BLOCK_SIZE * TOTAL_BLOCKS_NUMBER;
+    int size_byte = BLOCK_SIZE * DEFAULT_TOTAL_BLOCKS;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
     call_init_data_bitmap_on_format(fs); // bitmap only — no blocks pre-allocated
 
     auto result = call_allocate_data_block(fs);
     ASSERT_TRUE(result.has_value());
-    EXPECT_EQ(result.value(), DATA_START_BLOCK); // first absolute data block
+    EXPECT_EQ(result.value(), fs.get_superblock().data_start); // first absolute data block
 }
 
 TEST_F(DataManagerTest, allocate_data_block_FullDisk)
 {
-    int size_byte = BLOCK_SIZE * TOTAL_BLOCKS_NUMBER;
+    int size_byte = BLOCK_SIZE * DEFAULT_TOTAL_BLOCKS;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
     call_init_data_bitmap_on_format(fs);
 
-    for (int i = 0; i < DATA_TABLE_SIZE; i++)
+    for (int i = 0; i < fs.get_superblock().data_blocks; i++)
     {
         auto result = call_allocate_data_block(fs);
         EXPECT_TRUE(result.has_value());
@@ -63,22 +76,201 @@ TEST_F(DataManagerTest, allocate_data_block_FullDisk)
 
 TEST_F(DataManagerTest, allocate_data_block_recyle_block)
 {
-    int size_byte = BLOCK_SIZE * TOTAL_BLOCKS_NUMBER;
+    int size_byte = BLOCK_SIZE * DEFAULT_TOTAL_BLOCKS;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
     call_init_data_bitmap_on_format(fs);
 
-    for (int i = 0; i < DATA_TABLE_SIZE; i++)
+    for (int i = 0; i < fs.get_superblock().data_blocks; i++)
     {
         auto result = call_allocate_data_block(fs);
         EXPECT_TRUE(result.has_value());
     }
 
-    int relative_block = DATA_TABLE_SIZE / 2;
+    int relative_block = fs.get_superblock().data_blocks / 2;
     FileSystemStatus status = call_free_block(fs, relative_block);
     EXPECT_EQ(status, FileSystemStatus::OK);
 
     auto result = call_allocate_data_block(fs);
     ASSERT_TRUE(result.has_value());
-    EXPECT_EQ(result.value(), relative_block + DATA_START_BLOCK);
+    EXPECT_EQ(result.value(), relative_block + fs.get_superblock().data_start);
+}
+
+TEST_F(DataManagerTest, allocate_data_block_NextFit_SkipsFreedBlockBehindCursor)
+{
+    InMemoryBlockDevice device(BLOCK_SIZE * 1000);
+    FileSystem fs(device);
+    call_init_data_bitmap_on_format(fs);
+
+    // the cursor moves on to the second bitmap word
+    const int allocated = 2 * BITS_PER_WORD - 10;
+    for (int i = 0; i < allocated; i++)
+        ASSERT_TRUE(call_allocate_data_block(fs).has_value());
+    ASSERT_EQ(call_free_block(fs, 2), FileSystemStatus::OK);
+
+    auto result = call_allocate_data_block(fs);
+    ASSERT_TRUE(result.has_value());
+    EXPECT_EQ(result.value(), allocated + fs.get_superblock().data_start);
+}
+
+TEST_F(DataManagerTest, allocate_data_blocks_SkipsShortHoleForFullRun)
+{
+    InMemoryBlockDevice device(BLOCK_SIZE * 1000);
+    FileSystem fs(device);
+    call_init_data_bitmap_on_format(fs);
+    int data_start = fs.get_superblock().data_start;
+
+    for (int i = 0; i < 20; i++)
+        ASSERT_TRUE(call_allocate_data_block(fs).has_value());
+    for (int i = 5; i < 8; i++)
+        ASSERT_EQ(call_free_block(fs, i), FileSystemStatus::OK);
+
+    auto result = call_allocate_data_blocks(fs, 8, data_start);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_EQ(result.value().size(), 1u);
+    EXPECT_EQ(result.value()[0].first_block, data_start + 20);
+    EXPECT_EQ(result.value()[0].length, 8);
+
+    // a run that fits the hole takes it
+    result = call_allocate_data_blocks(fs, 3, data_start);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_EQ(result.value().size(), 1u);
+    EXPECT_EQ(result.value()[0].first_block, data_start + 5);
+}
+
+TEST_F(DataManagerTest, allocate_data_blocks_NotEnoughFree_FullDiskAndNothingTaken)
+{
+    int size_byte = BLOCK_SIZE * DEFAULT_TOTAL_BLOCKS;
+    InMemoryBlockDevice device(size_byte);
+    FileSystem fs(device);
+    call_init_data_bitmap_on_format(fs);
+    int data_blocks = fs.get_superblock().data_blocks;
+
+    auto result = call_allocate_data_blocks(fs, data_blocks + 1, -1);
+    ASSERT_FALSE(result.has_value());
+    EXPECT_EQ(result.error(), FileSystemStatus::FullDisk);
+
+    result = call_allocate_data_blocks(fs, data_blocks, -1);
+    ASSERT_TRUE(result.has_value());
+    ASSERT_EQ(result.value().size(), 1u);
+    EXPECT_EQ(result.value()[0].length, data_blocks);
+}
+
+TEST_F(DataManagerTest, write_file_Append_ReservesOneRunPastScatteredHoles)
+{
+    InMemoryBlockDevice device(BLOCK_SIZE * 1000);
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+
+    int inode_id = fs.create_file(ROOT_INODE_ID, "log").value();
+    std::vector<uint8_t> data(BLOCK_SIZE, 1);
+    ASSERT_TRUE(fs.write_file(inode_id, data, 0).has_value());
+
+    // one block holes right after the file
+    std::vector<int> taken;
+    for (int i = 0; i < 40; i++)
+        taken.push_back(call_allocate_data_block(fs).value());
+    for (size_t i = 0; i < taken.size(); i += 2)
+        ASSERT_EQ(call_free_block(fs, taken[i] - fs.get_superblock().data_start), FileSystemStatus::OK);
+
+    const int appended = TOTAL_DIRECT_BLOCKS - 1;
+    data.assign(appended * BLOCK_SIZE, 2);
+    ASSERT_TRUE(fs.write_file(inode_id, data, BLOCK_SIZE).has_value());
+
+    std::vector<BlockRun> runs;
+    ASSERT_EQ(call_map_blocks(fs, inode_id, 1, appended, runs), FileSystemStatus::OK);
+    ASSERT_EQ(runs.size(), 1u);
+    EXPECT_GT(runs[0].device_block, taken.back());
+}
+
+TEST(AllocationBitmapTest, Allocate_ManyWords_FillsThenWrapsToFreedBits)
+{
+    const int total_bits = 10000; // 157 words, 3 summary words
+    AllocationBitmap bitmap;
+    bitmap.reset(total_bits);
+
+    for (int i = 0; i < total_bits; i++)
+        ASSERT_EQ(bitmap.allocate(), i);
+    EXPECT_FALSE(bitmap.allocate().has_value());
+    EXPECT_EQ(bitmap.free_count(), 0);
+
+    ASSERT_TRUE(bitmap.clear(70));
+    ASSERT_TRUE(bitmap.clear(5000));
+    ASSERT_TRUE(bitmap.clear(9000));
+    EXPECT_EQ(bitmap.free_count(), 3);
+
+    // the cursor is on the last word, the search wraps around to the first free bit
+    EXPECT_EQ(bitmap.allocate(), 70);
+    EXPECT_EQ(bitmap.allocate(), 5000);
+    EXPECT_EQ(bitmap.allocate(), 9000);
+    EXPECT_FALSE(bitmap.allocate().has_value());
+}
+
+TEST(AllocationBitmapTest, ReservedBits_StayOffTheDeviceUntilClaimed)
+{
+    AllocationBitmap bitmap;
+    bitmap.reset(1000);
+
+    auto run = bitmap.reserve_run(-1, 4);
+    ASSERT_TRUE(run.has_value());
+    EXPECT_EQ(run->first, 0);
+    EXPECT_EQ(run->length, 4);
+    EXPECT_EQ(bitmap.word(0), 0u);
+    EXPECT_EQ(bitmap.free_count(), 996);
+
+    bitmap.claim(0);
+    EXPECT_EQ(bitmap.word(0), 1u);
+    for (int bit = 1; bit < 4; bit++)
+        bitmap.cancel(bit);
+    EXPECT_EQ(bitmap.free_count(), 999);
+    EXPECT_EQ(bitmap.allocate(), 1);
+}
+
+TEST(AllocationBitmapTest, Load_BitsPastTheEnd_NeverAllocated)
+{
+    std::vector<uint8_t> bytes(BLOCK_SIZE, 0x00);
+    bytes[0] = 0x05; // bits 0 and 2 in use
+    AllocationBitmap bitmap;
+    bitmap.load(bytes, 100);
+
+    EXPECT_EQ(bitmap.free_count(), 98);
+    EXPECT_TRUE(bitmap.test(2));
+    EXPECT_FALSE(bitmap.set(2));
+    EXPECT_FALSE(bitmap.set(100));
+    EXPECT_EQ(bitmap.allocate(), 1);
+
+    int allocated = 1;
+    while (bitmap.allocate().has_value())
+        allocated++;
+    EXPECT_EQ(allocated, 98);
+}
+
+TEST(AllocationBitmapTest, FreeCounts_TrackFormatWritesAndRemount)
+{
+    InMemoryBlockDevice device(BLOCK_SIZE * DEFAULT_TOTAL_BLOCKS);
+    SpaceStats before;
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+        before = fs.get_space_stats();
+        EXPECT_EQ(before.total_blocks, static_cast<uint64_t>(fs.get_superblock().data_blocks));
+        EXPECT_EQ(before.free_inodes, before.total_inodes - 1); // the root
+
+        int inode_id = fs.create_file(ROOT_INODE_ID, "file").value();
+        std::vector<uint8_t> data(3 * BLOCK_SIZE, 1);
+        ASSERT_TRUE(fs.write_file(inode_id, data, 0).has_value());
+
+        SpaceStats after = fs.get_space_stats();
+        EXPECT_EQ(after.free_blocks, before.free_blocks - 3);
+        EXPECT_EQ(after.free_inodes, before.free_inodes - 1);
+    }
+
+    FileSystem fs(device);
+    SpaceStats mounted = fs.get_space_stats();
+    EXPECT_EQ(mounted.free_blocks, before.free_blocks - 3);
+    EXPECT_EQ(mounted.free_inodes, before.free_inodes - 1);
+
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, fs.lookup(ROOT_INODE_ID, "file").value().inode_id), FileSystemStatus::OK);
+    EXPECT_EQ(fs.get_space_stats().free_blocks, before.free_blocks);
+    EXPECT_EQ(fs.get_space_stats().free_inodes, before.free_inodes);
 }
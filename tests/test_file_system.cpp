@@ -3,9 +3,16 @@
 #include "file_system.hpp"
 #include "fs_status.hpp"
 #include "fs_constants.hpp"
+#include "crc32c.hpp"
+#include "inode_lock_table.hpp"
 #include <string>
 #include <vector>
+#include <unordered_map>
+#include <set>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 // ── Fixture ──────────────────────────────────────────────────────────────────
 
@@ -14,7 +21,7 @@ class FileSystemTest : public ::testing::Test
 protected:
     void SetUp() override
     {
-        device = std::make_unique<InMemoryBlockDevice>(TOTAL_BLOCKS_NUMBER * BLOCK_SIZE);
+        device = std::make_unique<InMemoryBlockDevice>(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
         fs = std::make_unique<FileSystem>(*device);
         fs->format();
     }
@@ -33,7 +40,7 @@ TEST_F(FileSystemTest, Format_RootDirectoryIsAccessible)
 
 TEST(FileSystemConstructorTest, Constructor_RecognisesExistingFormat)
 {
-    InMemoryBlockDevice device(TOTAL_BLOCKS_NUMBER * BLOCK_SIZE);
+    InMemoryBlockDevice device(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
 
     {
         FileSystem fs(device);
@@ -46,6 +53,81 @@ TEST(FileSystemConstructorTest, Constructor_RecognisesExistingFormat)
     EXPECT_TRUE(result.has_value());
 }
 
+TEST(FileSystemConstructorTest, Constructor_KeepsFormattedGeometry)
+{
+    InMemoryBlockDevice device(4 * DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
+
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(1000), FileSystemStatus::OK);
+    }
+
+    FileSystem fs2(device);
+    ASSERT_TRUE(fs2.is_device_formatted());
+    EXPECT_EQ(fs2.get_superblock().total_blocks, 4 * DEFAULT_TOTAL_BLOCKS);
+    EXPECT_EQ(fs2.get_superblock().total_inodes, 1000);
+    EXPECT_EQ(fs2.get_superblock().inode_table_blocks, (1000 + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK);
+}
+
+TEST(FileSystemConstructorTest, Constructor_KeepsFileBehindIndirectBlocks)
+{
+    InMemoryBlockDevice device(static_cast<uint64_t>(4 * POINTERS_PER_BLOCK) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    std::vector<uint8_t> data(static_cast<size_t>(TOTAL_DIRECT_BLOCKS + POINTERS_PER_BLOCK + 8) * BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i += BLOCK_SIZE)
+        std::fill(data.begin() + i, data.begin() + i + BLOCK_SIZE, static_cast<uint8_t>(i / BLOCK_SIZE));
+    int inode_id;
+
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+        auto create_res = fs.create_file(ROOT_INODE_ID, "big.bin");
+        ASSERT_TRUE(create_res.has_value());
+        inode_id = create_res.value();
+
+        // one call, mapped through the indirect and the double indirect block
+        auto write_res = fs.write_file(inode_id, data, 0);
+        ASSERT_TRUE(write_res.has_value());
+        EXPECT_EQ(write_res.value(), data.size());
+        ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    }
+
+    FileSystem fs2(device);
+    std::vector<uint8_t> read_data(data.size());
+    auto read_res = fs2.read_file(inode_id, read_data, 0);
+    ASSERT_TRUE(read_res.has_value());
+    EXPECT_EQ(read_res.value(), data.size());
+    EXPECT_EQ(read_data, data);
+}
+
+TEST(FileSystemConstructorTest, Format_DeviceTooSmall_ReturnsOutOfBounds)
+{
+    InMemoryBlockDevice device((INODE_BITMAP_INDEX + 2) * BLOCK_SIZE);
+    FileSystem fs(device);
+
+    EXPECT_EQ(fs.format(), FileSystemStatus::OutOfBounds);
+    EXPECT_FALSE(fs.is_device_formatted());
+}
+
+TEST(FileSystemConstructorTest, MakeSuperblock_LayoutIsContiguous)
+{
+    auto layout_res = FileSystem::make_superblock(1'000'000, 0);
+    ASSERT_TRUE(layout_res.has_value());
+    const Superblock &layout = layout_res.value();
+
+    EXPECT_EQ(layout.total_inodes, 1'000'000 / BLOCKS_PER_INODE);
+    EXPECT_EQ(layout.inode_bitmap_start, INODE_BITMAP_INDEX);
+    EXPECT_EQ(layout.data_bitmap_start, layout.inode_bitmap_start + layout.inode_bitmap_blocks);
+    EXPECT_EQ(layout.inode_table_start, layout.data_bitmap_start + layout.data_bitmap_blocks);
+    EXPECT_EQ(layout.data_start, layout.inode_table_start + layout.inode_table_blocks);
+    EXPECT_EQ(layout.data_start + layout.data_blocks, 1'000'000);
+
+    // every bitmap covers its elements, and not with a spare block
+    EXPECT_GE(layout.inode_bitmap_blocks * BITS_PER_BLOCK, layout.total_inodes);
+    EXPECT_LT((layout.inode_bitmap_blocks - 1) * BITS_PER_BLOCK, layout.total_inodes);
+    EXPECT_GE(layout.data_bitmap_blocks * BITS_PER_BLOCK, layout.data_blocks);
+    EXPECT_LT((layout.data_bitmap_blocks - 1) * BITS_PER_BLOCK, layout.data_blocks);
+}
+
 // ── Lookup ────────────────────────────────────────────────────────────────────
 
 TEST_F(FileSystemTest, Lookup_DotEntry_Found)
@@ -69,6 +151,48 @@ TEST_F(FileSystemTest, Lookup_NonExistentEntry_ReturnsError)
     EXPECT_EQ(result.error(), FileSystemStatus::EntryNotFound);
 }
 
+TEST_F(FileSystemTest, Lookup_MissingName_CachedUntilCreated)
+{
+    EXPECT_EQ(fs->lookup(ROOT_INODE_ID, "later").error(), FileSystemStatus::EntryNotFound);
+    EXPECT_EQ(fs->lookup(ROOT_INODE_ID, "later").error(), FileSystemStatus::EntryNotFound);
+    DentryCacheStats stats = fs->get_dentry_cache_stats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.negative_hits, 1u);
+
+    auto create_res = fs->create_file(ROOT_INODE_ID, "later");
+    ASSERT_TRUE(create_res.has_value());
+    auto lookup_res = fs->lookup(ROOT_INODE_ID, "later");
+    ASSERT_TRUE(lookup_res.has_value());
+    EXPECT_EQ(lookup_res.value().inode_id, create_res.value());
+    EXPECT_EQ(fs->get_dentry_cache_stats().hits, 2u);
+}
+
+TEST_F(FileSystemTest, Lookup_AfterDelete_CachedAsMissing)
+{
+    auto create_res = fs->create_file(ROOT_INODE_ID, "gone");
+    ASSERT_TRUE(create_res.has_value());
+    ASSERT_TRUE(fs->lookup(ROOT_INODE_ID, "gone").has_value());
+    ASSERT_EQ(fs->delete_entry(ROOT_INODE_ID, create_res.value()), FileSystemStatus::OK);
+
+    EXPECT_EQ(fs->lookup(ROOT_INODE_ID, "gone").error(), FileSystemStatus::EntryNotFound);
+    DentryCacheStats stats = fs->get_dentry_cache_stats();
+    EXPECT_EQ(stats.misses, 0u);
+    EXPECT_EQ(stats.negative_hits, 1u);
+}
+
+TEST_F(FileSystemTest, Lookup_ManyNames_EvictsLeastRecentlyUsed)
+{
+    for (int i = 0; i < DENTRY_CACHE_ENTRIES + 10; i++)
+        fs->lookup(ROOT_INODE_ID, "missing" + std::to_string(i));
+    EXPECT_EQ(fs->get_dentry_cache_stats().evictions, 10u);
+
+    fs->lookup(ROOT_INODE_ID, "missing" + std::to_string(DENTRY_CACHE_ENTRIES + 9));
+    fs->lookup(ROOT_INODE_ID, "missing0");
+    DentryCacheStats stats = fs->get_dentry_cache_stats();
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.misses, static_cast<uint64_t>(DENTRY_CACHE_ENTRIES + 11));
+}
+
 // ── Create File ───────────────────────────────────────────────────────────────
 
 TEST_F(FileSystemTest, CreateFile_ReturnsValidInodeId)
@@ -173,6 +297,135 @@ TEST_F(FileSystemTest, WriteFile_AcrossBlockBoundary_DataMatches)
     EXPECT_EQ(read_data, big_data);
 }
 
+TEST_F(FileSystemTest, WriteFile_UnalignedAcrossManyBlocks_KeepsSurroundingBytes)
+{
+    auto create_result = fs->create_file(ROOT_INODE_ID, "multi.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> background(4 * BLOCK_SIZE, 0x11);
+    ASSERT_TRUE(fs->write_file(inode_id, background, 0).has_value());
+
+    // starts and ends in the middle of a block, spans three blocks
+    std::vector<uint8_t> patch(2 * BLOCK_SIZE, 0x22);
+    auto write_result = fs->write_file(inode_id, patch, BLOCK_SIZE / 2);
+    ASSERT_TRUE(write_result.has_value());
+    EXPECT_EQ(write_result.value(), patch.size());
+
+    std::vector<uint8_t> expected = background;
+    std::fill(expected.begin() + BLOCK_SIZE / 2, expected.begin() + BLOCK_SIZE / 2 + patch.size(), 0x22);
+
+    std::vector<uint8_t> read_data(background.size());
+    auto read_result = fs->read_file(inode_id, read_data, 0);
+    ASSERT_TRUE(read_result.has_value());
+    EXPECT_EQ(read_result.value(), read_data.size());
+    EXPECT_EQ(read_data, expected);
+}
+
+TEST_F(FileSystemTest, WriteFile_BeyondMaxFileSize_ReturnsError)
+{
+    auto create_result = fs->create_file(ROOT_INODE_ID, "huge.bin");
+    ASSERT_TRUE(create_result.has_value());
+
+    std::vector<uint8_t> data(BLOCK_SIZE, 0x33);
+    auto write_result = fs->write_file(create_result.value(), data, static_cast<size_t>(MAX_FILE_BLOCKS) * BLOCK_SIZE);
+    EXPECT_FALSE(write_result.has_value());
+    EXPECT_EQ(write_result.error(), FileSystemStatus::OutOfBounds);
+}
+
+TEST_F(FileSystemTest, WriteFile_PastDirectBlocks_UsesIndirectBlock)
+{
+    auto create_result = fs->create_file(ROOT_INODE_ID, "long.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> data((TOTAL_DIRECT_BLOCKS + 3) * BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8_t>(i * 7 % 251);
+    auto write_result = fs->write_file(inode_id, data, 0);
+    ASSERT_TRUE(write_result.has_value());
+    EXPECT_EQ(write_result.value(), data.size());
+
+    std::vector<uint8_t> read_data(data.size());
+    auto read_result = fs->read_file(inode_id, read_data, 0);
+    ASSERT_TRUE(read_result.has_value());
+    EXPECT_EQ(read_data, data);
+
+    auto attributes = fs->get_attributes(inode_id);
+    ASSERT_TRUE(attributes.has_value());
+    EXPECT_EQ(attributes.value().size, data.size());
+    EXPECT_EQ(attributes.value().blocks_used, static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS + 3 + 1)); // and the indirect block
+}
+
+TEST_F(FileSystemTest, WriteFile_BeyondFourGiB_LeavesHoleOfZeros)
+{
+    auto create_result = fs->create_file(ROOT_INODE_ID, "sparse.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    // the first block behind the triple indirect block
+    uint64_t offset = static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS + POINTERS_PER_BLOCK + POINTERS_PER_BLOCK * POINTERS_PER_BLOCK) * BLOCK_SIZE + 100;
+    std::vector<uint8_t> data = {7, 8, 9};
+    auto write_result = fs->write_file(inode_id, data, offset);
+    ASSERT_TRUE(write_result.has_value());
+
+    auto attributes = fs->get_attributes(inode_id);
+    ASSERT_TRUE(attributes.has_value());
+    EXPECT_EQ(attributes.value().size, offset + data.size());
+    EXPECT_EQ(attributes.value().blocks_used, 4u); // the data block and three levels of indirect blocks
+
+    std::vector<uint8_t> read_data(data.size());
+    ASSERT_TRUE(fs->read_file(inode_id, read_data, offset).has_value());
+    EXPECT_EQ(read_data, data);
+
+    std::vector<uint8_t> hole(2 * BLOCK_SIZE, 0xFF);
+    auto read_result = fs->read_file(inode_id, hole, static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS - 1) * BLOCK_SIZE);
+    ASSERT_TRUE(read_result.has_value());
+    EXPECT_EQ(read_result.value(), hole.size());
+    EXPECT_TRUE(std::all_of(hole.begin(), hole.end(), [](uint8_t byte)
+                            { return byte == 0; }));
+}
+
+TEST_F(FileSystemTest, DeleteFile_WithIndirectBlocks_FreesEveryBlock)
+{
+    auto free_before = fs->trim_free_blocks();
+    ASSERT_TRUE(free_before.has_value());
+
+    auto create_result = fs->create_file(ROOT_INODE_ID, "tree.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> data((TOTAL_DIRECT_BLOCKS + 2) * BLOCK_SIZE, 0x5A);
+    ASSERT_TRUE(fs->write_file(inode_id, data, 0).has_value());
+    uint64_t offset = static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS + POINTERS_PER_BLOCK + 1) * BLOCK_SIZE;
+    ASSERT_TRUE(fs->write_file(inode_id, std::span<const uint8_t>(data).first(BLOCK_SIZE), offset).has_value());
+
+    ASSERT_EQ(fs->delete_entry(ROOT_INODE_ID, inode_id), FileSystemStatus::OK);
+    ASSERT_EQ(fs->sync(), FileSystemStatus::OK);
+
+    auto free_after = fs->trim_free_blocks();
+    ASSERT_TRUE(free_after.has_value());
+    EXPECT_EQ(free_after.value(), free_before.value());
+}
+
+TEST_F(FileSystemTest, ReadFile_OffsetPastEnd_ReturnsError)
+{
+    auto create_result = fs->create_file(ROOT_INODE_ID, "short.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> data = {1, 2, 3};
+    fs->write_file(inode_id, data, 0);
+
+    std::vector<uint8_t> read_data(8);
+    auto at_end = fs->read_file(inode_id, read_data, data.size());
+    ASSERT_TRUE(at_end.has_value());
+    EXPECT_EQ(at_end.value(), 0u);
+
+    auto past_end = fs->read_file(inode_id, read_data, data.size() + 1);
+    EXPECT_FALSE(past_end.has_value());
+}
+
 // ── Delete File ───────────────────────────────────────────────────────────────
 
 TEST_F(FileSystemTest, DeleteFile_Success_LookupFails)
@@ -239,6 +492,54 @@ TEST_F(FileSystemTest, GetAttributes_FileAfterWrite_SizeUpdated)
     EXPECT_EQ(result.value().size, 5u);
 }
 
+TEST_F(FileSystemTest, GetAttributes_FileGrows_BlocksUsedUpdated)
+{
+    int inode_id = fs->create_file(ROOT_INODE_ID, "growing.bin").value();
+    ASSERT_EQ(fs->get_attributes(inode_id).value().blocks_used, 0u);
+
+    std::vector<uint8_t> data(BLOCK_SIZE * (TOTAL_DIRECT_BLOCKS + 1), 7);
+    ASSERT_TRUE(fs->write_file(inode_id, data, 0).has_value());
+
+    auto result = fs->get_attributes(inode_id); // the data blocks and the indirect block
+    ASSERT_TRUE(result.has_value());
+    EXPECT_EQ(result.value().blocks_used, static_cast<uint64_t>(TOTAL_DIRECT_BLOCKS + 2));
+    EXPECT_EQ(result.value().size, data.size());
+}
+
+TEST_F(FileSystemTest, GetAttributes_Again_ServedFromInodeCache)
+{
+    int inode_id = fs->create_file(ROOT_INODE_ID, "cached.txt").value();
+    InodeCacheStats before = fs->get_inode_cache_stats();
+
+    ASSERT_TRUE(fs->get_attributes(inode_id).has_value());
+    ASSERT_TRUE(fs->get_attributes(inode_id).has_value());
+    InodeCacheStats after = fs->get_inode_cache_stats();
+    EXPECT_EQ(after.hits, before.hits + 2);
+    EXPECT_EQ(after.misses, before.misses);
+}
+
+TEST(InodeCacheTest, ManyInodes_EvictLeastRecentlyUsed)
+{
+    const int files = INODE_CACHE_ENTRIES + 10;
+    InMemoryBlockDevice device(static_cast<uint64_t>(2048) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(files + 16), FileSystemStatus::OK);
+
+    int first_id = fs.create_file(ROOT_INODE_ID, "f0").value();
+    std::vector<uint8_t> data = {1, 2, 3};
+    ASSERT_TRUE(fs.write_file(first_id, data, 0).has_value());
+    for (int i = 1; i < files; i++)
+        ASSERT_TRUE(fs.create_file(ROOT_INODE_ID, "f" + std::to_string(i)).has_value());
+    EXPECT_GT(fs.get_inode_cache_stats().evictions, 0u);
+
+    // the evicted inode is read back from the inode table
+    uint64_t misses = fs.get_inode_cache_stats().misses;
+    auto result = fs.get_attributes(first_id);
+    ASSERT_TRUE(result.has_value());
+    EXPECT_EQ(result.value().size, 3u);
+    EXPECT_EQ(fs.get_inode_cache_stats().misses, misses + 1);
+}
+
 TEST_F(FileSystemTest, GetAttributes_InvalidInode_ReturnsError)
 {
     auto result = fs->get_attributes(-1);
@@ -345,6 +646,441 @@ TEST_F(FileSystemTest, ListDirectory_InvalidInode_ReturnsError)
     EXPECT_FALSE(result.has_value());
 }
 
+// ── Extents ───────────────────────────────────────────────────────────────────
+
+TEST_F(FileSystemTest, Extents_SequentialWrite_NeedsNoTreeNodes)
+{
+    fs->set_file_layout(InodeLayout::Extents);
+    auto create_result = fs->create_file(ROOT_INODE_ID, "stream.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> data(30 * BLOCK_SIZE + 123);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8_t>(i * 13 % 253);
+    ASSERT_TRUE(fs->write_file(inode_id, data, 0).has_value());
+
+    std::vector<uint8_t> read_data(data.size() - 500);
+    auto read_result = fs->read_file(inode_id, read_data, 500);
+    ASSERT_TRUE(read_result.has_value());
+    EXPECT_TRUE(std::equal(read_data.begin(), read_data.end(), data.begin() + 500));
+
+    auto attributes = fs->get_attributes(inode_id);
+    ASSERT_TRUE(attributes.has_value());
+    EXPECT_EQ(attributes.value().blocks_used, 31u); // one inline extent
+}
+
+TEST_F(FileSystemTest, Extents_WriteIntoHole_ReadsBackInOrder)
+{
+    fs->set_file_layout(InodeLayout::Extents);
+    auto create_result = fs->create_file(ROOT_INODE_ID, "holes.bin");
+    ASSERT_TRUE(create_result.has_value());
+    int inode_id = create_result.value();
+
+    std::vector<uint8_t> block(BLOCK_SIZE);
+    for (int file_block : {10, 0, 5, 9})
+    {
+        std::fill(block.begin(), block.end(), static_cast<uint8_t>(file_block + 1));
+        ASSERT_TRUE(fs->write_file(inode_id, block, static_cast<size_t>(file_block) * BLOCK_SIZE).has_value());
+    }
+
+    std::vector<uint8_t> read_data(11 * BLOCK_SIZE);
+    ASSERT_TRUE(fs->read_file(inode_id, read_data, 0).has_value());
+    for (int file_block = 0; file_block < 11; file_block++)
+    {
+        bool written = file_block == 0 || file_block == 5 || file_block == 9 || file_block == 10;
+        EXPECT_EQ(read_data[file_block * BLOCK_SIZE], written ? file_block + 1 : 0) << "block " << file_block;
+    }
+
+    auto attributes = fs->get_attributes(inode_id);
+    ASSERT_TRUE(attributes.has_value());
+    EXPECT_EQ(attributes.value().blocks_used, 4u);
+}
+
+TEST(ExtentTreeTest, InterleavedFiles_GrowTheTree_AndSurviveRemount)
+{
+    const int file_blocks = INLINE_EXTENTS * EXTENTS_PER_NODE + 100; // past what one level of nodes holds
+    InMemoryBlockDevice device(static_cast<uint64_t>(2 * file_blocks + 512) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    int inode_ids[2];
+
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(), FileSystemStatus::OK);
+        fs.set_file_layout(InodeLayout::Extents);
+        for (int i = 0; i < 2; i++)
+        {
+            auto create_res = fs.create_file(ROOT_INODE_ID, "file" + std::to_string(i));
+            ASSERT_TRUE(create_res.has_value());
+            inode_ids[i] = create_res.value();
+        }
+
+        // the files take turns, so neither has two neighbouring blocks and every block is an extent
+        std::vector<uint8_t> block(BLOCK_SIZE);
+        for (int file_block = 0; file_block < file_blocks; file_block++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                std::fill(block.begin(), block.end(), static_cast<uint8_t>(file_block * 2 + i));
+                ASSERT_TRUE(fs.write_file(inode_ids[i], block, static_cast<size_t>(file_block) * BLOCK_SIZE).has_value());
+            }
+            ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+        }
+
+        auto attributes = fs.get_attributes(inode_ids[0]);
+        ASSERT_TRUE(attributes.has_value());
+        EXPECT_GT(attributes.value().blocks_used, static_cast<uint64_t>(file_blocks + INLINE_EXTENTS)); // two levels of nodes
+
+        auto free_before = fs.trim_free_blocks();
+        ASSERT_TRUE(free_before.has_value());
+        ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, inode_ids[1]), FileSystemStatus::OK);
+        ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+        auto free_after = fs.trim_free_blocks();
+        ASSERT_TRUE(free_after.has_value());
+        EXPECT_EQ(static_cast<uint64_t>(free_after.value() - free_before.value()), attributes.value().blocks_used);
+    }
+
+    FileSystem fs2(device);
+    std::vector<uint8_t> read_data(static_cast<size_t>(file_blocks) * BLOCK_SIZE);
+    auto read_res = fs2.read_file(inode_ids[0], read_data, 0);
+    ASSERT_TRUE(read_res.has_value());
+    EXPECT_EQ(read_res.value(), read_data.size());
+    for (int file_block = 0; file_block < file_blocks; file_block++)
+        ASSERT_EQ(read_data[static_cast<size_t>(file_block) * BLOCK_SIZE], static_cast<uint8_t>(file_block * 2)) << "block " << file_block;
+}
+
+// ── Hash Tree Directories ─────────────────────────────────────────────────────
+
+/* every page of the directory, until the first page past the end */
+static std::vector<Entry> list_all_pages(FileSystem &fs, int dir_inode_id)
+{
+    std::vector<Entry> entries;
+    for (uint32_t page = 0;; page++)
+    {
+        auto page_res = fs.list_directory_content(dir_inode_id, page);
+        if (!page_res.has_value())
+            break;
+        for (const Entry &entry : page_res.value())
+            if (entry.inode_id != -1)
+                entries.push_back(entry);
+    }
+    return entries;
+}
+
+TEST(HashTreeDirectoryTest, LargeDirectory_GrowsTwoIndexLevels_AndSurvivesRemount)
+{
+    const int files = 24000; // the leaves outgrow what one index node holds
+    InMemoryBlockDevice device(static_cast<uint64_t>(4096) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    int dir_id;
+    int free_before;
+    std::vector<int> inode_ids;
+
+    {
+        FileSystem fs(device);
+        ASSERT_EQ(fs.format(files + 16), FileSystemStatus::OK);
+        auto dir_res = fs.create_directory(ROOT_INODE_ID, "spool");
+        ASSERT_TRUE(dir_res.has_value());
+        dir_id = dir_res.value();
+
+        auto free_res = fs.trim_free_blocks();
+        ASSERT_TRUE(free_res.has_value());
+        free_before = free_res.value();
+
+        for (int i = 0; i < files; i++)
+        {
+            auto create_res = fs.create_file(dir_id, "msg" + std::to_string(i));
+            ASSERT_TRUE(create_res.has_value()) << "failed at file " << i;
+            inode_ids.push_back(create_res.value());
+        }
+        ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+    }
+
+    FileSystem fs(device);
+    auto attributes = fs.get_attributes(dir_id);
+    ASSERT_TRUE(attributes.has_value());
+    EXPECT_EQ(attributes.value().size, static_cast<uint64_t>(files + 2));
+    EXPECT_GT(attributes.value().blocks_used, static_cast<uint64_t>(DIR_INDEX_ENTRIES + 1));
+
+    for (int i = 0; i < files; i += 97)
+    {
+        auto lookup_res = fs.lookup(dir_id, "msg" + std::to_string(i));
+        ASSERT_TRUE(lookup_res.has_value()) << "lookup failed for file " << i;
+        EXPECT_EQ(lookup_res.value().inode_id, inode_ids[i]);
+    }
+    EXPECT_EQ(fs.lookup(dir_id, "msg" + std::to_string(files)).error(), FileSystemStatus::EntryNotFound);
+    EXPECT_EQ(fs.lookup(dir_id, "..").value().inode_id, ROOT_INODE_ID);
+    EXPECT_EQ(list_all_pages(fs, dir_id).size(), static_cast<size_t>(files + 2));
+
+    // every other file by name, a few of the rest by inode only
+    for (int i = 0; i < files; i += 2)
+        ASSERT_EQ(fs.delete_entry(dir_id, inode_ids[i], "msg" + std::to_string(i)), FileSystemStatus::OK);
+    for (int i = 1; i < files; i += 200)
+        ASSERT_EQ(fs.delete_entry(dir_id, inode_ids[i]), FileSystemStatus::OK);
+    EXPECT_EQ(fs.lookup(dir_id, "msg0").error(), FileSystemStatus::EntryNotFound);
+    EXPECT_EQ(fs.lookup(dir_id, "msg1").error(), FileSystemStatus::EntryNotFound);
+    EXPECT_EQ(fs.lookup(dir_id, "msg3").value().inode_id, inode_ids[3]);
+    EXPECT_EQ(fs.get_attributes(dir_id).value().size, static_cast<uint64_t>(files / 2 - files / 200 + 2));
+
+    // the rest, then the directory and its whole tree
+    for (int i = 3; i < files; i += 2)
+    {
+        if (i % 200 == 1)
+            continue;
+        ASSERT_EQ(fs.delete_entry(dir_id, inode_ids[i], "msg" + std::to_string(i)), FileSystemStatus::OK);
+    }
+    EXPECT_EQ(list_all_pages(fs, dir_id).size(), 2u);
+    ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, dir_id), FileSystemStatus::OK);
+    ASSERT_EQ(fs.sync(), FileSystemStatus::OK);
+
+    auto free_after = fs.trim_free_blocks();
+    ASSERT_TRUE(free_after.has_value());
+    EXPECT_EQ(free_after.value(), free_before + 1); // the linear block went at the conversion
+}
+
+TEST(HashTreeDirectoryTest, CollidingNames_RunAcrossLeaves)
+{
+    // equal length strings that collide keep colliding behind any common prefix, so 7 pairs give 2^7 names of one hash
+    std::unordered_map<uint32_t, std::string> seen;
+    std::vector<std::pair<std::string, std::string>> pairs;
+    for (int i = 0; pairs.size() < 7; i++)
+    {
+        std::string part = std::to_string(10000000 + i);
+        uint32_t hash = crc32c(reinterpret_cast<const uint8_t *>(part.data()), part.size());
+        auto [it, inserted] = seen.emplace(hash, part);
+        if (!inserted)
+        {
+            pairs.emplace_back(it->second, part);
+            seen.erase(it);
+        }
+    }
+
+    std::vector<std::string> names;
+    for (int mask = 0; mask < (1 << pairs.size()); mask++)
+    {
+        std::string name;
+        for (size_t k = 0; k < pairs.size(); k++)
+            name += (mask >> k) & 1 ? pairs[k].second : pairs[k].first;
+        names.push_back(name);
+    }
+    uint32_t hash = crc32c(reinterpret_cast<const uint8_t *>(names[0].data()), names[0].size());
+    for (const std::string &name : names)
+        ASSERT_EQ(crc32c(reinterpret_cast<const uint8_t *>(name.data()), name.size()), hash);
+    for (int i = 0; i < 100; i++)
+        names.push_back("other" + std::to_string(i));
+
+    InMemoryBlockDevice device(static_cast<uint64_t>(DEFAULT_TOTAL_BLOCKS) * BLOCK_SIZE);
+    FileSystem fs(device);
+    ASSERT_EQ(fs.format(512), FileSystemStatus::OK);
+    std::vector<int> inode_ids;
+    for (const std::string &name : names)
+    {
+        auto create_res = fs.create_file(ROOT_INODE_ID, name);
+        ASSERT_TRUE(create_res.has_value()) << "failed at " << name;
+        inode_ids.push_back(create_res.value());
+    }
+
+    for (size_t i = 0; i < names.size(); i++)
+        EXPECT_EQ(fs.lookup(ROOT_INODE_ID, names[i]).value().inode_id, inode_ids[i]) << names[i];
+    EXPECT_EQ(list_all_pages(fs, ROOT_INODE_ID).size(), names.size() + 2);
+
+    for (size_t i = 0; i < names.size(); i += 2)
+        ASSERT_EQ(fs.delete_entry(ROOT_INODE_ID, inode_ids[i], names[i]), FileSystemStatus::OK);
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        auto lookup_res = fs.lookup(ROOT_INODE_ID, names[i]);
+        if (i % 2 == 0)
+        {
+            EXPECT_FALSE(lookup_res.has_value()) << names[i];
+        }
+        else
+        {
+            EXPECT_EQ(lookup_res.value().inode_id, inode_ids[i]) << names[i];
+        }
+    }
+}
+
+// ── Concurrency ───────────────────────────────────────────────────────────────
+
+TEST(InodeLockTableTest, Exclusive_WaitsForSharedHolder_TableEmptiesAfter)
+{
+    InodeLockTable table;
+    std::atomic<bool> writer_done{false};
+    std::thread writer;
+    {
+        InodeLockTable::Guard reader(table, 7, InodeLockMode::Shared);
+
+        std::thread other_reader([&]
+                                 { InodeLockTable::Guard shared(table, 7, InodeLockMode::Shared); });
+        other_reader.join(); // readers do not wait for each other
+
+        writer = std::thread([&]
+                             {
+            InodeLockTable::Guard exclusive(table, 7, InodeLockMode::Exclusive);
+            writer_done = true; });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        EXPECT_FALSE(writer_done);
+        EXPECT_EQ(table.size(), 1u);
+    }
+
+    writer.join();
+    EXPECT_TRUE(writer_done);
+    EXPECT_EQ(table.size(), 0u);
+}
+
+TEST(InodeLockTableTest, ParentAndChild_SameInode_LockedOnce)
+{
+    InodeLockTable table;
+    {
+        InodeLockTable::Guard guard(table, 3, InodeLockMode::Exclusive, 3, InodeLockMode::Shared);
+        EXPECT_EQ(table.size(), 1u);
+    }
+    {
+        InodeLockTable::Guard guard(table, 1, InodeLockMode::Exclusive, 2, InodeLockMode::Exclusive);
+        EXPECT_EQ(table.size(), 2u);
+    }
+    EXPECT_EQ(table.size(), 0u);
+}
+
+TEST(InodeLockTableTest, ReversedPairs_DoNotDeadlock)
+{
+    const int rounds = 10000;
+
+    InodeLockTable table;
+    auto lock_pairs = [&](int parent_id, int child_id)
+    {
+        for (int round = 0; round < rounds; round++)
+            InodeLockTable::Guard guard(table, parent_id, InodeLockMode::Exclusive, child_id, InodeLockMode::Exclusive);
+    };
+    std::thread forward(lock_pairs, 4, 9);
+    std::thread backward(lock_pairs, 9, 4); // a client may send any pair
+    forward.join();
+    backward.join();
+    EXPECT_EQ(table.size(), 0u);
+}
+
+TEST_F(FileSystemTest, DeleteEntry_DotAndDotDot_Rejected)
+{
+    auto dir_res = fs->create_directory(ROOT_INODE_ID, "dir");
+    ASSERT_TRUE(dir_res.has_value());
+
+    EXPECT_EQ(fs->delete_entry(dir_res.value(), ROOT_INODE_ID, ".."), FileSystemStatus::EntryTypeError);
+    EXPECT_EQ(fs->delete_entry(dir_res.value(), dir_res.value(), "."), FileSystemStatus::EntryTypeError);
+    EXPECT_TRUE(fs->lookup(ROOT_INODE_ID, "dir").has_value());
+    EXPECT_TRUE(fs->get_inode_by_path("/dir").has_value());
+}
+
+TEST_F(FileSystemTest, Concurrency_WritersInOwnDirectories_ReadersOfSharedFile)
+{
+    const int writers_number = 4;
+    const int files_per_writer = 16;
+    const int readers_number = 4;
+    const int reader_rounds = 200;
+    const size_t file_size = 2 * BLOCK_SIZE + 100;
+
+    fs.reset();
+    device = std::make_unique<InMemoryBlockDevice>(4096 * BLOCK_SIZE);
+    fs = std::make_unique<FileSystem>(*device);
+    ASSERT_EQ(fs->format(), FileSystemStatus::OK);
+    SpaceStats before = fs->get_space_stats();
+
+    std::vector<uint8_t> shared_data(3 * BLOCK_SIZE);
+    for (size_t i = 0; i < shared_data.size(); i++)
+        shared_data[i] = static_cast<uint8_t>(i * 7);
+    auto shared_res = fs->create_file(ROOT_INODE_ID, "shared");
+    ASSERT_TRUE(shared_res.has_value());
+    ASSERT_TRUE(fs->write_file(shared_res.value(), shared_data, 0).has_value());
+
+    auto file_data = [&](int writer, int file)
+    { return std::vector<uint8_t>(file_size, static_cast<uint8_t>(writer * files_per_writer + file + 1)); };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < writers_number; t++)
+        threads.emplace_back([&, t]
+                             {
+            auto dir_res = fs->create_directory(ROOT_INODE_ID, "w" + std::to_string(t));
+            ASSERT_TRUE(dir_res.has_value());
+            for (int i = 0; i < files_per_writer; i++)
+            {
+                auto file_res = fs->create_file(dir_res.value(), "f" + std::to_string(i));
+                ASSERT_TRUE(file_res.has_value());
+                std::vector<uint8_t> data = file_data(t, i);
+                ASSERT_TRUE(fs->write_file(file_res.value(), data, 0).has_value());
+                EXPECT_EQ(fs->sync(), FileSystemStatus::OK);
+            } });
+
+    for (int t = 0; t < readers_number; t++)
+        threads.emplace_back([&]
+                             {
+            std::vector<uint8_t> read(shared_data.size());
+            for (int round = 0; round < reader_rounds; round++)
+            {
+                auto entry_res = fs->lookup(ROOT_INODE_ID, "shared");
+                ASSERT_TRUE(entry_res.has_value());
+                auto attributes_res = fs->get_attributes(entry_res.value().inode_id);
+                ASSERT_TRUE(attributes_res.has_value());
+                EXPECT_EQ(attributes_res.value().size, shared_data.size());
+                auto read_res = fs->read_file(entry_res.value().inode_id, read, 0);
+                ASSERT_TRUE(read_res.has_value());
+                EXPECT_EQ(read, shared_data);
+            } });
+
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (int t = 0; t < writers_number; t++)
+    {
+        auto dir_res = fs->get_inode_by_path("/w" + std::to_string(t));
+        ASSERT_TRUE(dir_res.has_value());
+        for (int i = 0; i < files_per_writer; i++)
+        {
+            auto entry_res = fs->lookup(dir_res.value(), "f" + std::to_string(i));
+            ASSERT_TRUE(entry_res.has_value());
+            std::vector<uint8_t> read(file_size);
+            ASSERT_TRUE(fs->read_file(entry_res.value().inode_id, read, 0).has_value());
+            EXPECT_EQ(read, file_data(t, i)) << "writer " << t << " file " << i;
+        }
+    }
+
+    // every bit the threads set reached the bitmap blocks, a remount counts the same
+    SpaceStats after = fs->get_space_stats();
+    EXPECT_EQ(after.free_inodes, before.free_inodes - 1 - writers_number * (files_per_writer + 1));
+    fs.reset();
+    fs = std::make_unique<FileSystem>(*device);
+    SpaceStats mounted = fs->get_space_stats();
+    EXPECT_EQ(mounted.free_inodes, after.free_inodes);
+    EXPECT_EQ(mounted.free_blocks, after.free_blocks);
+}
+
+TEST_F(FileSystemTest, Concurrency_CreateDeleteChurn_ReusedInodesSurvive)
+{
+    const int threads_number = 4;
+    const int rounds = 3000;
+
+    ASSERT_EQ(fs->format(16), FileSystemStatus::OK); // few inodes, the freed ids are taken again at once
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_number; t++)
+        threads.emplace_back([&, t]
+                             {
+            auto dir_res = fs->create_directory(ROOT_INODE_ID, "d" + std::to_string(t));
+            ASSERT_TRUE(dir_res.has_value());
+            for (int round = 0; round < rounds; round++)
+            {
+                auto file_res = fs->create_file(dir_res.value(), "f");
+                ASSERT_TRUE(file_res.has_value());
+                ASSERT_TRUE(fs->get_attributes(file_res.value()).has_value());
+                ASSERT_EQ(fs->delete_entry(dir_res.value(), file_res.value(), "f"), FileSystemStatus::OK);
+            } });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (int t = 0; t < threads_number; t++)
+    {
+        auto dir_res = fs->get_inode_by_path("/d" + std::to_string(t));
+        ASSERT_TRUE(dir_res.has_value());
+        EXPECT_FALSE(fs->lookup(dir_res.value(), "f").has_value());
+    }
+}
+
 // ── Private Function Tests ────────────────────────────────────────────────────
 
 class FileSystemInternalTest : public ::testing::Test
@@ -352,7 +1088,7 @@ class FileSystemInternalTest : public ::testing::Test
 protected:
     void SetUp() override
     {
-        device = std::make_unique<InMemoryBlockDevice>(TOTAL_BLOCKS_NUMBER * BLOCK_SIZE);
+        device = std::make_unique<InMemoryBlockDevice>(DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE);
         fs = std::make_unique<FileSystem>(*device);
         fs->format();
     }
@@ -377,9 +1113,9 @@ protected:
         return fs->free_inode(inode_id);
     }
 
-    std::expected<int, FileSystemStatus> call_allocate_data_block()
+    std::expected<int, FileSystemStatus> call_allocate_data_block(int group_index = -1)
     {
-        return fs->allocate_data_block();
+        return fs->allocate_data_block(group_index);
     }
 
     FileSystemStatus call_free_data_block(int block_number)
@@ -397,6 +1133,27 @@ protected:
         return fs->get_inode_by_path(path);
     }
 
+    int call_inode_group_index(int inode_id)
+    {
+        return fs->inode_group_index(inode_id);
+    }
+
+    /* the group of an absolute data block */
+    int data_block_group(int block_index)
+    {
+        return (block_index - fs->get_superblock().data_start) / BLOCKS_PER_GROUP;
+    }
+
+    /* a sparse volume of three allocation groups */
+    void format_three_groups()
+    {
+        fs.reset();
+        device = std::make_unique<InMemoryBlockDevice>(static_cast<uint64_t>(3 * BLOCKS_PER_GROUP) * BLOCK_SIZE, InMemoryLayout::Sparse);
+        fs = std::make_unique<FileSystem>(*device);
+        ASSERT_EQ(fs->format(), FileSystemStatus::OK);
+        ASSERT_EQ(fs->get_group_count(), 3);
+    }
+
     std::unique_ptr<InMemoryBlockDevice> device;
     std::unique_ptr<FileSystem> fs;
 };
@@ -422,7 +1179,7 @@ TEST_F(FileSystemInternalTest, WriteInode_ThenGetInode_DataMatches)
     auto read_res = call_get_inode(inode_id);
     ASSERT_TRUE(read_res.has_value());
     EXPECT_EQ(read_res.value().type, EntryType::File);
-    EXPECT_EQ(read_res.value().size, 42);
+    EXPECT_EQ(read_res.value().size, 42u);
     EXPECT_EQ(read_res.value().link_count, 1);
 }
 
@@ -432,7 +1189,7 @@ TEST_F(FileSystemInternalTest, GetInode_OutOfBounds_ReturnsError)
     EXPECT_FALSE(result.has_value());
     EXPECT_EQ(result.error(), FileSystemStatus::OutOfBounds);
 
-    result = call_get_inode(TOTAL_INODE_NUMBER);
+    result = call_get_inode(fs->get_superblock().total_inodes);
     EXPECT_FALSE(result.has_value());
     EXPECT_EQ(result.error(), FileSystemStatus::OutOfBounds);
 }
@@ -473,7 +1230,7 @@ TEST_F(FileSystemInternalTest, FreeInode_ThenReallocate_ReusesSameId)
 
 TEST_F(FileSystemInternalTest, AllocateInode_WhenFull_ReturnsError)
 {
-    for (int i = 1; i < TOTAL_INODE_NUMBER; i++) // 0 already used by root
+    for (int i = 1; i < fs->get_superblock().total_inodes; i++) // 0 already used by root
         call_allocate_inode();
 
     auto result = call_allocate_inode();
@@ -481,13 +1238,42 @@ TEST_F(FileSystemInternalTest, AllocateInode_WhenFull_ReturnsError)
     EXPECT_EQ(result.error(), FileSystemStatus::FullInode);
 }
 
+TEST_F(FileSystemInternalTest, AllocateInode_CrossesBitmapBlocks)
+{
+    fs.reset();
+    device = std::make_unique<InMemoryBlockDevice>(static_cast<uint64_t>(3 * BITS_PER_BLOCK) * BLOCK_SIZE, InMemoryLayout::Sparse);
+    fs = std::make_unique<FileSystem>(*device);
+    ASSERT_EQ(fs->format(BITS_PER_BLOCK + 10), FileSystemStatus::OK);
+    ASSERT_EQ(fs->get_superblock().inode_bitmap_blocks, 2);
+    ASSERT_EQ(fs->get_superblock().data_bitmap_blocks, 3);
+
+    for (int i = 1; i < BITS_PER_BLOCK; i++) // 0 already used by root
+        ASSERT_TRUE(call_allocate_inode().has_value());
+
+    auto result = call_allocate_inode();
+    ASSERT_TRUE(result.has_value());
+    EXPECT_EQ(result.value(), BITS_PER_BLOCK); // the first bit of the second bitmap block
+
+    Inode inode{};
+    inode.type = EntryType::File;
+    inode.link_count = 1;
+    std::fill(inode.direct_blocks, inode.direct_blocks + TOTAL_DIRECT_BLOCKS, -1);
+    ASSERT_EQ(call_write_inode(result.value(), inode), FileSystemStatus::OK);
+    EXPECT_TRUE(call_get_inode(result.value()).has_value());
+
+    // every free data block is found, across the three data bitmap blocks
+    auto trim_res = fs->trim_free_blocks();
+    ASSERT_TRUE(trim_res.has_value());
+    EXPECT_EQ(trim_res.value(), fs->get_superblock().data_blocks - 1); // the root directory block
+}
+
 // ── allocate_data_block / free_data_block ─────────────────────────────────────
 
 TEST_F(FileSystemInternalTest, AllocateDataBlock_ReturnsAbsoluteBlockIndex)
 {
     auto result = call_allocate_data_block();
     ASSERT_TRUE(result.has_value());
-    EXPECT_GE(result.value(), DATA_START_BLOCK);
+    EXPECT_GE(result.value(), fs->get_superblock().data_start);
 }
 
 TEST_F(FileSystemInternalTest, FreeDataBlock_ThenReallocate_ReusesSameBlock)
@@ -497,7 +1283,7 @@ TEST_F(FileSystemInternalTest, FreeDataBlock_ThenReallocate_ReusesSameBlock)
     int block_index = alloc1.value();
 
     // free_data_block takes the data-table-relative index
-    int relative = block_index - DATA_START_BLOCK;
+    int relative = block_index - fs->get_superblock().data_start;
     FileSystemStatus status = call_free_data_block(relative);
     ASSERT_EQ(status, FileSystemStatus::OK);
 
@@ -508,7 +1294,7 @@ TEST_F(FileSystemInternalTest, FreeDataBlock_ThenReallocate_ReusesSameBlock)
 
 TEST_F(FileSystemInternalTest, AllocateDataBlock_WhenFull_ReturnsError)
 {
-    for (int i = 0; i < DATA_TABLE_SIZE; i++)
+    for (int i = 0; i < fs->get_superblock().data_blocks; i++)
         call_allocate_data_block();
 
     auto result = call_allocate_data_block();
@@ -532,8 +1318,9 @@ TEST_F(FileSystemInternalTest, GetBlockIndex_OutOfRange_ReturnsError)
 {
     Inode inode{};
     std::fill(inode.direct_blocks, inode.direct_blocks + TOTAL_DIRECT_BLOCKS, 10);
+    std::fill(inode.indirect_blocks, inode.indirect_blocks + INDIRECT_LEVELS, 10);
 
-    auto result = call_get_block_index(inode, TOTAL_DIRECT_BLOCKS);
+    auto result = call_get_block_index(inode, MAX_FILE_BLOCKS);
     EXPECT_FALSE(result.has_value());
     EXPECT_EQ(result.error(), FileSystemStatus::OutOfBounds);
 }
@@ -542,11 +1329,11 @@ TEST_F(FileSystemInternalTest, GetBlockIndex_ValidBlock_ReturnsIndex)
 {
     Inode inode{};
     std::fill(inode.direct_blocks, inode.direct_blocks + TOTAL_DIRECT_BLOCKS, -1);
-    inode.direct_blocks[0] = DATA_START_BLOCK;
+    inode.direct_blocks[0] = fs->get_superblock().data_start;
 
     auto result = call_get_block_index(inode, 0);
     ASSERT_TRUE(result.has_value());
-    EXPECT_EQ(result.value(), DATA_START_BLOCK);
+    EXPECT_EQ(result.value(), fs->get_superblock().data_start);
 }
 
 // ── get_inode_by_path ─────────────────────────────────────────────────────────
@@ -611,3 +1398,79 @@ TEST_F(FileSystemInternalTest, ExpandDirectory_FillBeyondOneBlock_AllEntriesAcce
         EXPECT_EQ(result.value().inode_id, inode_ids[i]);
     }
 }
+
+// ── Allocation Groups ─────────────────────────────────────────────────────────
+
+TEST_F(FileSystemInternalTest, AllocationGroups_SmallVolume_OneGroup)
+{
+    EXPECT_EQ(fs->get_group_count(), 1);
+}
+
+TEST_F(FileSystemInternalTest, AllocationGroups_NewDirectories_SpreadOverGroups)
+{
+    format_three_groups();
+
+    std::set<int> groups;
+    for (int i = 0; i < 3; i++)
+    {
+        auto dir_res = fs->create_directory(ROOT_INODE_ID, "d" + std::to_string(i));
+        ASSERT_TRUE(dir_res.has_value());
+        groups.insert(call_inode_group_index(dir_res.value()));
+    }
+    EXPECT_EQ(groups.size(), 3u);
+}
+
+TEST_F(FileSystemInternalTest, AllocationGroups_FileAndItsData_StayInTheGroupOfItsDirectory)
+{
+    format_three_groups();
+
+    // the second directory goes to a group the root is not in
+    ASSERT_TRUE(fs->create_directory(ROOT_INODE_ID, "d0").has_value());
+    auto dir_res = fs->create_directory(ROOT_INODE_ID, "d1");
+    ASSERT_TRUE(dir_res.has_value());
+    int group = call_inode_group_index(dir_res.value());
+    ASSERT_NE(group, call_inode_group_index(ROOT_INODE_ID));
+
+    auto dir_inode = call_get_inode(dir_res.value());
+    ASSERT_TRUE(dir_inode.has_value());
+    auto dir_block = call_get_block_index(dir_inode.value(), 0);
+    ASSERT_TRUE(dir_block.has_value());
+    EXPECT_EQ(data_block_group(dir_block.value()), group);
+
+    auto file_res = fs->create_file(dir_res.value(), "f");
+    ASSERT_TRUE(file_res.has_value());
+    EXPECT_EQ(call_inode_group_index(file_res.value()), group);
+
+    std::vector<uint8_t> data(4 * BLOCK_SIZE, 0xAB);
+    ASSERT_TRUE(fs->write_file(file_res.value(), data, 0).has_value());
+
+    auto file_inode = call_get_inode(file_res.value());
+    ASSERT_TRUE(file_inode.has_value());
+    for (int i = 0; i < 4; i++)
+    {
+        auto block_res = call_get_block_index(file_inode.value(), i);
+        ASSERT_TRUE(block_res.has_value());
+        EXPECT_EQ(data_block_group(block_res.value()), group) << "block " << i;
+    }
+}
+
+TEST_F(FileSystemInternalTest, AllocationGroups_GroupFull_NextGroupUsed)
+{
+    format_three_groups();
+
+    // fill the data of the root group, the next block comes from the group after it
+    int root_group = call_inode_group_index(ROOT_INODE_ID);
+    while (true)
+    {
+        auto block_res = call_allocate_data_block(root_group);
+        ASSERT_TRUE(block_res.has_value());
+        if (data_block_group(block_res.value()) != root_group)
+        {
+            EXPECT_EQ(data_block_group(block_res.value()), root_group + 1);
+            break;
+        }
+    }
+
+    SpaceStats stats = fs->get_space_stats();
+    EXPECT_EQ(stats.free_blocks, stats.total_blocks - BLOCKS_PER_GROUP - 1); // the root group and the block past it
+}
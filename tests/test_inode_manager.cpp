@@ -33,7 +33,7 @@ protected:
 
 TEST_F(InodeManagerTest, init_inode_bitmap)
 {
-    int size_byte = TOTAL_BLOCKS_NUMBER * BLOCK_SIZE;
+    int size_byte = DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
 
@@ -43,12 +43,12 @@ TEST_F(InodeManagerTest, init_inode_bitmap)
     uint8_t buffer[BLOCK_SIZE];
     device.read_block(INODE_BITMAP_INDEX, buffer);
 
-    int total_bytes = TOTAL_INODE_NUMBER / BITS_IN_BYTE;
+    int total_bytes = fs.get_superblock().total_inodes / BITS_IN_BYTE;
     for (int i = 0; i < total_bytes; i++)
         EXPECT_EQ(buffer[i], 0);
 
     int unused_first_byte;
-    int remain_bits = TOTAL_INODE_NUMBER % BITS_IN_BYTE;
+    int remain_bits = fs.get_superblock().total_inodes % BITS_IN_BYTE;
     if (remain_bits == 0)
         unused_first_byte = total_bytes;
     else
@@ -68,12 +68,12 @@ TEST_F(InodeManagerTest, init_inode_bitmap)
 
 TEST_F(InodeManagerTest, allocate_inode)
 {
-    int size_byte = TOTAL_BLOCKS_NUMBER * BLOCK_SIZE;
+    int size_byte = DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
     call_init_inode_bitmap_on_format(fs);
 
-    for (int i = 0; i < TOTAL_INODE_NUMBER; i++)
+    for (int i = 0; i < fs.get_superblock().total_inodes; i++)
     {
         auto result = call_allocate_inode(fs);
         ASSERT_TRUE(result.has_value());
@@ -87,12 +87,12 @@ TEST_F(InodeManagerTest, allocate_inode)
 
 TEST_F(InodeManagerTest, full_inode_table)
 {
-    int size_byte = TOTAL_BLOCKS_NUMBER * BLOCK_SIZE;
+    int size_byte = DEFAULT_TOTAL_BLOCKS * BLOCK_SIZE;
     InMemoryBlockDevice device(size_byte);
     FileSystem fs(device);
     call_init_inode_bitmap_on_format(fs);
 
-    for (int i = 0; i < TOTAL_INODE_NUMBER; i++)
+    for (int i = 0; i < fs.get_superblock().total_inodes; i++)
         call_allocate_inode(fs);
 
     auto result = call_allocate_inode(fs);